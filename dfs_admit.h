@@ -0,0 +1,288 @@
+#ifndef DFS_ADMIT_H
+#define DFS_ADMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "dfs_log.h"
+
+// dfs_admit: S1's admission control for transfers.
+//
+// Uploads, downloads and tars run only while fewer than S1's concurrency
+// limit are in flight, and uploads only while the bytes they bring in stay
+// under a budget. A transfer over the concurrency limit may wait for a free
+// slot in a short queue, which holds ADMIT_QUEUE_DEPTH transfers per slot
+// for as many typical transfer times each. Beyond that, or over the byte
+// budget, it is turned away before it moves any data, with a hint of when to
+// retry, so an overload costs clients a retry rather than S1 its throughput.
+//
+// The concurrency limit adapts to the latency it causes (AIMD). Each finished
+// transfer is timed and normalised by its size: the time per ADMIT_UNIT bytes,
+// plus one unit for the fixed cost of any transfer. The lowest such latency
+// seen lately is the baseline. A transfer that comes in under ADMIT_TOLERANCE
+// times the baseline while the limit is at least half used adds 1/limit to
+// the limit, so the limit grows by about one every round of transfers. One
+// over it multiplies the limit by ADMIT_BACKOFF, at most once per typical
+// transfer time, since the transfers already in flight were admitted under
+// the old limit. The baseline drifts up slowly towards what S1 sees, so a
+// lasting change in file sizes or backends doesn't pin the limit at its floor.
+//
+// The counters live in an anonymous shared mapping created before S1 forks,
+// so every session process draws from the same limits, and queued transfers
+// sleep on a futex in it that every finished transfer wakes. Each session
+// process also notes there what it holds, so S1 can give back the transfer
+// of one that died in the middle of it.
+
+#define ADMIT_MIN_LIMIT 2           // The limit never drops below this many transfers
+#define ADMIT_START_LIMIT 8
+#define ADMIT_UNIT 262144           // Bytes that cost as much as a transfer's fixed overhead
+#define ADMIT_TOLERANCE 3.0         // Latency over this times the baseline signals queueing
+#define ADMIT_BACKOFF 0.8
+#define ADMIT_DRIFT 0.01            // How fast the baseline follows higher latencies
+#define ADMIT_QUEUE_DEPTH 4         // Queued transfers per slot of the limit
+#define ADMIT_QUEUE_MAX_US 2000000  // Longest a transfer waits in the queue
+#define ADMIT_RETRY_MIN_MS 20
+#define ADMIT_RETRY_MAX_MS 5000
+#define ADMIT_OWNERS 1024           // Session processes that can hold a transfer, see WORKER_MAX
+
+// Structure to store the shared counters
+typedef struct {
+    int lock;
+    int max_limit;                  // Bound on the adaptive limit
+    long max_bytes;                 // Upload bytes in flight, 0 for no budget
+    double limit;                   // Transfers admitted at once
+    int inflight;
+    int waiting;                    // Transfers queued for a slot
+    uint32_t released;              // Futex bumped by every finished transfer
+    long bytes;
+    double baseline_us;             // Normalised latency of an unqueued transfer
+    double mean_us;                 // Average transfer time, for retry hints
+    uint64_t backoff_us;            // Last time the limit was cut
+    long refused;
+    struct {
+        int holding;
+        long bytes;
+    } owners[ADMIT_OWNERS];         // What each session process holds
+} AdmitTable;
+
+static AdmitTable* admit;
+static int admit_holding;           // This session has a transfer admitted
+static long admit_held;             // Bytes that transfer counts against the budget
+static long admit_moved;            // Bytes it has moved, for normalising its latency
+static uint64_t admit_start_us;
+static int admit_owner = -1;        // This process's entry in owners, -1 for none
+
+// Function to get a monotonic timestamp in microseconds
+static uint64_t admit_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Function to take the table lock
+static void admit_lock() {
+    while (__atomic_test_and_set(&admit->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+// Function to release the table lock
+static void admit_unlock() {
+    __atomic_clear(&admit->lock, __ATOMIC_RELEASE);
+}
+
+// Function to map the shared counters; max_limit bounds the adaptive limit
+// and max_bytes the upload bytes in flight (0 for none). Must be called
+// before S1 forks; without it every transfer is admitted.
+static int admit_init(int max_limit, long max_bytes) {
+    admit = mmap(NULL, sizeof(AdmitTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admit == MAP_FAILED) {
+        admit = NULL;
+        return -1;
+    }
+    memset(admit, 0, sizeof(AdmitTable));
+    
+    admit->max_limit = max_limit < ADMIT_MIN_LIMIT ? ADMIT_MIN_LIMIT : max_limit;
+    admit->max_bytes = max_bytes;
+    admit->limit = admit->max_limit < ADMIT_START_LIMIT ? admit->max_limit : ADMIT_START_LIMIT;
+    return 0;
+}
+
+// Function to tell a refused client how long to wait: about the time until
+// the transfers in flight and queued have made room for it
+static int admit_retry_ms() {
+    int ms = ADMIT_RETRY_MIN_MS;
+    
+    if (admit && admit->limit > 0) {
+        ms = (int)(admit->mean_us * (admit->waiting + 1) / admit->limit / 1000);
+        ms = ms < ADMIT_RETRY_MIN_MS ? ADMIT_RETRY_MIN_MS : ms > ADMIT_RETRY_MAX_MS ? ADMIT_RETRY_MAX_MS : ms;
+    }
+    return ms;
+}
+
+// Function to admit a transfer for this session, waiting in the queue if
+// there is room in it; -1 if S1 is at its limit
+static int admit_begin() {
+    if (!admit)
+        return 0;
+    
+    uint64_t start = admit_now_us();
+    uint64_t deadline = 0;
+    
+    admit_lock();
+    while (admit->inflight >= (int)admit->limit) {
+        uint64_t now = admit_now_us();
+        
+        // Join the queue, or give up if it is full or the wait ran out
+        if (deadline == 0) {
+            uint64_t wait = ADMIT_QUEUE_DEPTH * admit->mean_us;
+            wait = wait < ADMIT_QUEUE_MAX_US ? wait : ADMIT_QUEUE_MAX_US;
+            if (admit->waiting >= ADMIT_QUEUE_DEPTH * (int)admit->limit || wait == 0) {
+                admit->refused++;
+                admit_unlock();
+                return -1;
+            }
+            admit->waiting++;
+            deadline = start + wait;
+        } else if (now >= deadline) {
+            admit->waiting--;
+            admit->refused++;
+            admit_unlock();
+            return -1;
+        }
+        
+        uint32_t released = admit->released;
+        admit_unlock();
+        
+        struct timespec timeout = { (time_t)((deadline - now) / 1000000), (long)((deadline - now) % 1000000) * 1000 };
+        syscall(SYS_futex, &admit->released, FUTEX_WAIT, released, &timeout, NULL, 0);
+        admit_lock();
+    }
+    if (deadline)
+        admit->waiting--;
+    admit->inflight++;
+    if (admit_owner >= 0 && admit_owner < ADMIT_OWNERS) {
+        admit->owners[admit_owner].holding = 1;
+        admit->owners[admit_owner].bytes = 0;
+    }
+    admit_unlock();
+    
+    admit_holding = 1;
+    admit_held = admit_moved = 0;
+    admit_start_us = admit_now_us();
+    return 0;
+}
+
+// Function to count size bytes of the admitted upload against the budget.
+// If they would overrun it the transfer is released and -1 returned. An
+// upload is let through when it's the only one, so a file larger than the
+// budget still gets in.
+static int admit_reserve(long size) {
+    if (!admit || !admit_holding)
+        return 0;
+    
+    admit_lock();
+    if (admit->max_bytes > 0 && admit->bytes > 0 && admit->bytes + size > admit->max_bytes) {
+        admit->refused++;
+        admit->inflight--;
+        admit->released++;
+        if (admit_owner >= 0 && admit_owner < ADMIT_OWNERS)
+            admit->owners[admit_owner].holding = 0;
+        admit_unlock();
+        syscall(SYS_futex, &admit->released, FUTEX_WAKE, 1, NULL, NULL, 0);
+        admit_holding = 0;
+        return -1;
+    }
+    admit->bytes += size;
+    admit_held = size;
+    if (admit_owner >= 0 && admit_owner < ADMIT_OWNERS)
+        admit->owners[admit_owner].bytes = size;
+    admit_unlock();
+    return 0;
+}
+
+// Function to note n bytes moved by this session's transfer
+static void admit_charge(long n) {
+    admit_moved += n;
+}
+
+// Function to release this session's transfer. A completed one (sample set)
+// feeds its latency to the limit.
+static void admit_end(int sample) {
+    if (!admit || !admit_holding)
+        return;
+    
+    uint64_t now = admit_now_us();
+    double elapsed = (double)(now - admit_start_us);
+    double latency = elapsed / (1.0 + (double)admit_moved / ADMIT_UNIT);
+    int old_limit, new_limit;
+    
+    admit_lock();
+    admit->inflight--;
+    admit->bytes -= admit_held;
+    old_limit = (int)admit->limit;
+    
+    if (sample) {
+        admit->mean_us = admit->mean_us == 0 ? elapsed : admit->mean_us * 0.9 + elapsed * 0.1;
+        
+        if (admit->baseline_us == 0 || latency < admit->baseline_us) {
+            admit->baseline_us = latency;
+        } else {
+            admit->baseline_us += (latency - admit->baseline_us) * ADMIT_DRIFT;
+        }
+        
+        if (latency > ADMIT_TOLERANCE * admit->baseline_us) {
+            if (now - admit->backoff_us > (uint64_t)admit->mean_us) {
+                admit->limit *= ADMIT_BACKOFF;
+                if (admit->limit < ADMIT_MIN_LIMIT)
+                    admit->limit = ADMIT_MIN_LIMIT;
+                admit->backoff_us = now;
+            }
+        } else if (admit->inflight + 1 >= admit->limit / 2) {
+            admit->limit += 1.0 / admit->limit;
+            if (admit->limit > admit->max_limit)
+                admit->limit = admit->max_limit;
+        }
+    }
+    new_limit = (int)admit->limit;
+    admit->released++;
+    if (admit_owner >= 0 && admit_owner < ADMIT_OWNERS)
+        admit->owners[admit_owner].holding = 0;
+    admit_unlock();
+    syscall(SYS_futex, &admit->released, FUTEX_WAKE, 1, NULL, NULL, 0);
+    
+    admit_holding = 0;
+    admit_held = 0;
+    if (new_limit != old_limit)
+        log_event(LOG_DEBUG, "admit_limit", new_limit < old_limit ? "down" : "up", new_limit);
+}
+
+// Function to give back the transfer of a session process that exited while
+// it held one; returns 1 if it did
+static int admit_reclaim(int owner) {
+    int held = 0;
+    
+    if (!admit || owner < 0 || owner >= ADMIT_OWNERS)
+        return 0;
+    
+    admit_lock();
+    if (admit->owners[owner].holding) {
+        admit->inflight--;
+        admit->bytes -= admit->owners[owner].bytes;
+        admit->owners[owner].holding = 0;
+        admit->released++;
+        held = 1;
+    }
+    admit_unlock();
+    if (held)
+        syscall(SYS_futex, &admit->released, FUTEX_WAKE, 1, NULL, NULL, 0);
+    return held;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,321 @@
+#ifndef DFS_BACKEND_H
+#define DFS_BACKEND_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dfs_stats.h"
+#include "dfs_route.h"
+#include "dfs_log.h"
+
+// dfs_backend: what S1's sessions have learned about each backend instance.
+//
+// One slot per backend address lives in an anonymous shared mapping created
+// before S1 forks, so every session sees what the others observed: how long
+// the backend takes to answer a command (an EWMA and a histogram that is
+// halved every BACKEND_WINDOW samples, so it follows the recent past) and how
+// many requests are outstanding on it. Reads go to the replica with the lowest
+// EWMA x (outstanding + 1), and a read that takes longer than the configured
+// percentile of its backend's history is hedged to the next replica.
+//
+// Each backend also has a circuit breaker. BACKEND_BREAKER_FAILURES failed
+// connects or health probes in a row open it, and while it is open sessions
+// skip the backend at once instead of waiting on TCP. A monitor process
+// forked from S1 probes every known backend with PING, so a dead backend is
+// found, and a recovered one readmitted, without clients paying for it; only
+// its probes close a breaker, since a session trying a hung backend would hang
+// with every other backend it holds. Without the monitor, one session may try
+// the backend once the open period has passed, and a failure reopens the
+// breaker for twice as long.
+
+#define BACKEND_MAX 64
+#define BACKEND_EWMA_SHIFT 3        // A new sample weighs 1/8
+#define BACKEND_WINDOW 1024         // Samples between halvings of the histogram
+#define BACKEND_MIN_SAMPLES 16      // Fewer and the percentile means nothing yet
+#define BACKEND_MIN_HEDGE_US 1000   // Never hedge sooner than this
+#define BACKEND_BREAKER_FAILURES 3  // Failures in a row that open the breaker
+#define BACKEND_OPEN_US 1000000     // First open period, doubled up to BACKEND_MAX_OPEN_US
+#define BACKEND_MAX_OPEN_US 30000000
+#define BACKEND_PROBE_TIMEOUT_MS 2000
+
+// Structure to store what is known about one backend
+typedef struct {
+    int used;                       // 0 free, 1 being claimed, 2 ready
+    ServerAddr addr;
+    uint64_t ewma_us;               // Time to answer a command
+    int outstanding;                // Requests in flight from every session
+    int failures;                   // Failed connects and probes in a row
+    uint64_t open_until_us;         // Breaker open until then (monotonic); 0 when closed
+    uint64_t open_us;               // Length of the last open period
+    StatsHistogram latency;         // Recent answer times, nanoseconds
+} BackendState;
+
+// Structure to store the shared table
+typedef struct {
+    int hedge_percentile;           // 1-99, 0 to never hedge
+    int monitored;                  // Whether the health monitor is running
+    BackendState backends[BACKEND_MAX];
+} BackendTable;
+
+static BackendTable* backend_table;
+
+// Function to map the shared table; call before forking
+static int backend_init(int hedge_percentile) {
+    backend_table = mmap(NULL, sizeof(BackendTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (backend_table == MAP_FAILED) {
+        backend_table = NULL;
+        return -1;
+    }
+    
+    backend_table->hedge_percentile = hedge_percentile;
+    return 0;
+}
+
+// Function to find a backend's slot, claiming a free one the first time it
+// is seen. NULL when the table is full or not mapped.
+static BackendState* backend_lookup(const ServerAddr* addr) {
+    if (!backend_table)
+        return NULL;
+    
+    for (int i = 0; i < BACKEND_MAX; i++) {
+        BackendState* state = &backend_table->backends[i];
+        int used = __atomic_load_n(&state->used, __ATOMIC_ACQUIRE);
+        
+        if (used == 0) {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&state->used, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                state->addr = *addr;
+                __atomic_store_n(&state->used, 2, __ATOMIC_RELEASE);
+                return state;
+            }
+            used = expected;
+        }
+        
+        // Another session is claiming this slot; wait for it to say for whom
+        while (used == 1)
+            used = __atomic_load_n(&state->used, __ATOMIC_ACQUIRE);
+        if (route_compare_addr(&state->addr, addr) == 0)
+            return state;
+    }
+    
+    return NULL;
+}
+
+// Function to count a request that was sent to a backend
+static void backend_begin(BackendState* state) {
+    if (state)
+        __atomic_fetch_add(&state->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+// Function to count a request that is finished with a backend
+static void backend_done(BackendState* state) {
+    if (state)
+        __atomic_fetch_sub(&state->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+// Function to record how long a backend took to answer
+static void backend_sample(BackendState* state, uint64_t elapsed_ns) {
+    if (!state)
+        return;
+    
+    uint64_t us = elapsed_ns / 1000;
+    uint64_t ewma = __atomic_load_n(&state->ewma_us, __ATOMIC_RELAXED);
+    
+    // Racing sessions may lose an update; the average doesn't need every sample
+    ewma = ewma ? ewma - (ewma >> BACKEND_EWMA_SHIFT) + (us >> BACKEND_EWMA_SHIFT) : us;
+    __atomic_store_n(&state->ewma_us, ewma ? ewma : 1, __ATOMIC_RELAXED);
+    
+    // Whoever moves the count down halves the buckets, so it happens once per window
+    stats_record(&state->latency, elapsed_ns);
+    uint64_t count = __atomic_load_n(&state->latency.count, __ATOMIC_RELAXED);
+    if (count >= BACKEND_WINDOW &&
+        __atomic_compare_exchange_n(&state->latency.count, &count, count / 2, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        for (int i = 0; i < STATS_BUCKETS; i++)
+            __atomic_store_n(&state->latency.buckets[i], __atomic_load_n(&state->latency.buckets[i], __ATOMIC_RELAXED) / 2,
+                             __ATOMIC_RELAXED);
+        __atomic_store_n(&state->latency.sum, __atomic_load_n(&state->latency.sum, __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to get the monotonic clock in microseconds
+static uint64_t backend_now_us() {
+    return stats_now() / 1000;
+}
+
+// Function to check whether a backend may be used. While its breaker is open
+// this fails at once; after the open period one caller is let through to try.
+static int backend_allow(BackendState* state) {
+    if (!state)
+        return 1;
+    
+    uint64_t until = __atomic_load_n(&state->open_until_us, __ATOMIC_ACQUIRE);
+    uint64_t now = backend_now_us();
+    
+    if (until == 0)
+        return 1;
+    if (backend_table->monitored || now < until)
+        return 0;
+    
+    // Half open: the caller that moves the deadline gets the trial
+    return __atomic_compare_exchange_n(&state->open_until_us, &until, now + BACKEND_PROBE_TIMEOUT_MS * 1000ULL, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+// Function to record that a backend worked, closing its breaker
+static void backend_success(BackendState* state) {
+    if (!state)
+        return;
+    
+    __atomic_store_n(&state->failures, 0, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&state->open_until_us, 0, __ATOMIC_ACQ_REL) != 0) {
+        char text[96];
+        snprintf(text, sizeof(text), "%s:%d", state->addr.host, state->addr.port);
+        log_event(LOG_INFO, "backend_up", text, 0);
+        __atomic_store_n(&state->open_us, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Function to record that a backend failed, opening its breaker after enough in a row
+static void backend_failure(BackendState* state) {
+    if (!state)
+        return;
+    
+    int failures = __atomic_add_fetch(&state->failures, 1, __ATOMIC_RELAXED);
+    if (failures < BACKEND_BREAKER_FAILURES)
+        return;
+    
+    uint64_t open = __atomic_load_n(&state->open_us, __ATOMIC_RELAXED);
+    open = open ? (open * 2 < BACKEND_MAX_OPEN_US ? open * 2 : BACKEND_MAX_OPEN_US) : BACKEND_OPEN_US;
+    __atomic_store_n(&state->open_us, open, __ATOMIC_RELAXED);
+    
+    if (__atomic_exchange_n(&state->open_until_us, backend_now_us() + open, __ATOMIC_ACQ_REL) == 0) {
+        char text[96];
+        snprintf(text, sizeof(text), "%s:%d", state->addr.host, state->addr.port);
+        log_event(LOG_WARN, "backend_down", text, failures);
+    }
+}
+
+// Function to connect a socket within timeout_ms instead of the TCP timeout
+static int backend_connect(int sock, const struct sockaddr_in* addr, int timeout_ms) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    int error = 0;
+    socklen_t len = sizeof(error);
+    
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        struct pollfd pfd = { sock, POLLOUT, 0 };
+        
+        if (errno != EINPROGRESS)
+            return -1;
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+            errno = error ? error : errno;
+            return -1;
+        }
+    }
+    fcntl(sock, F_SETFL, flags);
+    
+    return 0;
+}
+
+// Function to check one backend: connect, PING, and a PONG within the timeout
+static int backend_probe(const ServerAddr* addr) {
+    struct sockaddr_in serv_addr = { 0 };
+    char reply[8] = { 0 };
+    int ok = 0;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (sock < 0)
+        return 0;
+    
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(addr->port);
+    if (inet_pton(AF_INET, addr->host, &serv_addr.sin_addr) > 0 &&
+        backend_connect(sock, &serv_addr, BACKEND_PROBE_TIMEOUT_MS) == 0 && send(sock, "PING", 4, MSG_NOSIGNAL) == 4) {
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        ok = poll(&pfd, 1, BACKEND_PROBE_TIMEOUT_MS) > 0 && recv(sock, reply, sizeof(reply) - 1, 0) > 0 &&
+             strcmp(reply, "PONG") == 0;
+    }
+    close(sock);
+    
+    return ok;
+}
+
+// Function to probe every backend in the table every interval_ms until S1 exits
+static void backend_monitor(pid_t server, int interval_ms) {
+    signal(SIGHUP, SIG_IGN);
+    
+    // Don't hold the server's sockets or its readiness pipe open
+    for (int fd = 3; fd < 1024; fd++) {
+        close(fd);
+    }
+    
+    while (getppid() == server) {
+        for (int i = 0; i < BACKEND_MAX; i++) {
+            BackendState* state = &backend_table->backends[i];
+            
+            if (__atomic_load_n(&state->used, __ATOMIC_ACQUIRE) != 2)
+                continue;
+            if (backend_probe(&state->addr))
+                backend_success(state);
+            else
+                backend_failure(state);
+        }
+        usleep(interval_ms * 1000);
+    }
+    
+    exit(0);
+}
+
+// Function to fork the health monitor; call after backend_init
+static int backend_start_monitor(int interval_ms) {
+    pid_t parent = getpid();
+    pid_t pid;
+    
+    if (!backend_table || interval_ms <= 0)
+        return 0;
+    
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+        backend_monitor(parent, interval_ms);
+    backend_table->monitored = 1;
+    
+    return 0;
+}
+
+// Function to get a backend's load score; lower is better, 0 for one never measured
+static uint64_t backend_score(const BackendState* state) {
+    if (!state)
+        return 0;
+    
+    int outstanding = __atomic_load_n(&state->outstanding, __ATOMIC_RELAXED);
+    return __atomic_load_n(&state->ewma_us, __ATOMIC_RELAXED) * (uint64_t)(outstanding > 0 ? outstanding + 1 : 1);
+}
+
+// Function to get how long to wait on a backend before hedging, in
+// microseconds; 0 when reads of it aren't hedged
+static uint64_t backend_hedge_delay_us(const BackendState* state) {
+    if (!state || !backend_table || backend_table->hedge_percentile <= 0 ||
+        __atomic_load_n(&state->latency.count, __ATOMIC_RELAXED) < BACKEND_MIN_SAMPLES)
+        return 0;
+    
+    uint64_t delay = stats_percentile(&state->latency, backend_table->hedge_percentile / 100.0) / 1000;
+    return delay > BACKEND_MIN_HEDGE_US ? delay : BACKEND_MIN_HEDGE_US;
+}
+
+#endif
\ No newline at end of file
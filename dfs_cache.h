@@ -0,0 +1,463 @@
+#ifndef DFS_CACHE_H
+#define DFS_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// dfs_cache: S1's memory cache of files read from the backend pools.
+//
+// A file downloaded through S1 may be kept in memory, so the next download
+// of it is answered by S1 alone, without a backend connection or disk. The
+// cache is split into CACHE_SHARDS shards by the hash of the path, each with
+// a lock, a table of entries and an equal share of the memory. The memory is
+// a memfd mapped shared before S1 forks, so every session process fills and
+// serves from the same cache, and a hit is sent to the client with sendfile
+// straight from the cache's pages rather than copied through a buffer.
+//
+// Admission is TinyLFU: every lookup counts the path in a small count-min
+// sketch per shard whose counters are halved every CACHE_SKETCH_SAMPLE
+// lookups per counter, so it estimates how often each path was asked for
+// lately. When a new file needs room, the least recently used entry is
+// evicted only if the new file was asked for more often; otherwise the new
+// file is turned away and the cache keeps what it has. Files are large next
+// to a shard, so there is no admission window in front of it.
+//
+// An upload or removal through S1 invalidates the path, including a fill
+// in progress: each shard counts its invalidations, and a fill that started
+// before one of them is dropped when it completes, so a read that raced an
+// upload never leaves the old content behind. Writes through another S1,
+// or straight to a backend, are not seen; entries expire after
+// CACHE_MAX_AGE seconds to bound how stale they can get.
+
+#define CACHE_SHARDS 16
+#define CACHE_SHARD_ENTRIES 256     // Files each shard holds at most
+#define CACHE_KEY_MAX 256           // Longer paths are not cached
+#define CACHE_ITEM_MAX 4194304      // Largest file cached; bigger ones always stream from a backend
+#define CACHE_ITEM_SHARE 4          // A file may take at most this fraction of its shard
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 1024     // Counters per row, a power of two
+#define CACHE_SKETCH_SAMPLE 8       // Lookups per counter between two halvings
+#define CACHE_COUNTER_MAX 15
+#define CACHE_MAX_AGE 30            // Seconds an entry is served before it is read again
+#define CACHE_TAG_MAX 64            // Room for the version tag the backend sent the file with
+
+// States of an entry
+#define CACHE_FREE 0
+#define CACHE_FILLING 1             // Reserved, content being written by one session
+#define CACHE_READY 2
+#define CACHE_DEAD 3                // Invalidated while in use; freed by its last user
+
+// Structure to store one cached file
+typedef struct {
+    uint64_t hash;
+    char path[CACHE_KEY_MAX];
+    long offset;                    // Where its content sits in the shard's memory
+    long size;
+    uint64_t used;                  // Shard tick of the last hit, for LRU
+    time_t stored;
+    int state;
+    int users;                      // Sessions sending or filling it
+    char tag[CACHE_TAG_MAX];
+} CacheEntry;
+
+// Structure to store one shard
+typedef struct {
+    int lock;
+    uint64_t tick;
+    uint32_t invalidations;
+    uint32_t lookups;               // Since the sketch was last halved
+    long used_bytes;
+    uint8_t sketch[CACHE_SKETCH_ROWS][CACHE_SKETCH_WIDTH];
+    CacheEntry entries[CACHE_SHARD_ENTRIES];
+} CacheShard;
+
+// Structure to store the shared cache
+typedef struct {
+    long shard_bytes;
+    uint64_t hits, misses, admitted, rejected, evicted;
+    CacheShard shards[CACHE_SHARDS];
+} CacheTable;
+
+// Structure to store a session's handle on an entry, or on a miss it may fill
+typedef struct {
+    int shard;
+    int entry;                      // -1 while the miss holds no reservation
+    uint64_t hash;
+    char path[CACHE_KEY_MAX];
+    uint32_t invalidations;         // The shard's count when the miss was looked up
+    long offset;                    // In cache_fd, of the entry's content
+    long size;
+    long filled;
+    char tag[CACHE_TAG_MAX];
+} CacheRef;
+
+static CacheTable* cache;
+static char* cache_memory;
+static int cache_fd = -1;           // The memfd holding every shard's memory
+
+// Function to take a shard's lock
+static void cache_lock(CacheShard* shard) {
+    while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+// Function to release a shard's lock
+static void cache_unlock(CacheShard* shard) {
+    __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+}
+
+// Function to map a cache of bytes in all. Must be called before S1 forks;
+// without it every lookup misses.
+static int cache_init(long bytes) {
+    long shard_bytes = (bytes / CACHE_SHARDS) & ~4095L;
+    
+    if (shard_bytes <= 0)
+        return -1;
+    
+    cache = mmap(NULL, sizeof(CacheTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        cache = NULL;
+        return -1;
+    }
+    memset(cache, 0, sizeof(CacheTable));
+    cache->shard_bytes = shard_bytes;
+    
+    cache_fd = memfd_create("w25-cache", MFD_CLOEXEC);
+    if (cache_fd < 0 || ftruncate(cache_fd, shard_bytes * CACHE_SHARDS) < 0 ||
+        (cache_memory = mmap(NULL, shard_bytes * CACHE_SHARDS, PROT_READ | PROT_WRITE, MAP_SHARED, cache_fd, 0)) ==
+            MAP_FAILED) {
+        if (cache_fd >= 0)
+            close(cache_fd);
+        munmap(cache, sizeof(CacheTable));
+        cache = NULL;
+        cache_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to hash a path the way the cache keys it, with runs of slashes
+// collapsed so ~/S1//a.pdf and ~/S1/a.pdf are the same file (FNV-1a)
+static uint64_t cache_key(const char* path, char* key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t len = 0;
+    
+    for (const char* p = path; *p && len < CACHE_KEY_MAX - 1; p++) {
+        if (*p == '/' && len > 0 && key[len - 1] == '/')
+            continue;
+        key[len++] = *p;
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    key[len] = '\0';
+    return hash;
+}
+
+// Function to find a shard's counter for a hash in a sketch row
+static uint8_t* cache_counter(CacheShard* shard, int row, uint64_t hash) {
+    uint64_t h = (hash ^ (0x9e3779b97f4a7c15ULL * (row + 1))) * 0xff51afd7ed558ccdULL;
+    return &shard->sketch[row][(h >> 32) & (CACHE_SKETCH_WIDTH - 1)];
+}
+
+// Function to estimate how often a hash was looked up lately
+static int cache_frequency(CacheShard* shard, uint64_t hash) {
+    int min = CACHE_COUNTER_MAX;
+    
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        int count = *cache_counter(shard, row, hash);
+        min = count < min ? count : min;
+    }
+    return min;
+}
+
+// Function to count a lookup of a hash, halving every counter once the
+// shard has seen enough lookups that old ones should weigh less
+static void cache_count(CacheShard* shard, uint64_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t* counter = cache_counter(shard, row, hash);
+        if (*counter < CACHE_COUNTER_MAX)
+            (*counter)++;
+    }
+    
+    if (++shard->lookups >= CACHE_SKETCH_WIDTH * CACHE_SKETCH_SAMPLE) {
+        for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+            for (int i = 0; i < CACHE_SKETCH_WIDTH; i++)
+                shard->sketch[row][i] >>= 1;
+        }
+        shard->lookups /= 2;
+    }
+}
+
+// Function to drop an entry: freed now, or by its last user if it has any
+static void cache_drop(CacheShard* shard, CacheEntry* entry) {
+    if (entry->users > 0) {
+        entry->state = CACHE_DEAD;
+        return;
+    }
+    shard->used_bytes -= entry->size;
+    entry->state = CACHE_FREE;
+}
+
+// Function to look a path up. A hit fills ref and keeps the entry in place
+// until cache_release; a miss returns -1 with ref ready for cache_reserve.
+static int cache_lookup(const char* path, CacheRef* ref) {
+    ref->entry = -1;
+    if (!cache)
+        return -1;
+    
+    ref->hash = cache_key(path, ref->path);
+    ref->shard = (int)(ref->hash % CACHE_SHARDS);
+    
+    CacheShard* shard = &cache->shards[ref->shard];
+    time_t now = time(NULL);
+    
+    cache_lock(shard);
+    cache_count(shard, ref->hash);
+    ref->invalidations = shard->invalidations;
+    
+    for (int i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+        CacheEntry* entry = &shard->entries[i];
+        if (entry->state != CACHE_READY || entry->hash != ref->hash || strcmp(entry->path, ref->path) != 0)
+            continue;
+        
+        if (now - entry->stored >= CACHE_MAX_AGE) {
+            cache_drop(shard, entry);
+            break;
+        }
+        entry->users++;
+        entry->used = ++shard->tick;
+        ref->entry = i;
+        ref->offset = (long)ref->shard * cache->shard_bytes + entry->offset;
+        ref->size = entry->size;
+        strcpy(ref->tag, entry->tag);
+        cache_unlock(shard);
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    cache_unlock(shard);
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+// Function to compare two entries by where their content sits
+static int cache_by_offset(const void* a, const void* b) {
+    long x = (*(CacheEntry* const*)a)->offset, y = (*(CacheEntry* const*)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+// Function to find size bytes free in a shard's memory; -1 if no gap is big enough
+static long cache_find_gap(CacheShard* shard, long size) {
+    CacheEntry* taken[CACHE_SHARD_ENTRIES];
+    int count = 0;
+    long end = 0;
+    
+    for (int i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+        if (shard->entries[i].state != CACHE_FREE)
+            taken[count++] = &shard->entries[i];
+    }
+    qsort(taken, count, sizeof(taken[0]), cache_by_offset);
+    
+    // First fit
+    for (int i = 0; i < count; i++) {
+        if (taken[i]->offset - end >= size)
+            return end;
+        end = taken[i]->offset + taken[i]->size;
+    }
+    return cache->shard_bytes - end >= size ? end : -1;
+}
+
+// Function to reserve room for the size bytes of a missed file, and its
+// version tag (may be empty), evicting
+// what the admission policy lets it replace. Returns -1 if the file isn't
+// admitted, isn't cacheable, or was invalidated since the lookup; otherwise
+// the session writes the content with cache_fill and ends with
+// cache_commit or cache_abort.
+static int cache_reserve(CacheRef* ref, long size, const char* tag) {
+    if (!cache || ref->entry >= 0 || size <= 0 || size > CACHE_ITEM_MAX || size > cache->shard_bytes / CACHE_ITEM_SHARE ||
+        strlen(ref->path) >= CACHE_KEY_MAX - 1)
+        return -1;
+    
+    CacheShard* shard = &cache->shards[ref->shard];
+    int frequency;
+    long offset;
+    int slot = -1;
+    
+    cache_lock(shard);
+    if (shard->invalidations != ref->invalidations) {
+        cache_unlock(shard);
+        return -1;
+    }
+    
+    // Another session may be filling it, or have filled it, already
+    for (int i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+        CacheEntry* entry = &shard->entries[i];
+        if ((entry->state == CACHE_FILLING || entry->state == CACHE_READY) && entry->hash == ref->hash &&
+            strcmp(entry->path, ref->path) == 0) {
+            cache_unlock(shard);
+            return -1;
+        }
+    }
+    
+    frequency = cache_frequency(shard, ref->hash);
+    while (1) {
+        CacheEntry* victim = NULL;
+        
+        slot = -1;
+        for (int i = 0; i < CACHE_SHARD_ENTRIES && slot < 0; i++) {
+            if (shard->entries[i].state == CACHE_FREE)
+                slot = i;
+        }
+        offset = slot >= 0 ? cache_find_gap(shard, size) : -1;
+        if (offset >= 0)
+            break;
+        
+        // Make room by the least recently used entry nobody is reading, if
+        // the new file is asked for more often than it
+        for (int i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+            CacheEntry* entry = &shard->entries[i];
+            if (entry->state == CACHE_READY && entry->users == 0 && (!victim || entry->used < victim->used))
+                victim = entry;
+        }
+        if (!victim || cache_frequency(shard, victim->hash) >= frequency) {
+            cache_unlock(shard);
+            __atomic_add_fetch(&cache->rejected, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        cache_drop(shard, victim);
+        __atomic_add_fetch(&cache->evicted, 1, __ATOMIC_RELAXED);
+    }
+    
+    CacheEntry* entry = &shard->entries[slot];
+    entry->hash = ref->hash;
+    strcpy(entry->path, ref->path);
+    entry->offset = offset;
+    entry->size = size;
+    snprintf(entry->tag, sizeof(entry->tag), "%s", tag ? tag : "");
+    entry->state = CACHE_FILLING;
+    entry->users = 1;
+    shard->used_bytes += size;
+    cache_unlock(shard);
+    
+    ref->entry = slot;
+    ref->offset = (long)ref->shard * cache->shard_bytes + offset;
+    ref->size = size;
+    ref->filled = 0;
+    return 0;
+}
+
+// Function to append n bytes of content to a reserved entry
+static void cache_fill(CacheRef* ref, const void* data, long n) {
+    if (ref->entry < 0 || ref->filled + n > ref->size)
+        return;
+    memcpy(cache_memory + ref->offset + ref->filled, data, n);
+    ref->filled += n;
+}
+
+// Function to fill a reserved entry with the start of a file, read straight
+// into the cache's memory
+static void cache_fill_fd(CacheRef* ref, int fd) {
+    ssize_t n;
+    
+    while (ref->entry >= 0 && ref->filled < ref->size &&
+           (n = pread(fd, cache_memory + ref->offset + ref->filled, ref->size - ref->filled, ref->filled)) > 0)
+        ref->filled += n;
+}
+
+// Function to let go of an entry: a hit that was sent, or a reservation
+// that is given up
+static void cache_release(CacheRef* ref) {
+    if (!cache || ref->entry < 0)
+        return;
+    
+    CacheShard* shard = &cache->shards[ref->shard];
+    CacheEntry* entry = &shard->entries[ref->entry];
+    
+    cache_lock(shard);
+    entry->users--;
+    if (entry->state == CACHE_FILLING)
+        entry->state = CACHE_DEAD;
+    if (entry->state == CACHE_DEAD)
+        cache_drop(shard, entry);
+    cache_unlock(shard);
+    ref->entry = -1;
+}
+
+// Function to give up a reservation
+static void cache_abort(CacheRef* ref) {
+    cache_release(ref);
+}
+
+// Function to make a filled reservation visible to lookups. It is dropped
+// instead if the path was invalidated meanwhile or isn't filled completely.
+static void cache_commit(CacheRef* ref) {
+    if (!cache || ref->entry < 0)
+        return;
+    
+    CacheShard* shard = &cache->shards[ref->shard];
+    CacheEntry* entry = &shard->entries[ref->entry];
+    
+    cache_lock(shard);
+    if (entry->state == CACHE_FILLING && ref->filled == ref->size && shard->invalidations == ref->invalidations) {
+        entry->state = CACHE_READY;
+        entry->stored = time(NULL);
+        entry->used = ++shard->tick;
+        entry->users--;
+        cache_unlock(shard);
+        __atomic_add_fetch(&cache->admitted, 1, __ATOMIC_RELAXED);
+        ref->entry = -1;
+        return;
+    }
+    cache_unlock(shard);
+    cache_release(ref);
+}
+
+// Function to drop a path from the cache, and any fill of it in progress,
+// because it is being written or removed
+static void cache_invalidate(const char* path) {
+    char key[CACHE_KEY_MAX];
+    
+    if (!cache)
+        return;
+    
+    uint64_t hash = cache_key(path, key);
+    CacheShard* shard = &cache->shards[hash % CACHE_SHARDS];
+    
+    cache_lock(shard);
+    shard->invalidations++;
+    for (int i = 0; i < CACHE_SHARD_ENTRIES; i++) {
+        CacheEntry* entry = &shard->entries[i];
+        if ((entry->state == CACHE_READY || entry->state == CACHE_FILLING) && entry->hash == hash &&
+            strcmp(entry->path, key) == 0)
+            cache_drop(shard, entry);
+    }
+    cache_unlock(shard);
+}
+
+// Function to report the cache's use and counters, as a line of text or a
+// JSON object like the servers' in a stats report
+static size_t cache_format(char* out, size_t size, int json) {
+    long used = 0;
+    int files = 0;
+    
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        used += __atomic_load_n(&cache->shards[s].used_bytes, __ATOMIC_RELAXED);
+        for (int i = 0; i < CACHE_SHARD_ENTRIES; i++)
+            files += cache->shards[s].entries[i].state == CACHE_READY;
+    }
+    
+    int len = snprintf(out, size,
+                       json ? "{\"server\":\"S1 cache\",\"bytes\":%ld,\"capacity\":%ld,\"files\":%d,\"hits\":%llu,"
+                              "\"misses\":%llu,\"admitted\":%llu,\"rejected\":%llu,\"evicted\":%llu}"
+                            : "S1 cache %ld/%ld bytes, %d files: hits %llu misses %llu admitted %llu rejected %llu "
+                              "evicted %llu\n",
+                       used, cache->shard_bytes * CACHE_SHARDS, files, (unsigned long long)cache->hits,
+                       (unsigned long long)cache->misses, (unsigned long long)cache->admitted,
+                       (unsigned long long)cache->rejected, (unsigned long long)cache->evicted);
+    return len < (int)size ? (size_t)len : size - 1;
+}
+
+#endif
\ No newline at end of file
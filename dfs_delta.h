@@ -0,0 +1,305 @@
+#ifndef DFS_DELTA_H
+#define DFS_DELTA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dfs_local.h"
+
+// dfs_delta: uploads that send only what changed, rsync style.
+//
+// The server holding a file describes its current version with one
+// signature per full block: a weak checksum that can be rolled along a
+// buffer one byte at a time, and a strong hash. The block size grows with
+// the file, so the signatures stay small next to it. The client slides a
+// window over its new version, looks every position's weak checksum up
+// among the signatures and confirms a hit with the strong hash. What
+// matches becomes an instruction to copy blocks of the old version, and
+// everything else is sent as literal data.
+//
+// The delta is a sequence of operations, numbers big endian:
+//   'C' <u32 block> <u32 count>    copy count blocks of the old version
+//   'D' <u32 length> <bytes>       literal data, up to DELTA_LITERAL_MAX
+// The server rebuilds the file from its old version and the delta into a
+// temporary file. Copies go through copy_file_range, which shares the
+// blocks on filesystems that can. The result takes the file's name only if
+// its size and hash match what the client had, so a replica whose old
+// version differs, or a hash collision, fails the upload instead of
+// storing something else.
+//
+// Strong and whole-file hashes are 64-bit FNV-1a.
+
+#define DELTA_BLOCK_MIN 2048
+#define DELTA_BLOCK_MAX (128 * 1024)
+#define DELTA_SIG_SIZE 12           // Weak checksum and strong hash of one block
+#define DELTA_LITERAL_MAX 65536
+#define DELTA_HASH_INIT 0xcbf29ce484222325ULL
+#define DELTA_OP_COPY 'C'
+#define DELTA_OP_DATA 'D'
+
+// Structure to store where a delta is read from: a socket, or a file
+// another process handed over, read at its own offset
+typedef struct {
+    int fd;
+    int positional;                 // Read with pread from offset
+    long offset;
+    long left;                      // Bytes of the delta not read yet
+} DeltaInput;
+
+// Function to pick the block size for a file of size bytes: about its
+// square root, as a power of two
+static inline int delta_block_size(long size) {
+    int block = DELTA_BLOCK_MIN;
+    
+    while (block < DELTA_BLOCK_MAX && (long)block * block < size)
+        block *= 2;
+    return block;
+}
+
+// Function to store a 32-bit number big endian
+static inline void delta_put32(unsigned char* out, uint32_t value) {
+    for (int i = 3; i >= 0; i--, value >>= 8)
+        out[i] = value & 0xff;
+}
+
+// Function to read a 32-bit number stored big endian
+static inline uint32_t delta_get32(const unsigned char* in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+// Function to hash len bytes of data, continuing from hash
+static inline uint64_t delta_hash(const void* data, size_t len, uint64_t hash) {
+    const unsigned char* p = data;
+    
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to compute the weak checksum of a block: the sum of its bytes,
+// and the sum of those sums, 16 bits each
+static inline uint32_t delta_weak(const unsigned char* data, int len) {
+    uint32_t a = 0, b = 0;
+    
+    for (int i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b & 0xffff) << 16;
+}
+
+// Function to move the weak checksum of a len-byte window one byte on:
+// out leaves it at the front, in enters at the back
+static inline uint32_t delta_roll(uint32_t weak, unsigned char out, unsigned char in, int len) {
+    uint32_t a = weak & 0xffff, b = weak >> 16;
+    
+    a = (a - out + in) & 0xffff;
+    b = (b - (uint32_t)len * out + a) & 0xffff;
+    return a | b << 16;
+}
+
+// Function to store one block's signature
+static inline void delta_put_sig(unsigned char* out, uint32_t weak, uint64_t strong) {
+    delta_put32(out, weak);
+    delta_put32(out + 4, strong >> 32);
+    delta_put32(out + 8, (uint32_t)strong);
+}
+
+// Function to compute the signatures of the full blocks of a size-byte file
+// into one allocation; returns its length, or -1 if the file can't be read
+static inline long delta_signatures(int fd, long size, int block, unsigned char** out) {
+    long count = size / block;
+    unsigned char* sigs = malloc(count > 0 ? count * DELTA_SIG_SIZE : 1);
+    unsigned char* data = malloc(block);
+    
+    if (!sigs || !data) {
+        free(sigs);
+        free(data);
+        return -1;
+    }
+    for (long i = 0; i < count; i++) {
+        if (pread(fd, data, block, i * block) != block) {
+            free(sigs);
+            free(data);
+            return -1;
+        }
+        delta_put_sig(sigs + i * DELTA_SIG_SIZE, delta_weak(data, block), delta_hash(data, block, DELTA_HASH_INIT));
+    }
+    
+    free(data);
+    *out = sigs;
+    return count * DELTA_SIG_SIZE;
+}
+
+// Function to write one operation's header
+static inline int delta_put_op(FILE* out, int op, uint32_t first, uint32_t second, int with_second) {
+    unsigned char header[9];
+    
+    header[0] = op;
+    delta_put32(header + 1, first);
+    delta_put32(header + 5, second);
+    return fwrite(header, 1, with_second ? 9 : 5, out) == (size_t)(with_second ? 9 : 5) ? 0 : -1;
+}
+
+// Function to write size bytes of data as literal operations
+static inline int delta_put_data(FILE* out, const unsigned char* data, long size) {
+    for (long done = 0; done < size;) {
+        long chunk = size - done < DELTA_LITERAL_MAX ? size - done : DELTA_LITERAL_MAX;
+        if (delta_put_op(out, DELTA_OP_DATA, chunk, 0, 0) < 0 || fwrite(data + done, 1, chunk, out) != (size_t)chunk)
+            return -1;
+        done += chunk;
+    }
+    return 0;
+}
+
+// Function to write the delta that turns the version the sig_len bytes of
+// signatures describe into the size bytes of data, with block-byte blocks.
+// Consecutive blocks are copied with one operation. Sets *hash to the hash
+// of data; returns 0, or -1 if out can't be written or memory runs out.
+static inline int delta_encode(const unsigned char* data, long size, const unsigned char* sigs, long sig_len, int block,
+                               FILE* out, uint64_t* hash) {
+    long count = sig_len / DELTA_SIG_SIZE;
+    long slots = 1;
+    long literal = 0, pos = 0;
+    long copy_first = -1, copy_count = 0;
+    uint32_t weak = 0;
+    int rolled = 0, failed = 0;
+    
+    // The signatures by weak checksum, open addressing; a slot holds block + 1
+    while (slots < count * 2)
+        slots *= 2;
+    uint32_t* table = calloc(slots, sizeof(uint32_t));
+    if (!table)
+        return -1;
+    for (long i = 0; i < count; i++) {
+        long slot = delta_get32(sigs + i * DELTA_SIG_SIZE) & (slots - 1);
+        while (table[slot])
+            slot = (slot + 1) & (slots - 1);
+        table[slot] = i + 1;
+    }
+    
+    while (!failed && count > 0 && pos + block <= size) {
+        long match = -1;
+        uint64_t strong = 0;
+        int hashed = 0;
+        
+        weak = rolled ? weak : delta_weak(data + pos, block);
+        for (long slot = weak & (slots - 1); table[slot] && match < 0; slot = (slot + 1) & (slots - 1)) {
+            const unsigned char* sig = sigs + (long)(table[slot] - 1) * DELTA_SIG_SIZE;
+            if (delta_get32(sig) != weak)
+                continue;
+            if (!hashed) {
+                strong = delta_hash(data + pos, block, DELTA_HASH_INIT);
+                hashed = 1;
+            }
+            if (delta_get32(sig + 4) == strong >> 32 && delta_get32(sig + 8) == (uint32_t)strong)
+                match = table[slot] - 1;
+        }
+        
+        if (match < 0) {
+            // Slide on by a byte; what slid past is sent as it is
+            if (pos + block < size)
+                weak = delta_roll(weak, data[pos], data[pos + block], block);
+            rolled = 1;
+            pos++;
+            continue;
+        }
+        
+        // Literals before the match go first, then the copy joins the run it continues
+        if (pos > literal || (copy_count > 0 && match != copy_first + copy_count)) {
+            if (copy_count > 0)
+                failed |= delta_put_op(out, DELTA_OP_COPY, copy_first, copy_count, 1) < 0;
+            failed |= delta_put_data(out, data + literal, pos - literal) < 0;
+            copy_count = 0;
+        }
+        if (copy_count == 0)
+            copy_first = match;
+        copy_count++;
+        pos += block;
+        literal = pos;
+        rolled = 0;
+    }
+    
+    if (copy_count > 0)
+        failed |= delta_put_op(out, DELTA_OP_COPY, copy_first, copy_count, 1) < 0;
+    failed |= delta_put_data(out, data + literal, size - literal) < 0;
+    free(table);
+    
+    *hash = delta_hash(data, size, DELTA_HASH_INIT);
+    return failed || fflush(out) != 0 ? -1 : 0;
+}
+
+// Function to read exactly n bytes of a delta; -1 if it ends before
+static inline int delta_read(DeltaInput* in, void* buffer, long n) {
+    char* p = buffer;
+    
+    if (n > in->left)
+        return -1;
+    for (long done = 0; done < n;) {
+        ssize_t got = in->positional ? pread(in->fd, p + done, n - done, in->offset) : recv(in->fd, p + done, n - done, 0);
+        if (got <= 0)
+            return -1;
+        in->offset += got;
+        done += got;
+    }
+    in->left -= n;
+    return 0;
+}
+
+// Function to rebuild a file into out_fd, from the base_size bytes of its
+// old version in base_fd and a delta with block-byte blocks. Returns the
+// bytes written, or -1 for a delta that is cut short, malformed or refers
+// past the old version, or a write that fails.
+static inline long delta_apply(DeltaInput* in, int base_fd, long base_size, int block, int out_fd) {
+    unsigned char header[9];
+    long written = 0;
+    char* data = malloc(DELTA_LITERAL_MAX);
+    
+    if (!data)
+        return -1;
+    while (in->left > 0) {
+        if (delta_read(in, header, 5) < 0)
+            break;
+        
+        if (header[0] == DELTA_OP_COPY) {
+            if (delta_read(in, header + 5, 4) < 0)
+                break;
+            long offset = (long)delta_get32(header + 1) * block;
+            long length = (long)delta_get32(header + 5) * block;
+            if (offset + length > base_size || local_copy(base_fd, offset, out_fd, length) != length)
+                break;
+            written += length;
+        } else if (header[0] == DELTA_OP_DATA) {
+            long length = delta_get32(header + 1);
+            if (length > DELTA_LITERAL_MAX || delta_read(in, data, length) < 0 || write(out_fd, data, length) != length)
+                break;
+            written += length;
+        } else {
+            break;
+        }
+    }
+    
+    free(data);
+    return in->left == 0 ? written : -1;
+}
+
+// Function to check that a rebuilt file is size bytes hashing to hash
+static inline int delta_verify(int fd, long size, uint64_t hash) {
+    char buffer[65536];
+    uint64_t actual = DELTA_HASH_INIT;
+    long done = 0;
+    ssize_t n;
+    
+    while (done < size && (n = pread(fd, buffer, sizeof(buffer), done)) > 0) {
+        actual = delta_hash(buffer, n, actual);
+        done += n;
+    }
+    return done == size && pread(fd, buffer, 1, size) == 0 && actual == hash ? 0 : -1;
+}
+
+#endif
\ No newline at end of file
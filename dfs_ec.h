@@ -0,0 +1,168 @@
+#ifndef DFS_EC_H
+#define DFS_EC_H
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+// dfs_ec: Reed-Solomon erasure coding over GF(2^8).
+//
+// A file is cut into stripes of k chunks of EC_CHUNK bytes; chunk i of every
+// stripe goes to data shard i and m parity shards get linear combinations of
+// the stripe's chunks. The code is systematic (the first k rows of the
+// encoding matrix are the identity) with a Cauchy matrix below, so any k of
+// the k+m shards rebuild the file. Multiplying a buffer by a constant uses two
+// 16-entry tables (low and high nibble): built with -mssse3 or -march=native
+// each 16-byte block is two pshufb lookups, otherwise two lookups per byte.
+
+#define EC_CHUNK 4096               // Bytes per shard per stripe
+#define EC_MAX_SHARDS 16            // k + m
+
+static uint8_t ec_exp[512];
+static uint8_t ec_log[256];
+static int ec_ready;
+
+// Function to build the log and exp tables of GF(2^8) with polynomial 0x11d
+static void ec_init() {
+    int x = 1;
+    
+    if (ec_ready)
+        return;
+    
+    for (int i = 0; i < 255; i++) {
+        ec_exp[i] = ec_exp[i + 255] = (uint8_t)x;
+        ec_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    ec_exp[510] = ec_exp[0];
+    ec_ready = 1;
+}
+
+// Function to multiply two field elements
+static uint8_t ec_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0)
+        return 0;
+    return ec_exp[ec_log[a] + ec_log[b]];
+}
+
+// Function to invert a non-zero field element
+static uint8_t ec_inv(uint8_t a) {
+    return ec_exp[255 - ec_log[a]];
+}
+
+// Function to add c times src to dst: dst ^= c * src
+static void ec_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    uint8_t low[16], high[16];
+    size_t i = 0;
+    
+    if (c == 0)
+        return;
+    
+    // c * b = c * (b & 0x0f) ^ c * (b & 0xf0)
+    for (int n = 0; n < 16; n++) {
+        low[n] = ec_mul(c, (uint8_t)n);
+        high[n] = ec_mul(c, (uint8_t)(n << 4));
+    }
+
+#if defined(__SSSE3__)
+    __m128i tl = _mm_loadu_si128((const __m128i*)low);
+    __m128i th = _mm_loadu_si128((const __m128i*)high);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i l = _mm_shuffle_epi8(tl, _mm_and_si128(s, mask));
+        __m128i h = _mm_shuffle_epi8(th, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+#endif
+    
+    for (; i < len; i++)
+        dst[i] ^= low[src[i] & 0x0f] ^ high[src[i] >> 4];
+}
+
+// Function to get the encoding matrix coefficient for shard row and data column:
+// identity for the data shards, Cauchy 1 / (x_row + y_col) for the parity shards
+static uint8_t ec_coefficient(int k, int row, int col) {
+    if (row < k)
+        return row == col;
+    return ec_inv((uint8_t)(row ^ col));
+}
+
+// Function to compute the m parity chunks of one stripe
+static void ec_encode(int k, int m, uint8_t* const* data, uint8_t** parity, size_t len) {
+    for (int p = 0; p < m; p++) {
+        memset(parity[p], 0, len);
+        for (int d = 0; d < k; d++)
+            ec_mul_add(parity[p], data[d], ec_coefficient(k, k + p, d), len);
+    }
+}
+
+// Function to build the matrix that turns k available shards (rows, in
+// ascending order) back into the k data shards. Returns -1 if it is singular.
+static int ec_decode_matrix(int k, const int* rows, uint8_t decode[EC_MAX_SHARDS][EC_MAX_SHARDS]) {
+    uint8_t a[EC_MAX_SHARDS][EC_MAX_SHARDS];
+    
+    for (int r = 0; r < k; r++) {
+        for (int c = 0; c < k; c++) {
+            a[r][c] = ec_coefficient(k, rows[r], c);
+            decode[r][c] = r == c;
+        }
+    }
+    
+    // Gauss-Jordan elimination; addition is xor
+    for (int c = 0; c < k; c++) {
+        int pivot = c;
+        while (pivot < k && a[pivot][c] == 0)
+            pivot++;
+        if (pivot == k)
+            return -1;
+        
+        for (int j = 0; j < k; j++) {
+            uint8_t t = a[c][j]; a[c][j] = a[pivot][j]; a[pivot][j] = t;
+            t = decode[c][j]; decode[c][j] = decode[pivot][j]; decode[pivot][j] = t;
+        }
+        
+        uint8_t scale = ec_inv(a[c][c]);
+        for (int j = 0; j < k; j++) {
+            a[c][j] = ec_mul(a[c][j], scale);
+            decode[c][j] = ec_mul(decode[c][j], scale);
+        }
+        
+        for (int r = 0; r < k; r++) {
+            uint8_t f = a[r][c];
+            if (r == c || f == 0)
+                continue;
+            for (int j = 0; j < k; j++) {
+                a[r][j] ^= ec_mul(f, a[c][j]);
+                decode[r][j] ^= ec_mul(f, decode[c][j]);
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// Function to rebuild the data chunks of one stripe from k available chunks,
+// ordered like the rows given to ec_decode_matrix
+static void ec_decode(int k, uint8_t decode[EC_MAX_SHARDS][EC_MAX_SHARDS], uint8_t* const* available,
+                      uint8_t** data, size_t len) {
+    for (int d = 0; d < k; d++) {
+        memset(data[d], 0, len);
+        for (int j = 0; j < k; j++)
+            ec_mul_add(data[d], available[j], decode[d][j], len);
+    }
+}
+
+// Function to get the size of every shard of a file
+static long ec_shard_size(int k, long filesize) {
+    long stripes = (filesize + (long)k * EC_CHUNK - 1) / ((long)k * EC_CHUNK);
+    return stripes * EC_CHUNK;
+}
+
+#endif
\ No newline at end of file
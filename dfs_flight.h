@@ -0,0 +1,345 @@
+#ifndef DFS_FLIGHT_H
+#define DFS_FLIGHT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// dfs_flight: S1's coalescing of identical reads in flight.
+//
+// When many clients download the same file or ask for the same tar at once,
+// only the first request (the leader) fetches it from the backends. The
+// others (followers) attach to its flight and are sent what the leader
+// fetches, instead of each opening backend connections of their own.
+//
+// The leader writes the content into a buffer file in the flight directory
+// (-F dir; a tmpfs such as /dev/shm keeps it in memory) as it arrives, and
+// publishes the size and how many bytes the buffer holds in a shared table.
+// Every follower reads the buffer from its own offset with sendfile and
+// sleeps on a futex in the table while it has caught up with the leader,
+// so a slow client holds back neither the leader nor the other followers.
+// The buffer file is removed by the last request to let go of the flight.
+//
+// A leader that fails, or takes a path whose content doesn't go through the
+// buffer, ends its flight as failed. A follower that hasn't told its client
+// anything yet then fetches the file by itself; one that already has ends
+// its session like a broken transfer would. Followers also notice a leader
+// that died. Writes through S1 close the flights of the path they change,
+// so a request arriving after the write starts a fresh fetch.
+//
+// The table lives in an anonymous shared mapping created before S1 forks,
+// so requests coalesce across every session process.
+
+#define FLIGHT_MAX 64               // Flights at once; requests beyond fetch alone
+#define FLIGHT_KEY_MAX 512
+#define FLIGHT_TAG_MAX 64
+#define FLIGHT_WAIT_MS 1000         // A follower checks on its leader at least this often
+
+// States of a flight
+#define FLIGHT_FREE 0
+#define FLIGHT_RUNNING 1
+#define FLIGHT_DONE 2               // The buffer holds all size bytes
+#define FLIGHT_FAILED 3
+
+// Roles of a request, and what a follower returns to have its request fetch alone
+#define FLIGHT_ALONE 0
+#define FLIGHT_LEADER 1
+#define FLIGHT_FOLLOWER 2
+#define FLIGHT_RETRY 1
+
+// Structure to store one flight
+typedef struct {
+    char key[FLIGHT_KEY_MAX];
+    int state;
+    int open;                       // New requests may still join
+    int refs;                       // Leader and followers attached
+    pid_t leader;                   // 0 once the leader let go
+    uint32_t id;                    // Names the buffer file
+    long size;                      // -1 until the leader knows it
+    long written;                   // Bytes in the buffer
+    uint32_t progress;              // Futex bumped by every change of the above
+    char tag[FLIGHT_TAG_MAX];       // Version of what is fetched, empty if unknown
+} Flight;
+
+// Structure to store the shared table
+typedef struct {
+    int lock;
+    uint32_t next_id;
+    Flight flights[FLIGHT_MAX];
+} FlightTable;
+
+static FlightTable* flights;
+static char flight_dir[1024];
+static pid_t flight_owner;          // S1's main process, so two S1 sharing a directory don't collide
+static Flight* flight_leading;      // The flight this session leads
+static int flight_fd = -1;          // Its buffer, open for writing
+
+// Function to take the table lock
+static void flight_lock() {
+    while (__atomic_test_and_set(&flights->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+// Function to release the table lock
+static void flight_unlock() {
+    __atomic_clear(&flights->lock, __ATOMIC_RELEASE);
+}
+
+// Function to map the shared table, with the buffers kept in dir. Must be
+// called before S1 forks; without it every request fetches alone.
+static int flight_init(const char* dir) {
+    flights = mmap(NULL, sizeof(FlightTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flights == MAP_FAILED) {
+        flights = NULL;
+        return -1;
+    }
+    memset(flights, 0, sizeof(FlightTable));
+    snprintf(flight_dir, sizeof(flight_dir), "%s", dir);
+    flight_owner = getpid();
+    return 0;
+}
+
+// Function to build the path of a flight's buffer
+static void flight_buffer_path(uint32_t id, char* out, size_t size) {
+    snprintf(out, size, "%s/w25-flight.%d.%u", flight_dir, (int)flight_owner, id);
+}
+
+// Function to copy a key with runs of slashes collapsed, so two spellings
+// of a path share a flight
+static void flight_key(const char* key, char* out) {
+    size_t len = 0;
+    
+    for (const char* p = key; *p && len < FLIGHT_KEY_MAX - 1; p++) {
+        if (*p == '/' && len > 0 && out[len - 1] == '/')
+            continue;
+        out[len++] = *p;
+    }
+    out[len] = '\0';
+}
+
+// Function to wake everyone waiting on a flight
+static void flight_wake(Flight* flight) {
+    syscall(SYS_futex, &flight->progress, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Function to let go of a flight; the last one out removes its buffer
+static void flight_detach(Flight* flight) {
+    char path[1200];
+    int last;
+    
+    flight_lock();
+    flight->refs--;
+    last = flight->refs == 0 && flight->state != FLIGHT_RUNNING;
+    if (last) {
+        flight_buffer_path(flight->id, path, sizeof(path));
+        flight->state = FLIGHT_FREE;
+    }
+    flight_unlock();
+    
+    if (last)
+        unlink(path);
+}
+
+// Function to join the flight of key, or start one. Returns FLIGHT_FOLLOWER
+// with *out set, FLIGHT_LEADER when this session fetches for the others, or
+// FLIGHT_ALONE when it fetches only for itself.
+static int flight_join(const char* key, Flight** out) {
+    char normal[FLIGHT_KEY_MAX];
+    char path[1200];
+    Flight* free_slot = NULL;
+    
+    *out = NULL;
+    if (!flights)
+        return FLIGHT_ALONE;
+    
+    flight_key(key, normal);
+    flight_lock();
+    for (int i = 0; i < FLIGHT_MAX; i++) {
+        Flight* flight = &flights->flights[i];
+        if (flight->state == FLIGHT_FREE) {
+            free_slot = free_slot ? free_slot : flight;
+        } else if (flight->open && flight->state != FLIGHT_FAILED && strcmp(flight->key, normal) == 0) {
+            flight->refs++;
+            flight_unlock();
+            *out = flight;
+            return FLIGHT_FOLLOWER;
+        }
+    }
+    if (!free_slot) {
+        flight_unlock();
+        return FLIGHT_ALONE;
+    }
+    
+    Flight* flight = free_slot;
+    strcpy(flight->key, normal);
+    flight->state = FLIGHT_RUNNING;
+    flight->open = 1;
+    flight->refs = 1;
+    flight->leader = getpid();
+    flight->id = flights->next_id++;
+    flight->size = -1;
+    flight->written = 0;
+    flight->tag[0] = '\0';
+    flight_buffer_path(flight->id, path, sizeof(path));
+    flight_unlock();
+    
+    // Followers open the buffer once the size is out, so it only has to exist by then
+    flight_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    flight_leading = flight;
+    if (flight_fd < 0) {
+        flight_leading = NULL;
+        flight_lock();
+        flight->state = FLIGHT_FAILED;
+        flight->leader = 0;
+        flight->progress++;
+        flight_unlock();
+        flight_wake(flight);
+        flight_detach(flight);
+        return FLIGHT_ALONE;
+    }
+    return FLIGHT_LEADER;
+}
+
+// Function to tell the path of the buffer of the flight this session
+// leads, so content can be built right in it; -1 if it leads none
+static int flight_path(char* out, size_t size) {
+    if (!flight_leading)
+        return -1;
+    flight_buffer_path(flight_leading->id, out, size);
+    return 0;
+}
+
+// Function to publish the size and version tag (may be NULL) of what the
+// leader is fetching, and that written bytes of it are in the buffer already
+static void flight_publish(long size, long written, const char* tag) {
+    if (!flight_leading)
+        return;
+    
+    flight_lock();
+    flight_leading->size = size;
+    flight_leading->written = written;
+    snprintf(flight_leading->tag, sizeof(flight_leading->tag), "%s", tag ? tag : "");
+    flight_leading->progress++;
+    flight_unlock();
+    flight_wake(flight_leading);
+}
+
+// Function to add n bytes the leader fetched to its buffer. A buffer that
+// can't take them fails the flight; the leader carries on by itself.
+static void flight_write(const char* data, long n) {
+    if (!flight_leading)
+        return;
+    
+    long done = 0;
+    ssize_t w = 0;
+    while (done < n && (w = write(flight_fd, data + done, n - done)) > 0)
+        done += w;
+    
+    flight_lock();
+    if (done == n) {
+        flight_leading->written += n;
+    } else {
+        flight_leading->state = FLIGHT_FAILED;
+    }
+    flight_leading->progress++;
+    flight_unlock();
+    flight_wake(flight_leading);
+}
+
+// Function to tell whether the flight this session leads has followers
+static int flight_shared() {
+    return flight_leading && __atomic_load_n(&flight_leading->refs, __ATOMIC_RELAXED) > 1;
+}
+
+// Function to end the flight this session leads: done if the buffer holds
+// everything, failed otherwise
+static void flight_end() {
+    Flight* flight = flight_leading;
+    
+    if (!flight)
+        return;
+    
+    flight_lock();
+    if (flight->state == FLIGHT_RUNNING)
+        flight->state = flight->size >= 0 && flight->written == flight->size ? FLIGHT_DONE : FLIGHT_FAILED;
+    flight->leader = 0;
+    flight->open &= flight->state == FLIGHT_DONE;
+    flight->progress++;
+    flight_unlock();
+    flight_wake(flight);
+    
+    close(flight_fd);
+    flight_fd = -1;
+    flight_leading = NULL;
+    flight_detach(flight);
+}
+
+// Function to read a flight's state, size and buffered bytes together;
+// returns the progress count to wait on for the next change
+static uint32_t flight_look(Flight* flight, int* state, long* size, long* written) {
+    uint32_t progress;
+    
+    flight_lock();
+    *state = flight->state;
+    *size = flight->size;
+    *written = flight->written;
+    progress = flight->progress;
+    flight_unlock();
+    return progress;
+}
+
+// Function to wait for a flight to change from progress. A leader that
+// died meanwhile fails its flight.
+static void flight_wait(Flight* flight, uint32_t progress) {
+    struct timespec timeout = { FLIGHT_WAIT_MS / 1000, (FLIGHT_WAIT_MS % 1000) * 1000000L };
+    
+    if (syscall(SYS_futex, &flight->progress, FUTEX_WAIT, progress, &timeout, NULL, 0) == 0 || errno != ETIMEDOUT)
+        return;
+    
+    flight_lock();
+    if (flight->state == FLIGHT_RUNNING && flight->leader > 0 && kill(flight->leader, 0) < 0 && errno == ESRCH) {
+        flight->state = FLIGHT_FAILED;
+        flight->leader = 0;
+        flight->open = 0;
+        flight->refs--;
+        flight->progress++;
+    }
+    flight_unlock();
+}
+
+// Function to open a follower's own view of a flight's buffer
+static int flight_open(Flight* flight) {
+    char path[1200];
+    
+    flight_buffer_path(flight->id, path, sizeof(path));
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Function to keep requests arriving from now on out of the flight of key,
+// because what it fetches is being changed
+static void flight_close(const char* key) {
+    char normal[FLIGHT_KEY_MAX];
+    
+    if (!flights)
+        return;
+    
+    flight_key(key, normal);
+    flight_lock();
+    for (int i = 0; i < FLIGHT_MAX; i++) {
+        Flight* flight = &flights->flights[i];
+        if (flight->state != FLIGHT_FREE && strcmp(flight->key, normal) == 0)
+            flight->open = 0;
+    }
+    flight_unlock();
+}
+
+#endif
\ No newline at end of file
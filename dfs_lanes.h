@@ -0,0 +1,198 @@
+#ifndef DFS_LANES_H
+#define DFS_LANES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dfs_log.h"
+
+// dfs_lanes: a backend's two service lanes.
+//
+// A backend used to serve one connection at a time, so a LIST_FILES or a
+// REMOVE_FILE waited behind whatever SEND_FILE was streaming. Now the accept
+// loop looks at each new connection's first command without consuming it and
+// queues the connection on one of two lanes, each served by its own thread:
+// the control lane takes PING, LIST_FILES, REMOVE_FILE, STATS and TRACE, the
+// bulk lane everything that moves file content. Control commands are short,
+// so the control lane never builds up a queue, and they no longer wait for a
+// transfer to finish. Within a lane connections are still served one at a
+// time and in order. The bulk thread runs at a lower CPU priority, so the
+// control lane also comes first when the two compete for a core.
+//
+// Connections come in on the TCP listener and, for S1 on the same host, on
+// the backend's Unix listener (see dfs_local.h); both are sorted alike.
+
+#define LANE_QUEUE 256              // Connections waiting per lane
+#define LANE_UNSORTED 64            // Connections whose first command hasn't arrived
+#define LANE_PEEK_TIMEOUT_MS 5000   // A connection silent this long goes to the bulk lane anyway
+#define LANE_PEEK_SIZE 1024         // A whole command as the backends read it, prefixes and all
+#define LANE_BULK_NICE 10
+#define LANE_LISTENERS 2            // TCP and Unix
+
+// Structure to store one lane's queue of connections
+typedef struct {
+    const char* name;
+    int socks[LANE_QUEUE];
+    int head, count;
+    void (*handler)(int);
+    int nice;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} Lane;
+
+static Lane lane_control = { "control", { 0 }, 0, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static Lane lane_bulk = { "bulk", { 0 }, 0, 0, NULL, LANE_BULK_NICE, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// Function to tell whether a command belongs on the control lane
+static int lane_is_control(const char* command) {
+    static const char* control[] = { "PING", "LIST_FILES", "REMOVE_FILE", "STATS", "TRACE" };
+    
+    // Skip S1's trace prefix, "T:<id>:<sent us> ", and its signature, "K:<expiry>:<mac> "
+    if (strncmp(command, "T:", 2) == 0 && strchr(command, ' '))
+        command = strchr(command, ' ') + 1;
+    if (strncmp(command, "K:", 2) == 0 && strchr(command, ' '))
+        command = strchr(command, ' ') + 1;
+    
+    for (size_t i = 0; i < sizeof(control) / sizeof(control[0]); i++) {
+        size_t len = strlen(control[i]);
+        if (strncmp(command, control[i], len) == 0 && (command[len] == ' ' || command[len] == 0))
+            return 1;
+    }
+    return 0;
+}
+
+// Function to queue a connection on a lane; a full lane turns it away
+static void lane_push(Lane* lane, int sock) {
+    pthread_mutex_lock(&lane->lock);
+    if (lane->count == LANE_QUEUE) {
+        pthread_mutex_unlock(&lane->lock);
+        log_event(LOG_WARN, "lane_full", lane->name, LANE_QUEUE);
+        send(sock, "ERROR: Server busy", 18, MSG_NOSIGNAL);
+        close(sock);
+        return;
+    }
+    lane->socks[(lane->head + lane->count++) % LANE_QUEUE] = sock;
+    pthread_cond_signal(&lane->ready);
+    pthread_mutex_unlock(&lane->lock);
+}
+
+// Function to serve a lane's connections in order, forever
+static void* lane_main(void* arg) {
+    Lane* lane = arg;
+    
+    if (lane->nice)
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), lane->nice);
+    
+    while (1) {
+        pthread_mutex_lock(&lane->lock);
+        while (lane->count == 0)
+            pthread_cond_wait(&lane->ready, &lane->lock);
+        int sock = lane->socks[lane->head];
+        lane->head = (lane->head + 1) % LANE_QUEUE;
+        lane->count--;
+        pthread_mutex_unlock(&lane->lock);
+        
+        lane->handler(sock);
+    }
+    return NULL;
+}
+
+// Function to sort a connection onto a lane by its first command
+static void lane_sort(int sock) {
+    char peek[LANE_PEEK_SIZE];
+    ssize_t len = recv(sock, peek, sizeof(peek) - 1, MSG_PEEK | MSG_DONTWAIT);
+    
+    if (len <= 0) {
+        // Closed before saying anything; nothing to serve
+        close(sock);
+        return;
+    }
+    peek[len] = 0;
+    lane_push(lane_is_control(peek) ? &lane_control : &lane_bulk, sock);
+}
+
+// Function to accept connections on server_fd and local_fd (-1 for none)
+// and serve them on the two lanes with handler, which must close the socket
+// it is given. Never returns.
+static void lanes_serve(int server_fd, int local_fd, void (*handler)(int)) {
+    struct pollfd pfds[LANE_UNSORTED + LANE_LISTENERS];
+    int64_t since[LANE_UNSORTED + LANE_LISTENERS];
+    int listeners[LANE_LISTENERS] = { server_fd, local_fd };
+    int unsorted = 0;
+    pthread_t thread;
+    
+    lane_control.handler = lane_bulk.handler = handler;
+    if (pthread_create(&thread, NULL, lane_main, &lane_control) != 0 ||
+        pthread_create(&thread, NULL, lane_main, &lane_bulk) != 0) {
+        perror("pthread_create failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int l = 0; l < LANE_LISTENERS; l++)
+        pfds[l].events = POLLIN;
+    
+    while (1) {
+        // Stop accepting while every slot waits for a first command
+        for (int l = 0; l < LANE_LISTENERS; l++)
+            pfds[l].fd = unsorted < LANE_UNSORTED ? listeners[l] : -1;
+        if (poll(pfds, unsorted + LANE_LISTENERS, 1000) < 0 && errno != EINTR) {
+            log_event(LOG_ERROR, "poll_failed", strerror(errno), errno);
+            continue;
+        }
+        
+        int64_t now = (int64_t)time(NULL) * 1000;
+        for (int i = unsorted + LANE_LISTENERS - 1; i >= LANE_LISTENERS; i--) {
+            int last = unsorted + LANE_LISTENERS - 1;
+            
+            if (!pfds[i].revents && now - since[i] < LANE_PEEK_TIMEOUT_MS)
+                continue;
+            
+            if (pfds[i].revents)
+                lane_sort(pfds[i].fd);
+            else
+                lane_push(&lane_bulk, pfds[i].fd);
+            pfds[i] = pfds[last];
+            since[i] = since[last];
+            unsorted--;
+        }
+        
+        for (int l = 0; l < LANE_LISTENERS; l++) {
+            if (pfds[l].fd < 0 || !(pfds[l].revents & POLLIN) || unsorted == LANE_UNSORTED)
+                continue;
+            
+            struct sockaddr_in address;
+            socklen_t addrlen = sizeof(address);
+            int client_sock = accept(listeners[l], (struct sockaddr*)&address, &addrlen);
+            
+            if (client_sock < 0) {
+                log_event(LOG_ERROR, "accept_failed", strerror(errno), errno);
+                continue;
+            }
+            if (address.sin_family == AF_INET)
+                log_event(LOG_DEBUG, "s1_connected", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+            else
+                log_event(LOG_DEBUG, "s1_connected", "unix", 0);
+            
+            int slot = unsorted + LANE_LISTENERS;
+            pfds[slot].fd = client_sock;
+            pfds[slot].events = POLLIN;
+            pfds[slot].revents = 0;
+            since[slot] = now;
+            unsorted++;
+        }
+    }
+}
+
+#endif
\ No newline at end of file
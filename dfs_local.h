@@ -0,0 +1,192 @@
+#ifndef DFS_LOCAL_H
+#define DFS_LOCAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// dfs_local: the transport between S1 and backends on the same host.
+//
+// Besides its TCP port every backend listens on a Unix domain socket named
+// after that port, w25-<port>.sock in $W25_SOCKET_DIR (default
+// LOCAL_SOCKET_DIR). S1 tries that socket first for a backend configured on
+// a loopback address and falls back to TCP when it isn't there, so nothing
+// has to be configured and a backend on another host is reached as before.
+//
+// The protocol on the Unix socket is the same, with one addition: file
+// content that already sits in a file doesn't have to travel through the
+// socket at all. A message may carry an open descriptor (SCM_RIGHTS) of the
+// file it is about. A backend answering SEND_FILE attaches the file to the
+// size it replies with, and S1 sends it to the client with sendfile; S1
+// attaches the file it staged an upload in to the size it announces, and
+// the backend copies it with copy_file_range. Either side that doesn't want
+// the descriptor ignores it and the content is streamed as before.
+
+#define LOCAL_SOCKET_DIR "/tmp"
+#define LOCAL_CONNECT_TIMEOUT_MS 100  // A Unix socket that doesn't answer at once isn't worth waiting for
+
+static int local_enabled = 1;       // S1 tries the Unix socket of backends on this host
+
+// Function to build the path of the Unix socket for a backend's port
+static inline int local_socket_path(int port, struct sockaddr_un* addr) {
+    const char* dir = getenv("W25_SOCKET_DIR");
+    
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/w25-%d.sock", dir && dir[0] ? dir : LOCAL_SOCKET_DIR,
+                       port);
+    return len < (int)sizeof(addr->sun_path) ? 0 : -1;
+}
+
+// Function to open a backend's Unix listener for port, replacing a socket
+// left behind by an earlier run; -1 if it can't
+static inline int local_listen(int port) {
+    struct sockaddr_un addr;
+    int fd;
+    
+    if (local_socket_path(port, &addr) < 0 || (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 10) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to tell whether a host is this one's loopback address
+static inline int local_is_loopback(const char* host) {
+    return strncmp(host, "127.", 4) == 0 || strcmp(host, "localhost") == 0;
+}
+
+// Function to connect to the Unix socket of a backend on this host; -1 if
+// the backend isn't local or has no such socket
+static inline int local_connect(const char* host, int port) {
+    struct sockaddr_un addr;
+    int fd;
+    
+    if (!local_enabled || !local_is_loopback(host) || local_socket_path(port, &addr) < 0 ||
+        (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    
+    // A full backlog would block connect; don't wait long for it
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    
+    int result = connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+    if (result < 0 && errno == EAGAIN) {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+        
+        result = -1;
+        if (poll(&pfd, 1, LOCAL_CONNECT_TIMEOUT_MS) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+            err == 0)
+            result = 0;
+    }
+    if (result < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    fcntl(fd, F_SETFL, flags);
+    return fd;
+}
+
+// Function to tell whether a connection is on a Unix socket
+static inline int local_is_unix(int sock) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    
+    return getsockname(sock, (struct sockaddr*)&addr, &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+// Function to send a message with an open descriptor attached
+static inline ssize_t local_send_fd(int sock, const char* msg, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { (void*)msg, strlen(msg) };
+    struct msghdr hdr = { 0 };
+    
+    memset(control, 0, sizeof(control));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL);
+}
+
+// Function to copy size bytes from offset in src_fd to dst_fd, in the kernel
+// where it can; returns the bytes copied
+static inline long local_copy(int src_fd, long offset, int dst_fd, long size) {
+    char buffer[65536];
+    loff_t from = offset;
+    long copied = 0;
+    
+    while (copied < size) {
+        ssize_t n = copy_file_range(src_fd, &from, dst_fd, NULL, size - copied, 0);
+        if (n > 0) {
+            copied += n;
+            continue;
+        }
+        if (n == 0)
+            break;
+        
+        // Not between these two files (another filesystem, an old kernel): copy through a buffer
+        n = pread(src_fd, buffer, size - copied < (long)sizeof(buffer) ? size - copied : (long)sizeof(buffer), from);
+        if (n <= 0 || write(dst_fd, buffer, n) != n)
+            break;
+        from += n;
+        copied += n;
+    }
+    return copied;
+}
+
+// Function to receive a message like recv, and the descriptor attached to
+// it in *fd, -1 if none. A descriptor beyond the first is closed.
+static inline ssize_t local_recv(int sock, char* buffer, size_t size, int* fd) {
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    struct iovec iov = { buffer, size };
+    struct msghdr hdr = { 0 };
+    
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    
+    *fd = -1;
+    ssize_t len = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+    if (len < 0)
+        return len;
+    
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int received;
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*fd < 0)
+                *fd = received;
+            else
+                close(received);
+        }
+    }
+    return len;
+}
+
+#endif
\ No newline at end of file
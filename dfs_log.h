@@ -0,0 +1,276 @@
+#ifndef DFS_LOG_H
+#define DFS_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "dfs_trace.h"
+
+// dfs_log: structured logging that stays off the request path.
+//
+// A request only copies a fixed-size binary record (time, level, pid, trace,
+// event, one number and a short text) into a lock-free ring in an anonymous
+// shared mapping; it never formats, writes or waits. A flusher process forked
+// at startup drains the ring, renders the records as logfmt lines and writes
+// them to stdout in batches. When the ring is full records are dropped and
+// counted instead of blocking. Records below the configured level are never
+// built, and high-rate events go through log_sampled(), which keeps one of
+// every N.
+
+#define LOG_RING_SIZE 8192          // Records, power of two
+#define LOG_TEXT_SIZE 160
+#define LOG_FLUSH_INTERVAL_US 20000 // How often the flusher looks for new records
+
+// Log levels
+enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+};
+
+static const char* log_level_names[] = { "debug", "info", "warn", "error", "off" };
+
+// Structure to store one log record
+typedef struct {
+    uint64_t seq;                   // Ring position + 1 once written, position + size once read
+    uint64_t time_us;
+    uint64_t trace_id;
+    const char* event;              // Static string; valid in the flusher, which is forked from us
+    long value;
+    int pid;
+    int level;
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+// Structure to store the shared ring of one server
+typedef struct {
+    char server[8];
+    int level;                      // Lowest level that is recorded
+    unsigned sample;                // Keep one of every sample sampled events
+    uint64_t sampled;
+    uint64_t dropped;
+    uint64_t tail;                  // Next position producers claim
+    uint64_t head;                  // Next position the flusher reads
+    LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+static LogRing* log_ring;
+static volatile sig_atomic_t log_stopping;
+
+// Function to parse a level name; -1 when unknown
+static int log_parse_level(const char* name) {
+    for (int i = 0; i <= LOG_OFF; i++) {
+        if (strcasecmp(name, log_level_names[i]) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// Function to check whether a level is recorded, so callers can skip building text
+static int log_enabled(int level) {
+    return log_ring && level >= log_ring->level;
+}
+
+// Function to record one event. Never blocks; drops the record when the ring is full.
+static void log_event(int level, const char* event, const char* text, long value) {
+    if (!log_enabled(level))
+        return;
+
+    uint64_t pos = __atomic_load_n(&log_ring->tail, __ATOMIC_RELAXED);
+    LogRecord* record;
+
+    // Claim a slot whose previous record the flusher has already taken
+    for (;;) {
+        record = &log_ring->records[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&log_ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&log_ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record->time_us = (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    record->trace_id = trace_current;
+    record->event = event;
+    record->value = value;
+    record->pid = getpid();
+    record->level = level;
+
+    size_t len = text ? strnlen(text, LOG_TEXT_SIZE - 1) : 0;
+    memcpy(record->text, text, len);
+    record->text[len] = 0;
+
+    __atomic_store_n(&record->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Function to record a high-rate event, keeping one of every N
+static void log_sampled(int level, const char* event, const char* text, long value) {
+    if (!log_enabled(level))
+        return;
+
+    if (log_ring->sample > 1 && __atomic_fetch_add(&log_ring->sampled, 1, __ATOMIC_RELAXED) % log_ring->sample != 0)
+        return;
+
+    log_event(level, event, text, value);
+}
+
+// Function to render one record as a logfmt line; returns the length written
+static size_t log_format(char* out, size_t size, const LogRecord* record, const char* server) {
+    time_t sec = record->time_us / 1000000;
+    struct tm tm;
+    size_t len;
+
+    gmtime_r(&sec, &tm);
+    len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    len += snprintf(out + len, size - len, ".%06uZ %-5s %s pid=%d", (unsigned)(record->time_us % 1000000),
+                    log_level_names[record->level], server, record->pid);
+    if (record->trace_id && len < size)
+        len += snprintf(out + len, size - len, " trace=%016llx", (unsigned long long)record->trace_id);
+    if (len < size)
+        len += snprintf(out + len, size - len, " event=%s", record->event ? record->event : "-");
+    if (record->value && len < size)
+        len += snprintf(out + len, size - len, " value=%ld", record->value);
+
+    // Quote the text, escaping what would break the line
+    if (record->text[0] && len + 4 < size) {
+        len += snprintf(out + len, size - len, " msg=\"");
+        for (const char* c = record->text; *c && len + 4 < size; c++) {
+            if (*c == '"' || *c == '\\') {
+                out[len++] = '\\';
+                out[len++] = *c;
+            } else {
+                out[len++] = (unsigned char)*c < 0x20 ? ' ' : *c;
+            }
+        }
+        out[len++] = '"';
+    }
+    if (len + 1 < size) {
+        out[len++] = '\n';
+    }
+    out[len < size ? len : size - 1] = 0;
+
+    return len < size ? len : size - 1;
+}
+
+// Function to move every finished record from the ring to stdout; returns how many
+static int log_drain() {
+    static char batch[65536];
+    size_t len = 0;
+    int drained = 0;
+    uint64_t dropped = __atomic_exchange_n(&log_ring->dropped, 0, __ATOMIC_RELAXED);
+
+    if (dropped) {
+        LogRecord note = { 0 };
+        note.time_us = trace_now_us();
+        note.event = "log_dropped";
+        note.value = (long)dropped;
+        note.pid = getpid();
+        note.level = LOG_WARN;
+        len += log_format(batch + len, sizeof(batch) - len, &note, log_ring->server);
+    }
+
+    for (;;) {
+        uint64_t pos = log_ring->head;
+        LogRecord* record = &log_ring->records[pos & (LOG_RING_SIZE - 1)];
+
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+
+        // Write out the batch when the next line might not fit
+        if (len + LOG_TEXT_SIZE * 2 + 128 > sizeof(batch)) {
+            fwrite(batch, 1, len, stdout);
+            len = 0;
+        }
+        len += log_format(batch + len, sizeof(batch) - len, record, log_ring->server);
+
+        __atomic_store_n(&record->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        log_ring->head = pos + 1;
+        drained++;
+    }
+
+    if (len > 0) {
+        fwrite(batch, 1, len, stdout);
+        fflush(stdout);
+    }
+
+    return drained;
+}
+
+// Function to stop the flusher once it has drained what is left
+static void log_stop(int sig) {
+    (void)sig;
+    log_stopping = 1;
+}
+
+// Function to run the flusher until the server exits
+static void log_flusher(pid_t server) {
+    signal(SIGTERM, log_stop);
+    signal(SIGINT, log_stop);
+
+    // Don't hold the server's sockets or its readiness pipe open
+    for (int fd = 3; fd < 1024; fd++) {
+        close(fd);
+    }
+
+    while (!log_stopping && getppid() == server) {
+        if (log_drain() == 0)
+            usleep(LOG_FLUSH_INTERVAL_US);
+    }
+
+    log_drain();
+    exit(0);
+}
+
+// Function to map the ring and fork the flusher; call before forking anything else
+static int log_init(const char* server, int level, unsigned sample) {
+    log_ring = mmap(NULL, sizeof(LogRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log_ring == MAP_FAILED) {
+        log_ring = NULL;
+        return -1;
+    }
+
+    snprintf(log_ring->server, sizeof(log_ring->server), "%s", server);
+    log_ring->level = level;
+    log_ring->sample = sample ? sample : 1;
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring->records[i].seq = i;
+    }
+
+    // Anything printed before now must not be flushed twice
+    fflush(stdout);
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        munmap(log_ring, sizeof(LogRing));
+        log_ring = NULL;
+        return -1;
+    }
+    if (pid == 0) {
+        log_flusher(parent);
+    }
+
+    return 0;
+}
+
+#endif
\ No newline at end of file
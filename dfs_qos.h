@@ -0,0 +1,482 @@
+#ifndef DFS_QOS_H
+#define DFS_QOS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+// dfs_qos: bandwidth and operation limits per tenant.
+//
+// Every session belongs to a tenant: the one a "client" line maps its address
+// to, else the one the client announced with the "tenant <name>" command if
+// that has a "tenant" line, else a tenant of its own named after its address.
+// Each tenant has a byte bucket and an operation bucket in an anonymous
+// shared mapping created before S1 forks, so all sessions of a tenant draw
+// from the same buckets. A tenant no session has used for QOS_IDLE_US gives
+// its slot up to the next new one; while every slot is taken, new sessions
+// share the "default" tenant, which always has slot 0. The table also notes
+// each session process's tenant, so a process that dies mid-session doesn't
+// keep its tenant's slot taken.
+//
+// The byte bucket fills at the tenant's fair share of S1's capacity:
+// capacity x weight / (sum of the weights of the tenants active in the last
+// QOS_ACTIVE_US), capped by the tenant's own rate. A tenant running alone gets
+// all of it, so batch work soaks up whatever interactive users leave, and a
+// heavier tenant keeps most of it while the two compete. The bucket holds up
+// to the tenant's burst, which lets short requests through without waiting.
+// A session takes what it moves and sleeps off any debt, so transfers are
+// paced rather than refused. The shared table is rewritten on SIGHUP, and
+// running sessions see the new limits at once.
+//
+// The config file:
+//
+//   capacity <bytes/s>                                  # shared fairly, 0 none
+//   tenant <name> <weight> [<bytes/s> [<burst> [<ops/s>]]]   # 0 for no cap
+//   client <ipv4>[/<bits>] <tenant>
+//
+// Sizes take a K, M or G suffix. The tenant named "default" sets the limits of
+// tenants without a line of their own.
+
+#define QOS_MAX_TENANTS 256
+#define QOS_MAX_CLIENTS 64
+#define QOS_NAME_MAX 32
+#define QOS_ACTIVE_US 200000        // A tenant that moved data this recently competes for capacity
+#define QOS_QUANTUM 16384           // Bytes a session moves between visits to the shared bucket
+#define QOS_BURST_US 100000         // Burst of a tenant without one: this long at its rate
+#define QOS_IDLE_US 10000000        // A tenant without sessions this long may lose its slot
+#define QOS_DEFAULT "default"
+#define QOS_OWNERS 1024             // Session processes that can hold a tenant, see WORKER_MAX
+
+// Structure to store the limits of one tenant
+typedef struct {
+    char name[QOS_NAME_MAX];
+    int weight;
+    long rate;                      // Bytes per second, 0 for no cap of its own
+    long burst;                     // Bytes, 0 for QOS_BURST_US worth
+    long iops;                      // Operations per second, 0 for no cap
+} QosClass;
+
+// Structure to store a parsed config file
+typedef struct {
+    long capacity;
+    int class_count;
+    QosClass classes[QOS_MAX_TENANTS];
+    int client_count;
+    struct {
+        uint32_t addr, mask;        // Host byte order
+        char tenant[QOS_NAME_MAX];
+    } clients[QOS_MAX_CLIENTS];
+} QosConfig;
+
+// Structure to store the buckets of one tenant
+typedef struct {
+    int used;
+    int sessions;                   // Sessions drawing from it now
+    QosClass limits;
+    double tokens;                  // Bytes; negative while sessions sleep off a debt
+    double op_tokens;
+    uint64_t refill_us;
+    uint64_t active_us;             // Last time it moved data
+} QosTenant;
+
+// Structure to store the shared table
+typedef struct {
+    int lock;
+    int enabled;
+    QosConfig config;
+    QosTenant tenants[QOS_MAX_TENANTS];
+    int owners[QOS_OWNERS];         // Each session process's tenant plus one, 0 for none
+} QosTable;
+
+static QosTable* qos;
+static int qos_tenant = -1;         // This session's tenant
+static int qos_mapped;              // A "client" line picked it
+static long qos_pending;            // Bytes moved but not yet taken from the bucket
+static int qos_owner = -1;          // This process's entry in owners, -1 for none
+
+// Function to get a monotonic timestamp in microseconds
+static uint64_t qos_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Function to take the table lock
+static void qos_lock() {
+    while (__atomic_test_and_set(&qos->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+// Function to release the table lock
+static void qos_unlock() {
+    __atomic_clear(&qos->lock, __ATOMIC_RELEASE);
+}
+
+// Function to parse a size with an optional K, M or G suffix; -1 if it isn't one
+static long qos_parse_size(const char* text) {
+    char* end;
+    long value = strtol(text, &end, 10);
+    
+    if (end == text || value < 0)
+        return -1;
+    if (*end == 'K' || *end == 'k')
+        value <<= 10, end++;
+    else if (*end == 'M' || *end == 'm')
+        value <<= 20, end++;
+    else if (*end == 'G' || *end == 'g')
+        value <<= 30, end++;
+    return *end ? -1 : value;
+}
+
+// Function to find a tenant's class in a config; NULL if it has none
+static const QosClass* qos_class(const QosConfig* config, const char* name) {
+    for (int i = 0; i < config->class_count; i++) {
+        if (strcmp(config->classes[i].name, name) == 0)
+            return &config->classes[i];
+    }
+    return NULL;
+}
+
+// Function to load a config file; on failure error says where
+static int qos_load(QosConfig* config, const char* path, char* error, size_t error_size) {
+    char line[1024];
+    int line_no = 0;
+    FILE* file = fopen(path, "r");
+    
+    memset(config, 0, sizeof(*config));
+    error[0] = 0;
+    if (!file) {
+        snprintf(error, error_size, "cannot open %s", path);
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), file)) {
+        char* words[8];
+        int count = 0;
+        char* save;
+        
+        line_no++;
+        line[strcspn(line, "#\r\n")] = 0;
+        for (char* w = strtok_r(line, " \t", &save); w && count < 8; w = strtok_r(NULL, " \t", &save))
+            words[count++] = w;
+        if (count == 0)
+            continue;
+        
+        if (strcmp(words[0], "capacity") == 0 && count == 2) {
+            if ((config->capacity = qos_parse_size(words[1])) < 0) {
+                snprintf(error, error_size, "%s:%d: bad capacity %s", path, line_no, words[1]);
+                break;
+            }
+        } else if (strcmp(words[0], "tenant") == 0 && count >= 3 && count <= 6) {
+            // tenant <name> <weight> [<bytes/s> [<burst> [<ops/s>]]]
+            QosClass* class = (QosClass*)qos_class(config, words[1]);
+            if (!class && config->class_count == QOS_MAX_TENANTS) {
+                snprintf(error, error_size, "%s:%d: more than %d tenants", path, line_no, QOS_MAX_TENANTS);
+                break;
+            }
+            if (!class)
+                class = &config->classes[config->class_count++];
+            
+            memset(class, 0, sizeof(*class));
+            snprintf(class->name, sizeof(class->name), "%s", words[1]);
+            class->weight = atoi(words[2]);
+            class->rate = count > 3 ? qos_parse_size(words[3]) : 0;
+            class->burst = count > 4 ? qos_parse_size(words[4]) : 0;
+            class->iops = count > 5 ? qos_parse_size(words[5]) : 0;
+            if (class->weight < 1 || class->rate < 0 || class->burst < 0 || class->iops < 0) {
+                snprintf(error, error_size, "%s:%d: need weight >= 1 and sizes >= 0", path, line_no);
+                break;
+            }
+        } else if (strcmp(words[0], "client") == 0 && count == 3) {
+            // client <ipv4>[/<bits>] <tenant>
+            char* slash = strchr(words[1], '/');
+            int bits = slash ? atoi(slash + 1) : 32;
+            struct in_addr addr;
+            
+            if (slash)
+                *slash = 0;
+            if (inet_pton(AF_INET, words[1], &addr) != 1 || bits < 0 || bits > 32) {
+                snprintf(error, error_size, "%s:%d: bad client address %s", path, line_no, words[1]);
+                break;
+            }
+            if (config->client_count == QOS_MAX_CLIENTS) {
+                snprintf(error, error_size, "%s:%d: more than %d clients", path, line_no, QOS_MAX_CLIENTS);
+                break;
+            }
+            config->clients[config->client_count].mask = bits ? 0xffffffffu << (32 - bits) : 0;
+            config->clients[config->client_count].addr = ntohl(addr.s_addr) & config->clients[config->client_count].mask;
+            snprintf(config->clients[config->client_count].tenant, QOS_NAME_MAX, "%s", words[2]);
+            config->client_count++;
+        } else {
+            snprintf(error, error_size, "%s:%d: expected capacity, tenant or client", path, line_no);
+            break;
+        }
+    }
+    
+    int failed = error[0] != 0 || ferror(file);
+    fclose(file);
+    return failed ? -1 : 0;
+}
+
+// Function to get the limits of a tenant under a config
+static QosClass qos_limits(const QosConfig* config, const char* name) {
+    const QosClass* class = qos_class(config, name);
+    QosClass limits = { "", 1, 0, 0, 0 };
+    
+    if (!class)
+        class = qos_class(config, "default");
+    if (class)
+        limits = *class;
+    snprintf(limits.name, sizeof(limits.name), "%s", name);
+    return limits;
+}
+
+// Function to map the shared table; call before forking
+static int qos_init() {
+    qos = mmap(NULL, sizeof(QosTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (qos == MAP_FAILED) {
+        qos = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to install a config: tenants already known keep their buckets and
+// get their new limits at once
+static void qos_configure(const QosConfig* config) {
+    if (!qos)
+        return;
+    
+    qos_lock();
+    qos->config = *config;
+    if (!qos->tenants[0].used) {
+        qos->tenants[0].used = 1;
+        qos->tenants[0].refill_us = qos_now_us();
+        snprintf(qos->tenants[0].limits.name, QOS_NAME_MAX, "%s", QOS_DEFAULT);
+    }
+    for (int i = 0; i < QOS_MAX_TENANTS; i++) {
+        if (qos->tenants[i].used)
+            qos->tenants[i].limits = qos_limits(config, qos->tenants[i].limits.name);
+    }
+    qos->enabled = 1;
+    qos_unlock();
+}
+
+// Function to find a tenant's slot, or set one up for it: a free one, or one
+// no session has used for QOS_IDLE_US. -1 when the table is full. Call with
+// the lock held.
+static int qos_slot(const char* name) {
+    uint64_t now = qos_now_us();
+    int slot = -1;
+    
+    for (int i = 0; i < QOS_MAX_TENANTS; i++) {
+        if (qos->tenants[i].used && strcmp(qos->tenants[i].limits.name, name) == 0)
+            return i;
+    }
+    for (int i = 1; i < QOS_MAX_TENANTS && slot < 0; i++) {
+        const QosTenant* tenant = &qos->tenants[i];
+        if (!tenant->used || (tenant->sessions == 0 && now - tenant->refill_us >= QOS_IDLE_US))
+            slot = i;
+    }
+    if (slot < 0)
+        return -1;
+    
+    QosTenant* tenant = &qos->tenants[slot];
+    memset(tenant, 0, sizeof(*tenant));
+    tenant->used = 1;
+    tenant->limits = qos_limits(&qos->config, name);
+    tenant->refill_us = now;
+    return slot;
+}
+
+// Function to move this session to a tenant's slot; call with the lock held
+static void qos_move(int slot) {
+    if (qos_tenant >= 0)
+        qos->tenants[qos_tenant].sessions--;
+    qos_tenant = slot;
+    if (slot >= 0)
+        qos->tenants[slot].sessions++;
+    if (qos_owner >= 0 && qos_owner < QOS_OWNERS)
+        qos->owners[qos_owner] = slot + 1;
+}
+
+// Function to start a session on the tenant its client's address picks: the
+// one a "client" line maps it to, else one of its own, else, with the table
+// full, the default tenant
+static void qos_attach(uint32_t client_addr) {
+    const char* name = NULL;
+    char own[QOS_NAME_MAX];
+    
+    if (!qos || !qos->enabled)
+        return;
+    
+    qos_lock();
+    for (int i = 0; i < qos->config.client_count && !name; i++) {
+        if ((client_addr & qos->config.clients[i].mask) == qos->config.clients[i].addr)
+            name = qos->config.clients[i].tenant;
+    }
+    qos_mapped = name != NULL;
+    if (!name) {
+        struct in_addr addr = { htonl(client_addr) };
+        snprintf(own, sizeof(own), "%s", inet_ntoa(addr));
+        name = own;
+    }
+    
+    int slot = qos_slot(name);
+    qos_move(slot >= 0 ? slot : 0);
+    qos_unlock();
+}
+
+// Function to move this session to the tenant its client announced. The
+// session keeps the tenant it has when a "client" line picked that, when the
+// name has no "tenant" line or when the table is full. Copies the name of
+// the tenant the session ends up with to out; returns 0 if it is the one
+// announced.
+static int qos_announce(const char* name, char* out, size_t size) {
+    int moved = 0;
+    
+    if (!qos || !qos->enabled || qos_tenant < 0) {
+        snprintf(out, size, "%s", name);
+        return 0;
+    }
+    
+    qos_lock();
+    if (!qos_mapped && qos_class(&qos->config, name)) {
+        int slot = qos_slot(name);
+        if (slot >= 0) {
+            qos_move(slot);
+            moved = 1;
+        }
+    }
+    snprintf(out, size, "%s", qos->tenants[qos_tenant].limits.name);
+    qos_unlock();
+    
+    return moved ? 0 : -1;
+}
+
+// Function to end this session's claim on its tenant
+static void qos_detach() {
+    if (!qos || qos_tenant < 0)
+        return;
+    
+    qos_lock();
+    qos_move(-1);
+    qos_unlock();
+}
+
+// Function to end the claim of a session process that exited in a session
+static void qos_reclaim(int owner) {
+    if (!qos || owner < 0 || owner >= QOS_OWNERS)
+        return;
+    
+    qos_lock();
+    if (qos->owners[owner] > 0)
+        qos->tenants[qos->owners[owner] - 1].sessions--;
+    qos->owners[owner] = 0;
+    qos_unlock();
+}
+
+// Function to get the byte rate a tenant is entitled to now; 0 for no limit.
+// Call with the lock held.
+static double qos_rate(const QosTenant* tenant, uint64_t now) {
+    double rate = 0;
+    
+    if (qos->config.capacity > 0) {
+        long active = tenant->limits.weight;
+        for (int i = 0; i < QOS_MAX_TENANTS; i++) {
+            const QosTenant* other = &qos->tenants[i];
+            if (other->used && other != tenant && now - other->active_us < QOS_ACTIVE_US)
+                active += other->limits.weight;
+        }
+        rate = (double)qos->config.capacity * tenant->limits.weight / active;
+    }
+    if (tenant->limits.rate > 0 && (rate == 0 || tenant->limits.rate < rate))
+        rate = tenant->limits.rate;
+    return rate;
+}
+
+// Function to take bytes and one operation per ops from the session's
+// tenant, sleeping off whatever it owes
+static void qos_take(long bytes, int ops) {
+    uint64_t wait_us = 0;
+    
+    if (qos_tenant < 0 || !qos)
+        return;
+    
+    qos_lock();
+    QosTenant* tenant = &qos->tenants[qos_tenant];
+    uint64_t now = qos_now_us();
+    double elapsed = (now - tenant->refill_us) / 1e6;
+    double rate = qos_rate(tenant, now);
+    double burst = tenant->limits.burst > 0 ? tenant->limits.burst : rate * QOS_BURST_US / 1e6 + QOS_QUANTUM;
+    double op_burst = tenant->limits.iops > 0 ? tenant->limits.iops : 1;
+    
+    // A new tenant starts with a full burst
+    if (tenant->active_us == 0) {
+        tenant->tokens = burst;
+        tenant->op_tokens = op_burst;
+    }
+    tenant->refill_us = now;
+    if (bytes > 0 || tenant->active_us == 0)
+        tenant->active_us = now;
+    
+    if (rate > 0) {
+        tenant->tokens += elapsed * rate;
+        if (tenant->tokens > burst)
+            tenant->tokens = burst;
+        tenant->tokens -= bytes;
+        if (tenant->tokens < 0)
+            wait_us = (uint64_t)(-tenant->tokens / rate * 1e6);
+    }
+    if (tenant->limits.iops > 0) {
+        tenant->op_tokens += elapsed * tenant->limits.iops;
+        if (tenant->op_tokens > op_burst)
+            tenant->op_tokens = op_burst;
+        tenant->op_tokens -= ops;
+        if (tenant->op_tokens < 0 && (uint64_t)(-tenant->op_tokens / tenant->limits.iops * 1e6) > wait_us)
+            wait_us = (uint64_t)(-tenant->op_tokens / tenant->limits.iops * 1e6);
+    }
+    qos_unlock();
+    
+    if (wait_us > 0)
+        usleep(wait_us);
+}
+
+// Function to count bytes this session moved for its client, visiting the
+// shared bucket once a quantum has built up
+static void qos_charge(long bytes) {
+    if (qos_tenant < 0)
+        return;
+    
+    qos_pending += bytes;
+    if (qos_pending >= QOS_QUANTUM) {
+        qos_take(qos_pending, 0);
+        qos_pending = 0;
+    }
+}
+
+// Function to settle the bytes of a finished command
+static void qos_flush() {
+    if (qos_pending > 0)
+        qos_take(qos_pending, 0);
+    qos_pending = 0;
+}
+
+// Function to admit one command from this session's client
+static void qos_admit() {
+    qos_take(0, 1);
+}
+
+// Function to tell whether S1 paces the bandwidth of this session's tenant
+static int qos_paced() {
+    if (qos_tenant < 0 || !qos)
+        return 0;
+    return qos->config.capacity > 0 || qos->tenants[qos_tenant].limits.rate > 0;
+}
+
+#endif
\ No newline at end of file
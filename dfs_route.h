@@ -0,0 +1,465 @@
+#ifndef DFS_ROUTE_H
+#define DFS_ROUTE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// dfs_route: where S1 sends each file.
+//
+// A routing table maps file extensions to pools of backend instances. Every
+// backend of a pool runs the same server binary and stores paths under the
+// pool's prefix (~/S3 for S3), so S1 only rewrites ~/S1 to that prefix. Within
+// a pool a file is placed by consistent hashing of its client-visible path:
+// each backend owns `vnodes` points on a 64-bit ring and a path belongs to the
+// first point at or after its hash. Adding a backend to a pool moves only about
+// 1/N of its paths, and S1 looks further round the ring for files stored before
+// the move. A pool can keep each file on `replicas` consecutive backends of
+// the ring, acknowledging an upload once `quorum` of them have stored it, and
+// can erasure-code files of at least `min bytes` into k data and m parity
+// shards kept on k+m consecutive backends instead. The table is read from a
+// config file:
+//
+//   vnodes 64
+//   pool texts S3 127.0.0.1:8082 127.0.0.1:8092 127.0.0.1:8093
+//   replicas texts 2 1
+//   route txt texts
+//   erasure docs 4 2 1048576
+//
+// Without one, S1 builds the classic table: pdf to S2, txt to S3, zip to S4.
+// .c files stay on S1's own disk unless the table routes them to a pool too;
+// then S1 keeps no files of its own, and any number of S1 instances reading
+// the same table serve the same namespace.
+
+#define ROUTE_MAX_POOLS 8
+#define ROUTE_MAX_BACKENDS 16       // Per pool
+#define ROUTE_MAX_ROUTES 32
+#define ROUTE_DEFAULT_VNODES 64
+#define ROUTE_MAX_VNODES 1024
+#define ROUTE_DEFAULT_EC_MIN (1024 * 1024)
+
+// Structure to store where a backend server listens
+typedef struct {
+    char host[64];
+    int port;
+} ServerAddr;
+
+// Structure to store one virtual node on a pool's hash ring
+typedef struct {
+    uint64_t hash;
+    int backend;
+} RoutePoint;
+
+// Structure to store one pool of interchangeable backends
+typedef struct {
+    char name[32];
+    char prefix[8];                 // Storage prefix of the backends, "S3" for ~/S3
+    int backend_count;
+    ServerAddr backends[ROUTE_MAX_BACKENDS];
+    int replicas;                   // Copies of every file, 1 without replication
+    int write_quorum;               // Copies stored before an upload is acknowledged
+    int ec_data;                    // Erasure coding data shards, 0 when files are only copied
+    int ec_parity;
+    long ec_min_size;               // Smaller files are copied instead
+    int point_count;
+    RoutePoint* points;             // Sorted by hash
+} RoutePool;
+
+// Structure to store which pool an extension goes to
+typedef struct {
+    char ext[16];
+    int pool;
+} Route;
+
+// Structure to store the whole routing table
+typedef struct {
+    int vnodes;
+    int pool_count;
+    RoutePool pools[ROUTE_MAX_POOLS];
+    int route_count;
+    Route routes[ROUTE_MAX_ROUTES];
+} RouteTable;
+
+static RouteTable route_table;
+
+// Function to hash a key onto the ring: FNV-1a with a final mix so that
+// similar keys (host:port#1, host:port#2) land far apart. Repeated and
+// trailing slashes are skipped, so ~/S1/a//x.txt and ~/S1/a/x.txt agree.
+static uint64_t route_hash(const char* key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    for (; *key; key++) {
+        if (*key == '/' && (key[1] == '/' || key[1] == 0))
+            continue;
+        h ^= (unsigned char)*key;
+        h *= 0x100000001b3ULL;
+    }
+    
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    
+    return h;
+}
+
+// Function to parse a backend address given as host:port or just port
+static int route_parse_addr(const char* text, ServerAddr* server) {
+    const char* colon = strrchr(text, ':');
+    
+    if (colon) {
+        snprintf(server->host, sizeof(server->host), "%.*s", (int)(colon - text), text);
+        server->port = atoi(colon + 1);
+    } else {
+        snprintf(server->host, sizeof(server->host), "127.0.0.1");
+        server->port = atoi(text);
+    }
+    
+    return server->port > 0 && server->port < 65536 ? 0 : -1;
+}
+
+// Function to order backend addresses. Sessions that hold several serial
+// backends at once take them in this order so that two of them never wait on
+// each other.
+static int route_compare_addr(const ServerAddr* a, const ServerAddr* b) {
+    int c = strcmp(a->host, b->host);
+    return c ? c : (a->port > b->port) - (a->port < b->port);
+}
+
+// Function to find a pool by name; -1 if there is none
+static int route_pool_index(const RouteTable* table, const char* name) {
+    for (int i = 0; i < table->pool_count; i++) {
+        if (strcmp(table->pools[i].name, name) == 0)
+            return i;
+    }
+    
+    return -1;
+}
+
+// Function to add an empty pool; returns its index or -1 when the table is full
+static int route_add_pool(RouteTable* table, const char* name, const char* prefix) {
+    if (table->pool_count >= ROUTE_MAX_POOLS)
+        return -1;
+    
+    RoutePool* pool = &table->pools[table->pool_count];
+    memset(pool, 0, sizeof(*pool));
+    snprintf(pool->name, sizeof(pool->name), "%s", name);
+    snprintf(pool->prefix, sizeof(pool->prefix), "%s", prefix);
+    pool->replicas = 1;
+    pool->write_quorum = 1;
+    
+    return table->pool_count++;
+}
+
+// Function to add a backend to a pool
+static int route_add_backend(RouteTable* table, int pool, const ServerAddr* server) {
+    RoutePool* p = &table->pools[pool];
+    
+    if (p->backend_count >= ROUTE_MAX_BACKENDS)
+        return -1;
+    
+    p->backends[p->backend_count++] = *server;
+    return 0;
+}
+
+// Function to send an extension to a pool, replacing an earlier route for it.
+// .ec and .ecm name the shards and manifests of erasure-coded files, which
+// clients must not be able to write, so they can't be routed.
+static int route_add(RouteTable* table, const char* ext, int pool) {
+    int i;
+    
+    if (strcmp(ext, "ec") == 0 || strcmp(ext, "ecm") == 0)
+        return -1;
+    for (i = 0; i < table->route_count && strcmp(table->routes[i].ext, ext) != 0; i++)
+        ;
+    if (i == ROUTE_MAX_ROUTES)
+        return -1;
+    
+    snprintf(table->routes[i].ext, sizeof(table->routes[i].ext), "%s", ext);
+    table->routes[i].pool = pool;
+    if (i == table->route_count)
+        table->route_count++;
+    
+    return 0;
+}
+
+// Function to order ring points by hash
+static int route_compare_points(const void* a, const void* b) {
+    uint64_t x = ((const RoutePoint*)a)->hash, y = ((const RoutePoint*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// Function to place every backend's virtual nodes on its pool's ring
+static int route_build(RouteTable* table) {
+    char key[96];
+    
+    if (table->vnodes <= 0)
+        table->vnodes = ROUTE_DEFAULT_VNODES;
+    
+    for (int i = 0; i < table->pool_count; i++) {
+        RoutePool* pool = &table->pools[i];
+        
+        free(pool->points);
+        pool->point_count = pool->backend_count * table->vnodes;
+        pool->points = malloc((pool->point_count ? pool->point_count : 1) * sizeof(RoutePoint));
+        if (!pool->points)
+            return -1;
+        
+        // Points depend only on the backend's address, so reordering a pool's list moves nothing
+        for (int b = 0, n = 0; b < pool->backend_count; b++) {
+            for (int v = 0; v < table->vnodes; v++, n++) {
+                snprintf(key, sizeof(key), "%s:%d#%d", pool->backends[b].host, pool->backends[b].port, v);
+                pool->points[n].hash = route_hash(key);
+                pool->points[n].backend = b;
+            }
+        }
+        qsort(pool->points, pool->point_count, sizeof(RoutePoint), route_compare_points);
+    }
+    
+    return 0;
+}
+
+// Function to release a table's rings
+static void route_free(RouteTable* table) {
+    for (int i = 0; i < table->pool_count; i++) {
+        free(table->pools[i].points);
+        table->pools[i].points = NULL;
+    }
+}
+
+// Function to build the classic table: one S2, S3 and S4 for pdf, txt and zip
+static int route_defaults(RouteTable* table, const ServerAddr* s2, const ServerAddr* s3, const ServerAddr* s4) {
+    const ServerAddr* servers[] = { s2, s3, s4 };
+    const char* prefixes[] = { "S2", "S3", "S4" };
+    const char* exts[] = { "pdf", "txt", "zip" };
+    
+    memset(table, 0, sizeof(*table));
+    table->vnodes = ROUTE_DEFAULT_VNODES;
+    for (int i = 0; i < 3; i++) {
+        int pool = route_add_pool(table, prefixes[i], prefixes[i]);
+        route_add_backend(table, pool, servers[i]);
+        route_add(table, exts[i], pool);
+    }
+    
+    return route_build(table);
+}
+
+// Function to read a table from a config file. On failure the message says
+// which line is wrong and the table must not be used.
+static int route_load(RouteTable* table, const char* path, char* error, size_t error_size) {
+    char line[1024];
+    int line_no = 0;
+    FILE* file = fopen(path, "r");
+    
+    memset(table, 0, sizeof(*table));
+    table->vnodes = ROUTE_DEFAULT_VNODES;
+    
+    if (!file) {
+        snprintf(error, error_size, "cannot open %s", path);
+        return -1;
+    }
+    
+    while (fgets(line, sizeof(line), file)) {
+        char* words[ROUTE_MAX_BACKENDS + 3];
+        int count = 0;
+        char* save;
+        
+        line_no++;
+        line[strcspn(line, "#\r\n")] = 0;
+        for (char* w = strtok_r(line, " \t", &save); w && count < ROUTE_MAX_BACKENDS + 3; w = strtok_r(NULL, " \t", &save))
+            words[count++] = w;
+        if (count == 0)
+            continue;
+        
+        if (strcmp(words[0], "vnodes") == 0 && count == 2) {
+            table->vnodes = atoi(words[1]);
+            if (table->vnodes < 1 || table->vnodes > ROUTE_MAX_VNODES) {
+                snprintf(error, error_size, "%s:%d: vnodes must be 1-%d", path, line_no, ROUTE_MAX_VNODES);
+                break;
+            }
+        } else if (strcmp(words[0], "pool") == 0 && count >= 4) {
+            // pool <name> <prefix> <host:port>...
+            int pool = route_pool_index(table, words[1]);
+            if (pool < 0 && (pool = route_add_pool(table, words[1], words[2])) < 0) {
+                snprintf(error, error_size, "%s:%d: more than %d pools", path, line_no, ROUTE_MAX_POOLS);
+                break;
+            }
+            
+            int i;
+            for (i = 3; i < count; i++) {
+                ServerAddr server;
+                if (route_parse_addr(words[i], &server) < 0 || route_add_backend(table, pool, &server) < 0) {
+                    snprintf(error, error_size, "%s:%d: bad or too many backends at %s", path, line_no, words[i]);
+                    break;
+                }
+            }
+            if (i < count)
+                break;
+        } else if (strcmp(words[0], "replicas") == 0 && (count == 3 || count == 4)) {
+            // replicas <pool> <copies> [<write quorum>], the quorum defaulting to a majority
+            int pool = route_pool_index(table, words[1]);
+            int replicas = atoi(words[2]);
+            int quorum = count == 4 ? atoi(words[3]) : replicas / 2 + 1;
+            
+            if (pool < 0) {
+                snprintf(error, error_size, "%s:%d: unknown pool %s", path, line_no, words[1]);
+                break;
+            }
+            if (replicas < 1 || replicas > ROUTE_MAX_BACKENDS || quorum < 1 || quorum > replicas) {
+                snprintf(error, error_size, "%s:%d: need 1 <= quorum <= replicas <= %d", path, line_no, ROUTE_MAX_BACKENDS);
+                break;
+            }
+            table->pools[pool].replicas = replicas;
+            table->pools[pool].write_quorum = quorum;
+        } else if (strcmp(words[0], "erasure") == 0 && (count == 4 || count == 5)) {
+            // erasure <pool> <data shards> <parity shards> [<min bytes>]
+            int pool = route_pool_index(table, words[1]);
+            int data = atoi(words[2]);
+            int parity = atoi(words[3]);
+            long min_size = count == 5 ? atol(words[4]) : ROUTE_DEFAULT_EC_MIN;
+            
+            if (pool < 0) {
+                snprintf(error, error_size, "%s:%d: unknown pool %s", path, line_no, words[1]);
+                break;
+            }
+            if (data < 1 || parity < 1 || data + parity > ROUTE_MAX_BACKENDS || min_size < 1) {
+                snprintf(error, error_size, "%s:%d: need data, parity >= 1, data + parity <= %d and min bytes >= 1",
+                         path, line_no, ROUTE_MAX_BACKENDS);
+                break;
+            }
+            table->pools[pool].ec_data = data;
+            table->pools[pool].ec_parity = parity;
+            table->pools[pool].ec_min_size = min_size;
+        } else if (strcmp(words[0], "route") == 0 && count == 3) {
+            // route <ext>[,<ext>...] <pool>
+            int pool = route_pool_index(table, words[2]);
+            if (pool < 0) {
+                snprintf(error, error_size, "%s:%d: unknown pool %s", path, line_no, words[2]);
+                break;
+            }
+            
+            char* ext;
+            for (ext = strtok_r(words[1], ",", &save); ext; ext = strtok_r(NULL, ",", &save)) {
+                if (route_add(table, ext, pool) < 0) {
+                    snprintf(error, error_size, "%s:%d: cannot route .%s", path, line_no, ext);
+                    break;
+                }
+            }
+            if (ext)
+                break;
+        } else {
+            snprintf(error, error_size, "%s:%d: expected vnodes, pool, replicas, erasure or route", path, line_no);
+            break;
+        }
+    }
+    
+    int failed = !feof(file);
+    fclose(file);
+    if (failed)
+        return -1;
+    
+    // Every routed pool needs somewhere to put files, and enough backends for its copies
+    for (int i = 0; i < table->route_count; i++) {
+        if (table->pools[table->routes[i].pool].backend_count == 0) {
+            snprintf(error, error_size, "%s: pool %s has no backends", path, table->pools[table->routes[i].pool].name);
+            return -1;
+        }
+    }
+    for (int i = 0; i < table->pool_count; i++) {
+        if (table->pools[i].replicas > table->pools[i].backend_count) {
+            snprintf(error, error_size, "%s: pool %s has fewer backends than replicas", path, table->pools[i].name);
+            return -1;
+        }
+        if (table->pools[i].ec_data + table->pools[i].ec_parity > table->pools[i].backend_count) {
+            snprintf(error, error_size, "%s: pool %s has fewer backends than erasure shards", path, table->pools[i].name);
+            return -1;
+        }
+    }
+    
+    if (route_build(table) < 0) {
+        snprintf(error, error_size, "out of memory");
+        route_free(table);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Function to find the pool for an extension; NULL when it isn't routed
+static RoutePool* route_find(RouteTable* table, const char* ext) {
+    for (int i = 0; i < table->route_count; i++) {
+        if (strcmp(table->routes[i].ext, ext) == 0)
+            return &table->pools[table->routes[i].pool];
+    }
+    
+    return NULL;
+}
+
+// Function to list a pool's backends in ring order from a path's position:
+// the owner and its replicas first, then where the path lived before backends
+// were added. Returns how many were written to order.
+static int route_candidates(const RoutePool* pool, const char* path, int* order, int max) {
+    int found = 0;
+    int lo = 0, hi = pool->point_count;
+    uint64_t h = route_hash(path);
+    
+    if (pool->point_count == 0)
+        return 0;
+    
+    // First point at or after the path's hash, wrapping round
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (pool->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    for (int i = 0; i < pool->point_count && found < max && found < pool->backend_count; i++) {
+        int backend = pool->points[(lo + i) % pool->point_count].backend;
+        int seen = 0;
+        
+        for (int k = 0; k < found; k++)
+            seen |= order[k] == backend;
+        if (!seen)
+            order[found++] = backend;
+    }
+    
+    return found;
+}
+
+// Function to list every distinct backend of the table, with the pool it was
+// first found in. Returns how many were written.
+static int route_all_backends(const RouteTable* table, const ServerAddr** out, const RoutePool** pools, int max) {
+    int found = 0;
+    
+    for (int i = 0; i < table->pool_count; i++) {
+        const RoutePool* pool = &table->pools[i];
+        
+        for (int b = 0; b < pool->backend_count && found < max; b++) {
+            int seen = 0;
+            for (int k = 0; k < found; k++)
+                seen |= out[k]->port == pool->backends[b].port && strcmp(out[k]->host, pool->backends[b].host) == 0;
+            if (seen)
+                continue;
+            
+            out[found] = &pool->backends[b];
+            pools[found++] = pool;
+        }
+    }
+    
+    return found;
+}
+
+// Function to rewrite a ~/S1 path to the pool's storage prefix
+static void route_backend_path(const RoutePool* pool, const char* path, char* out, size_t size) {
+    if (strncmp(path, "~/S1", 4) == 0 && (path[4] == '/' || path[4] == 0)) {
+        snprintf(out, size, "~/%s%s", pool->prefix, path + 4);
+    } else {
+        snprintf(out, size, "%s", path);
+    }
+}
+
+#endif
\ No newline at end of file
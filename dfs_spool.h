@@ -0,0 +1,550 @@
+#ifndef DFS_SPOOL_H
+#define DFS_SPOOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dfs_log.h"
+
+// dfs_spool: S1's write-behind queue of uploads waiting for their backends.
+//
+// An upload is appended to the current segment file of the spool directory
+// (queue.<n>) as a header and the file's bytes, and is fsynced, with the
+// directory when the segment is new, before the client hears it was stored. A forwarder process sends the queued uploads on
+// to their backends and appends the sequence number of each one that no
+// longer needs forwarding to the done log: forwarded, cancelled by a removal
+// or superseded by a newer upload of the same path. On restart the segments
+// are replayed minus the done log, so nothing acknowledged is lost, and a
+// torn record at the end of a segment (a crash mid-append) is cut off.
+//
+// The pending uploads are indexed by path in an anonymous shared mapping
+// created before S1 forks, so every session can serve reads of a file from
+// the spool until its forwarding completes. Appends, rotation and cleanup
+// take an flock on the spool's lock file; the index itself is guarded by a
+// spinlock held only while it is searched or changed.
+
+#define SPOOL_MAX_ENTRIES 4096
+#define SPOOL_PATH_MAX 1024
+#define SPOOL_MAGIC 0x57325351u          // "W2SQ"
+#define SPOOL_SEGMENT_MAX (64L * 1024 * 1024) // Segment size after which appends start a new one
+#define SPOOL_RETRY_US 1000000           // First wait before retrying a failed forward, doubled up to SPOOL_MAX_RETRY_US
+#define SPOOL_MAX_RETRY_US 30000000
+
+enum { SPOOL_FREE, SPOOL_QUEUED, SPOOL_FORWARDING };
+
+// Structure to store the header of a record in a segment; size bytes of data follow
+typedef struct {
+    uint32_t magic;
+    uint32_t path_len;
+    uint64_t seq;
+    int64_t size;
+    char path[SPOOL_PATH_MAX];
+} SpoolRecord;
+
+// Structure to store one pending upload
+typedef struct {
+    int state;
+    uint64_t seq;
+    int segment;
+    long offset;                    // Where its data starts in the segment
+    long size;
+    int attempts;                   // Failed forwards so far
+    uint64_t retry_at_us;           // Not forwarded again before then (monotonic)
+    char path[SPOOL_PATH_MAX];      // Client path, ~/S1/...
+} SpoolEntry;
+
+// Structure to store the shared index
+typedef struct {
+    int lock;
+    int first_segment;              // Oldest segment still on disk
+    int segment;                    // Segment appended to
+    long tail;                      // Its size
+    uint64_t next_seq;
+    int pending;                    // Entries in use
+    SpoolEntry entries[SPOOL_MAX_ENTRIES];
+} SpoolTable;
+
+static SpoolTable* spool;
+static char spool_dir[SPOOL_PATH_MAX];
+
+// Function to take the index lock
+static void spool_lock() {
+    while (__atomic_test_and_set(&spool->lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+// Function to release the index lock
+static void spool_unlock() {
+    __atomic_clear(&spool->lock, __ATOMIC_RELEASE);
+}
+
+// Function to get the path of a segment or other spool file
+static void spool_file(char* out, size_t size, const char* name, int segment) {
+    if (segment >= 0)
+        snprintf(out, size, "%s/%s.%08d", spool_dir, name, segment);
+    else
+        snprintf(out, size, "%s/%s", spool_dir, name);
+}
+
+// Function to take the spool's file lock; -1 if it can't be opened
+static int spool_flock() {
+    char path[SPOOL_PATH_MAX + 16];
+    
+    spool_file(path, sizeof(path), "lock", -1);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to make the spool directory's entries durable: a segment or done
+// log just created, or files just unlinked
+static int spool_sync_dir() {
+    int fd = open(spool_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    
+    int failed = fsync(fd) < 0;
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+// Function to durably record sequence numbers that need no forwarding
+static int spool_mark_done(const uint64_t* seqs, int count) {
+    char path[SPOOL_PATH_MAX + 16];
+    
+    if (count == 0)
+        return 0;
+    
+    spool_file(path, sizeof(path), "done", -1);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    
+    struct stat st;
+    int created = fstat(fd, &st) == 0 && st.st_size == 0;
+    int failed = write(fd, seqs, count * sizeof(uint64_t)) != (ssize_t)(count * sizeof(uint64_t)) || fdatasync(fd) < 0 ||
+                 (created && spool_sync_dir() < 0);
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+// Function to find the entry of a path with the given state, -1 if there is none
+static int spool_index_find(const char* path, int state) {
+    for (int i = 0; i < SPOOL_MAX_ENTRIES; i++) {
+        if (spool->entries[i].state == state && strcmp(spool->entries[i].path, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Function to index a record, replacing a queued older upload of the same path.
+// Sets *superseded to the replaced record's sequence number, or 0.
+static int spool_index_add(const char* path, uint64_t seq, int segment, long offset, long size, uint64_t* superseded) {
+    int slot = spool_index_find(path, SPOOL_QUEUED);
+    
+    *superseded = 0;
+    if (slot >= 0) {
+        *superseded = spool->entries[slot].seq;
+    } else {
+        for (int i = 0; slot < 0 && i < SPOOL_MAX_ENTRIES; i++) {
+            if (spool->entries[i].state == SPOOL_FREE)
+                slot = i;
+        }
+        if (slot < 0)
+            return -1;
+        spool->pending++;
+    }
+    
+    SpoolEntry* entry = &spool->entries[slot];
+    entry->seq = seq;
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->size = size;
+    entry->attempts = 0;
+    entry->retry_at_us = 0;
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->state = SPOOL_QUEUED;
+    return 0;
+}
+
+// Function to compare sequence numbers for sorting and searching
+static int spool_compare_seq(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to compare segment numbers for sorting
+static int spool_compare_int(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Function to read the done log, sorted; NULL with *count 0 when it is empty
+static uint64_t* spool_read_done(int* count) {
+    char path[SPOOL_PATH_MAX + 16];
+    struct stat st;
+    uint64_t* seqs = NULL;
+    
+    *count = 0;
+    spool_file(path, sizeof(path), "done", -1);
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    
+    if (fstat(fileno(file), &st) == 0 && st.st_size >= (off_t)sizeof(uint64_t)) {
+        seqs = malloc(st.st_size);
+        if (seqs)
+            *count = fread(seqs, sizeof(uint64_t), st.st_size / sizeof(uint64_t), file);
+    }
+    fclose(file);
+    
+    if (*count > 1)
+        qsort(seqs, *count, sizeof(uint64_t), spool_compare_seq);
+    return seqs;
+}
+
+// Function to replay one segment into the index; a torn record ends it
+static void spool_replay(int segment, const uint64_t* done, int done_count) {
+    char path[SPOOL_PATH_MAX + 16];
+    SpoolRecord record;
+    struct stat st;
+    long offset = 0;
+    uint64_t superseded;
+    
+    spool_file(path, sizeof(path), "queue", segment);
+    FILE* file = fopen(path, "r+b");
+    if (!file || fstat(fileno(file), &st) < 0) {
+        if (file)
+            fclose(file);
+        return;
+    }
+    
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        long data = offset + (long)sizeof(record);
+        
+        if (record.magic != SPOOL_MAGIC || record.path_len >= SPOOL_PATH_MAX || record.size < 0 ||
+            data + record.size > st.st_size)
+            break;
+        record.path[record.path_len] = 0;
+        
+        if (record.seq >= spool->next_seq)
+            spool->next_seq = record.seq + 1;
+        
+        // A later record of the same path supersedes this one, as it did before the restart
+        if (!bsearch(&record.seq, done, done_count, sizeof(uint64_t), spool_compare_seq)) {
+            if (spool_index_add(record.path, record.seq, segment, data, record.size, &superseded) < 0)
+                log_event(LOG_ERROR, "spool_full", record.path, (long)record.seq);
+            else if (superseded)
+                spool_mark_done(&superseded, 1);
+        }
+        
+        offset = data + record.size;
+        if (fseek(file, offset, SEEK_SET) != 0)
+            break;
+    }
+    
+    if (offset < st.st_size) {
+        log_event(LOG_WARN, "spool_truncated", path, offset);
+        if (ftruncate(fileno(file), offset) < 0)
+            log_event(LOG_ERROR, "spool_truncate_failed", path, errno);
+    }
+    spool->tail = offset;
+    fclose(file);
+}
+
+// Function to map the index and recover the spool in dir; call before forking.
+// Returns the number of uploads still to forward, or -1.
+static int spool_init(const char* dir) {
+    int segments[SPOOL_MAX_ENTRIES];
+    int segment_count = 0;
+    int done_count;
+    DIR* d;
+    struct dirent* ent;
+    
+    snprintf(spool_dir, sizeof(spool_dir), "%s", dir);
+    if (mkdir(spool_dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    
+    spool = mmap(NULL, sizeof(SpoolTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (spool == MAP_FAILED) {
+        spool = NULL;
+        return -1;
+    }
+    spool->next_seq = 1;
+    
+    d = opendir(spool_dir);
+    if (!d)
+        return -1;
+    while ((ent = readdir(d)) != NULL && segment_count < SPOOL_MAX_ENTRIES) {
+        if (strncmp(ent->d_name, "queue.", 6) == 0)
+            segments[segment_count++] = atoi(ent->d_name + 6);
+    }
+    closedir(d);
+    qsort(segments, segment_count, sizeof(int), spool_compare_int);
+    
+    // Sequence numbers go on from the highest one seen, done or not
+    uint64_t* done = spool_read_done(&done_count);
+    if (done_count > 0)
+        spool->next_seq = done[done_count - 1] + 1;
+    for (int i = 0; i < segment_count; i++) {
+        spool->segment = segments[i];
+        spool_replay(segments[i], done, done_count);
+    }
+    free(done);
+    
+    spool->first_segment = segment_count > 0 ? segments[0] : 0;
+    return spool->pending;
+}
+
+// Function to append an upload of size bytes read from file and index it.
+// Returns 0 once it is on disk, -1 if it wasn't spooled.
+static int spool_append(const char* path, FILE* file, long size) {
+    char segment_path[SPOOL_PATH_MAX + 16];
+    char buffer[65536];
+    SpoolRecord record;
+    uint64_t superseded;
+    int lock_fd, fd, failed = 0;
+    
+    if (!spool || strlen(path) >= SPOOL_PATH_MAX)
+        return -1;
+    
+    // A full index would leave nowhere to serve the file from
+    if (__atomic_load_n(&spool->pending, __ATOMIC_RELAXED) >= SPOOL_MAX_ENTRIES)
+        return -1;
+    
+    if ((lock_fd = spool_flock()) < 0)
+        return -1;
+    
+    if (spool->tail >= SPOOL_SEGMENT_MAX) {
+        spool->segment++;
+        spool->tail = 0;
+    }
+    
+    spool_file(segment_path, sizeof(segment_path), "queue", spool->segment);
+    fd = open(segment_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        close(lock_fd);
+        return -1;
+    }
+    
+    memset(&record, 0, sizeof(record));
+    record.magic = SPOOL_MAGIC;
+    record.path_len = strlen(path);
+    record.size = size;
+    memcpy(record.path, path, record.path_len);
+    
+    spool_lock();
+    record.seq = spool->next_seq++;
+    spool_unlock();
+    
+    long offset = spool->tail;
+    long written = 0;
+    
+    failed = pwrite(fd, &record, sizeof(record), offset) != (ssize_t)sizeof(record);
+    while (!failed && written < size) {
+        size_t want = size - written < (long)sizeof(buffer) ? (size_t)(size - written) : sizeof(buffer);
+        size_t got = fread(buffer, 1, want, file);
+        
+        failed = got == 0 || pwrite(fd, buffer, got, offset + sizeof(record) + written) != (ssize_t)got;
+        written += got;
+    }
+    // A new segment's name must survive a crash as well as its data
+    failed = failed || fdatasync(fd) < 0 || (offset == 0 && spool_sync_dir() < 0);
+    close(fd);
+    
+    if (failed) {
+        // Whatever got written sits past the tail and is overwritten by the next append
+        close(lock_fd);
+        return -1;
+    }
+    spool->tail = offset + sizeof(record) + size;
+    
+    spool_lock();
+    failed = spool_index_add(path, record.seq, spool->segment, offset + sizeof(record), size, &superseded) < 0;
+    spool_unlock();
+    
+    // A record that can't be indexed must not come back on restart either
+    spool_mark_done(failed ? &record.seq : &superseded, failed || superseded ? 1 : 0);
+    close(lock_fd);
+    
+    return failed ? -1 : 0;
+}
+
+// Function to get the newest pending upload of a path; -1 if it isn't spooled
+static int spool_find(const char* path, SpoolEntry* out) {
+    int found = -1;
+    
+    if (!spool || __atomic_load_n(&spool->pending, __ATOMIC_RELAXED) == 0)
+        return -1;
+    
+    spool_lock();
+    for (int i = 0; i < SPOOL_MAX_ENTRIES; i++) {
+        SpoolEntry* entry = &spool->entries[i];
+        if (entry->state != SPOOL_FREE && strcmp(entry->path, path) == 0 && (found < 0 || entry->seq > out->seq)) {
+            *out = *entry;
+            found = i;
+        }
+    }
+    spool_unlock();
+    
+    return found < 0 ? -1 : 0;
+}
+
+// Function to open the data of a pending upload, positioned at its first
+// byte; NULL if it has been forwarded and cleaned up since it was found
+static FILE* spool_open(const SpoolEntry* entry) {
+    char path[SPOOL_PATH_MAX + 16];
+    
+    spool_file(path, sizeof(path), "queue", entry->segment);
+    FILE* file = fopen(path, "rb");
+    if (file && fseek(file, entry->offset, SEEK_SET) != 0) {
+        fclose(file);
+        file = NULL;
+    }
+    return file;
+}
+
+// Function to claim the oldest upload that is due for forwarding; -1 if none is
+static int spool_claim(SpoolEntry* out, uint64_t now_us) {
+    int found = -1;
+    
+    if (!spool || __atomic_load_n(&spool->pending, __ATOMIC_RELAXED) == 0)
+        return -1;
+    
+    spool_lock();
+    for (int i = 0; i < SPOOL_MAX_ENTRIES; i++) {
+        SpoolEntry* entry = &spool->entries[i];
+        if (entry->state == SPOOL_QUEUED && entry->retry_at_us <= now_us &&
+            (found < 0 || entry->seq < spool->entries[found].seq))
+            found = i;
+    }
+    if (found >= 0) {
+        spool->entries[found].state = SPOOL_FORWARDING;
+        *out = spool->entries[found];
+    }
+    spool_unlock();
+    
+    return found < 0 ? -1 : 0;
+}
+
+// Function to settle a claimed upload: dropped from the spool once stored,
+// otherwise queued again after a backoff, unless a newer upload of the path
+// has been queued meanwhile, which replaces it
+static void spool_finish(const SpoolEntry* claimed, int stored, uint64_t now_us) {
+    int drop = stored;
+    
+    if (stored)
+        spool_mark_done(&claimed->seq, 1);
+    
+    spool_lock();
+    for (int i = 0; i < SPOOL_MAX_ENTRIES; i++) {
+        SpoolEntry* entry = &spool->entries[i];
+        if (entry->state != SPOOL_FORWARDING || entry->seq != claimed->seq)
+            continue;
+        
+        if (!stored && spool_index_find(entry->path, SPOOL_QUEUED) >= 0)
+            drop = 1;
+        if (drop) {
+            entry->state = SPOOL_FREE;
+            spool->pending--;
+        } else {
+            uint64_t wait = (uint64_t)SPOOL_RETRY_US << (entry->attempts < 5 ? entry->attempts : 5);
+            entry->attempts++;
+            entry->retry_at_us = now_us + (wait < SPOOL_MAX_RETRY_US ? wait : SPOOL_MAX_RETRY_US);
+            entry->state = SPOOL_QUEUED;
+        }
+        break;
+    }
+    spool_unlock();
+    
+    if (drop && !stored)
+        spool_mark_done(&claimed->seq, 1);
+}
+
+// Function to drop the pending uploads of a path, waiting for one being
+// forwarded to finish first. Returns how many were dropped.
+static int spool_cancel(const char* path) {
+    uint64_t seqs[SPOOL_MAX_ENTRIES];
+    int count, forwarding;
+    
+    if (!spool || __atomic_load_n(&spool->pending, __ATOMIC_RELAXED) == 0)
+        return 0;
+    
+    while (1) {
+        spool_lock();
+        forwarding = spool_index_find(path, SPOOL_FORWARDING) >= 0;
+        count = 0;
+        for (int i = 0; !forwarding && i < SPOOL_MAX_ENTRIES; i++) {
+            SpoolEntry* entry = &spool->entries[i];
+            if (entry->state == SPOOL_QUEUED && strcmp(entry->path, path) == 0) {
+                seqs[count++] = entry->seq;
+                entry->state = SPOOL_FREE;
+                spool->pending--;
+            }
+        }
+        spool_unlock();
+        
+        if (!forwarding)
+            break;
+        usleep(10000);
+    }
+    
+    spool_mark_done(seqs, count);
+    return count;
+}
+
+// Function to delete what the spool no longer needs: segments no pending
+// upload points into, and everything, done log included, once it is empty
+static void spool_cleanup() {
+    char path[SPOOL_PATH_MAX + 16];
+    int lock_fd;
+    
+    if (!spool || (spool->first_segment == spool->segment && spool->tail == 0))
+        return;
+    if ((lock_fd = spool_flock()) < 0)
+        return;
+    
+    spool_lock();
+    int empty = spool->pending == 0;
+    int oldest = spool->segment;
+    for (int i = 0; i < SPOOL_MAX_ENTRIES; i++) {
+        if (spool->entries[i].state != SPOOL_FREE && spool->entries[i].segment < oldest)
+            oldest = spool->entries[i].segment;
+    }
+    spool_unlock();
+    
+    // Appends hold the file lock, so an empty spool stays empty meanwhile
+    int last = empty ? spool->segment : oldest - 1;
+    for (int s = spool->first_segment; s <= last; s++) {
+        spool_file(path, sizeof(path), "queue", s);
+        unlink(path);
+    }
+    
+    // The segments must be gone for good before the done log, or a crash
+    // could bring their uploads back without it
+    if (empty) {
+        spool_sync_dir();
+        spool_file(path, sizeof(path), "done", -1);
+        unlink(path);
+        spool->segment++;
+        spool->tail = 0;
+        spool->first_segment = spool->segment;
+    } else {
+        spool->first_segment = oldest;
+    }
+    
+    close(lock_fd);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,300 @@
+#ifndef DFS_STATS_H
+#define DFS_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// dfs_stats: per-operation counters and latency histograms shared by every
+// process of a server.
+//
+// The region is an anonymous shared mapping created before the server forks,
+// so S1's per-client children all record into the same counters. Updates are
+// relaxed atomic adds; nothing takes a lock. Each operation keeps one
+// histogram per phase (parse, backend connect, disk, network) plus its total.
+// Histograms are log-linear like HDR histograms: 16 sub-buckets per power of
+// two of nanoseconds, so every recorded value is within ~6% of the truth.
+
+#define STATS_MAX_OPS 16
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (48 * STATS_SUB_BUCKETS)
+#define STATS_REPORT_SIZE 65536     // Enough for every op and phase of one server
+
+// Request phases
+enum {
+    STATS_PARSE,
+    STATS_CONNECT,
+    STATS_DISK,
+    STATS_NETWORK,
+    STATS_TOTAL,
+    STATS_PHASES
+};
+
+static const char* stats_phase_names[STATS_PHASES] = { "parse", "connect", "disk", "network", "total" };
+
+// Structure to store one latency histogram, in nanoseconds
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+// Structure to store the counters of one operation
+typedef struct {
+    const char* name;
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    StatsHistogram phases[STATS_PHASES];
+} StatsOp;
+
+// Structure to store the shared statistics of one server
+typedef struct {
+    const char* server;
+    time_t started;
+    int op_count;
+    StatsOp ops[STATS_MAX_OPS];
+} StatsRegion;
+
+// Structure to store the request being measured by this process
+typedef struct {
+    int op;                         // -1 when no request is open
+    uint64_t start;
+    uint64_t phase[STATS_PHASES];
+    unsigned touched;               // Phases that were entered at least once
+    uint64_t bytes;
+    int error;
+} StatsRequest;
+
+static StatsRegion* stats_region;
+static __thread StatsRequest stats_current = { -1 };
+
+// Function to get a monotonic timestamp in nanoseconds
+static uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function to map the shared region; call before forking. Names must be static strings.
+static int stats_init(const char* server, const char* const* op_names, int op_count) {
+    stats_region = mmap(NULL, sizeof(StatsRegion), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats_region == MAP_FAILED) {
+        stats_region = NULL;
+        return -1;
+    }
+
+    stats_region->server = server;
+    stats_region->started = time(NULL);
+    stats_region->op_count = op_count < STATS_MAX_OPS ? op_count : STATS_MAX_OPS;
+    for (int i = 0; i < stats_region->op_count; i++) {
+        stats_region->ops[i].name = op_names[i];
+    }
+
+    return 0;
+}
+
+// Function to find an operation by name; -1 for commands that aren't measured
+static int stats_lookup(const char* name) {
+    for (int i = 0; stats_region && i < stats_region->op_count; i++) {
+        if (strcmp(stats_region->ops[i].name, name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+// Function to map a value to its histogram bucket
+static int stats_bucket(uint64_t value) {
+    if (value < STATS_SUB_BUCKETS)
+        return (int)value;
+
+    int shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+    int index = (shift + 1) * STATS_SUB_BUCKETS + (int)((value >> shift) & (STATS_SUB_BUCKETS - 1));
+
+    return index < STATS_BUCKETS ? index : STATS_BUCKETS - 1;
+}
+
+// Function to get the highest value that falls into a bucket
+static uint64_t stats_bucket_high(int index) {
+    if (index < STATS_SUB_BUCKETS)
+        return index;
+
+    int shift = index / STATS_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS) << shift;
+
+    return low + ((1ULL << shift) - 1);
+}
+
+// Function to record one value into a histogram
+static void stats_record(StatsHistogram* h, uint64_t value) {
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[stats_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    while (value > max && !__atomic_compare_exchange_n(&h->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Function to open a request measurement; its start time counts towards the total
+static void stats_begin(int op, uint64_t start) {
+    memset(&stats_current, 0, sizeof(stats_current));
+    stats_current.op = op;
+    stats_current.start = start;
+}
+
+// Function to charge the time since a timestamp to a phase of the open request
+static void stats_add(int phase, uint64_t since) {
+    stats_current.phase[phase] += stats_now() - since;
+    stats_current.touched |= 1u << phase;
+}
+
+// Function to count payload bytes moved by the open request
+static void stats_bytes(long bytes) {
+    if (bytes > 0)
+        stats_current.bytes += bytes;
+}
+
+// Function to mark the open request as failed
+static void stats_error() {
+    stats_current.error = 1;
+}
+
+// Function to close the open request and publish its phases
+static void stats_end() {
+    if (!stats_region || stats_current.op < 0 || stats_current.op >= stats_region->op_count) {
+        stats_current.op = -1;
+        return;
+    }
+
+    StatsOp* op = &stats_region->ops[stats_current.op];
+
+    __atomic_fetch_add(&op->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&op->bytes, stats_current.bytes, __ATOMIC_RELAXED);
+    if (stats_current.error)
+        __atomic_fetch_add(&op->errors, 1, __ATOMIC_RELAXED);
+
+    for (int p = 0; p < STATS_TOTAL; p++) {
+        if (stats_current.touched & (1u << p))
+            stats_record(&op->phases[p], stats_current.phase[p]);
+    }
+    stats_record(&op->phases[STATS_TOTAL], stats_now() - stats_current.start);
+
+    stats_current.op = -1;
+}
+
+// Function to read a percentile (0-1) from a histogram, in nanoseconds
+static uint64_t stats_percentile(const StatsHistogram* h, double q) {
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    uint64_t target = (uint64_t)(q * count + 0.999999);
+    uint64_t seen = 0;
+
+    if (count == 0)
+        return 0;
+    if (target < 1)
+        target = 1;
+
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target) {
+            uint64_t high = stats_bucket_high(i);
+            return high < max ? high : max;
+        }
+    }
+
+    return max;
+}
+
+// Function to render the region as text or JSON; returns the length written
+static size_t stats_format(char* out, size_t size, int json) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    size_t len = 0;
+
+#define STATS_PRINT(...) do { \
+        if (len < size) \
+            len += snprintf(out + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+    if (!stats_region) {
+        STATS_PRINT(json ? "{\"error\":\"stats unavailable\"}" : "ERROR: stats unavailable\n");
+        return len < size ? len : size - 1;
+    }
+
+    long uptime = (long)(time(NULL) - stats_region->started);
+
+    if (json) {
+        STATS_PRINT("{\"server\":\"%s\",\"uptime_s\":%ld,\"ops\":{", stats_region->server, uptime);
+    } else {
+        STATS_PRINT("%s uptime %lds\n", stats_region->server, uptime);
+        STATS_PRINT("%-11s %-8s %9s %7s %12s %9s %9s %9s %9s %9s %9s\n", "op", "phase", "count", "errors",
+                    "bytes", "mean(ms)", "p50(ms)", "p90(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+    }
+
+    for (int i = 0, first_op = 1; i < stats_region->op_count; i++) {
+        const StatsOp* op = &stats_region->ops[i];
+        uint64_t count = __atomic_load_n(&op->count, __ATOMIC_RELAXED);
+        uint64_t errors = __atomic_load_n(&op->errors, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_load_n(&op->bytes, __ATOMIC_RELAXED);
+
+        if (count == 0)
+            continue;
+
+        if (json) {
+            STATS_PRINT("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"bytes\":%llu,\"phases\":{", first_op ? "" : ",",
+                        op->name, (unsigned long long)count, (unsigned long long)errors, (unsigned long long)bytes);
+        }
+        first_op = 0;
+
+        // Total first, then the phases it breaks down into
+        for (int k = 0, first_phase = 1; k < STATS_PHASES; k++) {
+            int p = (k + STATS_TOTAL) % STATS_PHASES;
+            const StatsHistogram* h = &op->phases[p];
+            uint64_t n = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+            if (n == 0)
+                continue;
+
+            double mean = __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / (double)n / 1e6;
+            double max = __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e6;
+
+            if (json) {
+                STATS_PRINT("%s\"%s\":{\"count\":%llu,\"mean_ms\":%.3f", first_phase ? "" : ",",
+                            stats_phase_names[p], (unsigned long long)n, mean);
+                STATS_PRINT(",\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                            stats_percentile(h, quantiles[0]) / 1e6, stats_percentile(h, quantiles[1]) / 1e6,
+                            stats_percentile(h, quantiles[2]) / 1e6, stats_percentile(h, quantiles[3]) / 1e6, max);
+            } else if (p == STATS_TOTAL) {
+                STATS_PRINT("%-11s %-8s %9llu %7llu %12llu %9.3f", op->name, stats_phase_names[p],
+                            (unsigned long long)n, (unsigned long long)errors, (unsigned long long)bytes, mean);
+            } else {
+                STATS_PRINT("%-11s %-8s %9llu %7s %12s %9.3f", "", stats_phase_names[p], (unsigned long long)n, "", "",
+                            mean);
+            }
+            if (!json) {
+                for (int q = 0; q < 4; q++)
+                    STATS_PRINT(" %9.3f", stats_percentile(h, quantiles[q]) / 1e6);
+                STATS_PRINT(" %9.3f\n", max);
+            }
+            first_phase = 0;
+        }
+
+        if (json)
+            STATS_PRINT("}}");
+    }
+
+    if (json)
+        STATS_PRINT("}}");
+
+#undef STATS_PRINT
+
+    return len < size ? len : size - 1;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,170 @@
+#ifndef DFS_TOKEN_H
+#define DFS_TOKEN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// dfs_token: commands S1 signs for the backends, and receipts they sign back.
+//
+// S1 and the backends can share a key (-K file). A backend with a key only
+// serves commands that carry S1's signature, "K:<expiry>:<mac> " in front of
+// the command (after any trace prefix), where mac is a keyed hash of the
+// expiry and the command and expiry a Unix time TOKEN_TTL after signing.
+// S1 signs everything it sends, so only S1, or a client S1 gave a signed
+// command to, gets anything out of a backend. Health probes stay unsigned.
+//
+// That is what lets a client move file content straight to or from the
+// backends: S1 decides where a file goes or comes from, signs the exact
+// RECV_FILE or SEND_FILE command, and the client sends it to the backend
+// itself. The RECV_FILE of a direct upload ends with the backend S1 meant it
+// for, as "host:port" from S1's routing table. A backend that stored a file
+// adds a receipt to its reply, "R:<expiry>:<mac>:<backend>", signed over
+// that name, what it stored and its size, which the client hands back to S1
+// as proof the upload is in place on that backend.
+//
+// The hash is SipHash-2-4 with a 128-bit key drawn from the key file.
+
+#define TOKEN_TTL 30                // Seconds a signed command or receipt stays valid
+#define TOKEN_MAX 128               // Longest signature or receipt, with its separator
+#define TOKEN_BACKEND_MAX 72        // Longest backend name in a receipt, host:port
+
+static int token_enabled;           // A key was loaded
+static uint64_t token_k0, token_k1;
+
+// Function to rotate x left by b bits
+static inline uint64_t token_rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+// Function to run one SipHash round over the state v
+static inline void token_round(uint64_t* v) {
+    v[0] += v[1];
+    v[1] = token_rotl(v[1], 13) ^ v[0];
+    v[0] = token_rotl(v[0], 32);
+    v[2] += v[3];
+    v[3] = token_rotl(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = token_rotl(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = token_rotl(v[1], 17) ^ v[2];
+    v[2] = token_rotl(v[2], 32);
+}
+
+// Function to hash len bytes of data under the key k0, k1 (SipHash-2-4)
+static inline uint64_t token_siphash(uint64_t k0, uint64_t k1, const void* data, size_t len) {
+    const unsigned char* in = data;
+    uint64_t v[4] = { 0x736f6d6570736575ULL ^ k0, 0x646f72616e646f6dULL ^ k1, 0x6c7967656e657261ULL ^ k0,
+                      0x7465646279746573ULL ^ k1 };
+    uint64_t m;
+    size_t i;
+    
+    // Eight bytes at a time, little endian, then the rest with the length on top
+    for (i = 0; i <= len; i += 8) {
+        m = 0;
+        if (i + 8 <= len) {
+            for (int k = 7; k >= 0; k--)
+                m = (m << 8) | in[i + k];
+        } else {
+            m = (uint64_t)len << 56;
+            for (int k = (int)(len - i) - 1; k >= 0; k--)
+                m |= (uint64_t)in[i + k] << (8 * k);
+        }
+        v[3] ^= m;
+        token_round(v);
+        token_round(v);
+        v[0] ^= m;
+    }
+    
+    v[2] ^= 0xff;
+    for (int r = 0; r < 4; r++)
+        token_round(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+// Function to load the shared key from a file of at least 16 bytes, any
+// content; -1 if it can't be read or is too short
+static inline int token_load_key(const char* path) {
+    unsigned char data[4096];
+    FILE* file = fopen(path, "rb");
+    
+    if (!file)
+        return -1;
+    size_t len = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    if (len < 16)
+        return -1;
+    
+    // The key is whatever the file holds, condensed to 128 bits
+    token_k0 = token_siphash(0x77323520746f6b65ULL, 0x6e206b6579203000ULL, data, len);
+    token_k1 = token_siphash(0x77323520746f6b65ULL, 0x6e206b6579203100ULL, data, len);
+    token_enabled = 1;
+    return 0;
+}
+
+// Function to compute the mac of text valid until expiry
+static inline uint64_t token_mac(long expiry, const char* text) {
+    char buffer[4096];
+    int len = snprintf(buffer, sizeof(buffer), "%ld %s", expiry, text);
+    
+    return token_siphash(token_k0, token_k1, buffer, len < (int)sizeof(buffer) ? (size_t)len : sizeof(buffer) - 1);
+}
+
+// Function to write a signed command, "K:<expiry>:<mac> <command>", to out
+static inline int token_sign(const char* command, char* out, size_t size) {
+    long expiry = (long)time(NULL) + TOKEN_TTL;
+    
+    if (!token_enabled)
+        return snprintf(out, size, "%s", command);
+    return snprintf(out, size, "K:%ld:%016llx %s", expiry, (unsigned long long)token_mac(expiry, command), command);
+}
+
+// Function to take the signature off the front of a command and check it.
+// Returns 1 for a valid one, 0 for none and -1 for a forged or expired one;
+// without a key any signature is taken off and 0 returned.
+static inline int token_check(char* command) {
+    long expiry;
+    unsigned long long mac;
+    int used = 0;
+    
+    if (strncmp(command, "K:", 2) != 0 || sscanf(command, "K:%ld:%llx %n", &expiry, &mac, &used) != 2 || used == 0)
+        return 0;
+    memmove(command, command + used, strlen(command + used) + 1);
+    
+    if (!token_enabled)
+        return 0;
+    return expiry >= (long)time(NULL) && mac == token_mac(expiry, command) ? 1 : -1;
+}
+
+// Function to write the receipt of the backend S1 calls backend for size
+// bytes of stored, the arguments of the RECV_FILE that stored them; -1 if
+// they are too long to sign whole
+static inline int token_receipt(const char* backend, const char* stored, long size, char* out, size_t out_size) {
+    char text[4096];
+    long expiry = (long)time(NULL) + TOKEN_TTL;
+    
+    if (snprintf(text, sizeof(text), "STORED %s %s %ld", backend, stored, size) >= (int)sizeof(text))
+        return -1;
+    return snprintf(out, out_size, "R:%ld:%016llx:%s", expiry, (unsigned long long)token_mac(expiry, text), backend);
+}
+
+// Function to check a receipt for size bytes of stored; returns the backend
+// it names, pointing into receipt, or NULL if it is forged or expired
+static inline const char* token_check_receipt(const char* receipt, const char* stored, long size) {
+    char text[4096];
+    long expiry;
+    unsigned long long mac;
+    int used = 0;
+    
+    if (!token_enabled || sscanf(receipt, "R:%ld:%llx:%n", &expiry, &mac, &used) != 2 || used == 0
+        || expiry < (long)time(NULL))
+        return NULL;
+    
+    if (snprintf(text, sizeof(text), "STORED %s %s %ld", receipt + used, stored, size) >= (int)sizeof(text))
+        return NULL;
+    return mac == token_mac(expiry, text) ? receipt + used : NULL;
+}
+
+#endif
\ No newline at end of file
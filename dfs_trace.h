@@ -0,0 +1,215 @@
+#ifndef DFS_TRACE_H
+#define DFS_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// dfs_trace: request tracing across w25clients, S1 and the backends.
+//
+// Every command may start with a trace prefix "T:<16 hex id>:<sent us> ".
+// The id is chosen by the client (or by S1 when a client sends none) and is
+// passed on to every backend command issued for the request; the timestamp is
+// the sender's wall clock, so the receiving hop can record how long the
+// command waited before it was read. Each process records spans into a ring
+// in an anonymous shared mapping, overwriting the oldest, and the rings are
+// exported as Chrome trace event JSON (chrome://tracing, Perfetto).
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_EXPORT_SIZE (TRACE_RING_SIZE * 320)   // Worst case export of one ring
+#define TRACE_DETAIL_SIZE 96
+
+// Structure to store one finished span
+typedef struct {
+    uint64_t seq;                   // Slot index + 1 once the span is complete, 0 while written
+    uint64_t trace_id;
+    uint64_t start_us;              // Wall clock, comparable across processes on one host
+    uint64_t dur_us;
+    uint32_t phase_us[4];           // parse, connect, disk, network; 0 when not measured
+    int tid;                        // Process that recorded the span
+    char name[24];
+    char detail[TRACE_DETAIL_SIZE];
+} TraceSpan;
+
+// Structure to store the shared span ring of one server
+typedef struct {
+    int server_id;                  // 1-4, the trace "process"
+    char server[8];
+    uint64_t next;
+    TraceSpan spans[TRACE_RING_SIZE];
+} TraceRing;
+
+static TraceRing* trace_ring;
+static __thread uint64_t trace_current;     // Trace of the request being served
+static __thread uint64_t trace_sent_us;     // When the previous hop sent it, 0 if unknown
+
+// Function to get the wall clock in microseconds
+static inline uint64_t trace_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Function to map the shared ring; call before forking
+static inline int trace_init(int server_id, const char* server) {
+    trace_ring = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (trace_ring == MAP_FAILED) {
+        trace_ring = NULL;
+        return -1;
+    }
+    
+    trace_ring->server_id = server_id;
+    snprintf(trace_ring->server, sizeof(trace_ring->server), "%s", server);
+    
+    return 0;
+}
+
+// Function to make a new non-zero trace id
+static inline uint64_t trace_new_id() {
+    static __thread uint64_t state;
+    uint64_t id;
+    
+    if (state == 0)
+        state = trace_now_us() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&state;
+    
+    do {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        id = state * 0x2545F4914F6CDD1DULL;
+    } while (id == 0);
+    
+    return id;
+}
+
+// Function to take the trace prefix off a received command. Sets the current
+// trace, starting a new one when the sender didn't send a prefix.
+static inline void trace_parse(char* command) {
+    unsigned long long id = 0, sent = 0;
+    int used = 0;
+    
+    trace_current = 0;
+    trace_sent_us = 0;
+    
+    if (strncmp(command, "T:", 2) == 0 && sscanf(command, "T:%llx:%llu %n", &id, &sent, &used) == 2 && used > 0) {
+        memmove(command, command + used, strlen(command + used) + 1);
+        trace_current = id;
+        trace_sent_us = sent;
+    }
+    
+    if (trace_current == 0)
+        trace_current = trace_new_id();
+}
+
+// Function to write the prefix that carries the current trace to the next hop
+static inline int trace_prefix(char* out, size_t size) {
+    return snprintf(out, size, "T:%016llx:%llu ", (unsigned long long)trace_current,
+                    (unsigned long long)trace_now_us());
+}
+
+// Function to record a span of the current trace. phase_ns may be NULL.
+static inline void trace_span(const char* name, uint64_t start_us, uint64_t end_us, const char* detail,
+                              const uint64_t* phase_ns) {
+    if (!trace_ring)
+        return;
+    
+    uint64_t index = __atomic_fetch_add(&trace_ring->next, 1, __ATOMIC_RELAXED);
+    TraceSpan* span = &trace_ring->spans[index % TRACE_RING_SIZE];
+    
+    __atomic_store_n(&span->seq, 0, __ATOMIC_RELEASE);
+    span->trace_id = trace_current;
+    span->start_us = start_us;
+    span->dur_us = end_us > start_us ? end_us - start_us : 0;
+    span->tid = getpid();
+    for (int i = 0; i < 4; i++)
+        span->phase_us[i] = phase_ns ? (uint32_t)(phase_ns[i] / 1000) : 0;
+    snprintf(span->name, sizeof(span->name), "%s", name);
+    snprintf(span->detail, sizeof(span->detail), "%s", detail ? detail : "");
+    __atomic_store_n(&span->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+// Function to write a JSON string with escaping
+static inline size_t trace_json_string(char* out, size_t size, const char* text) {
+    size_t len = 0;
+    
+    if (size < 3)
+        return 0;
+    
+    out[len++] = '"';
+    for (; *text && len + 8 < size; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\') {
+            out[len++] = '\\';
+            out[len++] = c;
+        } else if (c < 0x20) {
+            len += snprintf(out + len, size - len, "\\u%04x", c);
+        } else {
+            out[len++] = c;
+        }
+    }
+    out[len++] = '"';
+    out[len] = 0;
+    
+    return len;
+}
+
+// Function to export the ring as comma-separated Chrome trace events, only
+// those of one trace when trace_id is non-zero. Returns the length written.
+static inline size_t trace_export(char* out, size_t size, uint64_t trace_id) {
+    static const char* phase_names[4] = { "parse_ms", "connect_ms", "disk_ms", "network_ms" };
+    size_t len = 0;
+
+#define TRACE_PRINT(...) do { \
+        if (len < size) \
+            len += snprintf(out + len, size - len, __VA_ARGS__); \
+    } while (0)
+    
+    if (!trace_ring || size == 0)
+        return 0;
+    
+    // Name the process row after the server
+    TRACE_PRINT("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+                trace_ring->server_id, trace_ring->server);
+    
+    uint64_t end = __atomic_load_n(&trace_ring->next, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    
+    for (uint64_t index = begin; index < end && len + 512 < size; index++) {
+        TraceSpan span = trace_ring->spans[index % TRACE_RING_SIZE];
+        
+        // Skip spans still being written or overwritten while copying
+        if (span.seq != index + 1 || __atomic_load_n(&trace_ring->spans[index % TRACE_RING_SIZE].seq,
+                                                     __ATOMIC_ACQUIRE) != index + 1)
+            continue;
+        if (trace_id && span.trace_id != trace_id)
+            continue;
+        
+        span.name[sizeof(span.name) - 1] = 0;
+        span.detail[sizeof(span.detail) - 1] = 0;
+        
+        TRACE_PRINT(",{\"name\":");
+        if (len < size)
+            len += trace_json_string(out + len, size - len, span.name);
+        TRACE_PRINT(",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"trace\":\"%016llx\",\"detail\":",
+                    trace_ring->server, (unsigned long long)span.start_us, (unsigned long long)span.dur_us,
+                    trace_ring->server_id, span.tid, (unsigned long long)span.trace_id);
+        if (len < size)
+            len += trace_json_string(out + len, size - len, span.detail);
+        for (int i = 0; i < 4; i++) {
+            if (span.phase_us[i])
+                TRACE_PRINT(",\"%s\":%.3f", phase_names[i], span.phase_us[i] / 1000.0);
+        }
+        TRACE_PRINT("}}");
+    }
+
+#undef TRACE_PRINT
+    
+    return len < size ? len : size - 1;
+}
+
+#endif
\ No newline at end of file
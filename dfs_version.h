@@ -0,0 +1,43 @@
+#ifndef DFS_VERSION_H
+#define DFS_VERSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// dfs_version: version tags of stored files, for conditional downloads.
+//
+// A server sending a file puts the file's version tag after its size,
+// "<size> <tag>". The tag names the stored copy: its inode, size and
+// modification time, which change whenever an upload replaces the file.
+// A client that still holds the copy a tag names passes the tag with
+// downlf, and S1 answers VERSION_NOT_MODIFIED instead of sending the file
+// again. Replicas store their copies separately, so their tags differ; a
+// download another replica answers is sent in full, as without a tag.
+// Readers that only want the size take the number and ignore the rest.
+
+#define VERSION_TAG_MAX 64
+#define VERSION_NOT_MODIFIED "NOT_MODIFIED"
+
+// Function to write the version tag of a stored file
+static inline void version_tag(const struct stat* st, char* out, size_t size) {
+    snprintf(out, size, "%lx-%lx-%lx.%lx", (unsigned long)st->st_ino, (unsigned long)st->st_size,
+             (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec);
+}
+
+// Function to read a size reply, "<size>" or "<size> <tag>"; the tag is
+// empty when the sender gave none
+static inline long version_parse(const char* reply, char* tag) {
+    tag[0] = '\0';
+    if (sscanf(reply, "%*s %63s", tag) != 1)
+        tag[0] = '\0';
+    return atol(reply);
+}
+
+// Function to tell whether a client's tag names the version a server holds
+static inline int version_matches(const char* client_tag, const char* tag) {
+    return client_tag && client_tag[0] && tag && tag[0] && strcmp(client_tag, tag) == 0;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,263 @@
+#ifndef DFS_WORKERS_H
+#define DFS_WORKERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "dfs_log.h"
+
+// dfs_workers: S1's pre-forked session processes.
+//
+// S1 used to fork a process for every client it accepted. Now it opens one
+// listener per group (by default one group per CPU), all bound to the same
+// address with SO_REUSEPORT so the kernel spreads new connections across
+// them, and forks the session processes ahead of time. A worker blocks in
+// accept on its group's listener, serves the session, and goes back for the
+// next one. The main process only keeps each group stocked: at least
+// WORKER_SPARE_MIN idle workers, more as soon as a connection waits with
+// none idle. A worker that finishes a session while its group already has
+// WORKER_SPARE_MAX idle exits, so the pool shrinks again after a storm.
+//
+// Every worker has a slot in an anonymous shared mapping created before the
+// first fork, where it marks itself busy or idle; the main process frees
+// the slot when it reaps the worker, so a crashed worker is never counted.
+// The slot's index also names the worker in the admission and tenant tables.
+// A worker that picks up a session also writes a byte to a pipe the main
+// process polls, so spares are replaced right away rather than on a timer.
+
+#define WORKER_MAX 1024             // Session processes across all groups, at most
+#define WORKER_MAX_GROUPS 64
+#define WORKER_SPARE_MIN 2          // Idle workers each group keeps ready
+#define WORKER_SPARE_MAX 8          // Idle workers beyond which a finishing one exits
+#define WORKER_POLL_MS 100          // Longest the main process goes without a look at the pool
+#define WORKER_BACKLOG 128          // Connections each listener holds until a worker accepts
+
+// Structure to store one worker slot
+typedef struct {
+    pid_t pid;                      // 0 for a free slot, -1 while being forked
+    int group;
+    int busy;                       // In a session
+} WorkerSlot;
+
+// Structure to store the shared pool
+typedef struct {
+    uint32_t generation;            // Bumped by every reload; workers catch up between sessions
+    WorkerSlot slots[WORKER_MAX];
+} WorkerTable;
+
+static WorkerTable* workers;
+static int worker_fds[WORKER_MAX_GROUPS];
+static int worker_notify[2] = { -1, -1 };  // Workers write a byte here when they turn busy
+static int worker_groups;
+static int worker_limit = WORKER_MAX;    // Session processes allowed across all groups
+static int worker_pin;              // Pin group g's workers to CPU g
+static int worker_self = -1;        // This worker's slot
+static uint32_t worker_generation;  // Reloads this worker has caught up with
+
+// Function to open another listener on server_fd's address
+static int workers_listener(int server_fd) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    int opt = 1;
+    int fd;
+    
+    if (getsockname(server_fd, (struct sockaddr*)&address, &addrlen) < 0 ||
+        (fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+        bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, WORKER_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to set up groups listeners, the first being server_fd, for up
+// to limit session processes. A group whose listener can't be opened
+// (server_fd lacks SO_REUSEPORT) shares server_fd. Must be called before
+// the first fork.
+static int workers_init(int server_fd, int groups, int pin, int limit) {
+    workers = mmap(NULL, sizeof(WorkerTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        workers = NULL;
+        return -1;
+    }
+    memset(workers, 0, sizeof(WorkerTable));
+    if (pipe2(worker_notify, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+    
+    worker_groups = groups < 1 ? 1 : groups > WORKER_MAX_GROUPS ? WORKER_MAX_GROUPS : groups;
+    worker_pin = pin;
+    worker_limit = limit < 1 ? 1 : limit > WORKER_MAX ? WORKER_MAX : limit;
+    worker_fds[0] = server_fd;
+    for (int g = 1; g < worker_groups; g++) {
+        worker_fds[g] = workers_listener(server_fd);
+        if (worker_fds[g] < 0) {
+            log_event(LOG_WARN, "listener_shared", strerror(errno), g);
+            worker_fds[g] = server_fd;
+        }
+    }
+    return 0;
+}
+
+// Function to count a group's workers, or only its idle ones; group -1 counts all
+static int workers_count(int group, int idle_only) {
+    int count = 0;
+    
+    for (int i = 0; i < WORKER_MAX; i++) {
+        WorkerSlot* slot = &workers->slots[i];
+        if (slot->pid != 0 && (group < 0 || slot->group == group) &&
+            !(idle_only && __atomic_load_n(&slot->busy, __ATOMIC_RELAXED)))
+            count++;
+    }
+    return count;
+}
+
+// Function to fork a worker for group. Returns its pid in the main process,
+// 0 in the worker and -1 when the pool is full or fork fails.
+static pid_t workers_spawn(int group) {
+    int free_slot = -1;
+    
+    for (int i = 0; i < WORKER_MAX && free_slot < 0; i++) {
+        if (workers->slots[i].pid == 0)
+            free_slot = i;
+    }
+    if (free_slot < 0)
+        return -1;
+    
+    WorkerSlot* slot = &workers->slots[free_slot];
+    slot->pid = -1;
+    slot->group = group;
+    slot->busy = 0;
+    
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        slot->pid = 0;
+        return -1;
+    }
+    if (pid > 0) {
+        slot->pid = pid;
+        return pid;
+    }
+    
+    worker_self = free_slot;
+    worker_generation = __atomic_load_n(&workers->generation, __ATOMIC_ACQUIRE);
+    if (worker_pin) {
+        cpu_set_t cpus;
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        CPU_ZERO(&cpus);
+        CPU_SET(group % (online > 0 ? online : 1), &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+    return 0;
+}
+
+// Function to tell how many workers group should get now
+static int workers_wanted(int group) {
+    int idle = workers_count(group, 1);
+    int room = worker_limit - workers_count(-1, 0);
+    int wanted = idle < WORKER_SPARE_MIN ? WORKER_SPARE_MIN - idle : 0;
+    
+    return wanted < room ? wanted : room;
+}
+
+// Function to forget the workers that have exited, first handing the slot
+// of each to reclaim, which gives back whatever it still held
+static void workers_reap(void (*reclaim)(int)) {
+    pid_t pid;
+    
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < WORKER_MAX; i++) {
+            if (workers->slots[i].pid == pid) {
+                reclaim(i);
+                workers->slots[i].pid = 0;
+            }
+        }
+    }
+}
+
+// Function to wait up to timeout_ms for a connection that no idle worker is
+// there to take, or for a signal. With the pool full, such a connection is
+// accepted here and handed to refuse, which must close it.
+static void workers_wait(int timeout_ms, void (*refuse)(int)) {
+    struct pollfd pfds[WORKER_MAX_GROUPS + 1];
+    int full = workers_count(-1, 0) >= worker_limit;
+    int count = 1;
+    char drain[256];
+    
+    pfds[0].fd = worker_notify[0];
+    pfds[0].events = POLLIN;
+    
+    for (int g = 0; g < worker_groups; g++) {
+        if (workers_count(g, 1) == 0) {
+            pfds[count].fd = worker_fds[g];
+            pfds[count].events = POLLIN;
+            count++;
+        }
+    }
+    if (poll(pfds, count, timeout_ms) <= 0)
+        return;
+    
+    if (pfds[0].revents) {
+        while (read(worker_notify[0], drain, sizeof(drain)) > 0)
+            ;
+    }
+    for (int i = 1; i < count && full; i++) {
+        int sock = pfds[i].revents ? accept(pfds[i].fd, NULL, NULL) : -1;
+        if (sock >= 0)
+            refuse(sock);
+    }
+}
+
+// Function to have every worker reread its configuration before its next session
+static void workers_reload() {
+    __atomic_add_fetch(&workers->generation, 1, __ATOMIC_RELEASE);
+}
+
+// Function to tell a worker whether a reload happened since it last asked
+static int workers_reloaded() {
+    uint32_t generation = __atomic_load_n(&workers->generation, __ATOMIC_ACQUIRE);
+    int reloaded = generation != worker_generation;
+    
+    worker_generation = generation;
+    return reloaded;
+}
+
+// Function to accept the worker's next session, marking it busy once it has one
+static int workers_accept(struct sockaddr_in* address) {
+    socklen_t addrlen = sizeof(*address);
+    WorkerSlot* slot = &workers->slots[worker_self];
+    
+    __atomic_store_n(&slot->busy, 0, __ATOMIC_RELAXED);
+    int sock = accept(worker_fds[slot->group], (struct sockaddr*)address, &addrlen);
+    if (sock >= 0) {
+        __atomic_store_n(&slot->busy, 1, __ATOMIC_RELAXED);
+        if (write(worker_notify[1], "", 1) < 0) {
+            // A full pipe already has the main process's attention
+        }
+    }
+    return sock;
+}
+
+// Function to tell a worker that just finished a session to exit instead
+// of waiting for another, because its group has idle workers to spare
+static int workers_surplus() {
+    return workers_count(workers->slots[worker_self].group, 1) >= WORKER_SPARE_MAX;
+}
+
+#endif
\ No newline at end of file
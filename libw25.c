@@ -0,0 +1,1845 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <libgen.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "libw25.h"
+#include "dfs_delta.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define BUFFER_SIZE 1024
+#define MAX_FILENAME 256
+#define MAX_PATH 1024
+#define HEARTBEAT_INTERVAL 15   // Seconds of idleness before a session is pinged
+#define BUSY_TIMEOUT_MS 30000   // How long a request S1 keeps turning away for being busy is retried
+#define DIRECT_REPLY_SIZE 4096  // S1's answer to locatef and placef: backends and signed commands
+#define DIRECT_MAX_TARGETS 16
+#define MAX_SERVERS 16          // S1 instances a client spreads its sessions over
+#define CACHE_TAG_MAX 64        // Longest version tag S1 or a backend sends with a size
+#define DELTA_MIN_UPLOAD 65536  // Smaller files are uploaded in full; a delta saves them little
+
+// Return codes of the command functions
+#define OP_OK 0
+#define OP_ERROR -1
+#define OP_DISCONNECTED -2      // Connection dropped before the server replied; safe to retry
+#define OP_PROXY -3             // S1 wants the content to pass through it, not go direct
+#define OP_NOT_MODIFIED -4      // The local copy is the current version; nothing was sent
+
+// Request types
+enum {
+    OP_UPLOAD,
+    OP_DOWNLOAD,
+    OP_REMOVE,
+    OP_TAR,
+    OP_LIST,
+    OP_STATS,
+    OP_TRACE
+};
+
+// Structure to store one long-lived session with S1
+typedef struct {
+    int sock;
+    time_t last_active;
+} Session;
+
+struct W25Request {
+    W25Client* client;
+    int op;
+    uint64_t trace_id;          // Sent with every command so the servers' spans can be matched up
+    char arg1[MAX_PATH];
+    char arg2[MAX_PATH];
+    
+    // Upload source when sending from memory, download sink when receiving into memory
+    const void* src;
+    size_t src_len;
+    W25FreeFn free_fn;
+    void* free_arg;
+    int to_memory;
+    
+    W25Callback callback;
+    void* user;
+    int done;
+    int queued_done;            // On the completion queue
+    W25Result result;
+    
+    W25Request* next;
+    W25Request* prev;
+};
+
+// Structure to store what the client knows of one downloaded file: the
+// version the servers sent it as, and the local copy it was written to
+typedef struct {
+    char remote[MAX_PATH];
+    char local[MAX_PATH];       // Absolute path of the copy
+    char tag[CACHE_TAG_MAX];
+    long size;                  // Of the copy when it was written
+    long mtime_sec;
+    long mtime_nsec;
+    uint64_t checksum;
+} CacheEntry;
+
+struct W25Stream {
+    W25Client* client;
+    Session session;
+    int writing;
+    long remaining;
+};
+
+struct W25Client {
+    char hosts[MAX_SERVERS][64];    // Interchangeable S1 instances
+    int ports[MAX_SERVERS];
+    int server_count;
+    unsigned next_server;           // Where the next session starts looking
+    int connections;
+    char tenant[32];                // Announced on every new session; empty for none
+    int direct;                     // Try moving file content straight to and from the backends
+    int delta;                      // Try uploading only what changed, see delta_upload
+    
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t request_done;
+    W25Request* pending_head;
+    W25Request* pending_tail;
+    W25Request* done_head;
+    W25Request* done_tail;
+    int stopping;
+    
+    // Idle sessions kept for streams
+    Session* idle;
+    int idle_count;
+    
+    int notify_pipe[2];
+    pthread_t* workers;
+    
+    // Download cache index, see cache_check; empty path for none
+    char cache_path[MAX_PATH];
+    pthread_mutex_t cache_lock;
+    CacheEntry* cache;
+    int cache_count;
+    int cache_capacity;
+};
+
+// Function to get file extension
+static const char* get_file_extension(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+        return "";
+    return dot + 1;
+}
+
+// Function to check that a file may be stored by the servers (.c, .pdf, .txt, .zip)
+static int supported_extension(const char* filename) {
+    const char* ext = get_file_extension(filename);
+    return strcmp(ext, "c") == 0 || strcmp(ext, "pdf") == 0 || strcmp(ext, "txt") == 0 || strcmp(ext, "zip") == 0;
+}
+
+// Function to get a monotonic timestamp in milliseconds
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Function to send exactly len bytes
+static int send_all(int sock, const void* data, size_t len) {
+    const char* p = data;
+    
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Function to receive exactly len bytes
+static int recv_all(int sock, void* data, size_t len) {
+    char* p = data;
+    
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Function to send a length-prefixed control message
+static int send_msg(int sock, const char* msg) {
+    uint32_t len = htonl(strlen(msg));
+    
+    if (send_all(sock, &len, sizeof(len)) < 0)
+        return -1;
+    return send_all(sock, msg, strlen(msg));
+}
+
+// Function to receive a length-prefixed control message, truncating it to fit the buffer
+static int recv_msg(int sock, char* buffer, size_t size) {
+    uint32_t len;
+    char discard[BUFFER_SIZE];
+    
+    memset(buffer, 0, size);
+    if (recv_all(sock, &len, sizeof(len)) < 0)
+        return -1;
+    len = ntohl(len);
+    
+    size_t keep = len < size - 1 ? len : size - 1;
+    if (recv_all(sock, buffer, keep) < 0)
+        return -1;
+    
+    // Drain whatever did not fit so the stream stays aligned on message boundaries
+    for (size_t left = len - keep; left > 0; ) {
+        size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        if (recv_all(sock, discard, chunk) < 0)
+            return -1;
+        left -= chunk;
+    }
+    
+    return (int)keep;
+}
+
+// Function to make a new non-zero trace id
+static uint64_t new_trace_id() {
+    static __thread uint64_t state;
+    uint64_t id;
+    
+    if (state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        state = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)&state;
+    }
+    
+    do {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        id = state * 0x2545F4914F6CDD1DULL;
+    } while (id == 0);
+    
+    return id;
+}
+
+// Function to put the trace prefix "T:<id>:<sent us> " in front of a command
+static void trace_command(char* traced, size_t size, uint64_t trace_id, const char* cmd) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(traced, size, "T:%016llx:%llu %s", (unsigned long long)trace_id,
+             (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000, cmd);
+}
+
+// Function to send a command with its trace prefix
+static int send_command(int sock, uint64_t trace_id, const char* cmd) {
+    char traced[BUFFER_SIZE + 64];
+    
+    trace_command(traced, sizeof(traced), trace_id, cmd);
+    return send_msg(sock, traced);
+}
+
+// Function to send a command S1 signed to a backend, which like S1 takes
+// the trace prefix but not the length prefix
+static int send_backend_command(int sock, uint64_t trace_id, const char* cmd) {
+    char traced[BUFFER_SIZE + 128];
+    
+    trace_command(traced, sizeof(traced), trace_id, cmd);
+    return send_all(sock, traced, strlen(traced));
+}
+
+// Function to receive a backend's reply, unframed like its commands
+static int recv_backend(int sock, char* buffer, size_t size) {
+    ssize_t len = recv(sock, buffer, size - 1, 0);
+    
+    if (len <= 0)
+        return -1;
+    buffer[len] = '\0';
+    return 0;
+}
+
+// Function to receive a length-prefixed message of any size into a new NUL-terminated allocation
+static char* recv_msg_alloc(int sock, size_t* length) {
+    uint32_t len;
+    char* data;
+    
+    if (recv_all(sock, &len, sizeof(len)) < 0)
+        return NULL;
+    len = ntohl(len);
+    
+    data = malloc((size_t)len + 1);
+    if (!data || recv_all(sock, data, len) < 0) {
+        free(data);
+        return NULL;
+    }
+    data[len] = 0;
+    *length = len;
+    
+    return data;
+}
+
+// Function to connect to a server: S1, or a backend for a direct transfer
+static int connect_host(const char* host, int port) {
+    int sock = 0;
+    int opt = 1;
+    struct sockaddr_in serv_addr;
+    
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+    
+    if (inet_pton(AF_INET, host, &serv_addr.sin_addr) <= 0) {
+        close(sock);
+        return -1;
+    }
+    
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    
+    // Commands are small request/response messages, so don't let Nagle delay them,
+    // and let the kernel notice a dead peer on a session that stays open for long
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    
+    return sock;
+}
+
+// Function to connect to S1: each session to the next instance in turn,
+// and to the one after that if an instance is down
+static int connect_to_server(W25Client* client) {
+    unsigned first = __atomic_fetch_add(&client->next_server, 1, __ATOMIC_RELAXED);
+    int sock = -1;
+    
+    for (int i = 0; i < client->server_count && sock < 0; i++) {
+        int k = (first + i) % client->server_count;
+        sock = connect_host(client->hosts[k], client->ports[k]);
+    }
+    return sock;
+}
+
+// Function to add the S1 instances of a "host:port,host:port,..." list
+static void add_servers(W25Client* client, const char* list) {
+    char copy[MAX_SERVERS * 72];
+    char* saveptr;
+    
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char* entry = strtok_r(copy, ", ", &saveptr); entry && client->server_count < MAX_SERVERS;
+         entry = strtok_r(NULL, ", ", &saveptr)) {
+        char* colon = strrchr(entry, ':');
+        int port = colon ? atoi(colon + 1) : 0;
+        
+        if (!colon || port <= 0 || colon - entry >= 64)
+            continue;
+        snprintf(client->hosts[client->server_count], sizeof(client->hosts[0]), "%.*s", (int)(colon - entry), entry);
+        client->ports[client->server_count++] = port;
+    }
+}
+
+// Function to close a session with S1
+static void session_close(Session* session) {
+    if (session->sock >= 0) {
+        close(session->sock);
+        session->sock = -1;
+    }
+}
+
+// Function to ping S1 over an open session
+static int session_ping(Session* session) {
+    char buffer[BUFFER_SIZE];
+    
+    if (send_msg(session->sock, "ping") < 0 || recv_msg(session->sock, buffer, BUFFER_SIZE) < 0
+        || strcmp(buffer, "PONG") != 0) {
+        session_close(session);
+        return -1;
+    }
+    
+    session->last_active = time(NULL);
+    return 0;
+}
+
+// Function to make sure a session is connected, reconnecting if S1 dropped it
+static int session_ensure(W25Client* client, Session* session) {
+    // A session that sat idle may have been closed by S1; probe it before reuse
+    if (session->sock >= 0 && time(NULL) - session->last_active >= HEARTBEAT_INTERVAL) {
+        session_ping(session);
+    }
+    
+    if (session->sock < 0) {
+        session->sock = connect_to_server(client);
+        if (session->sock < 0) {
+            return -1;
+        }
+        session->last_active = time(NULL);
+        
+        // S1 charges the session's transfers and commands to its tenant
+        if (client->tenant[0]) {
+            char buffer[BUFFER_SIZE];
+            snprintf(buffer, sizeof(buffer), "tenant %s", client->tenant);
+            if (send_msg(session->sock, buffer) < 0 || recv_msg(session->sock, buffer, BUFFER_SIZE) < 0
+                || strncmp(buffer, "ERROR", 5) == 0) {
+                session_close(session);
+                return -1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// Function to open a direct transfer on a line of S1's reply to locatef or
+// placef, "host:port <signed command>": connect to the backend, hand it the
+// command and, for an upload (size >= 0), the size. -1 if it isn't ready.
+static int direct_open(const char* line, uint64_t trace_id, long size) {
+    char buffer[BUFFER_SIZE];
+    char size_msg[32];
+    char host[64];
+    int port = 0, used = 0;
+    int sock;
+    
+    if (sscanf(line, "%63[^:]:%d %n", host, &port, &used) < 2 || used == 0 || (sock = connect_host(host, port)) < 0)
+        return -1;
+    
+    // An upload waits for the backend to take the command, then the size
+    int ok = send_backend_command(sock, trace_id, line + used) == 0;
+    if (ok && size >= 0) {
+        snprintf(size_msg, sizeof(size_msg), "%ld", size);
+        ok = recv_backend(sock, buffer, sizeof(buffer)) == 0 && strcmp(buffer, "READY") == 0 &&
+             send_all(sock, size_msg, strlen(size_msg)) == 0 && recv_backend(sock, buffer, sizeof(buffer)) == 0 &&
+             strcmp(buffer, "READY") == 0;
+    }
+    if (!ok) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function to upload straight to the replicas S1 places the file on, and
+// hand their receipts to S1; OP_PROXY if S1 wants the upload to go through
+// it, or too few replicas could be reached, before anything was sent
+static int direct_upload(Session* session, W25Request* request, FILE* file, long filesize) {
+    char reply[DIRECT_REPLY_SIZE];
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    int socks[DIRECT_MAX_TARGETS];
+    W25Result* result = &request->result;
+    int quorum, total, count = 0;
+    char* saveptr;
+    size_t chunk;
+    
+    snprintf(cmd, BUFFER_SIZE, "placef %s %s", request->arg1, request->arg2);
+    if (send_command(session->sock, request->trace_id, cmd) < 0 || recv_msg(session->sock, reply, sizeof(reply)) < 0)
+        return OP_DISCONNECTED;
+    if (sscanf(reply, "DIRECT %d %d", &quorum, &total) != 2)
+        return OP_PROXY;
+    
+    // A backend serves one transfer at a time, so hold each before taking the
+    // next, in S1's order, as S1 itself does; that keeps two uploads from each
+    // holding a replica the other waits for
+    strtok_r(reply, "\n", &saveptr);
+    for (char* line = strtok_r(NULL, "\n", &saveptr); line && count < DIRECT_MAX_TARGETS;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        socks[count] = direct_open(line, request->trace_id, filesize);
+        if (socks[count] >= 0)
+            count++;
+    }
+    if (count == 0 || count < quorum) {
+        for (int i = 0; i < count; i++)
+            close(socks[i]);
+        return OP_PROXY;
+    }
+    
+    // Same content to every replica; one that fails drops out
+    for (long sent = 0; sent < filesize; sent += chunk) {
+        const char* data = buffer;
+        
+        if (request->src) {
+            data = (const char*)request->src + sent;
+            chunk = filesize - sent;
+        } else if ((chunk = fread(buffer, 1, BUFFER_SIZE, file)) == 0) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (socks[i] >= 0 && send_all(socks[i], data, chunk) < 0) {
+                close(socks[i]);
+                socks[i] = -1;
+            }
+        }
+    }
+    result->bytes = filesize;
+    
+    // Collect the receipts of the replicas that stored it, as many as fit in a command to S1
+    int len = snprintf(cmd, BUFFER_SIZE, "commitf %s %s %ld", request->arg1, request->arg2, filesize);
+    for (int i = 0; i < count; i++) {
+        if (socks[i] < 0)
+            continue;
+        
+        char* receipt = recv_backend(socks[i], buffer, sizeof(buffer)) == 0 ? strstr(buffer, " R:") : NULL;
+        if (receipt && len + strlen(receipt) < BUFFER_SIZE - 1) {
+            strcpy(cmd + len, receipt);
+            len += strlen(receipt);
+        }
+        close(socks[i]);
+    }
+    
+    // S1 answers as if the upload had gone through it
+    if (send_command(session->sock, request->trace_id, cmd) < 0 || recv_msg(session->sock, buffer, BUFFER_SIZE) < 0)
+        return OP_DISCONNECTED;
+    
+    snprintf(result->message, sizeof(result->message), "%s", buffer);
+    return strncmp(buffer, "ERROR", 5) == 0 ? OP_ERROR : OP_OK;
+}
+
+// Function to upload only what changed in a file since the version the
+// servers hold, see dfs_delta.h: fetch that version's signatures, send the
+// delta, and let S1 rebuild the file. OP_PROXY to upload in full instead:
+// for small files, files the servers don't hold or won't take a delta for,
+// a delta no smaller than the file, or a delta the stored version rejects.
+static int delta_upload(Session* session, W25Request* request, FILE* file, long filesize) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    char path[MAX_PATH];
+    W25Result* result = &request->result;
+    int sock = session->sock;
+    long length, base_size;
+    int block;
+    
+    if (filesize < DELTA_MIN_UPLOAD)
+        return OP_PROXY;
+    
+    // The stored version's signatures
+    snprintf(path, sizeof(path), "%s", request->arg1);
+    snprintf(cmd, BUFFER_SIZE, "signf %s/%s", request->arg2, basename(path));
+    if (send_command(sock, request->trace_id, cmd) < 0 || recv_msg(sock, buffer, BUFFER_SIZE) < 0)
+        return OP_DISCONNECTED;
+    if (strncmp(buffer, "ERROR", 5) == 0)
+        return OP_PROXY;
+    
+    unsigned char* sigs = NULL;
+    if (sscanf(buffer, "%ld %d %ld", &length, &block, &base_size) == 3 && block >= DELTA_BLOCK_MIN &&
+        block <= DELTA_BLOCK_MAX && length == base_size / block * DELTA_SIG_SIZE)
+        sigs = malloc(length > 0 ? length : 1);
+    if (!sigs)
+        return send_msg(sock, "CANCEL") < 0 ? OP_DISCONNECTED : OP_PROXY;
+    if (send_msg(sock, "READY") < 0 || recv_all(sock, sigs, length) < 0) {
+        free(sigs);
+        return OP_DISCONNECTED;
+    }
+    
+    // The new version, from memory or mapped, against them
+    const unsigned char* data = request->src;
+    void* mapped = NULL;
+    if (!data) {
+        mapped = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        data = mapped != MAP_FAILED ? mapped : NULL;
+    }
+    FILE* delta = data ? tmpfile() : NULL;
+    uint64_t hash = 0;
+    int encoded = delta && delta_encode(data, filesize, sigs, length, block, delta, &hash) == 0;
+    long delta_size = encoded ? ftell(delta) : -1;
+    if (mapped && mapped != MAP_FAILED)
+        munmap(mapped, filesize);
+    free(sigs);
+    if (!encoded || delta_size >= filesize) {
+        if (delta)
+            fclose(delta);
+        return OP_PROXY;
+    }
+    
+    // Send command and delta size to server
+    snprintf(cmd, BUFFER_SIZE, "deltaf %s %s %d %ld %016llx", request->arg1, request->arg2, block, filesize,
+             (unsigned long long)hash);
+    sprintf(buffer, "%ld", delta_size);
+    if (send_command(sock, request->trace_id, cmd) < 0 || send_msg(sock, buffer) < 0 ||
+        recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        fclose(delta);
+        return OP_DISCONNECTED;
+    }
+    if (strcmp(buffer, "READY") != 0) {
+        fclose(delta);
+        snprintf(result->message, sizeof(result->message), "%s", buffer);
+        return strncmp(buffer, "ERROR: Server busy", 18) == 0 ? OP_ERROR : OP_PROXY;
+    }
+    
+    rewind(delta);
+    for (size_t n; (n = fread(buffer, 1, BUFFER_SIZE, delta)) > 0;) {
+        if (send_all(sock, buffer, n) < 0) {
+            fclose(delta);
+            return OP_DISCONNECTED;
+        }
+    }
+    fclose(delta);
+    
+    if (recv_msg(sock, buffer, BUFFER_SIZE) < 0)
+        return OP_DISCONNECTED;
+    if (strncmp(buffer, "ERROR", 5) == 0)
+        return OP_PROXY;
+    
+    snprintf(result->message, sizeof(result->message), "%s", buffer);
+    result->bytes = delta_size;
+    return OP_OK;
+}
+
+// Function to upload a file or an in-memory buffer to the server
+static int upload_file(Session* session, W25Request* request) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    const char* filename = request->arg1;
+    FILE* file = NULL;
+    struct stat st;
+    long filesize;
+    int bytes_read;
+    int sock = session->sock;
+    
+    // Check if file has valid extension (.c, .pdf, .txt, .zip)
+    if (!supported_extension(filename)) {
+        snprintf(result->message, sizeof(result->message), "Error: Unsupported file extension: %s", get_file_extension(filename));
+        return OP_ERROR;
+    }
+    
+    if (request->src) {
+        filesize = request->src_len;
+    } else {
+        // Open the file before talking to the server so a local error can't leave the session mid-command
+        file = fopen(filename, "rb");
+        if (!file) {
+            snprintf(result->message, sizeof(result->message), "Error: File %s not found", filename);
+            return OP_ERROR;
+        }
+        
+        fstat(fileno(file), &st);
+        filesize = st.st_size;
+    }
+    
+    // Only the changes, where the servers hold an earlier version
+    if (request->client->delta) {
+        int status = delta_upload(session, request, file, filesize);
+        if (status != OP_PROXY) {
+            if (file)
+                fclose(file);
+            return status;
+        }
+    }
+    
+    // Straight to the backends where S1 allows it
+    if (request->client->direct) {
+        int status = direct_upload(session, request, file, filesize);
+        if (status != OP_PROXY) {
+            if (file)
+                fclose(file);
+            return status;
+        }
+    }
+    
+    // Send command and file size to server
+    snprintf(cmd, BUFFER_SIZE, "uploadf %s %s", filename, request->arg2);
+    sprintf(buffer, "%ld", filesize);
+    if (send_command(sock, request->trace_id, cmd) < 0 || send_msg(sock, buffer) < 0) {
+        if (file)
+            fclose(file);
+        return OP_DISCONNECTED;
+    }
+    
+    // Wait for server to be ready
+    if (recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        if (file)
+            fclose(file);
+        return OP_DISCONNECTED;
+    }
+    
+    if (strcmp(buffer, "READY") != 0) {
+        snprintf(result->message, sizeof(result->message), "%s", strncmp(buffer, "ERROR", 5) == 0 ? buffer : "Error: Server not ready to receive file");
+        if (file)
+            fclose(file);
+        return OP_ERROR;
+    }
+    
+    // Send file content; a memory source goes out in one call without an intermediate copy
+    if (request->src) {
+        if (send_all(sock, request->src, request->src_len) < 0) {
+            return OP_DISCONNECTED;
+        }
+    } else {
+        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
+            if (send_all(sock, buffer, bytes_read) < 0) {
+                fclose(file);
+                return OP_DISCONNECTED;
+            }
+        }
+        
+        fclose(file);
+    }
+    result->bytes = filesize;
+    
+    // Get response from server
+    if (recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    snprintf(result->message, sizeof(result->message), "%s", buffer);
+    
+    return strncmp(buffer, "ERROR", 5) == 0 ? OP_ERROR : OP_OK;
+}
+
+// Function to send a reply to a server: length-prefixed to S1, raw to a backend
+static int send_reply(int sock, const char* reply, int raw) {
+    return raw ? send_all(sock, reply, strlen(reply)) : send_msg(sock, reply);
+}
+
+// Function to receive a sized file body from the server into a local file or,
+// when local_name is NULL, into a single allocation stored in the result; raw
+// for a backend serving a direct download
+static int receive_content(int sock, const char* local_name, long filesize, W25Result* result, int raw) {
+    char buffer[BUFFER_SIZE];
+    FILE* file = NULL;
+    long total_bytes = 0;
+    int bytes_read;
+    
+    // Prepare the sink; on failure tell the server to skip the transfer
+    if (local_name) {
+        file = fopen(local_name, "wb");
+        if (!file) {
+            snprintf(result->message, sizeof(result->message), "Error: Cannot create file %s", local_name);
+            return send_reply(sock, "CANCEL", raw) < 0 ? OP_DISCONNECTED : OP_ERROR;
+        }
+    } else {
+        result->data = malloc(filesize > 0 ? filesize : 1);
+        if (!result->data) {
+            snprintf(result->message, sizeof(result->message), "Error: Cannot allocate %ld bytes", filesize);
+            return send_reply(sock, "CANCEL", raw) < 0 ? OP_DISCONNECTED : OP_ERROR;
+        }
+    }
+    
+    // Tell server we're ready to receive the file content
+    if (send_reply(sock, "READY", raw) < 0) {
+        if (file)
+            fclose(file);
+        return OP_DISCONNECTED;
+    }
+    
+    // Receive file content, straight into the result buffer for memory downloads
+    while (total_bytes < filesize) {
+        size_t want = filesize - total_bytes;
+        
+        if (file) {
+            want = want < BUFFER_SIZE ? want : BUFFER_SIZE;
+            bytes_read = recv(sock, buffer, want, 0);
+        } else {
+            bytes_read = recv(sock, (char*)result->data + total_bytes, want, 0);
+        }
+        
+        if (bytes_read <= 0)
+            break;
+        
+        if (file)
+            fwrite(buffer, 1, bytes_read, file);
+        total_bytes += bytes_read;
+    }
+    
+    if (file)
+        fclose(file);
+    result->bytes = total_bytes;
+    result->data_len = total_bytes;
+    
+    return total_bytes < filesize ? OP_DISCONNECTED : OP_OK;
+}
+
+// Function to hash the content of a local file (64-bit FNV-1a); -1 if it
+// can't be read
+static int file_checksum(const char* path, uint64_t* checksum) {
+    unsigned char buffer[65536];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t n;
+    FILE* file = fopen(path, "rb");
+    
+    if (!file)
+        return -1;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            hash ^= buffer[i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    int failed = ferror(file);
+    fclose(file);
+    *checksum = hash;
+    return failed ? -1 : 0;
+}
+
+// Function to find the entry of a remote file downloaded to local; call with
+// the cache lock held
+static CacheEntry* cache_find(W25Client* client, const char* remote, const char* local) {
+    for (int i = 0; i < client->cache_count; i++) {
+        if (strcmp(client->cache[i].remote, remote) == 0 && strcmp(client->cache[i].local, local) == 0)
+            return &client->cache[i];
+    }
+    return NULL;
+}
+
+// Function to add an entry to the index in memory; NULL when out of memory
+static CacheEntry* cache_add(W25Client* client) {
+    if (client->cache_count == client->cache_capacity) {
+        int capacity = client->cache_capacity ? client->cache_capacity * 2 : 64;
+        CacheEntry* grown = realloc(client->cache, capacity * sizeof(CacheEntry));
+        if (!grown)
+            return NULL;
+        client->cache = grown;
+        client->cache_capacity = capacity;
+    }
+    return &client->cache[client->cache_count++];
+}
+
+// Function to read the index file, one entry per line:
+// "<tag> <size> <mtime sec> <mtime nsec> <checksum> <remote>\t<local>"
+static void cache_load(W25Client* client) {
+    char line[CACHE_TAG_MAX + 2 * MAX_PATH + 128];
+    FILE* file = fopen(client->cache_path, "r");
+    
+    if (!file)
+        return;
+    while (fgets(line, sizeof(line), file)) {
+        CacheEntry entry = {0};
+        unsigned long long checksum;
+        int used = 0;
+        
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%63s %ld %ld %ld %llx %n", entry.tag, &entry.size, &entry.mtime_sec, &entry.mtime_nsec,
+                   &checksum, &used) != 5 || used == 0)
+            continue;
+        
+        char* tab = strchr(line + used, '\t');
+        if (!tab || tab - (line + used) >= MAX_PATH || strlen(tab + 1) >= MAX_PATH)
+            continue;
+        snprintf(entry.remote, sizeof(entry.remote), "%.*s", (int)(tab - (line + used)), line + used);
+        snprintf(entry.local, sizeof(entry.local), "%s", tab + 1);
+        entry.checksum = checksum;
+        
+        CacheEntry* slot = cache_add(client);
+        if (slot)
+            *slot = entry;
+    }
+    fclose(file);
+}
+
+// Function to write the index file whole, through a temporary file so a
+// reader never sees half of it; call with the cache lock held
+static void cache_save(W25Client* client) {
+    char temp[MAX_PATH + 32];
+    
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", client->cache_path, (int)getpid());
+    FILE* file = fopen(temp, "w");
+    if (!file)
+        return;
+    for (int i = 0; i < client->cache_count; i++) {
+        CacheEntry* entry = &client->cache[i];
+        fprintf(file, "%s %ld %ld %ld %016llx %s\t%s\n", entry->tag, entry->size, entry->mtime_sec, entry->mtime_nsec,
+                (unsigned long long)entry->checksum, entry->remote, entry->local);
+    }
+    if (fclose(file) != 0 || rename(temp, client->cache_path) < 0)
+        unlink(temp);
+}
+
+// Function to tell the version tag of the copy of remote at local_name, if
+// it is still what was downloaded: the same size and modification time, or
+// failing that the same content. tag is left empty otherwise.
+static void cache_check(W25Client* client, const char* remote, const char* local_name, char* tag) {
+    char local[PATH_MAX];
+    struct stat st;
+    CacheEntry* entry;
+    uint64_t checksum;
+    long size = -1;
+    
+    tag[0] = '\0';
+    if (!client->cache_path[0] || !realpath(local_name, local) || strlen(local) >= MAX_PATH || stat(local, &st) < 0)
+        return;
+    
+    pthread_mutex_lock(&client->cache_lock);
+    entry = cache_find(client, remote, local);
+    if (entry && entry->size == st.st_size && entry->mtime_sec == st.st_mtim.tv_sec &&
+        entry->mtime_nsec == st.st_mtim.tv_nsec) {
+        snprintf(tag, CACHE_TAG_MAX, "%s", entry->tag);
+    } else if (entry && entry->size == st.st_size) {
+        size = entry->size;
+        checksum = entry->checksum;
+    }
+    pthread_mutex_unlock(&client->cache_lock);
+    
+    // A copy touched but not changed, e.g. by a checkout, is hashed once and kept
+    if (size < 0 || file_checksum(local, &checksum) < 0)
+        return;
+    pthread_mutex_lock(&client->cache_lock);
+    entry = cache_find(client, remote, local);
+    if (entry && entry->size == size && entry->checksum == checksum) {
+        entry->mtime_sec = st.st_mtim.tv_sec;
+        entry->mtime_nsec = st.st_mtim.tv_nsec;
+        snprintf(tag, CACHE_TAG_MAX, "%s", entry->tag);
+        cache_save(client);
+    }
+    pthread_mutex_unlock(&client->cache_lock);
+}
+
+// Function to record that remote was downloaded to local_name as version
+// tag; without a tag the entry is dropped, as the download can't be checked
+static void cache_store(W25Client* client, const char* remote, const char* local_name, const char* tag) {
+    char local[PATH_MAX];
+    struct stat st;
+    uint64_t checksum = 0;
+    
+    if (!client->cache_path[0] || !realpath(local_name, local) || strlen(local) >= MAX_PATH)
+        return;
+    int known = tag[0] && stat(local, &st) == 0 && file_checksum(local, &checksum) == 0;
+    
+    pthread_mutex_lock(&client->cache_lock);
+    CacheEntry* entry = cache_find(client, remote, local);
+    if (known && !entry && (entry = cache_add(client))) {
+        snprintf(entry->remote, sizeof(entry->remote), "%s", remote);
+        snprintf(entry->local, sizeof(entry->local), "%s", local);
+    }
+    if (known && entry) {
+        snprintf(entry->tag, sizeof(entry->tag), "%s", tag);
+        entry->size = st.st_size;
+        entry->mtime_sec = st.st_mtim.tv_sec;
+        entry->mtime_nsec = st.st_mtim.tv_nsec;
+        entry->checksum = checksum;
+        cache_save(client);
+    } else if (entry) {
+        *entry = client->cache[--client->cache_count];
+        cache_save(client);
+    }
+    pthread_mutex_unlock(&client->cache_lock);
+}
+
+// Function to read the version tag after the size in a download reply,
+// "<size> <tag>"; empty when the server sent none
+static void reply_tag(const char* reply, char* tag) {
+    if (sscanf(reply, "%*s %63s", tag) != 1)
+        tag[0] = '\0';
+}
+
+// Function to download straight from a backend holding the file, trying
+// them in the order S1 gives; OP_PROXY if S1 wants the download to go
+// through it, or no backend delivered the file. A backend whose version
+// tag is known, the client's copy, isn't asked for the content.
+static int direct_download(Session* session, W25Request* request, const char* local_name, const char* known,
+                           char* tag) {
+    char reply[DIRECT_REPLY_SIZE];
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    int status = OP_PROXY;
+    char* saveptr;
+    
+    snprintf(cmd, BUFFER_SIZE, "locatef %s", request->arg1);
+    if (send_command(session->sock, request->trace_id, cmd) < 0 || recv_msg(session->sock, reply, sizeof(reply)) < 0)
+        return OP_DISCONNECTED;
+    if (strncmp(reply, "DIRECT ", 7) != 0)
+        return OP_PROXY;
+    
+    // One backend at a time: one without the file, or one that drops out, leaves it to the next
+    strtok_r(reply, "\n", &saveptr);
+    for (char* line = strtok_r(NULL, "\n", &saveptr); line && status == OP_PROXY;
+         line = strtok_r(NULL, "\n", &saveptr)) {
+        int sock = direct_open(line, request->trace_id, -1);
+        if (sock < 0)
+            continue;
+        
+        if (recv_backend(sock, buffer, sizeof(buffer)) == 0 && strncmp(buffer, "ERROR", 5) != 0) {
+            reply_tag(buffer, tag);
+            if (known[0] && strcmp(known, tag) == 0) {
+                close(sock);
+                return OP_NOT_MODIFIED;
+            }
+            status = receive_content(sock, local_name, atol(buffer), result, 1);
+            if (status == OP_DISCONNECTED) {
+                free(result->data);
+                result->data = NULL;
+                status = OP_PROXY;
+            }
+        }
+        close(sock);
+    }
+    return status;
+}
+
+// Function to download file from the server
+static int download_file(Session* session, W25Request* request) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    char path[MAX_PATH];
+    W25Result* result = &request->result;
+    char local_path[MAX_PATH];
+    char known[CACHE_TAG_MAX] = "";
+    char tag[CACHE_TAG_MAX] = "";
+    const char* local_name = NULL;
+    long filesize;
+    int sock = session->sock;
+    int status = OP_PROXY;
+    
+    // Default to the remote file name in the current directory
+    if (!request->to_memory) {
+        snprintf(path, sizeof(path), "%s", request->arg1);
+        snprintf(local_path, sizeof(local_path), "%s", request->arg2[0] ? request->arg2 : basename(path));
+        local_name = local_path;
+        
+        // A copy from an earlier download is only fetched again if the servers hold another version
+        cache_check(request->client, request->arg1, local_name, known);
+    }
+    
+    // Straight from a backend where S1 allows it
+    if (request->client->direct)
+        status = direct_download(session, request, local_name, known, tag);
+    
+    if (status == OP_PROXY) {
+        // Send command to server
+        if (known[0]) {
+            snprintf(cmd, BUFFER_SIZE, "downlf %s %s", request->arg1, known);
+        } else {
+            snprintf(cmd, BUFFER_SIZE, "downlf %s", request->arg1);
+        }
+        if (send_command(sock, request->trace_id, cmd) < 0) {
+            return OP_DISCONNECTED;
+        }
+        
+        // Get file size from server
+        if (recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+            return OP_DISCONNECTED;
+        }
+        
+        if (strncmp(buffer, "ERROR", 5) == 0) {
+            snprintf(result->message, sizeof(result->message), "%s", buffer);
+            if (local_name)
+                cache_store(request->client, request->arg1, local_name, "");
+            return OP_ERROR;
+        }
+        
+        if (strcmp(buffer, "NOT_MODIFIED") == 0) {
+            status = OP_NOT_MODIFIED;
+        } else {
+            filesize = atol(buffer);
+            reply_tag(buffer, tag);
+            status = receive_content(sock, local_name, filesize, result, 0);
+        }
+    }
+    
+    snprintf(path, sizeof(path), "%s", request->arg1);
+    if (status == OP_NOT_MODIFIED) {
+        snprintf(result->message, sizeof(result->message), "File %s not modified", basename(path));
+        return OP_OK;
+    }
+    if (status == OP_OK) {
+        if (local_name)
+            cache_store(request->client, request->arg1, local_name, tag);
+        snprintf(result->message, sizeof(result->message), "File %s downloaded successfully", basename(path));
+    }
+    
+    return status;
+}
+
+// Function to remove file from the server
+static int remove_file(Session* session, W25Request* request) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    int sock = session->sock;
+    
+    // Send command to server
+    snprintf(cmd, BUFFER_SIZE, "removef %s", request->arg1);
+    if (send_command(sock, request->trace_id, cmd) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    // Get response from server. The request may already have been carried out,
+    // so a lost reply is reported instead of retried.
+    if (recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        session_close(session);
+        snprintf(result->message, sizeof(result->message), "Error: Connection lost before the server replied");
+        return OP_ERROR;
+    }
+    
+    snprintf(result->message, sizeof(result->message), "%s", buffer);
+    
+    return strncmp(buffer, "ERROR", 5) == 0 ? OP_ERROR : OP_OK;
+}
+
+// Function to download tar file of specified file type
+static int download_tar(Session* session, W25Request* request) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    const char* filetype = request->arg1;
+    long filesize;
+    int sock = session->sock;
+    int status;
+    char tar_filename[MAX_FILENAME];
+    
+    // Check if file type is valid (.c, .pdf, .txt)
+    if (strcmp(filetype, "c") != 0 && strcmp(filetype, "pdf") != 0 && strcmp(filetype, "txt") != 0) {
+        snprintf(result->message, sizeof(result->message), "Error: Unsupported file type: %s", filetype);
+        return OP_ERROR;
+    }
+    
+    // Send command to server
+    snprintf(cmd, BUFFER_SIZE, "downltar %s", filetype);
+    if (send_command(sock, request->trace_id, cmd) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    // Get file size from server
+    if (recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    if (strncmp(buffer, "ERROR", 5) == 0) {
+        snprintf(result->message, sizeof(result->message), "%s", buffer);
+        return OP_ERROR;
+    }
+    
+    filesize = atol(buffer);
+    
+    // Determine tar file name based on file type
+    if (request->arg2[0]) {
+        snprintf(tar_filename, sizeof(tar_filename), "%s", request->arg2);
+    } else if (strcmp(filetype, "c") == 0) {
+        strcpy(tar_filename, "cfiles.tar");
+    } else if (strcmp(filetype, "pdf") == 0) {
+        strcpy(tar_filename, "pdf.tar");
+    } else {
+        strcpy(tar_filename, "text.tar");
+    }
+    
+    status = receive_content(sock, tar_filename, filesize, result, 0);
+    if (status == OP_OK) {
+        snprintf(result->message, sizeof(result->message), "Tar file %s downloaded successfully", tar_filename);
+    }
+    
+    return status;
+}
+
+// Function to display filenames in specified path
+static int display_filenames(Session* session, W25Request* request) {
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    int sock = session->sock;
+    
+    // Send command to server
+    snprintf(cmd, BUFFER_SIZE, "dispfnames %s", request->arg1);
+    if (send_command(sock, request->trace_id, cmd) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    // Get response from server
+    if (recv_msg(sock, result->message, sizeof(result->message)) < 0) {
+        return OP_DISCONNECTED;
+    }
+    result->bytes = strlen(result->message);
+    
+    return strncmp(result->message, "ERROR", 5) == 0 ? OP_ERROR : OP_OK;
+}
+
+// Function to fetch the statistics or trace report of S1 and its backends; the
+// full report goes to the result data, the message holds as much of it as fits
+static int fetch_report(Session* session, W25Request* request) {
+    char cmd[BUFFER_SIZE];
+    W25Result* result = &request->result;
+    int sock = session->sock;
+    
+    // Send command to server
+    if (request->op == OP_STATS) {
+        snprintf(cmd, BUFFER_SIZE, "STATS %s", request->arg1[0] ? request->arg1 : "text");
+    } else {
+        snprintf(cmd, BUFFER_SIZE, "TRACE %s", request->arg1[0] ? request->arg1 : "0");
+    }
+    if (send_command(sock, request->trace_id, cmd) < 0) {
+        return OP_DISCONNECTED;
+    }
+    
+    // Get response from server
+    result->data = recv_msg_alloc(sock, &result->data_len);
+    if (!result->data) {
+        return OP_DISCONNECTED;
+    }
+    snprintf(result->message, sizeof(result->message), "%s", (char*)result->data);
+    result->bytes = result->data_len;
+    
+    return strncmp(result->message, "ERROR", 5) == 0 ? OP_ERROR : OP_OK;
+}
+
+// Function to read the retry hint out of S1's reply to a request it was too busy for; 0 if it isn't one
+static int busy_retry_ms(const char* message) {
+    int ms;
+    
+    return sscanf(message, "ERROR: Server busy, retry after %d ms", &ms) == 1 && ms > 0 ? ms : 0;
+}
+
+// Function to run one request over a session, reconnecting once if S1 dropped the
+// connection. If S1 was too busy to take it, the request waits out S1's hint,
+// doubled for every refusal in a row and jittered so refused clients spread out.
+static void run_request(W25Client* client, Session* session, W25Request* request) {
+    W25Result* result = &request->result;
+    int status = OP_DISCONNECTED;
+    int busy = 0;
+    uint64_t jitter = request->trace_id | 1;
+    double start = now_ms();
+    
+    for (int attempt = 0; attempt < 2 && status == OP_DISCONNECTED; attempt++) {
+        // A retry starts from a clean result
+        free(result->data);
+        memset(result, 0, sizeof(*result));
+        snprintf(result->trace_id, sizeof(result->trace_id), "%016llx", (unsigned long long)request->trace_id);
+        
+        if (session_ensure(client, session) < 0) {
+            snprintf(result->message, sizeof(result->message), "Error: Connection failed");
+            status = OP_ERROR;
+            break;
+        }
+        
+        switch (request->op) {
+        case OP_UPLOAD:
+            status = upload_file(session, request);
+            break;
+        case OP_DOWNLOAD:
+            status = download_file(session, request);
+            break;
+        case OP_REMOVE:
+            status = remove_file(session, request);
+            break;
+        case OP_TAR:
+            status = download_tar(session, request);
+            break;
+        case OP_STATS:
+        case OP_TRACE:
+            status = fetch_report(session, request);
+            break;
+        default:
+            status = display_filenames(session, request);
+            break;
+        }
+        
+        if (status == OP_DISCONNECTED) {
+            session_close(session);
+        } else {
+            session->last_active = time(NULL);
+        }
+        
+        // A client turned away at connect time finds its session closed; the ping notices
+        double retry_ms = status == OP_ERROR ? busy_retry_ms(result->message) : 0;
+        if (retry_ms > 0 && now_ms() - start < BUSY_TIMEOUT_MS) {
+            jitter ^= jitter << 13;
+            jitter ^= jitter >> 7;
+            jitter ^= jitter << 17;
+            retry_ms *= (1 << (busy < 2 ? busy : 2)) * (0.5 + (jitter % 1000) / 1000.0);
+            busy++;
+            usleep((useconds_t)(retry_ms * 1000));
+            session_ping(session);
+            status = OP_DISCONNECTED;
+            attempt = -1;
+        }
+    }
+    
+    if (status == OP_DISCONNECTED) {
+        snprintf(result->message, sizeof(result->message), "Error: Connection to server lost");
+        status = OP_ERROR;
+    }
+    
+    // Only a successful download hands its buffer to the caller
+    if (status != OP_OK) {
+        free(result->data);
+        result->data = NULL;
+        result->data_len = 0;
+    }
+    
+    result->status = status == OP_OK ? W25_OK : W25_ERROR;
+    result->elapsed_ms = now_ms() - start;
+}
+
+// Function to finish a request: release a borrowed upload buffer, then hand the
+// result to the callback or the completion queue
+static void complete_request(W25Client* client, W25Request* request) {
+    if (request->free_fn) {
+        request->free_fn((void*)request->src, request->free_arg);
+        request->free_fn = NULL;
+    }
+    
+    if (request->callback) {
+        request->callback(request, &request->result, request->user);
+        
+        pthread_mutex_lock(&client->lock);
+        request->done = 1;
+        pthread_cond_broadcast(&client->request_done);
+        pthread_mutex_unlock(&client->lock);
+        
+        free(request->result.data);
+        free(request);
+        return;
+    }
+    
+    pthread_mutex_lock(&client->lock);
+    request->done = 1;
+    request->queued_done = 1;
+    request->next = NULL;
+    request->prev = client->done_tail;
+    if (client->done_tail)
+        client->done_tail->next = request;
+    else
+        client->done_head = request;
+    client->done_tail = request;
+    pthread_cond_broadcast(&client->request_done);
+    pthread_mutex_unlock(&client->lock);
+    
+    // Wake anyone polling the completion fd
+    char byte = 1;
+    ssize_t unused = write(client->notify_pipe[1], &byte, 1);
+    (void)unused;
+}
+
+// Worker thread: owns one session and serves queued requests, pinging the
+// session while idle so S1 keeps it open
+static void* worker_main(void* arg) {
+    W25Client* client = arg;
+    Session session = { -1, 0 };
+    
+    pthread_mutex_lock(&client->lock);
+    while (1) {
+        while (!client->pending_head && !client->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += HEARTBEAT_INTERVAL;
+            
+            if (pthread_cond_timedwait(&client->work_ready, &client->lock, &deadline) == ETIMEDOUT
+                && session.sock >= 0 && time(NULL) - session.last_active >= HEARTBEAT_INTERVAL) {
+                pthread_mutex_unlock(&client->lock);
+                session_ping(&session);
+                pthread_mutex_lock(&client->lock);
+            }
+        }
+        
+        W25Request* request = client->pending_head;
+        if (!request) {
+            // Stopping and the queue is drained
+            break;
+        }
+        
+        client->pending_head = request->next;
+        if (!client->pending_head)
+            client->pending_tail = NULL;
+        pthread_mutex_unlock(&client->lock);
+        
+        run_request(client, &session, request);
+        complete_request(client, request);
+        
+        pthread_mutex_lock(&client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    session_close(&session);
+    return NULL;
+}
+
+W25Client* w25_client_new(const W25Options* options) {
+    W25Client* client = calloc(1, sizeof(W25Client));
+    if (!client) {
+        return NULL;
+    }
+    
+    // Unset fields fall back to $W25_SERVERS or $W25_HOST/$W25_PORT, as published by w25cluster, then the defaults
+    const char* env_host = getenv("W25_HOST");
+    const char* env_port = getenv("W25_PORT");
+    const char* env_servers = getenv("W25_SERVERS");
+    const char* env_tenant = getenv("W25_TENANT");
+    const char* env_direct = getenv("W25_DIRECT");
+    const char* env_cache = getenv("W25_CACHE");
+    const char* env_delta = getenv("W25_DELTA");
+    
+    if (options && options->servers) {
+        add_servers(client, options->servers);
+    } else if (!(options && (options->host || options->port > 0)) && env_servers) {
+        add_servers(client, env_servers);
+    }
+    if (client->server_count == 0) {
+        snprintf(client->hosts[0], sizeof(client->hosts[0]), "%s",
+                 options && options->host ? options->host : env_host && *env_host ? env_host : DEFAULT_HOST);
+        client->ports[0] = options && options->port > 0 ? options->port
+                         : env_port && atoi(env_port) > 0 ? atoi(env_port) : DEFAULT_PORT;
+        client->server_count = 1;
+    }
+    
+    // Clients that open one session each still spread over the instances
+    client->next_server = (unsigned)(new_trace_id() >> 32);
+    client->connections = options && options->connections > 0 ? options->connections : 1;
+    snprintf(client->tenant, sizeof(client->tenant), "%s",
+             options && options->tenant ? options->tenant : env_tenant ? env_tenant : "");
+    client->direct = options && options->direct ? 1 : env_direct && atoi(env_direct) > 0;
+    client->delta = options && options->delta ? 1 : env_delta && atoi(env_delta) > 0;
+    snprintf(client->cache_path, sizeof(client->cache_path), "%s",
+             options && options->cache ? options->cache : env_cache ? env_cache : "");
+    
+    client->idle = calloc(client->connections, sizeof(Session));
+    client->workers = calloc(client->connections, sizeof(pthread_t));
+    if (!client->idle || !client->workers || pipe(client->notify_pipe) < 0) {
+        free(client->idle);
+        free(client->workers);
+        free(client);
+        return NULL;
+    }
+    fcntl(client->notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(client->notify_pipe[1], F_SETFL, O_NONBLOCK);
+    
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->work_ready, NULL);
+    pthread_cond_init(&client->request_done, NULL);
+    pthread_mutex_init(&client->cache_lock, NULL);
+    if (client->cache_path[0])
+        cache_load(client);
+    
+    for (int i = 0; i < client->connections; i++) {
+        pthread_create(&client->workers[i], NULL, worker_main, client);
+    }
+    
+    return client;
+}
+
+void w25_client_free(W25Client* client) {
+    if (!client) {
+        return;
+    }
+    
+    pthread_mutex_lock(&client->lock);
+    client->stopping = 1;
+    pthread_cond_broadcast(&client->work_ready);
+    pthread_mutex_unlock(&client->lock);
+    
+    for (int i = 0; i < client->connections; i++) {
+        pthread_join(client->workers[i], NULL);
+    }
+    
+    // Requests nobody collected from the completion queue
+    while (client->done_head) {
+        W25Request* request = client->done_head;
+        client->done_head = request->next;
+        free(request->result.data);
+        free(request);
+    }
+    
+    for (int i = 0; i < client->idle_count; i++) {
+        session_close(&client->idle[i]);
+    }
+    
+    close(client->notify_pipe[0]);
+    close(client->notify_pipe[1]);
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->work_ready);
+    pthread_cond_destroy(&client->request_done);
+    pthread_mutex_destroy(&client->cache_lock);
+    free(client->cache);
+    free(client->idle);
+    free(client->workers);
+    free(client);
+}
+
+// Function to allocate a request and append it to the pending queue
+static W25Request* submit(W25Client* client, int op, const char* arg1, const char* arg2,
+                          W25Callback callback, void* user) {
+    W25Request* request = calloc(1, sizeof(W25Request));
+    if (!request) {
+        return NULL;
+    }
+    
+    request->client = client;
+    request->op = op;
+    request->trace_id = new_trace_id();
+    snprintf(request->arg1, sizeof(request->arg1), "%s", arg1 ? arg1 : "");
+    snprintf(request->arg2, sizeof(request->arg2), "%s", arg2 ? arg2 : "");
+    request->callback = callback;
+    request->user = user;
+    
+    return request;
+}
+
+// Function to queue a prepared request for the workers
+static W25Request* enqueue(W25Client* client, W25Request* request) {
+    if (!request) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&client->lock);
+    if (client->pending_tail)
+        client->pending_tail->next = request;
+    else
+        client->pending_head = request;
+    client->pending_tail = request;
+    pthread_cond_signal(&client->work_ready);
+    pthread_mutex_unlock(&client->lock);
+    
+    return request;
+}
+
+W25Request* w25_upload_file(W25Client* client, const char* local_path, const char* dest_path,
+                            W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_UPLOAD, local_path, dest_path, callback, user));
+}
+
+W25Request* w25_download_file(W25Client* client, const char* remote_path, const char* local_path,
+                              W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_DOWNLOAD, remote_path, local_path, callback, user));
+}
+
+W25Request* w25_remove(W25Client* client, const char* remote_path, W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_REMOVE, remote_path, NULL, callback, user));
+}
+
+W25Request* w25_download_tar(W25Client* client, const char* filetype, const char* local_path,
+                             W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_TAR, filetype, local_path, callback, user));
+}
+
+W25Request* w25_list(W25Client* client, const char* pathname, W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_LIST, pathname, NULL, callback, user));
+}
+
+W25Request* w25_stats(W25Client* client, const char* format, W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_STATS, format, NULL, callback, user));
+}
+
+W25Request* w25_trace(W25Client* client, const char* trace_id, W25Callback callback, void* user) {
+    return enqueue(client, submit(client, OP_TRACE, trace_id, NULL, callback, user));
+}
+
+W25Request* w25_upload_buffer(W25Client* client, const char* name, const char* dest_path,
+                              const void* data, size_t len, W25FreeFn free_fn, void* free_arg,
+                              W25Callback callback, void* user) {
+    W25Request* request = submit(client, OP_UPLOAD, name, dest_path, callback, user);
+    if (!request) {
+        return NULL;
+    }
+    
+    request->src = data ? data : "";
+    request->src_len = len;
+    request->free_fn = free_fn;
+    request->free_arg = free_arg;
+    
+    return enqueue(client, request);
+}
+
+W25Request* w25_download_buffer(W25Client* client, const char* remote_path,
+                                W25Callback callback, void* user) {
+    W25Request* request = submit(client, OP_DOWNLOAD, remote_path, NULL, callback, user);
+    if (!request) {
+        return NULL;
+    }
+    
+    request->to_memory = 1;
+    
+    return enqueue(client, request);
+}
+
+void* w25_result_take_data(W25Result* result, size_t* len) {
+    void* data = result->data;
+    
+    if (len)
+        *len = result->data_len;
+    result->data = NULL;
+    result->data_len = 0;
+    
+    return data;
+}
+
+int w25_request_done(W25Request* request) {
+    pthread_mutex_lock(&request->client->lock);
+    int done = request->done;
+    pthread_mutex_unlock(&request->client->lock);
+    
+    return done;
+}
+
+const W25Result* w25_request_wait(W25Request* request) {
+    W25Client* client = request->client;
+    
+    pthread_mutex_lock(&client->lock);
+    while (!request->done) {
+        pthread_cond_wait(&client->request_done, &client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    return &request->result;
+}
+
+const W25Result* w25_request_result(W25Request* request) {
+    return w25_request_done(request) ? &request->result : NULL;
+}
+
+void* w25_request_user(W25Request* request) {
+    return request->user;
+}
+
+void w25_request_free(W25Request* request) {
+    W25Client* client;
+    
+    if (!request) {
+        return;
+    }
+    
+    // Waits for an in-flight request so the worker never touches freed memory
+    w25_request_wait(request);
+    client = request->client;
+    
+    pthread_mutex_lock(&client->lock);
+    if (request->queued_done) {
+        if (request->prev)
+            request->prev->next = request->next;
+        else
+            client->done_head = request->next;
+        if (request->next)
+            request->next->prev = request->prev;
+        else
+            client->done_tail = request->prev;
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    free(request->result.data);
+    free(request);
+}
+
+int w25_client_fd(W25Client* client) {
+    return client->notify_pipe[0];
+}
+
+W25Request* w25_next_completed(W25Client* client) {
+    char byte;
+    
+    pthread_mutex_lock(&client->lock);
+    W25Request* request = client->done_head;
+    if (request) {
+        client->done_head = request->next;
+        if (client->done_head)
+            client->done_head->prev = NULL;
+        else
+            client->done_tail = NULL;
+        request->queued_done = 0;
+        request->next = request->prev = NULL;
+        
+        ssize_t unused = read(client->notify_pipe[0], &byte, 1);
+        (void)unused;
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    return request;
+}
+
+// Function to borrow an idle session for a stream, or open a new one
+static int stream_session(W25Client* client, Session* session) {
+    pthread_mutex_lock(&client->lock);
+    if (client->idle_count > 0) {
+        *session = client->idle[--client->idle_count];
+    } else {
+        session->sock = -1;
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    return session_ensure(client, session);
+}
+
+// Function to return a stream's session to the idle pool
+static void stream_release(W25Client* client, Session* session) {
+    pthread_mutex_lock(&client->lock);
+    if (session->sock >= 0 && client->idle_count < client->connections) {
+        client->idle[client->idle_count++] = *session;
+        session->sock = -1;
+    }
+    pthread_mutex_unlock(&client->lock);
+    
+    session_close(session);
+}
+
+W25Stream* w25_open_read(W25Client* client, const char* remote_path, long* size, W25Result* error) {
+    char buffer[BUFFER_SIZE];
+    W25Stream* stream = calloc(1, sizeof(W25Stream));
+    
+    if (error)
+        memset(error, 0, sizeof(*error));
+    if (!stream) {
+        return NULL;
+    }
+    stream->client = client;
+    
+    if (stream_session(client, &stream->session) < 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "Error: Connection failed");
+        free(stream);
+        return NULL;
+    }
+    
+    snprintf(buffer, BUFFER_SIZE, "downlf %s", remote_path);
+    if (send_command(stream->session.sock, new_trace_id(), buffer) < 0 || recv_msg(stream->session.sock, buffer, BUFFER_SIZE) < 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "Error: Connection to server lost");
+        session_close(&stream->session);
+        free(stream);
+        return NULL;
+    }
+    
+    if (strncmp(buffer, "ERROR", 5) == 0 || send_msg(stream->session.sock, "READY") < 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "%s", buffer);
+        stream_release(client, &stream->session);
+        free(stream);
+        return NULL;
+    }
+    
+    stream->remaining = atol(buffer);
+    if (size)
+        *size = stream->remaining;
+    
+    return stream;
+}
+
+ssize_t w25_stream_read(W25Stream* stream, void* buffer, size_t len) {
+    if (stream->writing || stream->session.sock < 0) {
+        return -1;
+    }
+    if (stream->remaining == 0) {
+        return 0;
+    }
+    
+    if ((long)len > stream->remaining)
+        len = stream->remaining;
+    
+    ssize_t n = recv(stream->session.sock, buffer, len, 0);
+    if (n <= 0) {
+        session_close(&stream->session);
+        return -1;
+    }
+    stream->remaining -= n;
+    
+    return n;
+}
+
+W25Stream* w25_open_write(W25Client* client, const char* name, const char* dest_path, long size,
+                          W25Result* error) {
+    char buffer[BUFFER_SIZE];
+    W25Stream* stream;
+    
+    if (error)
+        memset(error, 0, sizeof(*error));
+    if (!supported_extension(name)) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "Error: Unsupported file extension: %s", get_file_extension(name));
+        return NULL;
+    }
+    
+    stream = calloc(1, sizeof(W25Stream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->client = client;
+    stream->writing = 1;
+    
+    if (stream_session(client, &stream->session) < 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "Error: Connection failed");
+        free(stream);
+        return NULL;
+    }
+    
+    char cmd[BUFFER_SIZE];
+    int sock = stream->session.sock;
+    snprintf(cmd, BUFFER_SIZE, "uploadf %s %s", name, dest_path);
+    sprintf(buffer, "%ld", size);
+    if (send_command(sock, new_trace_id(), cmd) < 0 || send_msg(sock, buffer) < 0 || recv_msg(sock, buffer, BUFFER_SIZE) < 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "Error: Connection to server lost");
+        session_close(&stream->session);
+        free(stream);
+        return NULL;
+    }
+    
+    if (strcmp(buffer, "READY") != 0) {
+        if (error)
+            snprintf(error->message, sizeof(error->message), "%s", buffer);
+        stream_release(client, &stream->session);
+        free(stream);
+        return NULL;
+    }
+    
+    stream->remaining = size;
+    
+    return stream;
+}
+
+ssize_t w25_stream_write(W25Stream* stream, const void* buffer, size_t len) {
+    if (!stream->writing || stream->session.sock < 0) {
+        return -1;
+    }
+    
+    // Never write past the announced size; the rest would be read as the next command
+    if ((long)len > stream->remaining)
+        len = stream->remaining;
+    
+    if (send_all(stream->session.sock, buffer, len) < 0) {
+        session_close(&stream->session);
+        return -1;
+    }
+    stream->remaining -= len;
+    
+    return len;
+}
+
+int w25_stream_close(W25Stream* stream, W25Result* result) {
+    int status = W25_ERROR;
+    
+    if (result)
+        memset(result, 0, sizeof(*result));
+    
+    if (stream->session.sock >= 0 && stream->remaining == 0) {
+        if (!stream->writing) {
+            status = W25_OK;
+        } else {
+            char buffer[BUFFER_SIZE];
+            
+            if (recv_msg(stream->session.sock, buffer, BUFFER_SIZE) >= 0) {
+                status = strncmp(buffer, "ERROR", 5) == 0 ? W25_ERROR : W25_OK;
+                if (result)
+                    snprintf(result->message, sizeof(result->message), "%s", buffer);
+            } else {
+                session_close(&stream->session);
+            }
+        }
+    } else {
+        // Closed mid-transfer: the session is out of step with S1 and can't be reused
+        session_close(&stream->session);
+        if (result)
+            snprintf(result->message, sizeof(result->message), "Error: Stream closed before the transfer completed");
+    }
+    
+    if (result)
+        result->status = status;
+    
+    stream_release(stream->client, &stream->session);
+    free(stream);
+    
+    return status;
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+#ifndef LIBW25_H
+#define LIBW25_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// libw25: asynchronous client library for the w25 distributed file system.
+//
+// A W25Client keeps a pool of long-lived sessions to S1, one per worker
+// thread. Requests are queued and return immediately; each one completes
+// either through its callback (run on a worker thread) or on the completion
+// queue, which is signalled through a pollable file descriptor. Streaming
+// handles borrow a dedicated session for reading or writing one file
+// incrementally.
+//
+// Build:  gcc -c libw25.c -pthread          (link libw25.o with -pthread)
+//         gcc -shared -fPIC libw25.c -o libw25.so -pthread
+
+#define W25_OK 0
+#define W25_ERROR -1
+
+#define W25_MESSAGE_SIZE 8192
+
+typedef struct W25Client W25Client;
+typedef struct W25Request W25Request;
+typedef struct W25Stream W25Stream;
+
+// Structure to store the outcome of a request
+typedef struct {
+    int status;                     // W25_OK or W25_ERROR
+    char message[W25_MESSAGE_SIZE]; // Server reply, listing or error text
+    long bytes;                     // Payload bytes moved
+    double elapsed_ms;              // Time from dequeue to completion
+    void* data;                     // Downloaded content for w25_download_buffer
+    size_t data_len;
+    char trace_id[17];              // Trace the servers recorded the request under, see w25_trace
+} W25Result;
+
+// Structure to store client settings; zero fields take the defaults
+typedef struct {
+    const char* host;               // S1 address, default $W25_HOST or 127.0.0.1
+    int port;                       // S1 port, default $W25_PORT or 8080
+    int connections;                // Concurrent sessions, default 1
+    const char* tenant;             // QoS tenant S1 charges the sessions to, default $W25_TENANT or none
+    int direct;                     // 1 to move file content straight to and from the backends where S1
+                                    // allows it, default $W25_DIRECT or 0
+    const char* servers;            // S1 instances to spread sessions over, "host:port,host:port,...",
+                                    // default $W25_SERVERS unless host or port is given
+    const char* cache;              // Index file of downloaded copies; a download whose copy is still the
+                                    // version the servers hold is skipped, default $W25_CACHE or none
+    int delta;                      // 1 to upload only the blocks of a file that changed since the version
+                                    // the servers hold, default $W25_DELTA or 0
+} W25Options;
+
+typedef void (*W25Callback)(W25Request* request, const W25Result* result, void* user);
+typedef void (*W25FreeFn)(void* data, void* arg);
+
+// Client lifetime. w25_client_free waits for queued requests to finish.
+W25Client* w25_client_new(const W25Options* options);
+void w25_client_free(W25Client* client);
+
+// Request submission. With a callback the library owns the request and frees
+// it after the callback returns; without one the request is also placed on the
+// completion queue and must be released with w25_request_free.
+W25Request* w25_upload_file(W25Client* client, const char* local_path, const char* dest_path,
+                            W25Callback callback, void* user);
+W25Request* w25_download_file(W25Client* client, const char* remote_path, const char* local_path,
+                              W25Callback callback, void* user);
+W25Request* w25_remove(W25Client* client, const char* remote_path, W25Callback callback, void* user);
+W25Request* w25_download_tar(W25Client* client, const char* filetype, const char* local_path,
+                             W25Callback callback, void* user);
+W25Request* w25_list(W25Client* client, const char* pathname, W25Callback callback, void* user);
+
+// Server statistics: format is "text" or "json". The complete report is
+// returned in the result data (NUL-terminated); the message may be truncated.
+W25Request* w25_stats(W25Client* client, const char* format, W25Callback callback, void* user);
+
+// Recorded spans of S1 and the backends as Chrome trace event JSON, in the
+// result data. trace_id (hex, from W25Result.trace_id) selects one request;
+// NULL or "0" returns everything still in the servers' span rings.
+W25Request* w25_trace(W25Client* client, const char* trace_id, W25Callback callback, void* user);
+
+// Zero-copy buffer hand-off. w25_upload_buffer sends straight from the
+// caller's memory, which must stay valid until free_fn (if any) is called.
+// w25_download_buffer receives into one exact-size allocation whose
+// ownership moves to the caller through w25_result_take_data.
+W25Request* w25_upload_buffer(W25Client* client, const char* name, const char* dest_path,
+                              const void* data, size_t len, W25FreeFn free_fn, void* free_arg,
+                              W25Callback callback, void* user);
+W25Request* w25_download_buffer(W25Client* client, const char* remote_path,
+                                W25Callback callback, void* user);
+void* w25_result_take_data(W25Result* result, size_t* len);
+
+// Futures
+int w25_request_done(W25Request* request);
+const W25Result* w25_request_wait(W25Request* request);
+const W25Result* w25_request_result(W25Request* request);
+void* w25_request_user(W25Request* request);
+void w25_request_free(W25Request* request);
+
+// Completion queue. The fd becomes readable whenever a callback-less request
+// completes; w25_next_completed pops one without blocking, or returns NULL.
+int w25_client_fd(W25Client* client);
+W25Request* w25_next_completed(W25Client* client);
+
+// Streaming handles. A stream holds its own session until it is closed;
+// closing a stream before its full size was transferred drops that session.
+W25Stream* w25_open_read(W25Client* client, const char* remote_path, long* size, W25Result* error);
+ssize_t w25_stream_read(W25Stream* stream, void* buffer, size_t len);
+W25Stream* w25_open_write(W25Client* client, const char* name, const char* dest_path, long size,
+                          W25Result* error);
+ssize_t w25_stream_write(W25Stream* stream, const void* buffer, size_t len);
+int w25_stream_close(W25Stream* stream, W25Result* result);
+
+#endif
\ No newline at end of file
@@ -1,985 +1,3625 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <sys/wait.h>
-#include <libgen.h>
-
-#define PORT 8080
-#define S2_PORT 8081
-#define S3_PORT 8082
-#define S4_PORT 8083
-#define BUFFER_SIZE 1024
-#define MAX_FILENAME 256
-#define MAX_PATH 1024
-
-// Structure to store file information
-typedef struct {
-    char filename[MAX_FILENAME];
-    char extension[10];
-} FileInfo;
-
-// Function to create directory recursively
-void create_directory_recursive(const char* path) {
-    char temp[MAX_PATH];
-    char* p = NULL;
-    size_t len;
-    
-    snprintf(temp, sizeof(temp), "%s", path);
-    len = strlen(temp);
-    
-    if (temp[len - 1] == '/')
-        temp[len - 1] = 0;
-    
-    for (p = temp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            mkdir(temp, 0755);
-            *p = '/';
-        }
-    }
-    
-    mkdir(temp, 0755);
-}
-
-// Function to get file extension
-const char* get_file_extension(const char* filename) {
-    const char* dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return "";
-    return dot + 1;
-}
-
-// Function to connect to S2, S3 or S4
-int connect_to_server(int port) {
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return -1;
-    }
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("Invalid address/ Address not supported");
-        return -1;
-    }
-    
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Connection Failed");
-        return -1;
-    }
-    
-    return sock;
-}
-
-// Function to upload file to appropriate server based on extension
-void upload_file(int client_sock, char* filename, char* dest_path) {
-    char buffer[BUFFER_SIZE];
-    char full_path[MAX_PATH];
-    char response[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    const char* ext;
-    FILE* file;
-    struct stat st = {0};
-    long filesize;
-    int bytes_read, total_bytes = 0;
-    int server_sock = -1;
-    int port = -1;
-    
-    // First, receive the file from client
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_sock, buffer, BUFFER_SIZE, 0);
-    filesize = atol(buffer);
-    
-    snprintf(full_path, sizeof(full_path), "%s", dest_path);
-    create_directory_recursive(full_path);
-    
-    // Extract filename from the full path
-    char* base_filename = basename(filename);
-    
-    // Append filename to destination path
-    strcat(full_path, "/");
-    strcat(full_path, base_filename);
-    
-    // Open file for writing
-    file = fopen(full_path, "wb");
-    if (!file) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create file %s", full_path);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    // Tell client we're ready to receive the file content
-    strcpy(response, "READY");
-    send(client_sock, response, strlen(response), 0);
-    
-    // Receive file content
-    total_bytes = 0;
-    memset(buffer, 0, BUFFER_SIZE);
-    
-    while (total_bytes < filesize && (bytes_read = recv(client_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes_read, file);
-        total_bytes += bytes_read;
-        
-        if (total_bytes >= filesize)
-            break;
-        
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-    
-    fclose(file);
-    
-    // Get file extension
-    ext = get_file_extension(base_filename);
-    
-    // Determine if file needs to be transferred to another server
-    if (strcmp(ext, "c") == 0) {
-        // .c files stay on S1
-        snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
-    } else {
-        // Determine which server to transfer the file to
-        if (strcmp(ext, "pdf") == 0) {
-            port = S2_PORT;
-            server_sock = connect_to_server(port);
-            snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s %s", full_path, dest_path);
-        } else if (strcmp(ext, "txt") == 0) {
-            port = S3_PORT;
-            server_sock = connect_to_server(port);
-            snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s %s", full_path, dest_path);
-        } else if (strcmp(ext, "zip") == 0) {
-            port = S4_PORT;
-            server_sock = connect_to_server(port);
-            snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s %s", full_path, dest_path);
-        } else {
-            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        if (server_sock < 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        // Send command to server
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        // Wait for server to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Server not ready to receive file");
-            send(client_sock, response, strlen(response), 0);
-            close(server_sock);
-            return;
-        }
-        
-        // Send file size
-        sprintf(buffer, "%ld", filesize);
-        send(server_sock, buffer, strlen(buffer), 0);
-        
-        // Wait for server to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Server not ready to receive file content");
-            send(client_sock, response, strlen(response), 0);
-            close(server_sock);
-            return;
-        }
-        
-        // Send file content
-        file = fopen(full_path, "rb");
-        if (!file) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Cannot open file %s for reading", full_path);
-            send(client_sock, response, strlen(response), 0);
-            close(server_sock);
-            return;
-        }
-        
-        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-            send(server_sock, buffer, bytes_read, 0);
-            memset(buffer, 0, BUFFER_SIZE);
-        }
-        
-        fclose(file);
-        
-        // Get response from server
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        close(server_sock);
-        
-        // Delete the file from S1 as it has been transferred
-        remove(full_path);
-        
-        // Construct response for client
-        if (strncmp(buffer, "ERROR", 5) == 0) {
-            snprintf(response, BUFFER_SIZE, "%s", buffer);
-        } else {
-            if (strcmp(ext, "pdf") == 0) {
-                snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
-            } else if (strcmp(ext, "txt") == 0) {
-                snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
-            } else if (strcmp(ext, "zip") == 0) {
-                snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
-            }
-        }
-    }
-    
-    // Send response to client
-    send(client_sock, response, strlen(response), 0);
-}
-
-// Function to download file from appropriate server based on path
-void download_file(int client_sock, char* filename) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    const char* ext;
-    FILE* file;
-    struct stat st = {0};
-    long filesize;
-    int bytes_read, bytes_sent;
-    int server_sock = -1;
-    
-    // Extract filename and extension
-    char* base_filename = basename(filename);
-    ext = get_file_extension(base_filename);
-    
-    if (strcmp(ext, "c") == 0) {
-        // Handle .c files locally
-        if (stat(filename, &st) == -1) {
-            snprintf(response, BUFFER_SIZE, "ERROR: File %s not found", filename);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        filesize = st.st_size;
-        
-        // Send file size to client
-        sprintf(buffer, "%ld", filesize);
-        send(client_sock, buffer, strlen(buffer), 0);
-        
-        // Wait for client to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            return;
-        }
-        
-        // Send file content
-        file = fopen(filename, "rb");
-        if (!file) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Cannot open file %s", filename);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-            bytes_sent = send(client_sock, buffer, bytes_read, 0);
-            if (bytes_sent < 0) {
-                break;
-            }
-            memset(buffer, 0, BUFFER_SIZE);
-        }
-        
-        fclose(file);
-    } else {
-        // Determine which server to get the file from
-        if (strcmp(ext, "pdf") == 0) {
-            server_sock = connect_to_server(S2_PORT);
-        } else if (strcmp(ext, "txt") == 0) {
-            server_sock = connect_to_server(S3_PORT);
-        } else if (strcmp(ext, "zip") == 0) {
-            server_sock = connect_to_server(S4_PORT);
-        } else {
-            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        if (server_sock < 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        // Replace S1 with S2, S3, or S4 in the path
-        char modified_path[MAX_PATH];
-        strcpy(modified_path, filename);
-        
-        if (strncmp(modified_path, "~/S1", 4) == 0) {
-            if (strcmp(ext, "pdf") == 0) {
-                modified_path[3] = '2';  // Replace S1 with S2
-            } else if (strcmp(ext, "txt") == 0) {
-                modified_path[3] = '3';  // Replace S1 with S3
-            } else if (strcmp(ext, "zip") == 0) {
-                modified_path[3] = '4';  // Replace S1 with S4
-            }
-        }
-        
-        // Send request to server
-        snprintf(cmd, BUFFER_SIZE, "SEND_FILE %s", modified_path);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        // Get file size from server
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strncmp(buffer, "ERROR", 5) == 0) {
-            send(client_sock, buffer, strlen(buffer), 0);
-            close(server_sock);
-            return;
-        }
-        
-        filesize = atol(buffer);
-        
-        // Send file size to client
-        send(client_sock, buffer, strlen(buffer), 0);
-        
-        // Wait for client to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            close(server_sock);
-            return;
-        }
-        
-        // Tell server we're ready
-        strcpy(buffer, "READY");
-        send(server_sock, buffer, strlen(buffer), 0);
-        
-        // Forward file content from server to client
-        long total_received = 0;
-        
-        while (total_received < filesize) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
-            
-            if (bytes_read <= 0)
-                break;
-            
-            bytes_sent = send(client_sock, buffer, bytes_read, 0);
-            if (bytes_sent < 0)
-                break;
-            
-            total_received += bytes_read;
-        }
-        
-        close(server_sock);
-    }
-}
-
-// Function to remove file from appropriate server based on path
-void remove_file(int client_sock, char* filename) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    const char* ext;
-    int server_sock = -1;
-    
-    // Extract filename and extension
-    char* base_filename = basename(filename);
-    ext = get_file_extension(base_filename);
-    
-    if (strcmp(ext, "c") == 0) {
-        // Handle .c files locally
-        if (remove(filename) != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file %s", filename);
-        } else {
-            snprintf(response, BUFFER_SIZE, "File %s removed successfully", filename);
-        }
-        
-        send(client_sock, response, strlen(response), 0);
-    } else {
-        // Determine which server to connect to
-        if (strcmp(ext, "pdf") == 0) {
-            server_sock = connect_to_server(S2_PORT);
-        } else if (strcmp(ext, "txt") == 0) {
-            server_sock = connect_to_server(S3_PORT);
-        } else if (strcmp(ext, "zip") == 0) {
-            server_sock = connect_to_server(S4_PORT);
-        } else {
-            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        if (server_sock < 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        // Replace S1 with S2, S3, or S4 in the path
-        char modified_path[MAX_PATH];
-        strcpy(modified_path, filename);
-        
-        if (strncmp(modified_path, "~/S1", 4) == 0) {
-            if (strcmp(ext, "pdf") == 0) {
-                modified_path[3] = '2';  // Replace S1 with S2
-            } else if (strcmp(ext, "txt") == 0) {
-                modified_path[3] = '3';  // Replace S1 with S3
-            } else if (strcmp(ext, "zip") == 0) {
-                modified_path[3] = '4';  // Replace S1 with S4
-            }
-        }
-        
-        // Send request to server
-        snprintf(cmd, BUFFER_SIZE, "REMOVE_FILE %s", modified_path);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        // Get response from server
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        close(server_sock);
-        
-        // Forward response to client
-        send(client_sock, buffer, strlen(buffer), 0);
-    }
-}
-
-// Function to download tar file of specified file type
-void download_tar(int client_sock, char* filetype) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    char tar_path[MAX_PATH];
-    FILE* file;
-    long filesize;
-    int bytes_read, bytes_sent;
-    int server_sock = -1;
-    
-    if (strcmp(filetype, "c") == 0) {
-        // Create tar of .c files locally
-        sprintf(tar_path, "/tmp/cfiles.tar");
-        sprintf(cmd, "find ~/S1 -name \"*.c\" -type f | tar -cf %s -T -", tar_path);
-        
-        if (system(cmd) != 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to create tar of .c files");
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        // Get file size
-        struct stat st;
-        if (stat(tar_path, &st) == -1) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to get tar file size");
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        filesize = st.st_size;
-        
-        // Send file size to client
-        sprintf(buffer, "%ld", filesize);
-        send(client_sock, buffer, strlen(buffer), 0);
-        
-        // Wait for client to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            return;
-        }
-        
-        // Send file content
-        file = fopen(tar_path, "rb");
-        if (!file) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Cannot open tar file");
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-            bytes_sent = send(client_sock, buffer, bytes_read, 0);
-            if (bytes_sent < 0) {
-                break;
-            }
-            memset(buffer, 0, BUFFER_SIZE);
-        }
-        
-        fclose(file);
-        remove(tar_path);  // Clean up
-    } else {
-        // Determine which server to connect to
-        if (strcmp(filetype, "pdf") == 0) {
-            server_sock = connect_to_server(S2_PORT);
-        } else if (strcmp(filetype, "txt") == 0) {
-            server_sock = connect_to_server(S3_PORT);
-        } else {
-            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type: %s", filetype);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        if (server_sock < 0) {
-            snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for file type %s", filetype);
-            send(client_sock, response, strlen(response), 0);
-            return;
-        }
-        
-        // Send request to server
-        snprintf(cmd, BUFFER_SIZE, "SEND_TAR %s", filetype);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        // Get file size from server
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strncmp(buffer, "ERROR", 5) == 0) {
-            send(client_sock, buffer, strlen(buffer), 0);
-            close(server_sock);
-            return;
-        }
-        
-        filesize = atol(buffer);
-        
-        // Send file size to client
-        send(client_sock, buffer, strlen(buffer), 0);
-        
-        // Wait for client to be ready
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strcmp(buffer, "READY") != 0) {
-            close(server_sock);
-            return;
-        }
-        
-        // Tell server we're ready
-        strcpy(buffer, "READY");
-        send(server_sock, buffer, strlen(buffer), 0);
-        
-        // Forward file content from server to client
-        long total_received = 0;
-        
-        while (total_received < filesize) {
-            memset(buffer, 0, BUFFER_SIZE);
-            bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
-            
-            if (bytes_read <= 0)
-                break;
-            
-            bytes_sent = send(client_sock, buffer, bytes_read, 0);
-            if (bytes_sent < 0)
-                break;
-            
-            total_received += bytes_read;
-        }
-        
-        close(server_sock);
-    }
-}
-
-// Function to compare two file infos for sorting alphabetically
-int compare_file_info(const void* a, const void* b) {
-    return strcmp(((FileInfo*)a)->filename, ((FileInfo*)b)->filename);
-}
-
-// Function to display file names in specified path
-void display_filenames(int client_sock, char* pathname) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE * 8]; // Larger buffer for collected filenames
-    char cmd[BUFFER_SIZE];
-    DIR* dir;
-    struct dirent* ent;
-    int server_sock;
-    
-    // Check if directory exists
-    dir = opendir(pathname);
-    if (!dir) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Directory %s not found", pathname);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    closedir(dir);
-    
-    // Get .c files from S1
-    FileInfo* files = NULL;
-    int file_count = 0;
-    int max_files = 100; // Initial capacity
-    
-    files = (FileInfo*)malloc(max_files * sizeof(FileInfo));
-    if (!files) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    // Get local .c files
-    dir = opendir(pathname);
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_REG) {
-            const char* ext = get_file_extension(ent->d_name);
-            if (strcmp(ext, "c") == 0) {
-                if (file_count >= max_files) {
-                    max_files *= 2;
-                    files = (FileInfo*)realloc(files, max_files * sizeof(FileInfo));
-                    if (!files) {
-                        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
-                        send(client_sock, response, strlen(response), 0);
-                        closedir(dir);
-                        return;
-                    }
-                }
-                
-                strcpy(files[file_count].filename, ent->d_name);
-                strcpy(files[file_count].extension, "c");
-                file_count++;
-            }
-        }
-    }
-    closedir(dir);
-    
-    // Replace S1 with S2, S3, and S4 in the path to get files from other servers
-    char modified_path[MAX_PATH];
-    
-    // Get .pdf files from S2
-    strcpy(modified_path, pathname);
-    if (strncmp(modified_path, "~/S1", 4) == 0) {
-        modified_path[3] = '2';  // Replace S1 with S2
-    }
-    
-    server_sock = connect_to_server(S2_PORT);
-    if (server_sock >= 0) {
-        snprintf(cmd, BUFFER_SIZE, "LIST_FILES %s pdf", modified_path);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strncmp(buffer, "ERROR", 5) != 0) {
-            // Parse the response
-            char* token = strtok(buffer, ",");
-            while (token != NULL) {
-                if (file_count >= max_files) {
-                    max_files *= 2;
-                    files = (FileInfo*)realloc(files, max_files * sizeof(FileInfo));
-                    if (!files) {
-                        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
-                        send(client_sock, response, strlen(response), 0);
-                        close(server_sock);
-                        return;
-                    }
-                }
-                
-                strcpy(files[file_count].filename, token);
-                strcpy(files[file_count].extension, "pdf");
-                file_count++;
-                
-                token = strtok(NULL, ",");
-            }
-        }
-        
-        close(server_sock);
-    }
-    
-    // Get .txt files from S3
-    strcpy(modified_path, pathname);
-    if (strncmp(modified_path, "~/S1", 4) == 0) {
-        modified_path[3] = '3';  // Replace S1 with S3
-    }
-    
-    server_sock = connect_to_server(S3_PORT);
-    if (server_sock >= 0) {
-        snprintf(cmd, BUFFER_SIZE, "LIST_FILES %s txt", modified_path);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strncmp(buffer, "ERROR", 5) != 0) {
-            // Parse the response
-            char* token = strtok(buffer, ",");
-            while (token != NULL) {
-                if (file_count >= max_files) {
-                    max_files *= 2;
-                    files = (FileInfo*)realloc(files, max_files * sizeof(FileInfo));
-                    if (!files) {
-                        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
-                        send(client_sock, response, strlen(response), 0);
-                        close(server_sock);
-                        return;
-                    }
-                }
-                
-                strcpy(files[file_count].filename, token);
-                strcpy(files[file_count].extension, "txt");
-                file_count++;
-                
-                token = strtok(NULL, ",");
-            }
-        }
-        
-        close(server_sock);
-    }
-    
-    // Get .zip files from S4
-    strcpy(modified_path, pathname);
-    if (strncmp(modified_path, "~/S1", 4) == 0) {
-        modified_path[3] = '4';  // Replace S1 with S4
-    }
-    
-    server_sock = connect_to_server(S4_PORT);
-    if (server_sock >= 0) {
-        snprintf(cmd, BUFFER_SIZE, "LIST_FILES %s zip", modified_path);
-        send(server_sock, cmd, strlen(cmd), 0);
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        recv(server_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (strncmp(buffer, "ERROR", 5) != 0) {
-            // Parse the response
-            char* token = strtok(buffer, ",");
-            while (token != NULL) {
-                if (file_count >= max_files) {
-                    max_files *= 2;
-                    files = (FileInfo*)realloc(files, max_files * sizeof(FileInfo));
-                    if (!files) {
-                        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
-                        send(client_sock, response, strlen(response), 0);
-                        close(server_sock);
-                        return;
-                    }
-                }
-                
-                strcpy(files[file_count].filename, token);
-                strcpy(files[file_count].extension, "zip");
-                file_count++;
-                
-                token = strtok(NULL, ",");
-            }
-        }
-        
-        close(server_sock);
-    }
-    
-    // Sort files by extension group and then alphabetically
-    qsort(files, file_count, sizeof(FileInfo), compare_file_info);
-    
-    // Build response
-    memset(response, 0, BUFFER_SIZE * 8);
-    
-    if (file_count == 0) {
-        strcpy(response, "No files found in the specified directory");
-    } else {
-        // Add .c files first
-        // Add .c files first
-        strcat(response, "Files in directory:\n");
-        
-        // Group files by extension and list them in order: .c, .pdf, .txt, .zip
-        char current_ext[10];
-        
-        // Process .c files
-        strcpy(current_ext, "c");
-        for (int i = 0; i < file_count; i++) {
-            if (strcmp(files[i].extension, current_ext) == 0) {
-                strcat(response, files[i].filename);
-                strcat(response, "\n");
-            }
-        }
-        
-        // Process .pdf files
-        strcpy(current_ext, "pdf");
-        for (int i = 0; i < file_count; i++) {
-            if (strcmp(files[i].extension, current_ext) == 0) {
-                strcat(response, files[i].filename);
-                strcat(response, "\n");
-            }
-        }
-        
-        // Process .txt files
-        strcpy(current_ext, "txt");
-        for (int i = 0; i < file_count; i++) {
-            if (strcmp(files[i].extension, current_ext) == 0) {
-                strcat(response, files[i].filename);
-                strcat(response, "\n");
-            }
-        }
-        
-        // Process .zip files
-        strcpy(current_ext, "zip");
-        for (int i = 0; i < file_count; i++) {
-            if (strcmp(files[i].extension, current_ext) == 0) {
-                strcat(response, files[i].filename);
-                strcat(response, "\n");
-            }
-        }
-    }
-    
-    free(files);
-    
-    // Send response to client
-    send(client_sock, response, strlen(response), 0);
-}
-
-// Function to handle client
-void prcclient(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    char cmd[32], arg1[MAX_PATH], arg2[MAX_PATH];
-    int read_size;
-    
-    while (1) {
-        // Clear buffers
-        memset(buffer, 0, BUFFER_SIZE);
-        memset(response, 0, BUFFER_SIZE);
-        memset(cmd, 0, sizeof(cmd));
-        memset(arg1, 0, sizeof(arg1));
-        memset(arg2, 0, sizeof(arg2));
-        
-        // Receive command from client
-        read_size = recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (read_size <= 0) {
-            // Client disconnected or error
-            break;
-        }
-        
-        printf("Received command: %s\n", buffer);
-        
-        // Parse command
-        int args = sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
-        
-        if (strcmp(cmd, "uploadf") == 0) {
-            // Upload file
-            if (args < 3) {
-                strcpy(response, "ERROR: Invalid command syntax. Usage: uploadf filename destination_path");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                upload_file(client_sock, arg1, arg2);
-            }
-        } else if (strcmp(cmd, "downlf") == 0) {
-            // Download file
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax. Usage: downlf filename");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                download_file(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "removef") == 0) {
-            // Remove file
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax. Usage: removef filename");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                remove_file(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "downltar") == 0) {
-            // Download tar
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax. Usage: downltar filetype");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                download_tar(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "dispfnames") == 0) {
-            // Display filenames
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax. Usage: dispfnames pathname");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                display_filenames(client_sock, arg1);
-            }
-        } else {
-            // Unknown command
-            strcpy(response, "ERROR: Unknown command");
-            send(client_sock, response, strlen(response), 0);
-        }
-    }
-    
-    // Clean up
-    close(client_sock);
-}
-
-int main() {
-    int server_fd, client_sock;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-    pid_t pid;
-    
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
-    
-    // Bind socket to port
-    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Listen for connections
-    if (listen(server_fd, 10) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    printf("Server S1 started. Listening on port %d...\n", PORT);
-    
-    // Create ~/S1 directory if it doesn't exist
-    char s1_dir[MAX_PATH];
-    snprintf(s1_dir, sizeof(s1_dir), "%s/S1", getenv("HOME"));
-    mkdir(s1_dir, 0755);
-    
-    // Accept connections and fork for each client
-    while (1) {
-        if ((client_sock = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept failed");
-            continue;
-        }
-        
-        printf("New client connected\n");
-        
-        // Fork to handle client
-        pid = fork();
-        
-        if (pid < 0) {
-            perror("fork failed");
-            close(client_sock);
-        } else if (pid == 0) {
-            // Child process
-            close(server_fd);
-            prcclient(client_sock);
-            exit(0);
-        } else {
-            // Parent process
-            close(client_sock);
-        }
-    }
-    
-    return 0;
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+
+#include "dfs_stats.h"
+#include "dfs_trace.h"
+#include "dfs_log.h"
+#include "dfs_route.h"
+#include "dfs_ec.h"
+#include "dfs_backend.h"
+#include "dfs_spool.h"
+#include "dfs_qos.h"
+#include "dfs_workers.h"
+#include "dfs_admit.h"
+#include "dfs_local.h"
+#include "dfs_token.h"
+#include "dfs_cache.h"
+#include "dfs_flight.h"
+#include "dfs_version.h"
+#include "dfs_delta.h"
+
+#define PORT 8080
+#define S2_PORT 8081
+#define S3_PORT 8082
+#define S4_PORT 8083
+#define BUFFER_SIZE 1024
+#define MAX_FILENAME 256
+#define MAX_PATH 1024
+#define CONFIG_ERROR_SIZE (2 * MAX_PATH + 128)  // Room for a config file's path and one of its lines
+#define SESSION_IDLE_TIMEOUT 60   // Seconds a client session may stay silent before it is closed
+#define REPLICA_TIMEOUT 10        // Seconds to wait for replicas to acknowledge an upload
+#define EC_MAGIC "W25EC1"         // First word of the manifest of an erasure-coded file
+#define EC_MANIFEST_SUFFIX ".ecm"   // Added to a file's name to name its manifest
+#define EC_MANIFEST_MAX BUFFER_SIZE
+#define HEDGE_PERCENTILE 95       // Default percentile of a backend's answer time after which reads are hedged
+#define CONNECT_TIMEOUT_MS 1000   // Longest wait for a backend to accept a connection
+#define BACKEND_IO_TIMEOUT 30     // Seconds a backend may leave a send or receive hanging
+#define HEALTH_INTERVAL_MS 1000   // Default time between health probes of every backend
+#define SPOOL_IDLE_US 20000       // Forwarder's nap when nothing in the spool is due
+#define TRANSFER_LIMIT 64         // Default bound on the transfers S1 admits at once
+#define SESSION_RETRY_MS 1000     // Retry hint for clients turned away with every session process busy
+#define SENDFILE_CHUNK 65536      // Bytes sendfile moves to a client between two charges to its tenant
+#define DIRECT_REPLY_SIZE 4096    // Room for the backends and signed commands of a direct transfer
+
+// Commands measured in the statistics region
+static const char* stats_ops[] = { "uploadf", "downlf", "removef", "downltar", "dispfnames", "locatef", "placef", "commitf",
+                                    "signf", "deltaf" };
+
+// Structure to store file information
+typedef struct {
+    char filename[MAX_FILENAME];
+    char extension[10];
+} FileInfo;
+
+// Structure to store the manifest of an erasure-coded file
+typedef struct {
+    int data, parity;
+    long filesize;
+    ServerAddr shards[EC_MAX_SHARDS];   // Where shard i was stored
+} EcManifest;
+
+char storage_root[MAX_PATH];    // Directory that ~/S1 paths are stored under
+char route_config[MAX_PATH];    // Routing table file, empty for the built-in table
+char qos_config[MAX_PATH];      // Tenant limits file, empty for no limits
+volatile sig_atomic_t reload_requested;
+pid_t spool_forwarder;          // Process forwarding the upload spool, 0 without write-behind
+
+// Function to create directory recursively
+void create_directory_recursive(const char* path) {
+    char temp[MAX_PATH];
+    char* p = NULL;
+    size_t len;
+    
+    snprintf(temp, sizeof(temp), "%s", path);
+    len = strlen(temp);
+    
+    if (temp[len - 1] == '/')
+        temp[len - 1] = 0;
+    
+    for (p = temp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(temp, 0755);
+            *p = '/';
+        }
+    }
+    
+    mkdir(temp, 0755);
+}
+
+// Function to map a ~/S1 path onto the storage root
+void resolve_path(const char* path, char* out, size_t size) {
+    if (strncmp(path, "~/S1", 4) == 0 && (path[4] == '/' || path[4] == 0)) {
+        snprintf(out, size, "%s%s", storage_root, path + 4);
+    } else {
+        snprintf(out, size, "%s", path);
+    }
+}
+
+// Function to get file extension
+const char* get_file_extension(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+        return "";
+    return dot + 1;
+}
+
+// Function to tell whether files with extension ext live on S1's own disk:
+// .c files, unless the routing table sends them to a pool like the rest
+int stored_on_s1(const char* ext) {
+    return strcmp(ext, "c") == 0 && !route_find(&route_table, "c");
+}
+
+// Function to send exactly len bytes
+int send_all(int sock, const void* data, size_t len) {
+    const char* p = data;
+    
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Function to receive exactly len bytes
+int recv_all(int sock, void* data, size_t len) {
+    char* p = data;
+    
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+// Function to account for n bytes moved to or from the client
+void charge_client(long n) {
+    qos_charge(n);
+    admit_charge(n);
+}
+
+// Function to send a length-prefixed control message to the client
+int send_msg(int sock, const char* msg) {
+    uint32_t len = htonl(strlen(msg));
+    
+    // Every failed command reports back through an ERROR reply
+    if (strncmp(msg, "ERROR", 5) == 0)
+        stats_error();
+    
+    if (send_all(sock, &len, sizeof(len)) < 0)
+        return -1;
+    return send_all(sock, msg, strlen(msg));
+}
+
+// Function to receive a length-prefixed control message, truncating it to fit the buffer
+int recv_msg(int sock, char* buffer, size_t size) {
+    uint32_t len;
+    char discard[BUFFER_SIZE];
+    
+    memset(buffer, 0, size);
+    if (recv_all(sock, &len, sizeof(len)) < 0)
+        return -1;
+    len = ntohl(len);
+    
+    size_t keep = len < size - 1 ? len : size - 1;
+    if (recv_all(sock, buffer, keep) < 0)
+        return -1;
+    
+    // Drain whatever did not fit so the stream stays aligned on message boundaries
+    for (size_t left = len - keep; left > 0; ) {
+        size_t chunk = left < sizeof(discard) ? left : sizeof(discard);
+        if (recv_all(sock, discard, chunk) < 0)
+            return -1;
+        left -= chunk;
+    }
+    
+    return (int)keep;
+}
+
+// Function to send a command to a backend, carrying the current trace
+int send_command(int server_sock, const char* cmd) {
+    char traced[BUFFER_SIZE + 128];
+    int len = trace_prefix(traced, sizeof(traced));
+    
+    // Signed when S1 shares a key with the backends, see dfs_token.h
+    token_sign(cmd, traced + len, sizeof(traced) - len);
+    return send(server_sock, traced, strlen(traced), 0);
+}
+
+// Function to connect to S2, S3 or S4, over its Unix socket if it is on this
+// host (see dfs_local.h). Fails at once while the backend's circuit breaker
+// is open, and within CONNECT_TIMEOUT_MS otherwise.
+int connect_to_server(const ServerAddr* server) {
+    int sock = 0;
+    struct sockaddr_in serv_addr;
+    uint64_t t = stats_now();
+    uint64_t start_us = trace_now_us();
+    char detail[80];
+    BackendState* backend = backend_lookup(server);
+    
+    if (!backend_allow(backend)) {
+        snprintf(detail, sizeof(detail), "%s:%d", server->host, server->port);
+        log_event(LOG_DEBUG, "backend_skipped", detail, 0);
+        return -1;
+    }
+    
+    int local = (sock = local_connect(server->host, server->port)) >= 0;
+    int failed = 0;
+    
+    if (!local) {
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            log_event(LOG_ERROR, "socket_failed", strerror(errno), errno);
+            return -1;
+        }
+        
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_port = htons(server->port);
+        
+        if (inet_pton(AF_INET, server->host, &serv_addr.sin_addr) <= 0) {
+            log_event(LOG_ERROR, "invalid_backend_address", server->host, server->port);
+            close(sock);
+            return -1;
+        }
+        
+        failed = backend_connect(sock, &serv_addr, CONNECT_TIMEOUT_MS) < 0;
+    }
+    
+    stats_add(STATS_CONNECT, t);
+    snprintf(detail, sizeof(detail), "%s:%d%s%s", server->host, server->port, local ? " unix" : "",
+             failed ? " failed" : "");
+    trace_span("connect", start_us, trace_now_us(), detail, NULL);
+    
+    if (failed) {
+        log_event(LOG_WARN, "backend_connect_failed", detail, errno);
+        backend_failure(backend);
+        close(sock);
+        return -1;
+    }
+    
+    // A backend that stops answering ends the request instead of the session hanging on it
+    struct timeval timeout = { BACKEND_IO_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    return sock;
+}
+
+// Function to list servers in the order a session takes them in: a backend
+// serves one connection at a time, so a session holds every backend it has
+// connected to, and taking them in address order keeps two sessions from each
+// holding one the other waits for
+void sort_servers(const ServerAddr** servers, int count, int* visit) {
+    for (int i = 0; i < count; i++) {
+        int k = i;
+        for (; k > 0 && route_compare_addr(servers[i], servers[visit[k - 1]]) < 0; k--)
+            visit[k] = visit[k - 1];
+        visit[k] = i;
+    }
+}
+
+// Function to start an upload of size bytes on each server, each taken only
+// once the previous one answered. Servers that fail get -1 in socks. With a
+// file (fd not -1) holding the content at offset, a server on this host is
+// handed the file along with the size and copies it itself; passed marks
+// those, which need no content sent.
+void open_uploads(const ServerAddr** servers, const char** cmds, int count, long size, int fd, long offset, int* socks,
+                  int* passed, char* response) {
+    char buffer[BUFFER_SIZE];
+    int visit[ROUTE_MAX_BACKENDS];
+    uint64_t t = stats_now();
+    
+    sort_servers(servers, count, visit);
+    for (int v = 0; v < count; v++) {
+        int i = visit[v];
+        
+        socks[i] = connect_to_server(servers[i]);
+        if (passed)
+            passed[i] = 0;
+        if (socks[i] < 0)
+            continue;
+        
+        send_command(socks[i], cmds[i]);
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(socks[i], buffer, BUFFER_SIZE - 1, 0);
+        if (strcmp(buffer, "READY") != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Server not ready to receive file");
+            close(socks[i]);
+            socks[i] = -1;
+        }
+    }
+    
+    // Announce the size to all of them at once
+    for (int i = 0; i < count; i++) {
+        if (socks[i] < 0)
+            continue;
+        
+        if (fd >= 0 && passed && local_is_unix(socks[i])) {
+            sprintf(buffer, "%ld %ld", size, offset);
+            passed[i] = local_send_fd(socks[i], buffer, fd) >= 0;
+        } else {
+            sprintf(buffer, "%ld", size);
+            send(socks[i], buffer, strlen(buffer), 0);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (socks[i] < 0)
+            continue;
+        
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(socks[i], buffer, BUFFER_SIZE - 1, 0);
+        if (strcmp(buffer, "READY") != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Server not ready to receive file content");
+            close(socks[i]);
+            socks[i] = -1;
+        }
+    }
+    stats_add(STATS_NETWORK, t);
+}
+
+// Function to collect the acknowledgments of started uploads in whatever
+// order they arrive, up to REPLICA_TIMEOUT. With a client socket, success is
+// sent to it as soon as quorum of them are in while stragglers keep writing.
+// Closes every socket; returns how many uploads were stored.
+int collect_acks(int* socks, int count, int quorum, int client_sock, const char* success, char* response) {
+    char buffer[BUFFER_SIZE];
+    int acked = 0, answered = 0;
+    uint64_t t = stats_now();
+    uint64_t deadline = t + REPLICA_TIMEOUT * 1000000000ULL;
+    
+    while (1) {
+        struct pollfd pfds[ROUTE_MAX_BACKENDS];
+        int slots[ROUTE_MAX_BACKENDS];
+        int waiting = 0;
+        
+        for (int i = 0; i < count; i++) {
+            if (socks[i] >= 0) {
+                pfds[waiting].fd = socks[i];
+                pfds[waiting].events = POLLIN;
+                slots[waiting++] = i;
+            }
+        }
+        
+        uint64_t now = stats_now();
+        if (waiting == 0 || now >= deadline)
+            break;
+        int ready = poll(pfds, waiting, (int)((deadline - now) / 1000000) + 1);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready <= 0)
+            break;
+        
+        for (int k = 0; k < waiting; k++) {
+            if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            
+            int i = slots[k];
+            memset(buffer, 0, BUFFER_SIZE);
+            if (recv(socks[i], buffer, BUFFER_SIZE - 1, 0) > 0 && strncmp(buffer, "ERROR", 5) != 0) {
+                acked++;
+            } else if (buffer[0]) {
+                snprintf(response, BUFFER_SIZE, "%s", buffer);
+            }
+            close(socks[i]);
+            socks[i] = -1;
+        }
+        
+        if (client_sock >= 0 && !answered && acked >= quorum) {
+            stats_add(STATS_NETWORK, t);
+            send_msg(client_sock, success);
+            answered = 1;
+            t = stats_now();
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        if (socks[i] >= 0)
+            close(socks[i]);
+    }
+    if (!answered)
+        stats_add(STATS_NETWORK, t);
+    
+    return acked;
+}
+
+// Function to write filesize bytes of a staged upload, from where file is
+// positioned, to every replica of its path at once and answer the client as
+// soon as a write quorum has stored it. Replicas that are still busy after
+// that are waited for, up to REPLICA_TIMEOUT, so the session's next command
+// never overlaps them. Returns 0 if the quorum was reached, otherwise -1.
+int replicate_upload(int client_sock, FILE* file, long filesize, RoutePool* pool, const char* full_path,
+                     const char* cmd, const char* base_filename) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char success[BUFFER_SIZE];
+    int order[ROUTE_MAX_BACKENDS];
+    int socks[ROUTE_MAX_BACKENDS];
+    const ServerAddr* servers[ROUTE_MAX_BACKENDS];
+    const char* cmds[ROUTE_MAX_BACKENDS];
+    int passed[ROUTE_MAX_BACKENDS];
+    int bytes_read, streamed = 0;
+    long left = filesize;
+    uint64_t t;
+    
+    int count = route_candidates(pool, full_path, order, pool->replicas);
+    int quorum = pool->write_quorum < count ? pool->write_quorum : count;
+    
+    snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for %s", base_filename);
+    snprintf(success, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
+    
+    for (int i = 0; i < count; i++) {
+        servers[i] = &pool->backends[order[i]];
+        cmds[i] = cmd;
+    }
+    open_uploads(servers, cmds, count, filesize, fileno(file), ftell(file), socks, passed, response);
+    
+    // Replicas on this host copy the file themselves; the rest get it
+    // streamed chunk by chunk, so the copies travel side by side instead of
+    // one after another
+    for (int i = 0; i < count; i++) {
+        streamed += socks[i] >= 0 && !passed[i];
+    }
+    
+    while (streamed > 0 && left > 0) {
+        t = stats_now();
+        bytes_read = fread(buffer, 1, left < BUFFER_SIZE ? left : BUFFER_SIZE, file);
+        stats_add(STATS_DISK, t);
+        if (bytes_read <= 0)
+            break;
+        left -= bytes_read;
+        
+        t = stats_now();
+        for (int i = 0; i < count; i++) {
+            if (socks[i] >= 0 && !passed[i] && send_all(socks[i], buffer, bytes_read) < 0) {
+                close(socks[i]);
+                socks[i] = -1;
+            }
+        }
+        stats_add(STATS_NETWORK, t);
+    }
+    
+    int acked = collect_acks(socks, count, quorum, client_sock, success, response);
+    
+    if (acked < quorum) {
+        if (count > 1 && acked > 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Only %d of %d replicas stored %s", acked, count, base_filename);
+        }
+        send_msg(client_sock, response);
+    }
+    
+    // Missing copies are only logged; the file stays readable from the others
+    if (acked < count && acked > 0) {
+        log_event(LOG_WARN, "under_replicated", full_path, acked);
+    }
+    
+    return acked >= quorum ? 0 : -1;
+}
+
+// Function to remove a path from every backend of a pool that may hold it,
+// the owner first. response, if not NULL, gets the first success, or the
+// owner's error if no backend had it. Returns how many backends removed it.
+int remove_copies(const RoutePool* pool, const char* full_path, const char* backend_path, char* response) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    int order[ROUTE_MAX_BACKENDS];
+    int removed = 0;
+    
+    snprintf(cmd, BUFFER_SIZE, "REMOVE_FILE %s", backend_path);
+    
+    // Older copies may still sit on backends that owned the path before the
+    // pool grew, so every backend is asked
+    int candidates = route_candidates(pool, full_path, order, ROUTE_MAX_BACKENDS);
+    
+    for (int i = 0; i < candidates; i++) {
+        int server_sock = connect_to_server(&pool->backends[order[i]]);
+        if (server_sock < 0)
+            continue;
+        
+        // Send request to server
+        uint64_t t = stats_now();
+        send_command(server_sock, cmd);
+        
+        // Get response from server
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(server_sock, buffer, BUFFER_SIZE - 1, 0);
+        stats_add(STATS_NETWORK, t);
+        
+        close(server_sock);
+        
+        if (strncmp(buffer, "ERROR", 5) != 0) {
+            if (!removed && response)
+                snprintf(response, BUFFER_SIZE, "%s", buffer);
+            removed++;
+        } else if (i == 0 && response) {
+            snprintf(response, BUFFER_SIZE, "%s", buffer);
+        }
+    }
+    
+    return removed;
+}
+
+// Function to write the manifest of an erasure-coded file: the stripe layout,
+// the file size and where each shard went
+int ec_format_manifest(const EcManifest* manifest, char* out, size_t size) {
+    int len = snprintf(out, size, "%s %d %d %ld", EC_MAGIC, manifest->data, manifest->parity, manifest->filesize);
+    
+    for (int i = 0; i < manifest->data + manifest->parity && len < (int)size; i++)
+        len += snprintf(out + len, size - len, " %s:%d", manifest->shards[i].host, manifest->shards[i].port);
+    if (len < (int)size)
+        len += snprintf(out + len, size - len, "\n");
+    
+    return len < (int)size ? len : -1;
+}
+
+// Function to parse the manifest of an erasure-coded file of pool; -1 if it
+// is malformed or places a shard anywhere but on a backend of the pool
+int ec_parse_manifest(const char* text, long len, const RoutePool* pool, EcManifest* manifest) {
+    char copy[EC_MANIFEST_MAX];
+    char* save;
+    int count = 0;
+    
+    if (pool->ec_data == 0 || len <= 0 || len >= EC_MANIFEST_MAX || strncmp(text, EC_MAGIC " ", strlen(EC_MAGIC) + 1) != 0)
+        return -1;
+    
+    memcpy(copy, text, len);
+    copy[len] = 0;
+    if (copy[len - 1] != '\n' || sscanf(copy, EC_MAGIC " %d %d %ld", &manifest->data, &manifest->parity, &manifest->filesize) != 3)
+        return -1;
+    if (manifest->data < 1 || manifest->parity < 1 || manifest->data + manifest->parity > EC_MAX_SHARDS || manifest->filesize < 0)
+        return -1;
+    
+    // The shard holders follow the three numbers
+    strtok_r(copy, " \n", &save);
+    for (int i = 0; i < 3; i++)
+        strtok_r(NULL, " \n", &save);
+    for (char* w = strtok_r(NULL, " \n", &save); w; w = strtok_r(NULL, " \n", &save)) {
+        int b = 0;
+        if (count == manifest->data + manifest->parity || route_parse_addr(w, &manifest->shards[count]) < 0)
+            return -1;
+        while (b < pool->backend_count && route_compare_addr(&pool->backends[b], &manifest->shards[count]) != 0)
+            b++;
+        if (b == pool->backend_count)
+            return -1;
+        count++;
+    }
+    
+    return count == manifest->data + manifest->parity ? 0 : -1;
+}
+
+// Function to erasure-code a staged upload: its k data and m parity shards
+// are streamed to k+m backends of the path's ring at once, each shard stored
+// as <name>.<shard>.ec, and once at least k + 1 of them are stored a manifest
+// is stored as <name>.ecm on the replicas of the name. Reads then need any k
+// shards. The file is read from where it is positioned. Returns 0 once the
+// manifest, which is also left in manifest, is stored, otherwise -1.
+int ec_upload(int client_sock, FILE* file, long filesize, RoutePool* pool, const char* full_path,
+               const char* dest_path, const char* base_filename, EcManifest* manifest) {
+    char response[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    char shard_cmds[EC_MAX_SHARDS][BUFFER_SIZE];
+    const char* cmds[EC_MAX_SHARDS];
+    const ServerAddr* servers[EC_MAX_SHARDS];
+    int order[ROUTE_MAX_BACKENDS];
+    int socks[EC_MAX_SHARDS];
+    uint8_t* stripe;
+    uint8_t* chunks[EC_MAX_SHARDS];
+    uint64_t t;
+    
+    int k = pool->ec_data, m = pool->ec_parity, n = k + m;
+    long shard_size = ec_shard_size(k, filesize);
+    
+    route_candidates(pool, full_path, order, n);
+    snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for %s", base_filename);
+    
+    stripe = malloc((size_t)n * EC_CHUNK);
+    if (!stripe) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
+        send_msg(client_sock, response);
+        return -1;
+    }
+    
+    manifest->data = k;
+    manifest->parity = m;
+    manifest->filesize = filesize;
+    for (int i = 0; i < n; i++) {
+        manifest->shards[i] = pool->backends[order[i]];
+        servers[i] = &pool->backends[order[i]];
+        chunks[i] = stripe + (size_t)i * EC_CHUNK;
+        snprintf(shard_cmds[i], BUFFER_SIZE, "RECV_FILE %s.%d.ec %s", full_path, i, dest_path);
+        cmds[i] = shard_cmds[i];
+    }
+    open_uploads(servers, cmds, n, shard_size, -1, 0, socks, NULL, response);
+    
+    // Stripe by stripe: k chunks of the file, zero padded at the end, and the
+    // m parity chunks computed from them
+    ec_init();
+    
+    for (long done = 0, left = filesize; done < shard_size; done += EC_CHUNK) {
+        t = stats_now();
+        size_t got = fread(stripe, 1, left < (long)k * EC_CHUNK ? (size_t)left : (size_t)k * EC_CHUNK, file);
+        left -= got;
+        stats_add(STATS_DISK, t);
+        memset(stripe + got, 0, (size_t)k * EC_CHUNK - got);
+        
+        ec_encode(k, m, chunks, chunks + k, EC_CHUNK);
+        
+        t = stats_now();
+        for (int i = 0; i < n; i++) {
+            if (socks[i] >= 0 && send_all(socks[i], chunks[i], EC_CHUNK) < 0) {
+                close(socks[i]);
+                socks[i] = -1;
+            }
+        }
+        stats_add(STATS_NETWORK, t);
+    }
+    free(stripe);
+    
+    int stored = collect_acks(socks, n, n, -1, NULL, response);
+    
+    // k shards are enough to read the file back, one more lets it survive a loss
+    if (stored < k + 1) {
+        if (stored > 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Only %d of %d shards of %s stored", stored, n, base_filename);
+        }
+        send_msg(client_sock, response);
+        log_event(LOG_WARN, "ec_upload_failed", full_path, stored);
+        return -1;
+    }
+    if (stored < n) {
+        log_event(LOG_WARN, "under_replicated", full_path, stored);
+    }
+    
+    // The manifest goes where an ordinary file of this name would, under a
+    // name no client can upload to
+    char text[EC_MANIFEST_MAX];
+    int len = ec_format_manifest(manifest, text, sizeof(text));
+    FILE* manifest_file = tmpfile();
+    
+    if (len < 0 || !manifest_file || fwrite(text, 1, len, manifest_file) != (size_t)len || fflush(manifest_file) != 0) {
+        if (manifest_file)
+            fclose(manifest_file);
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create manifest of %s", base_filename);
+        send_msg(client_sock, response);
+        return -1;
+    }
+    
+    snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s" EC_MANIFEST_SUFFIX " %s", full_path, dest_path);
+    rewind(manifest_file);
+    int failed = replicate_upload(client_sock, manifest_file, len, pool, full_path, cmd, base_filename);
+    fclose(manifest_file);
+    return failed;
+}
+
+// Function to start reading k shards of an erasure-coded file: the data
+// shards when they are all there, otherwise any k, in which case the file is
+// decoded. socks gets -1 for shards not read. Returns how many were started,
+// fewer than k when the file can't be read.
+int ec_open_shards(const EcManifest* manifest, const char* backend_path, int* socks) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    const ServerAddr* servers[EC_MAX_SHARDS];
+    int visit[EC_MAX_SHARDS];
+    int k = manifest->data, n = manifest->data + manifest->parity;
+    long shard_size = ec_shard_size(k, manifest->filesize);
+    int found = 0;
+    
+    for (int i = 0; i < n; i++)
+        servers[i] = &manifest->shards[i];
+    sort_servers(servers, n, visit);
+    
+    // First only the data shards; if one of them is missing, all shards
+    for (int degraded = 0; degraded < 2 && found < k; degraded++) {
+        found = 0;
+        for (int i = 0; i < n; i++)
+            socks[i] = -1;
+        
+        for (int v = 0; v < n; v++) {
+            int i = visit[v];
+            if ((i >= k && !degraded) || found == k)
+                continue;
+            
+            socks[i] = connect_to_server(servers[i]);
+            if (socks[i] >= 0) {
+                uint64_t t = stats_now();
+                snprintf(cmd, BUFFER_SIZE, "SEND_FILE %s.%d.ec", backend_path, i);
+                send_command(socks[i], cmd);
+                memset(buffer, 0, BUFFER_SIZE);
+                recv(socks[i], buffer, BUFFER_SIZE - 1, 0);
+                stats_add(STATS_NETWORK, t);
+                
+                if (strncmp(buffer, "ERROR", 5) != 0 && atol(buffer) == shard_size) {
+                    found++;
+                    continue;
+                }
+                close(socks[i]);
+                socks[i] = -1;
+            }
+            
+            log_event(LOG_WARN, "shard_unavailable", backend_path, i);
+            if (!degraded)
+                break;
+        }
+        
+        if (found < k) {
+            for (int i = 0; i < n; i++) {
+                if (socks[i] >= 0)
+                    close(socks[i]);
+                socks[i] = -1;
+            }
+        }
+    }
+    
+    return found;
+}
+
+// Function to stream an erasure-coded file from the shards ec_open_shards
+// started, to the client or to a local file. Closes the shards; returns the
+// bytes written.
+long ec_read(const EcManifest* manifest, int* socks, int client_sock, FILE* out) {
+    uint8_t decode[EC_MAX_SHARDS][EC_MAX_SHARDS];
+    uint8_t* available[EC_MAX_SHARDS];
+    uint8_t* data[EC_MAX_SHARDS];
+    int rows[EC_MAX_SHARDS];
+    int k = manifest->data, n = manifest->data + manifest->parity;
+    int count = 0, degraded = 0;
+    long written = 0;
+    uint64_t t;
+    
+    for (int i = 0; i < n; i++) {
+        if (socks[i] >= 0) {
+            degraded |= i >= k;
+            rows[count++] = i;
+        }
+    }
+    
+    uint8_t* buffers = malloc((size_t)2 * k * EC_CHUNK);
+    
+    ec_init();
+    if (count == k && buffers && (!degraded || ec_decode_matrix(k, rows, decode) == 0)) {
+        for (int j = 0; j < k; j++) {
+            available[j] = buffers + (size_t)j * EC_CHUNK;
+            data[j] = degraded ? buffers + (size_t)(k + j) * EC_CHUNK : available[j];
+            send(socks[rows[j]], "READY", 5, 0);
+        }
+        
+        while (written < manifest->filesize) {
+            int failed = 0;
+            
+            t = stats_now();
+            for (int j = 0; j < k && !failed; j++)
+                failed = recv_all(socks[rows[j]], available[j], EC_CHUNK) < 0;
+            stats_add(STATS_NETWORK, t);
+            if (failed)
+                break;
+            
+            // Without the data shards the stripe is solved for from the parity
+            if (degraded)
+                ec_decode(k, decode, available, data, EC_CHUNK);
+            
+            for (int j = 0; j < k && written < manifest->filesize; j++) {
+                size_t len = manifest->filesize - written < EC_CHUNK ? manifest->filesize - written : EC_CHUNK;
+                
+                t = stats_now();
+                failed = out ? fwrite(data[j], 1, len, out) != len : send_all(client_sock, data[j], len) < 0;
+                if (!out)
+                    charge_client(len);
+                stats_add(out ? STATS_DISK : STATS_NETWORK, t);
+                if (failed)
+                    break;
+                written += len;
+            }
+            if (failed)
+                break;
+        }
+    }
+    
+    free(buffers);
+    for (int i = 0; i < n; i++) {
+        if (socks[i] >= 0)
+            close(socks[i]);
+    }
+    
+    return written;
+}
+
+// Function to read the manifest of an erasure-coded file of pool from one
+// backend; -1 when the backend doesn't have one for the file
+int ec_fetch_manifest(const RoutePool* pool, const ServerAddr* server, const char* backend_path, EcManifest* manifest) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    int server_sock = connect_to_server(server);
+    int found = -1;
+    
+    if (server_sock < 0)
+        return -1;
+    
+    uint64_t t = stats_now();
+    snprintf(cmd, BUFFER_SIZE, "SEND_FILE %s" EC_MANIFEST_SUFFIX, backend_path);
+    send_command(server_sock, cmd);
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(server_sock, buffer, BUFFER_SIZE - 1, 0);
+    
+    long filesize = atol(buffer);
+    if (strncmp(buffer, "ERROR", 5) != 0 && filesize > 0 && filesize < EC_MANIFEST_MAX) {
+        send(server_sock, "READY", 5, 0);
+        if (recv_all(server_sock, buffer, filesize) == 0)
+            found = ec_parse_manifest(buffer, filesize, pool, manifest);
+    }
+    stats_add(STATS_NETWORK, t);
+    close(server_sock);
+    
+    return found;
+}
+
+// Function to find the manifest of a file of pool on the backends that may
+// hold it, the owner first; -1 when the file isn't erasure-coded
+int ec_find_manifest(const RoutePool* pool, const char* full_path, const char* backend_path, EcManifest* manifest) {
+    int order[ROUTE_MAX_BACKENDS];
+    int candidates = pool->ec_data > 0 ? route_candidates(pool, full_path, order, ROUTE_MAX_BACKENDS) : 0;
+    
+    for (int i = 0; i < candidates; i++) {
+        if (ec_fetch_manifest(pool, &pool->backends[order[i]], backend_path, manifest) == 0)
+            return 0;
+    }
+    
+    return -1;
+}
+
+// Function to remove the shards of an erasure-coded file, wherever they still
+// are, except those keep (may be NULL) stores in the same place
+void ec_remove_shards(const EcManifest* manifest, const char* backend_path, const EcManifest* keep) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    
+    for (int i = 0; i < manifest->data + manifest->parity; i++) {
+        if (keep && i < keep->data + keep->parity && route_compare_addr(&keep->shards[i], &manifest->shards[i]) == 0)
+            continue;
+        
+        int server_sock = connect_to_server(&manifest->shards[i]);
+        if (server_sock < 0)
+            continue;
+        
+        uint64_t t = stats_now();
+        snprintf(cmd, BUFFER_SIZE, "REMOVE_FILE %s.%d.ec", backend_path, i);
+        send_command(server_sock, cmd);
+        memset(buffer, 0, BUFFER_SIZE);
+        recv(server_sock, buffer, BUFFER_SIZE - 1, 0);
+        stats_add(STATS_NETWORK, t);
+        close(server_sock);
+    }
+}
+
+// Function to replace the manifests in an unpacked tar of a pool with the
+// .filetype files they describe and drop the rest; -1 if one of them can't
+// be rebuilt
+int ec_rebuild_dir(const RoutePool* pool, const char* stage_dir, const char* filetype) {
+    char cmd[MAX_PATH * 2];
+    char rel[MAX_PATH];
+    char manifest_path[MAX_PATH * 2];
+    char local_path[MAX_PATH * 2];
+    char backend_path[MAX_PATH * 2];
+    char text[EC_MANIFEST_MAX];
+    int status = 0;
+    
+    snprintf(cmd, sizeof(cmd), "cd %s && find . -type f -name '*%s'", stage_dir, EC_MANIFEST_SUFFIX);
+    FILE* list = popen(cmd, "r");
+    if (!list)
+        return -1;
+    
+    while (fgets(rel, sizeof(rel), list)) {
+        EcManifest manifest;
+        int socks[EC_MAX_SHARDS];
+        
+        // ./dir/name.txt.ecm describes ./dir/name.txt
+        rel[strcspn(rel, "\n")] = 0;
+        snprintf(manifest_path, sizeof(manifest_path), "%s/%s", stage_dir, rel + 2);
+        rel[strlen(rel) - strlen(EC_MANIFEST_SUFFIX)] = 0;
+        snprintf(local_path, sizeof(local_path), "%s/%s", stage_dir, rel + 2);
+        snprintf(backend_path, sizeof(backend_path), "~/%s/%s", pool->prefix, rel + 2);
+        
+        FILE* file = fopen(manifest_path, "rb");
+        size_t len = file ? fread(text, 1, sizeof(text), file) : 0;
+        if (file)
+            fclose(file);
+        remove(manifest_path);
+        if (strcmp(get_file_extension(basename(rel)), filetype) != 0)
+            continue;
+        if (ec_parse_manifest(text, len, pool, &manifest) < 0) {
+            log_event(LOG_WARN, "bad_manifest", backend_path, (long)len);
+            continue;
+        }
+        
+        if (ec_open_shards(&manifest, backend_path, socks) < manifest.data || !(file = fopen(local_path, "wb"))) {
+            status = -1;
+            continue;
+        }
+        long written = ec_read(&manifest, socks, -1, file);
+        if (fclose(file) != 0 || written < manifest.filesize)
+            status = -1;
+    }
+    
+    pclose(list);
+    return status;
+}
+
+// Function to send an erasure-coded file to the client
+int ec_download(int client_sock, const EcManifest* manifest, const char* backend_path, const char* filename) {
+    char buffer[BUFFER_SIZE];
+    int socks[EC_MAX_SHARDS];
+    uint64_t t;
+    
+    int found = ec_open_shards(manifest, backend_path, socks);
+    
+    if (found < manifest->data) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: Only %d of the %d shards needed for %s are available", found,
+                 manifest->data, filename);
+        send_msg(client_sock, buffer);
+        return 0;
+    }
+    
+    // Send file size to client
+    t = stats_now();
+    sprintf(buffer, "%ld", manifest->filesize);
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    int ready = recv_msg(client_sock, buffer, BUFFER_SIZE);
+    stats_add(STATS_NETWORK, t);
+    if (ready < 0 || strcmp(buffer, "READY") != 0) {
+        for (int i = 0; i < manifest->data + manifest->parity; i++) {
+            if (socks[i] >= 0)
+                close(socks[i]);
+        }
+        return ready < 0 ? -1 : 0;
+    }
+    
+    long written = ec_read(manifest, socks, client_sock, NULL);
+    stats_bytes(written);
+    
+    // The client expects exactly filesize bytes; if we fell short the session can't continue
+    return written < manifest->filesize ? -1 : 0;
+}
+
+// Function to store an upload on its pool: large files of an erasure-coded
+// pool are striped, the rest copied. What the version it replaces left under
+// other names, a copy or a manifest and its shards, is removed once the new
+// one is stored. Returns 0 once it is stored.
+int store_upload(int client_sock, FILE* file, long filesize, RoutePool* pool, const char* full_path,
+                 const char* dest_path, const char* base_filename) {
+    char cmd[BUFFER_SIZE];
+    char backend_path[MAX_PATH];
+    char manifest_path[MAX_PATH + 8];
+    EcManifest old, manifest;
+    int failed;
+    
+    route_backend_path(pool, full_path, backend_path, sizeof(backend_path));
+    int was_coded = ec_find_manifest(pool, full_path, backend_path, &old) == 0;
+    
+    if (pool->ec_data > 0 && filesize >= pool->ec_min_size) {
+        failed = ec_upload(client_sock, file, filesize, pool, full_path, dest_path, base_filename, &manifest);
+        if (failed == 0) {
+            remove_copies(pool, full_path, backend_path, NULL);
+            if (was_coded)
+                ec_remove_shards(&old, backend_path, &manifest);
+        }
+        return failed;
+    }
+    
+    snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s %s", full_path, dest_path);
+    failed = replicate_upload(client_sock, file, filesize, pool, full_path, cmd, base_filename);
+    
+    // The manifest goes first, so its shards are never missing while it is there
+    if (failed == 0 && was_coded) {
+        snprintf(manifest_path, sizeof(manifest_path), "%s" EC_MANIFEST_SUFFIX, backend_path);
+        if (remove_copies(pool, full_path, manifest_path, NULL) > 0)
+            ec_remove_shards(&old, backend_path, NULL);
+    }
+    return failed;
+}
+
+// Function to upload file to appropriate server based on extension
+int upload_file(int client_sock, char* filename, char* dest_path) {
+    char buffer[BUFFER_SIZE];
+    char full_path[MAX_PATH];
+    char local_path[MAX_PATH];
+    char stage_path[MAX_PATH + 8];
+    char response[BUFFER_SIZE];
+    const char* ext;
+    FILE* file;
+    long filesize, total_bytes = 0;
+    int bytes_read;
+    int fd;
+    uint64_t t = stats_now();
+    
+    // First, receive the file from client
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        return -1;
+    }
+    filesize = atol(buffer);
+    stats_add(STATS_NETWORK, t);
+    
+    // Turn the upload away before any data moves if S1 can't take its bytes now
+    if (admit_reserve(filesize) < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Server busy, retry after %d ms", admit_retry_ms());
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    t = stats_now();
+    resolve_path(dest_path, local_path, sizeof(local_path));
+    create_directory_recursive(local_path);
+    
+    // Extract filename from the full path
+    char* base_filename = basename(filename);
+    
+    // Append filename to destination path
+    snprintf(full_path, sizeof(full_path), "%s/%s", dest_path, base_filename);
+    strncat(local_path, "/", sizeof(local_path) - strlen(local_path) - 1);
+    strncat(local_path, base_filename, sizeof(local_path) - strlen(local_path) - 1);
+    
+    // Stage the upload under a unique name so concurrent uploads of the same
+    // file can't truncate each other's copy while it is being forwarded
+    snprintf(stage_path, sizeof(stage_path), "%s.XXXXXX", local_path);
+    fd = mkstemp(stage_path);
+    file = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+    stats_add(STATS_DISK, t);
+    if (!file) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create file %s", full_path);
+        send_msg(client_sock, response);
+        return 0;
+    }
+    fchmod(fd, 0644);
+    
+    // Tell client we're ready to receive the file content
+    strcpy(response, "READY");
+    send_msg(client_sock, response);
+    
+    // Receive file content
+    total_bytes = 0;
+    memset(buffer, 0, BUFFER_SIZE);
+    
+    while (total_bytes < filesize) {
+        size_t want = filesize - total_bytes < BUFFER_SIZE ? filesize - total_bytes : BUFFER_SIZE;
+        t = stats_now();
+        bytes_read = recv(client_sock, buffer, want, 0);
+        stats_add(STATS_NETWORK, t);
+        
+        if (bytes_read <= 0)
+            break;
+        charge_client(bytes_read);
+        
+        t = stats_now();
+        fwrite(buffer, 1, bytes_read, file);
+        stats_add(STATS_DISK, t);
+        total_bytes += bytes_read;
+    }
+    
+    t = stats_now();
+    fflush(file);
+    stats_add(STATS_DISK, t);
+    stats_bytes(total_bytes);
+    
+    // A short upload means the client went away mid-transfer; end the session
+    if (total_bytes < filesize) {
+        fclose(file);
+        remove(stage_path);
+        return -1;
+    }
+    
+    // Get file extension
+    ext = get_file_extension(base_filename);
+    
+    // Determine if file needs to be transferred to another server
+    if (stored_on_s1(ext)) {
+        // .c files stay on S1
+        t = stats_now();
+        fclose(file);
+        rename(stage_path, local_path);
+        stats_add(STATS_DISK, t);
+        snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
+    } else {
+        // Only the open handle is needed to forward the file
+        remove(stage_path);
+        
+        // The extension picks the pool, the path picks the replicas within it
+        RoutePool* pool = route_find(&route_table, ext);
+        
+        if (!pool) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
+            send_msg(client_sock, response);
+            fclose(file);
+            return 0;
+        }
+        
+        // With write-behind the client is answered once the spool has the
+        // upload on disk, and the forwarder stores it on the pool later
+        if (spool) {
+            t = stats_now();
+            rewind(file);
+            int spooled = spool_append(full_path, file, filesize) == 0;
+            stats_add(STATS_DISK, t);
+            
+            if (spooled) {
+                fclose(file);
+                snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
+                send_msg(client_sock, response);
+                return 0;
+            }
+            
+            // The spool is full: store it now, and make sure no older upload still queued lands after it
+            log_event(LOG_WARN, "spool_bypassed", full_path, filesize);
+            spool_cancel(full_path);
+        }
+        
+        rewind(file);
+        store_upload(client_sock, file, filesize, pool, full_path, dest_path, base_filename);
+        fclose(file);
+        return 0;
+    }
+    
+    // Send response to client
+    send_msg(client_sock, response);
+    
+    return 0;
+}
+
+// Function to order a pool's replicas of a path, least loaded first. Equal
+// scores keep the order they came in, which starts at a different replica per
+// request so that backends nothing is known about yet share the reads.
+void rank_replicas(const RoutePool* pool, int* order, int count) {
+    uint64_t scores[ROUTE_MAX_BACKENDS];
+    
+    for (int i = 0; i < count; i++)
+        scores[i] = backend_score(backend_lookup(&pool->backends[order[i]]));
+    
+    for (int i = 1; i < count; i++) {
+        for (int k = i; k > 0 && scores[k] < scores[k - 1]; k--) {
+            uint64_t score = scores[k];
+            int backend = order[k];
+            scores[k] = scores[k - 1];
+            order[k] = order[k - 1];
+            scores[k - 1] = score;
+            order[k - 1] = backend;
+        }
+    }
+}
+
+// Function to order the replicas of a read: from a different one per
+// request, then least loaded first
+void spread_replicas(const RoutePool* pool, int* order, int replicas) {
+    int rotated[ROUTE_MAX_BACKENDS];
+    int first = replicas > 0 ? (int)(trace_current % replicas) : 0;
+    
+    if (replicas < 2)
+        return;
+    for (int i = 0; i < replicas; i++)
+        rotated[i] = order[(first + i) % replicas];
+    memcpy(order, rotated, replicas * sizeof(int));
+    rank_replicas(pool, order, replicas);
+}
+
+// Function to send a read command to the backends of a path in order until
+// one has the file, returning its socket with the answer in reply. While a
+// backend among the first `hedgeable` takes longer to answer than its hedge
+// delay, the command is also sent to the next one and whichever answers first
+// wins; closing the other cancels it. Returns -1 when none has the file, with
+// the first error a backend gave in reply, or what the caller put there if
+// none answered. *state is the winner's, for backend_done(), and *file_fd
+// the file a backend on this host attached to its answer, -1 if none.
+int hedged_read(const ServerAddr* const* servers, int count, int hedgeable, const char* cmd, char* reply,
+                BackendState** state, int* file_fd) {
+    char buffer[BUFFER_SIZE];
+    int fd;
+    struct {
+        int sock;
+        BackendState* state;
+        uint64_t start;
+    } reads[2];
+    int active = 0, next = 0, answered = 0;
+    
+    *file_fd = -1;
+    while (active > 0 || next < count) {
+        // Nothing in flight: move on to the next backend
+        if (active == 0) {
+            int sock = connect_to_server(servers[next]);
+            
+            if (sock >= 0) {
+                reads[0].sock = sock;
+                reads[0].state = backend_lookup(servers[next]);
+                reads[0].start = stats_now();
+                backend_begin(reads[0].state);
+                send_command(sock, cmd);
+                active = 1;
+            }
+            next++;
+            continue;
+        }
+        
+        // Wait no longer than the first read's I/O deadline, and with one in
+        // flight that may be hedged, no longer than its hedge delay
+        uint64_t now = stats_now();
+        uint64_t io_ns = (uint64_t)BACKEND_IO_TIMEOUT * 1000000000ULL;
+        uint64_t wait = io_ns;
+        int hedge = 0;
+        for (int i = 0; i < active; i++) {
+            uint64_t waited = now - reads[i].start;
+            uint64_t left = waited < io_ns ? io_ns - waited : 0;
+            wait = left < wait ? left : wait;
+        }
+        if (active == 1 && next < hedgeable) {
+            uint64_t delay = backend_hedge_delay_us(reads[0].state) * 1000;
+            uint64_t waited = now - reads[0].start;
+            uint64_t left = waited < delay ? delay - waited : 0;
+            if (delay > 0 && left <= wait) {
+                wait = left;
+                hedge = 1;
+            }
+        }
+        int timeout = (int)((wait + 999999) / 1000000);
+        
+        struct pollfd pfds[2];
+        for (int i = 0; i < active; i++) {
+            pfds[i].fd = reads[i].sock;
+            pfds[i].events = POLLIN;
+        }
+        
+        int ready = poll(pfds, active, timeout);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0) {
+            for (int i = 0; i < active; i++) {
+                backend_done(reads[i].state);
+                close(reads[i].sock);
+            }
+            return -1;
+        }
+        
+        if (ready == 0 && !hedge) {
+            // A backend that stalls past the I/O timeout failed this read
+            now = stats_now();
+            for (int i = active - 1; i >= 0; i--) {
+                if (now - reads[i].start < io_ns)
+                    continue;
+                log_event(LOG_WARN, "backend_stalled", cmd, BACKEND_IO_TIMEOUT);
+                backend_failure(reads[i].state);
+                backend_done(reads[i].state);
+                close(reads[i].sock);
+                reads[i] = reads[--active];
+            }
+            continue;
+        }
+        if (ready == 0) {
+            // Too slow: ask the next replica as well
+            int sock = connect_to_server(servers[next]);
+            
+            log_sampled(LOG_INFO, "hedged_read", cmd, next);
+            if (sock >= 0) {
+                reads[1].sock = sock;
+                reads[1].state = backend_lookup(servers[next]);
+                reads[1].start = stats_now();
+                backend_begin(reads[1].state);
+                send_command(sock, cmd);
+                active = 2;
+            }
+            next++;
+            continue;
+        }
+        
+        for (int i = active - 1; i >= 0; i--) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            
+            memset(buffer, 0, BUFFER_SIZE);
+            local_recv(reads[i].sock, buffer, BUFFER_SIZE - 1, &fd);
+            backend_sample(reads[i].state, stats_now() - reads[i].start);
+            if (buffer[0])
+                backend_success(reads[i].state);
+            
+            if (buffer[0] && strncmp(buffer, "ERROR", 5) != 0) {
+                // The winner; the loser's time so far says it is at least that slow
+                for (int k = 0; k < active; k++) {
+                    if (k == i)
+                        continue;
+                    backend_sample(reads[k].state, stats_now() - reads[k].start);
+                    backend_done(reads[k].state);
+                    close(reads[k].sock);
+                }
+                snprintf(reply, BUFFER_SIZE, "%s", buffer);
+                *state = reads[i].state;
+                *file_fd = fd;
+                return reads[i].sock;
+            }
+            if (fd >= 0)
+                close(fd);
+            
+            // Report the first answer if no backend has the file
+            if (!answered && buffer[0])
+                snprintf(reply, BUFFER_SIZE, "%s", buffer);
+            answered |= buffer[0] != 0;
+            backend_done(reads[i].state);
+            close(reads[i].sock);
+            reads[i] = reads[--active];
+        }
+    }
+    
+    return -1;
+}
+
+// Function to send the filesize bytes at offset in a local file descriptor
+// to the client: the size and version tag (may be NULL), then the content
+// once the client is READY, straight from the page cache with sendfile
+int send_file_range(int client_sock, int fd, off_t offset, long filesize, const char* tag) {
+    char buffer[BUFFER_SIZE];
+    long total_sent = 0;
+    ssize_t bytes_sent;
+    uint64_t t;
+    
+    // Send file size and version to client
+    t = stats_now();
+    if (tag && tag[0])
+        sprintf(buffer, "%ld %s", filesize, tag);
+    else
+        sprintf(buffer, "%ld", filesize);
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        return -1;
+    }
+    stats_add(STATS_NETWORK, t);
+    
+    if (strcmp(buffer, "READY") != 0) {
+        return 0;
+    }
+    
+    // Send file content
+    while (total_sent < filesize) {
+        t = stats_now();
+        bytes_sent = sendfile(client_sock, fd, &offset,
+                              filesize - total_sent < SENDFILE_CHUNK ? filesize - total_sent : SENDFILE_CHUNK);
+        stats_add(STATS_NETWORK, t);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            // EPIPE or a reset: the client went away, and the transfer failed
+            break;
+        }
+        total_sent += bytes_sent;
+        charge_client(bytes_sent);
+    }
+    
+    stats_bytes(total_sent);
+    
+    // The client expects exactly filesize bytes; if we fell short the session can't continue
+    return total_sent < filesize ? -1 : 0;
+}
+
+// Function to send filesize bytes of an open local file to the client, from
+// where it is positioned, with its version tag. Closes the file.
+int send_local_file(int client_sock, FILE* file, long filesize, const char* tag) {
+    int result = send_file_range(client_sock, fileno(file), ftello(file), filesize, tag);
+    
+    fclose(file);
+    return result;
+}
+
+// Function to send the client what another session fetches for the same
+// request: the size once the leader knows it, then the content from the
+// flight's buffer as it fills. Returns FLIGHT_RETRY when the leader gave up
+// before this client was told anything, so it has to be fetched again.
+// A client that holds the version being fetched is told so instead.
+int follow_flight(int client_sock, Flight* flight, const char* client_tag) {
+    char buffer[BUFFER_SIZE];
+    long size, written, total_sent = 0;
+    off_t offset = 0;
+    int state, fd;
+    uint32_t progress;
+    uint64_t t = stats_now();
+    
+    // Waiting for the leader stands in for connecting to a backend
+    progress = flight_look(flight, &state, &size, &written);
+    while (size < 0 && state == FLIGHT_RUNNING) {
+        flight_wait(flight, progress);
+        progress = flight_look(flight, &state, &size, &written);
+    }
+    if (size >= 0 && state != FLIGHT_FAILED && version_matches(client_tag, flight->tag)) {
+        stats_add(STATS_CONNECT, t);
+        flight_detach(flight);
+        send_msg(client_sock, VERSION_NOT_MODIFIED);
+        return 0;
+    }
+    fd = size >= 0 && state != FLIGHT_FAILED ? flight_open(flight) : -1;
+    stats_add(STATS_CONNECT, t);
+    if (fd < 0) {
+        flight_detach(flight);
+        return FLIGHT_RETRY;
+    }
+    
+    // Send file size and version to client
+    t = stats_now();
+    if (flight->tag[0])
+        sprintf(buffer, "%ld %s", size, flight->tag);
+    else
+        sprintf(buffer, "%ld", size);
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    int received = recv_msg(client_sock, buffer, BUFFER_SIZE);
+    if (received < 0 || strcmp(buffer, "READY") != 0) {
+        close(fd);
+        flight_detach(flight);
+        return received < 0 ? -1 : 0;
+    }
+    stats_add(STATS_NETWORK, t);
+    
+    // Send what the buffer holds, and wait for the leader to add more
+    while (total_sent < size) {
+        progress = flight_look(flight, &state, &size, &written);
+        if (written > total_sent) {
+            t = stats_now();
+            long want = written - total_sent < SENDFILE_CHUNK ? written - total_sent : SENDFILE_CHUNK;
+            ssize_t bytes_sent = sendfile(client_sock, fd, &offset, want);
+            stats_add(STATS_NETWORK, t);
+            if (bytes_sent < 0 && errno == EINTR)
+                continue;
+            if (bytes_sent <= 0)
+                break;              // The client went away (EPIPE or a reset)
+            total_sent += bytes_sent;
+            charge_client(bytes_sent);
+        } else if (state == FLIGHT_RUNNING) {
+            flight_wait(flight, progress);
+        } else {
+            break;
+        }
+    }
+    
+    close(fd);
+    flight_detach(flight);
+    stats_bytes(total_sent);
+    
+    // The client expects exactly size bytes; if we fell short the session can't continue
+    return total_sent < size ? -1 : 0;
+}
+
+// Function to send a file held in S1's memory cache to the client, from the
+// cache's pages, and let go of it
+int send_cached_file(int client_sock, CacheRef* cached) {
+    int result = send_file_range(client_sock, cache_fd, cached->offset, cached->size, cached->tag);
+    
+    cache_release(cached);
+    return result;
+}
+
+// Function to download a file of a pool from its backends, feeding the
+// memory cache and the flight this session leads on the way. A client whose
+// version tag names the copy a backend holds is only told it is current. A
+// file no backend holds a copy of may be erasure-coded, and is then read
+// from its shards.
+int fetch_pool_file(int client_sock, char* filename, RoutePool* pool, CacheRef* cached, const char* client_tag) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    char tag[VERSION_TAG_MAX];
+    const char* ext = get_file_extension(basename(filename));
+    FILE* file;
+    long filesize;
+    int bytes_read, bytes_sent;
+    int server_sock = -1;
+    int order[ROUTE_MAX_BACKENDS];
+    uint64_t t;
+    
+    // Replace S1 with the pool's server in the path
+    char modified_path[MAX_PATH];
+    route_backend_path(pool, filename, modified_path, sizeof(modified_path));
+    snprintf(cmd, BUFFER_SIZE, "SEND_FILE %s", modified_path);
+    
+    // Ask the replicas first, least loaded first and hedged; a file stored
+    // before the pool grew is still on the backends that owned it then,
+    // further round the ring
+    int candidates = route_candidates(pool, filename, order, ROUTE_MAX_BACKENDS);
+    int replicas = pool->replicas < candidates ? pool->replicas : candidates;
+    const ServerAddr* servers[ROUTE_MAX_BACKENDS];
+    BackendState* backend = NULL;
+    int file_fd;
+    
+    spread_replicas(pool, order, replicas);
+    for (int i = 0; i < candidates; i++)
+        servers[i] = &pool->backends[order[i]];
+    
+    t = stats_now();
+    snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
+    server_sock = hedged_read(servers, candidates, replicas, cmd, buffer, &backend, &file_fd);
+    stats_add(STATS_NETWORK, t);
+    
+    if (server_sock < 0) {
+        EcManifest manifest;
+        
+        // Shards are fetched and decoded per request
+        if (ec_find_manifest(pool, filename, modified_path, &manifest) == 0) {
+            flight_end();
+            return ec_download(client_sock, &manifest, modified_path, filename);
+        }
+        send_msg(client_sock, buffer);
+        return 0;
+    }
+    
+    filesize = version_parse(buffer, tag);
+    
+    // The client's copy is current: the backend is let go without sending it
+    if (version_matches(client_tag, tag)) {
+        if (file_fd >= 0)
+            close(file_fd);
+        close(server_sock);
+        backend_done(backend);
+        flight_end();
+        send_msg(client_sock, VERSION_NOT_MODIFIED);
+        return 0;
+    }
+    
+    // A backend on this host handed over the open file: the client is
+    // served from it like from a local file, and the backend is done. It is
+    // cheaper to open again than to copy, so followers fetch it themselves.
+    if (file_fd >= 0) {
+        close(server_sock);
+        backend_done(backend);
+        flight_end();
+        
+        t = stats_now();
+        file = fdopen(file_fd, "rb");
+        stats_add(STATS_DISK, t);
+        
+        if (!file) {
+            close(file_fd);
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to read file %s", filename);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        // Keep a copy for the next download, if the cache takes it
+        if (cache_reserve(cached, filesize, tag) == 0) {
+            t = stats_now();
+            cache_fill_fd(cached, file_fd);
+            cache_commit(cached);
+            stats_add(STATS_DISK, t);
+        }
+        return send_local_file(client_sock, file, filesize, tag);
+    }
+    
+    // The file is copied into the cache and the flight's buffer as it
+    // streams past; the backend's reply already carries the tag
+    cache_reserve(cached, filesize, tag);
+    flight_publish(filesize, 0, tag);
+    
+    // Send file size to client
+    t = stats_now();
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        close(server_sock);
+        backend_done(backend);
+        cache_abort(cached);
+        return -1;
+    }
+    
+    if (strcmp(buffer, "READY") != 0) {
+        close(server_sock);
+        backend_done(backend);
+        cache_abort(cached);
+        return 0;
+    }
+    
+    // Tell server we're ready
+    strcpy(buffer, "READY");
+    send(server_sock, buffer, strlen(buffer), 0);
+    
+    // Forward file content from server to client
+    long total_received = 0;
+    int client_gone = 0;
+    
+    while (total_received < filesize) {
+        memset(buffer, 0, BUFFER_SIZE);
+        bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
+        
+        if (bytes_read <= 0)
+            break;
+        
+        // Followers still get the rest of the file when this client goes away
+        if (!client_gone) {
+            bytes_sent = send_all(client_sock, buffer, bytes_read);
+            client_gone = bytes_sent < 0;
+            if (!client_gone)
+                charge_client(bytes_read);
+        }
+        if (client_gone && !flight_shared())
+            break;
+        
+        flight_write(buffer, bytes_read);
+        cache_fill(cached, buffer, bytes_read);
+        total_received += bytes_read;
+    }
+    
+    close(server_sock);
+    backend_done(backend);
+    cache_commit(cached);
+    stats_add(STATS_NETWORK, t);
+    stats_bytes(total_received);
+    
+    // The client expects exactly filesize bytes; if we fell short the session can't continue
+    return client_gone || total_received < filesize ? -1 : 0;
+}
+
+// Function to download file from appropriate server based on path. A
+// client that passes the version tag of the copy it holds is answered
+// NOT_MODIFIED instead of being sent that version again.
+int download_file(int client_sock, char* filename, const char* client_tag) {
+    char response[BUFFER_SIZE];
+    const char* ext;
+    FILE* file;
+    struct stat st = {0};
+    char local_path[MAX_PATH];
+    char tag[VERSION_TAG_MAX];
+    long filesize;
+    uint64_t t;
+    
+    // Extract filename and extension
+    char* base_filename = basename(filename);
+    ext = get_file_extension(base_filename);
+    
+    if (stored_on_s1(ext)) {
+        // Handle .c files locally
+        t = stats_now();
+        resolve_path(filename, local_path, sizeof(local_path));
+        if (stat(local_path, &st) == -1) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File %s not found", filename);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        filesize = st.st_size;
+        version_tag(&st, tag, sizeof(tag));
+        if (version_matches(client_tag, tag)) {
+            stats_add(STATS_DISK, t);
+            send_msg(client_sock, VERSION_NOT_MODIFIED);
+            return 0;
+        }
+        
+        // Open the file before announcing its size so the client never gets an error mid-stream
+        file = fopen(local_path, "rb");
+        stats_add(STATS_DISK, t);
+        if (!file) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Cannot open file %s", filename);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        return send_local_file(client_sock, file, filesize, tag);
+    } else {
+        // Determine which pool to get the file from
+        RoutePool* pool = route_find(&route_table, ext);
+        SpoolEntry queued;
+        CacheRef cached;
+        
+        if (!pool) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        // A hot file is answered from memory, without a backend
+        if (cache_lookup(filename, &cached) == 0) {
+            if (version_matches(client_tag, cached.tag)) {
+                cache_release(&cached);
+                send_msg(client_sock, VERSION_NOT_MODIFIED);
+                return 0;
+            }
+            return send_cached_file(client_sock, &cached);
+        }
+        
+        // An upload still waiting to be forwarded is read from the spool; one
+        // cleaned up since it was found is on its backends by now
+        t = stats_now();
+        file = spool_find(filename, &queued) == 0 ? spool_open(&queued) : NULL;
+        stats_add(STATS_DISK, t);
+        if (file) {
+            return send_local_file(client_sock, file, queued.size, NULL);
+        }
+        
+        // Concurrent downloads of the file share one fetch
+        Flight* flight;
+        char key[MAX_PATH + 8];
+        
+        snprintf(key, sizeof(key), "downlf %s", filename);
+        if (flight_join(key, &flight) == FLIGHT_FOLLOWER) {
+            int result = follow_flight(client_sock, flight, client_tag);
+            if (result != FLIGHT_RETRY)
+                return result;
+        }
+        
+        int result = fetch_pool_file(client_sock, filename, pool, &cached, client_tag);
+        flight_end();
+        return result;
+    }
+}
+
+// Function to send the client the block signatures of the stored version of
+// a file, from S1's own copy or a replica, so it can upload a delta of its
+// new version: "<length> <block size> <file size>", READY, then the
+// signatures, see dfs_delta.h
+int send_signatures(int client_sock, char* filename) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char local_path[MAX_PATH];
+    char cmd[BUFFER_SIZE];
+    const char* ext = get_file_extension(basename(filename));
+    struct stat st = {0};
+    SpoolEntry queued;
+    uint64_t t;
+    
+    if (stored_on_s1(ext)) {
+        unsigned char* sigs = NULL;
+        long length = -1;
+        int block = 0;
+        
+        t = stats_now();
+        resolve_path(filename, local_path, sizeof(local_path));
+        int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            block = delta_block_size(st.st_size);
+            length = delta_signatures(fd, st.st_size, block, &sigs);
+        }
+        if (fd >= 0)
+            close(fd);
+        stats_add(STATS_DISK, t);
+        
+        if (length < 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: File %s not found", filename);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        t = stats_now();
+        sprintf(buffer, "%ld %d %ld", length, block, (long)st.st_size);
+        send_msg(client_sock, buffer);
+        if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+            free(sigs);
+            return -1;
+        }
+        int failed = strcmp(buffer, "READY") == 0 && send_all(client_sock, sigs, length) < 0;
+        stats_add(STATS_NETWORK, t);
+        free(sigs);
+        return failed ? -1 : 0;
+    }
+    
+    // A pool's file is described by one of its replicas, unless S1 holds a
+    // newer version in the spool or the pool stripes it
+    RoutePool* pool = route_find(&route_table, ext);
+    if (!pool) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
+        send_msg(client_sock, response);
+        return 0;
+    }
+    if (pool->ec_data > 0 || (spool && spool_find(filename, &queued) == 0)) {
+        snprintf(response, BUFFER_SIZE, "ERROR: No delta uploads for %s, upload it in full", filename);
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    char modified_path[MAX_PATH];
+    int order[ROUTE_MAX_BACKENDS];
+    const ServerAddr* servers[ROUTE_MAX_BACKENDS];
+    BackendState* backend = NULL;
+    int file_fd;
+    
+    route_backend_path(pool, filename, modified_path, sizeof(modified_path));
+    snprintf(cmd, BUFFER_SIZE, "SEND_SIGS %s", modified_path);
+    int count = route_candidates(pool, filename, order, pool->replicas);
+    spread_replicas(pool, order, count);
+    for (int i = 0; i < count; i++)
+        servers[i] = &pool->backends[order[i]];
+    
+    t = stats_now();
+    snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
+    int server_sock = hedged_read(servers, count, count, cmd, buffer, &backend, &file_fd);
+    if (file_fd >= 0)
+        close(file_fd);
+    if (server_sock < 0) {
+        stats_add(STATS_NETWORK, t);
+        send_msg(client_sock, buffer);
+        return 0;
+    }
+    
+    // Pass the answer on, and the signatures once the client is ready
+    long length = atol(buffer), total = 0;
+    send_msg(client_sock, buffer);
+    int received = recv_msg(client_sock, buffer, BUFFER_SIZE);
+    if (received >= 0 && strcmp(buffer, "READY") == 0) {
+        send(server_sock, "READY", 5, 0);
+        while (total < length) {
+            int bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
+            if (bytes_read <= 0 || send_all(client_sock, buffer, bytes_read) < 0)
+                break;
+            total += bytes_read;
+        }
+    }
+    close(server_sock);
+    backend_done(backend);
+    stats_add(STATS_NETWORK, t);
+    
+    return received < 0 || (total > 0 && total < length) ? -1 : 0;
+}
+
+// Function to take a delta upload, "deltaf <file> <dest> <block> <size>
+// <hash>": the changes to the stored version of a file, which S1 applies to
+// its own copy or has every replica apply to theirs. The delta is staged like
+// an upload; the file is only replaced where the result has the size and
+// hash the client gave.
+int upload_delta(int client_sock, char* command) {
+    char buffer[BUFFER_SIZE];
+    char filename[MAX_PATH], dest_path[MAX_PATH];
+    char full_path[MAX_PATH];
+    char local_path[MAX_PATH];
+    char stage_path[MAX_PATH + 8];
+    char response[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    const char* ext;
+    FILE* file;
+    RoutePool* pool = NULL;
+    unsigned long long hash;
+    long filesize, delta_size, total_bytes = 0;
+    int block, fd, bytes_read;
+    uint64_t t = stats_now();
+    
+    // The delta's size follows the command unasked
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        return -1;
+    }
+    delta_size = atol(buffer);
+    stats_add(STATS_NETWORK, t);
+    
+    if (sscanf(command, "%*s %1023s %1023s %d %ld %llx", filename, dest_path, &block, &filesize, &hash) != 5 ||
+        block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX || filesize < 0 || delta_size < 0) {
+        strcpy(response, "ERROR: Invalid command syntax. Usage: deltaf filename destination_path block size hash");
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    char* base_filename = basename(filename);
+    ext = get_file_extension(base_filename);
+    if (!stored_on_s1(ext)) {
+        pool = route_find(&route_table, ext);
+        if (!pool || pool->ec_data > 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: No delta uploads for %s, upload it in full", base_filename);
+            send_msg(client_sock, response);
+            return 0;
+        }
+    }
+    if (admit_reserve(delta_size) < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Server busy, retry after %d ms", admit_retry_ms());
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    // Stage the delta next to where the file lives; only the handle is kept
+    t = stats_now();
+    resolve_path(dest_path, local_path, sizeof(local_path));
+    create_directory_recursive(local_path);
+    snprintf(full_path, sizeof(full_path), "%s/%s", dest_path, base_filename);
+    strncat(local_path, "/", sizeof(local_path) - strlen(local_path) - 1);
+    strncat(local_path, base_filename, sizeof(local_path) - strlen(local_path) - 1);
+    snprintf(stage_path, sizeof(stage_path), "%s.XXXXXX", local_path);
+    fd = mkstemp(stage_path);
+    file = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+    if (fd >= 0)
+        remove(stage_path);
+    stats_add(STATS_DISK, t);
+    if (!file) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create file %s", full_path);
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    // Tell client we're ready to receive the delta
+    strcpy(response, "READY");
+    send_msg(client_sock, response);
+    
+    while (total_bytes < delta_size) {
+        size_t want = delta_size - total_bytes < BUFFER_SIZE ? delta_size - total_bytes : BUFFER_SIZE;
+        t = stats_now();
+        bytes_read = recv(client_sock, buffer, want, 0);
+        stats_add(STATS_NETWORK, t);
+        
+        if (bytes_read <= 0)
+            break;
+        charge_client(bytes_read);
+        
+        t = stats_now();
+        fwrite(buffer, 1, bytes_read, file);
+        stats_add(STATS_DISK, t);
+        total_bytes += bytes_read;
+    }
+    
+    t = stats_now();
+    fflush(file);
+    stats_add(STATS_DISK, t);
+    stats_bytes(total_bytes);
+    
+    // A short delta means the client went away mid-transfer; end the session
+    if (total_bytes < delta_size) {
+        fclose(file);
+        return -1;
+    }
+    
+    if (pool) {
+        // The backends take the command in one buffer; a cut path would name another file
+        if (snprintf(cmd, BUFFER_SIZE, "RECV_DELTA %s %s %d %ld %llx", full_path, dest_path, block, filesize, hash)
+            >= BUFFER_SIZE) {
+            fclose(file);
+            snprintf(response, BUFFER_SIZE, "ERROR: Path too long");
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        // An older upload still queued must not land after this one
+        if (spool)
+            spool_cancel(full_path);
+        
+        rewind(file);
+        replicate_upload(client_sock, file, delta_size, pool, full_path, cmd, base_filename);
+        fclose(file);
+        return 0;
+    }
+    
+    // .c files are rebuilt here, next to S1's copy
+    DeltaInput input = { fileno(file), 1, 0, delta_size };
+    struct stat st = {0};
+    
+    t = stats_now();
+    int base_fd = open(local_path, O_RDONLY | O_CLOEXEC);
+    snprintf(stage_path, sizeof(stage_path), "%s.XXXXXX", local_path);
+    fd = base_fd >= 0 && fstat(base_fd, &st) == 0 ? mkstemp(stage_path) : -1;
+    long written = fd >= 0 ? delta_apply(&input, base_fd, st.st_size, block, fd) : -1;
+    int stored = written == filesize && delta_verify(fd, filesize, hash) == 0;
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        close(fd);
+        stored = stored && rename(stage_path, local_path) == 0;
+        if (!stored)
+            remove(stage_path);
+    }
+    if (base_fd >= 0)
+        close(base_fd);
+    fclose(file);
+    stats_add(STATS_DISK, t);
+    
+    if (stored) {
+        snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
+    } else {
+        snprintf(response, BUFFER_SIZE, "ERROR: Delta for %s does not match the stored version", full_path);
+    }
+    send_msg(client_sock, response);
+    return 0;
+}
+
+// Function to find the pool a file with extension ext can move to or from
+// directly, between the client and the backends; NULL when it has to pass
+// through S1: without a key shared with the backends, for files S1 stores
+// itself, in an erasure-coded pool (S1 does the coding) and for a tenant
+// whose bandwidth S1 paces
+RoutePool* direct_pool(const char* ext) {
+    if (!token_enabled || qos_paced())
+        return NULL;
+    
+    RoutePool* pool = route_find(&route_table, ext);
+    return pool && pool->ec_data == 0 ? pool : NULL;
+}
+
+// Function to add a backend and the command S1 signed for it to the lines
+// of a direct reply; -1 if they don't fit
+int add_direct_target(char* lines, size_t size, const ServerAddr* server, const char* cmd) {
+    char line[BUFFER_SIZE + 128];
+    int len = snprintf(line, sizeof(line), "\n%s:%d ", server->host, server->port);
+    
+    token_sign(cmd, line + len, sizeof(line) - len);
+    if (strlen(lines) + strlen(line) >= size)
+        return -1;
+    strcat(lines, line);
+    return 0;
+}
+
+// Function to tell the client where to download a file from by itself:
+// "DIRECT <count>" and a line per backend with the SEND_FILE S1 signed for
+// it, best first, or "PROXY" if the file has to come through S1
+void locate_file(int client_sock, char* filename) {
+    char lines[DIRECT_REPLY_SIZE] = "";
+    char reply[DIRECT_REPLY_SIZE + 32];
+    char cmd[BUFFER_SIZE];
+    char modified_path[MAX_PATH];
+    int order[ROUTE_MAX_BACKENDS];
+    SpoolEntry queued;
+    int count = 0;
+    
+    RoutePool* pool = direct_pool(get_file_extension(basename(filename)));
+    
+    // An upload not yet forwarded is only in the spool
+    if (!pool || (spool && spool_find(filename, &queued) == 0)) {
+        send_msg(client_sock, "PROXY");
+        return;
+    }
+    
+    route_backend_path(pool, filename, modified_path, sizeof(modified_path));
+    snprintf(cmd, BUFFER_SIZE, "SEND_FILE %s", modified_path);
+    
+    // The same order a read through S1 would try them in, see download_file
+    int candidates = route_candidates(pool, filename, order, ROUTE_MAX_BACKENDS);
+    spread_replicas(pool, order, pool->replicas < candidates ? pool->replicas : candidates);
+    while (count < candidates && add_direct_target(lines, sizeof(lines), &pool->backends[order[count]], cmd) == 0)
+        count++;
+    
+    snprintf(reply, sizeof(reply), "DIRECT %d%s", count, lines);
+    send_msg(client_sock, reply);
+}
+
+// Function to tell the client where to store an upload by itself: "DIRECT
+// <quorum> <count>" and a line per replica with the RECV_FILE S1 signed for
+// it, in the order the client must take them in (see sort_servers), or
+// "PROXY" if the file has to go through S1. Each RECV_FILE names its
+// replica, which signs that name into its receipt.
+void place_upload(int client_sock, char* filename, char* dest_path) {
+    char lines[DIRECT_REPLY_SIZE] = "";
+    char reply[DIRECT_REPLY_SIZE + 32];
+    char cmd[BUFFER_SIZE];
+    char full_path[MAX_PATH];
+    int order[ROUTE_MAX_BACKENDS];
+    int visit[ROUTE_MAX_BACKENDS];
+    const ServerAddr* servers[ROUTE_MAX_BACKENDS];
+    SpoolEntry queued;
+    
+    char* base_filename = basename(filename);
+    RoutePool* pool = direct_pool(get_file_extension(base_filename));
+    snprintf(full_path, sizeof(full_path), "%s/%s", dest_path, base_filename);
+    
+    // An older upload still queued must not land after this one; through S1
+    // the new one takes its place in the spool
+    if (!pool || (spool && spool_find(full_path, &queued) == 0)) {
+        send_msg(client_sock, "PROXY");
+        return;
+    }
+    
+    int count = route_candidates(pool, full_path, order, pool->replicas);
+    int quorum = pool->write_quorum < count ? pool->write_quorum : count;
+    
+    for (int i = 0; i < count; i++)
+        servers[i] = &pool->backends[order[i]];
+    sort_servers(servers, count, visit);
+    for (int v = 0; v < count; v++) {
+        const ServerAddr* server = servers[visit[v]];
+        int len = snprintf(cmd, BUFFER_SIZE, "RECV_FILE %s %s %s:%d", full_path, dest_path, server->host, server->port);
+        if (len >= BUFFER_SIZE || add_direct_target(lines, sizeof(lines), server, cmd) < 0) {
+            send_msg(client_sock, "PROXY");
+            return;
+        }
+    }
+    
+    snprintf(reply, sizeof(reply), "DIRECT %d %d%s", quorum, count, lines);
+    send_msg(client_sock, reply);
+}
+
+// Function to take the receipts of a direct upload from the client,
+// "commitf <filename> <destination> <size> <receipt>...", and answer it as
+// if S1 had stored the file: success once a write quorum of the replicas
+// signed for it
+void commit_upload(int client_sock, char* command) {
+    char response[BUFFER_SIZE];
+    char filename[MAX_PATH], dest_path[MAX_PATH];
+    char full_path[MAX_PATH * 2 + 2], receipt_args[MAX_PATH * 4 + 4];
+    char local_path[MAX_PATH];
+    int order[ROUTE_MAX_BACKENDS];
+    int counted[ROUTE_MAX_BACKENDS] = {0};
+    int acked = 0, used = 0;
+    long size;
+    
+    if (sscanf(command, "%*s %1023s %1023s %ld %n", filename, dest_path, &size, &used) < 3 || used == 0) {
+        send_msg(client_sock, "ERROR: Invalid command syntax. Usage: commitf filename destination_path size receipt...");
+        return;
+    }
+    
+    char* base_filename = basename(filename);
+    RoutePool* pool = direct_pool(get_file_extension(base_filename));
+    
+    if (!pool) {
+        snprintf(response, BUFFER_SIZE, "ERROR: %s can't be uploaded directly", base_filename);
+        send_msg(client_sock, response);
+        return;
+    }
+    snprintf(full_path, sizeof(full_path), "%s/%s", dest_path, base_filename);
+    snprintf(receipt_args, sizeof(receipt_args), "%s %s", full_path, dest_path);
+    
+    // Each replica counts once, however many of its receipts come along
+    int count = route_candidates(pool, full_path, order, pool->replicas);
+    int quorum = pool->write_quorum < count ? pool->write_quorum : count;
+    
+    for (char* receipt = strtok(command + used, " "); receipt; receipt = strtok(NULL, " ")) {
+        const char* backend = token_check_receipt(receipt, receipt_args, size);
+        char name[TOKEN_BACKEND_MAX];
+        
+        for (int i = 0; i < count && backend; i++) {
+            const ServerAddr* server = &pool->backends[order[i]];
+            snprintf(name, sizeof(name), "%s:%d", server->host, server->port);
+            if (!counted[i] && strcmp(name, backend) == 0) {
+                counted[i] = 1;
+                acked++;
+            }
+        }
+    }
+    
+    if (acked < quorum) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Only %d of %d replicas stored %s", acked, count, base_filename);
+        send_msg(client_sock, response);
+        return;
+    }
+    if (acked < count) {
+        log_event(LOG_WARN, "under_replicated", full_path, acked);
+    }
+    log_sampled(LOG_INFO, "direct_upload", full_path, size);
+    
+    // Listings start from S1's own tree while it keeps one, as after an upload through S1
+    if (stored_on_s1("c")) {
+        resolve_path(dest_path, local_path, sizeof(local_path));
+        create_directory_recursive(local_path);
+    }
+    
+    snprintf(response, BUFFER_SIZE, "File %s uploaded successfully to S1", base_filename);
+    send_msg(client_sock, response);
+}
+
+// Function to remove file from appropriate server based on path
+void remove_file(int client_sock, char* filename) {
+    char response[BUFFER_SIZE];
+    char local_path[MAX_PATH];
+    const char* ext;
+    
+    // Extract filename and extension
+    char* base_filename = basename(filename);
+    ext = get_file_extension(base_filename);
+    
+    if (stored_on_s1(ext)) {
+        // Handle .c files locally
+        uint64_t t = stats_now();
+        resolve_path(filename, local_path, sizeof(local_path));
+        int failed = remove(local_path) != 0;
+        stats_add(STATS_DISK, t);
+        
+        if (failed) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file %s", filename);
+        } else {
+            snprintf(response, BUFFER_SIZE, "File %s removed successfully", filename);
+        }
+        
+        send_msg(client_sock, response);
+    } else {
+        // Determine which pool to connect to
+        RoutePool* pool = route_find(&route_table, ext);
+        int removed = 0, coded = 0;
+        
+        if (!pool) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file extension: %s", ext);
+            send_msg(client_sock, response);
+            return;
+        }
+        
+        // Queued uploads of the file must not land after it is gone; one
+        // being forwarded is waited for and then removed like the rest
+        int cancelled = spool_cancel(filename) > 0;
+        
+        // Replace S1 with the pool's server in the path
+        char modified_path[MAX_PATH];
+        char manifest_path[MAX_PATH + 8];
+        route_backend_path(pool, filename, modified_path, sizeof(modified_path));
+        
+        // An erasure-coded file's manifest goes first and its shards after
+        // it, so a failure in between never leaves a manifest without shards
+        EcManifest manifest;
+        if (ec_find_manifest(pool, filename, modified_path, &manifest) == 0) {
+            snprintf(manifest_path, sizeof(manifest_path), "%s" EC_MANIFEST_SUFFIX, modified_path);
+            coded = remove_copies(pool, filename, manifest_path, NULL) > 0 ? 1 : -1;
+            if (coded > 0)
+                ec_remove_shards(&manifest, modified_path, NULL);
+        }
+        
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for extension %s", ext);
+        removed = remove_copies(pool, filename, modified_path, response) > 0;
+        
+        if (!removed && coded < 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file %s", filename);
+        } else if (!removed && (cancelled || coded > 0)) {
+            // A file that never left the spool, or was only stored as shards, was removed all the same
+            snprintf(response, BUFFER_SIZE, "File %s removed successfully", filename);
+        }
+        
+        send_msg(client_sock, response);
+    }
+}
+
+// Function to forward a backend's tar of one file type straight to the client
+int forward_backend_tar(int client_sock, const ServerAddr* server, const char* filetype) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    long filesize;
+    int bytes_read, bytes_sent;
+    int server_sock = connect_to_server(server);
+    uint64_t t;
+    
+    if (server_sock < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to connect to server for file type %s", filetype);
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    // Send request to server
+    t = stats_now();
+    snprintf(cmd, sizeof(cmd), "SEND_TAR %s", filetype);
+    send_command(server_sock, cmd);
+    stats_add(STATS_NETWORK, t);
+    
+    // Get file size from server
+    t = stats_now();
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(server_sock, buffer, BUFFER_SIZE, 0);
+    stats_add(STATS_NETWORK, t);
+    
+    if (strncmp(buffer, "ERROR", 5) == 0) {
+        send_msg(client_sock, buffer);
+        close(server_sock);
+        return 0;
+    }
+    
+    filesize = atol(buffer);
+    flight_publish(filesize, 0, NULL);
+    
+    // Send file size to client
+    t = stats_now();
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        close(server_sock);
+        return -1;
+    }
+    
+    if (strcmp(buffer, "READY") != 0) {
+        close(server_sock);
+        return 0;
+    }
+    
+    // Tell server we're ready
+    strcpy(buffer, "READY");
+    send(server_sock, buffer, strlen(buffer), 0);
+    
+    // Forward file content from server to client
+    long total_received = 0;
+    int client_gone = 0;
+    
+    while (total_received < filesize) {
+        memset(buffer, 0, BUFFER_SIZE);
+        bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
+        
+        if (bytes_read <= 0)
+            break;
+        
+        // Followers still get the rest of the tar when this client goes away
+        if (!client_gone) {
+            bytes_sent = send_all(client_sock, buffer, bytes_read);
+            client_gone = bytes_sent < 0;
+            if (!client_gone)
+                charge_client(bytes_read);
+        }
+        if (client_gone && !flight_shared())
+            break;
+        
+        flight_write(buffer, bytes_read);
+        total_received += bytes_read;
+    }
+    
+    close(server_sock);
+    stats_add(STATS_NETWORK, t);
+    stats_bytes(total_received);
+    
+    // The client expects exactly filesize bytes; if we fell short the session can't continue
+    return client_gone || total_received < filesize ? -1 : 0;
+}
+
+// Function to save a backend's tar of one file type to a local file
+int fetch_backend_tar(const ServerAddr* server, const char* filetype, const char* path) {
+    char buffer[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE];
+    long filesize, total_received = 0;
+    int bytes_read;
+    int server_sock = connect_to_server(server);
+    FILE* file;
+    uint64_t t;
+    
+    if (server_sock < 0) {
+        return -1;
+    }
+    
+    t = stats_now();
+    snprintf(cmd, sizeof(cmd), "SEND_TAR %s", filetype);
+    send_command(server_sock, cmd);
+    
+    memset(buffer, 0, BUFFER_SIZE);
+    bytes_read = recv(server_sock, buffer, BUFFER_SIZE - 1, 0);
+    stats_add(STATS_NETWORK, t);
+    
+    // A stalled backend times out with no size, which is no tar at all
+    if (bytes_read <= 0 || buffer[0] < '0' || buffer[0] > '9' || !(file = fopen(path, "wb"))) {
+        close(server_sock);
+        return -1;
+    }
+    
+    filesize = atol(buffer);
+    send(server_sock, "READY", 5, 0);
+    
+    while (total_received < filesize) {
+        t = stats_now();
+        bytes_read = recv(server_sock, buffer, BUFFER_SIZE, 0);
+        stats_add(STATS_NETWORK, t);
+        
+        if (bytes_read <= 0)
+            break;
+        
+        t = stats_now();
+        fwrite(buffer, 1, bytes_read, file);
+        stats_add(STATS_DISK, t);
+        total_received += bytes_read;
+    }
+    
+    close(server_sock);
+    if (fclose(file) != 0 || total_received < filesize) {
+        remove(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to build the tar of a file type and send it to the client
+int build_tar(int client_sock, char* filetype) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char cmd[MAX_PATH * 2];
+    char tar_path[MAX_PATH];
+    FILE* file;
+    long filesize, total_sent = 0;
+    int bytes_read, bytes_sent;
+    uint64_t t = stats_now();
+    
+    // The pid keeps concurrent sessions from sharing the staged tar; a tar
+    // other sessions wait for is built right in their flight's buffer
+    int shared = flight_path(tar_path, sizeof(tar_path)) == 0;
+    if (!shared)
+        snprintf(tar_path, sizeof(tar_path), "/tmp/%sfiles.%d.tar", filetype, (int)getpid());
+    
+    if (stored_on_s1(filetype)) {
+        // Create tar of .c files locally, with paths relative to ~/S1
+        snprintf(cmd, sizeof(cmd), "cd '%s' && find . -name \"*.c\" -type f | tar -cf %s -T -", storage_root, tar_path);
+        
+        int tar_status = system(cmd);
+        stats_add(STATS_DISK, t);
+        
+        if (tar_status != 0) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to create tar of .c files");
+            send_msg(client_sock, response);
+            return 0;
+        }
+    } else {
+        // Tars are built for .c, .pdf and .txt files
+        RoutePool* pool = route_find(&route_table, filetype);
+        
+        if (!pool || (strcmp(filetype, "c") != 0 && strcmp(filetype, "pdf") != 0 && strcmp(filetype, "txt") != 0)) {
+            snprintf(response, BUFFER_SIZE, "ERROR: Unsupported file type: %s", filetype);
+            send_msg(client_sock, response);
+            return 0;
+        }
+        
+        // A single backend's tar goes straight through
+        if (pool->backend_count == 1) {
+            return forward_backend_tar(client_sock, &pool->backends[0], filetype);
+        }
+        
+        // Files of a pool are spread over its backends, and replicated files sit
+        // on several: unpack every backend's tar into one directory, where the
+        // copies of a path coincide, and pack that again
+        char part_path[MAX_PATH + 16];
+        char stage_dir[MAX_PATH + 16];
+        int tar_status = 0;
+        
+        snprintf(stage_dir, sizeof(stage_dir), "%s.d", tar_path);
+        mkdir(stage_dir, 0700);
+        
+        // Erasure-coded files are collected as their manifests
+        const char* types[2] = { filetype, EC_MANIFEST_SUFFIX + 1 };
+        int type_count = pool->ec_data > 0 ? 2 : 1;
+        int missed[ROUTE_MAX_BACKENDS] = { 0 };
+        int missing = 0;
+        
+        // A file has copies on replicas backends, so the tar can do without
+        // up to replicas - 1 of them that are down or behind an open breaker
+        for (int i = 0; i < pool->backend_count * type_count && tar_status == 0; i++) {
+            int b = i / type_count;
+            
+            if (missed[b])
+                continue;
+            snprintf(part_path, sizeof(part_path), "%s.%d", tar_path, i);
+            int failed = fetch_backend_tar(&pool->backends[b], types[i % type_count], part_path) < 0;
+            if (!failed) {
+                t = stats_now();
+                snprintf(cmd, sizeof(cmd), "tar -xf %s -C %s", part_path, stage_dir);
+                failed = system(cmd) != 0;
+                stats_add(STATS_DISK, t);
+            }
+            remove(part_path);
+            
+            // A part that did not arrive or unpack counts its backend as missing
+            if (failed) {
+                missed[b] = 1;
+                missing++;
+                log_event(LOG_WARN, "tar_backend_missing", pool->backends[b].host, pool->backends[b].port);
+                tar_status = missing > pool->replicas - 1 ? -1 : 0;
+            }
+        }
+        
+        if (tar_status == 0 && type_count == 2) {
+            tar_status = ec_rebuild_dir(pool, stage_dir, filetype);
+        }
+        
+        t = stats_now();
+        if (tar_status == 0) {
+            snprintf(cmd, sizeof(cmd), "cd %s && find . -type f | tar -cf %s -T -", stage_dir, tar_path);
+            tar_status = system(cmd);
+        }
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", stage_dir);
+        system(cmd);
+        stats_add(STATS_DISK, t);
+        
+        if (tar_status != 0) {
+            remove(tar_path);
+            snprintf(response, BUFFER_SIZE, "ERROR: Failed to collect .%s files from every server", filetype);
+            send_msg(client_sock, response);
+            return 0;
+        }
+    }
+    
+    // Get file size
+    struct stat st;
+    if (stat(tar_path, &st) == -1) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to get tar file size");
+        send_msg(client_sock, response);
+        return 0;
+    }
+    
+    filesize = st.st_size;
+    
+    // Open the tar before announcing its size so the client never gets an error mid-stream
+    file = fopen(tar_path, "rb");
+    if (!file) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot open tar file");
+        send_msg(client_sock, response);
+        return 0;
+    }
+    if (shared) {
+        flight_publish(filesize, filesize, NULL);
+    } else {
+        remove(tar_path);  // Clean up once the open handle is closed
+    }
+    
+    // Send file size to client
+    t = stats_now();
+    sprintf(buffer, "%ld", filesize);
+    send_msg(client_sock, buffer);
+    
+    // Wait for client to be ready
+    if (recv_msg(client_sock, buffer, BUFFER_SIZE) < 0) {
+        fclose(file);
+        return -1;
+    }
+    stats_add(STATS_NETWORK, t);
+    
+    if (strcmp(buffer, "READY") != 0) {
+        fclose(file);
+        return 0;
+    }
+    
+    // Send file content
+    while (total_sent < filesize) {
+        t = stats_now();
+        bytes_read = fread(buffer, 1, BUFFER_SIZE, file);
+        stats_add(STATS_DISK, t);
+        if (bytes_read <= 0)
+            break;
+        
+        t = stats_now();
+        bytes_sent = send_all(client_sock, buffer, bytes_read);
+        stats_add(STATS_NETWORK, t);
+        if (bytes_sent < 0) {
+            break;
+        }
+        total_sent += bytes_read;
+        charge_client(bytes_read);
+    }
+    
+    fclose(file);
+    stats_bytes(total_sent);
+    
+    // The client expects exactly filesize bytes; if we fell short the session can't continue
+    return total_sent < filesize ? -1 : 0;
+}
+
+// Function to download tar file of specified file type; concurrent requests
+// for the same tar share one build
+int download_tar(int client_sock, char* filetype) {
+    Flight* flight;
+    char key[MAX_PATH + 16];
+    
+    snprintf(key, sizeof(key), "downltar %s", filetype);
+    if (flight_join(key, &flight) == FLIGHT_FOLLOWER) {
+        int result = follow_flight(client_sock, flight, NULL);
+        if (result != FLIGHT_RETRY)
+            return result;
+    }
+    
+    int result = build_tar(client_sock, filetype);
+    flight_end();
+    return result;
+}
+
+// Function to add a file to a growing list; -1 when memory runs out
+int add_file_info(FileInfo** files, int* file_count, int* max_files, const char* filename, const char* ext) {
+    if (*file_count >= *max_files) {
+        FileInfo* grown = (FileInfo*)realloc(*files, *max_files * 2 * sizeof(FileInfo));
+        if (!grown)
+            return -1;
+        *files = grown;
+        *max_files *= 2;
+    }
+    
+    snprintf((*files)[*file_count].filename, MAX_FILENAME, "%s", filename);
+    snprintf((*files)[*file_count].extension, sizeof((*files)[*file_count].extension), "%s", ext);
+    (*file_count)++;
+    
+    return 0;
+}
+
+// Function to compare two file infos for sorting alphabetically
+int compare_file_info(const void* a, const void* b) {
+    return strcmp(((FileInfo*)a)->filename, ((FileInfo*)b)->filename);
+}
+
+// Function to append the files of one extension to the listing
+void append_file_group(char* response, size_t size, const FileInfo* files, int file_count, const char* ext) {
+    size_t len = strlen(response);
+    
+    for (int i = 0; i < file_count; i++) {
+        // The same file can sit on two backends of a pool while it grows; list it once
+        if (strcmp(files[i].extension, ext) != 0 || (i > 0 && strcmp(files[i].filename, files[i - 1].filename) == 0))
+            continue;
+        if (len + strlen(files[i].filename) + 2 >= size)
+            break;
+        len += snprintf(response + len, size - len, "%s\n", files[i].filename);
+    }
+}
+
+// Function to display file names in specified path
+void display_filenames(int client_sock, char* pathname) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE * 8]; // Larger buffer for collected filenames
+    char cmd[BUFFER_SIZE];
+    char local_path[MAX_PATH];
+    char modified_path[MAX_PATH];
+    DIR* dir = NULL;
+    struct dirent* ent;
+    int server_sock;
+    int found = 0;                  // Some server has the directory
+    uint64_t t = stats_now();
+    
+    // Check if directory exists; without .c files of its own S1 leaves that to the backends
+    if (stored_on_s1("c")) {
+        resolve_path(pathname, local_path, sizeof(local_path));
+        dir = opendir(local_path);
+        if (!dir) {
+            stats_add(STATS_DISK, t);
+            snprintf(response, BUFFER_SIZE, "ERROR: Directory %s not found", pathname);
+            send_msg(client_sock, response);
+            return;
+        }
+        found = 1;
+    }
+    
+    // Get .c files from S1
+    FileInfo* files = NULL;
+    int file_count = 0;
+    int max_files = 100; // Initial capacity
+    int failed = 0;
+    char unavailable[BUFFER_SIZE] = "";
+    
+    files = (FileInfo*)malloc(max_files * sizeof(FileInfo));
+    if (!files) {
+        if (dir)
+            closedir(dir);
+        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
+        send_msg(client_sock, response);
+        return;
+    }
+    
+    // Get local .c files
+    while (dir && (ent = readdir(dir)) != NULL && !failed) {
+        if (ent->d_type == DT_REG && strcmp(get_file_extension(ent->d_name), "c") == 0) {
+            failed = add_file_info(&files, &file_count, &max_files, ent->d_name, "c") < 0;
+        }
+    }
+    if (dir)
+        closedir(dir);
+    stats_add(STATS_DISK, t);
+    
+    // Ask every backend of every routed pool for its files of each routed extension
+    for (int r = 0; r < route_table.route_count && !failed; r++) {
+        RoutePool* pool = &route_table.pools[route_table.routes[r].pool];
+        const char* ext = route_table.routes[r].ext;
+        
+        route_backend_path(pool, pathname, modified_path, sizeof(modified_path));
+        
+        // Erasure-coded files are listed by their manifests
+        for (int i = 0; i < pool->backend_count * (pool->ec_data > 0 ? 2 : 1) && !failed; i++) {
+            int b = pool->ec_data > 0 ? i / 2 : i;
+            int coded = pool->ec_data > 0 && i % 2 == 1;
+            
+            server_sock = connect_to_server(&pool->backends[b]);
+            if (server_sock < 0) {
+                // Say whose files may be missing rather than leave them out silently
+                char name[96];
+                snprintf(name, sizeof(name), " %s:%d", pool->backends[b].host, pool->backends[b].port);
+                if (!strstr(unavailable, name) && strlen(unavailable) + strlen(name) < sizeof(unavailable))
+                    strcat(unavailable, name);
+                continue;
+            }
+            
+            t = stats_now();
+            snprintf(cmd, BUFFER_SIZE, "LIST_FILES %s %s", modified_path, coded ? EC_MANIFEST_SUFFIX + 1 : ext);
+            send_command(server_sock, cmd);
+            
+            memset(buffer, 0, BUFFER_SIZE);
+            recv(server_sock, buffer, BUFFER_SIZE - 1, 0);
+            stats_add(STATS_NETWORK, t);
+            close(server_sock);
+            
+            // An empty directory answers "No files found", which is not a file name
+            if (strncmp(buffer, "ERROR", 5) == 0)
+                continue;
+            found = 1;
+            if (strcmp(buffer, "No files found") == 0)
+                continue;
+            
+            // Parse the response; name.txt.ecm stands for name.txt
+            char* save;
+            for (char* token = strtok_r(buffer, ",", &save); token && !failed; token = strtok_r(NULL, ",", &save)) {
+                if (coded) {
+                    token[strlen(token) - strlen(EC_MANIFEST_SUFFIX)] = 0;
+                    if (strcmp(get_file_extension(token), ext) != 0)
+                        continue;
+                }
+                failed = add_file_info(&files, &file_count, &max_files, token, ext) < 0;
+            }
+        }
+    }
+    
+    // Uploads still in the spool are listed as stored
+    if (spool && !failed) {
+        size_t dir_len = strlen(pathname);
+        while (dir_len > 1 && pathname[dir_len - 1] == '/')
+            dir_len--;
+        
+        spool_lock();
+        for (int i = 0; i < SPOOL_MAX_ENTRIES && !failed; i++) {
+            const char* path = spool->entries[i].path;
+            const char* name = strrchr(path, '/');
+            
+            if (spool->entries[i].state == SPOOL_FREE || !name || (size_t)(name - path) != dir_len ||
+                strncmp(path, pathname, dir_len) != 0)
+                continue;
+            if (route_find(&route_table, get_file_extension(name + 1))) {
+                failed = add_file_info(&files, &file_count, &max_files, name + 1, get_file_extension(name + 1)) < 0;
+                found = 1;
+            }
+        }
+        spool_unlock();
+    }
+    
+    if (failed) {
+        free(files);
+        snprintf(response, BUFFER_SIZE, "ERROR: Memory allocation failed");
+        send_msg(client_sock, response);
+        return;
+    }
+    
+    // No server has the directory, and none that might is out of reach
+    if (!found && !unavailable[0]) {
+        free(files);
+        snprintf(response, BUFFER_SIZE, "ERROR: Directory %s not found", pathname);
+        send_msg(client_sock, response);
+        return;
+    }
+    
+    // Sort files alphabetically, then list them grouped by extension: .c first,
+    // then the routed extensions in routing table order
+    qsort(files, file_count, sizeof(FileInfo), compare_file_info);
+    
+    memset(response, 0, sizeof(response));
+    
+    if (file_count == 0) {
+        strcpy(response, "No files found in the specified directory");
+    } else {
+        strcat(response, "Files in directory:\n");
+        append_file_group(response, sizeof(response), files, file_count, "c");
+        for (int r = 0; r < route_table.route_count; r++) {
+            if (strcmp(route_table.routes[r].ext, "c") != 0)
+                append_file_group(response, sizeof(response), files, file_count, route_table.routes[r].ext);
+        }
+    }
+    if (unavailable[0] && strlen(response) + strlen(unavailable) + 32 < sizeof(response)) {
+        strcat(response, file_count == 0 ? "\n" : "");
+        strcat(response, "Unavailable servers:");
+        strcat(response, unavailable);
+        strcat(response, "\n");
+    }
+    
+    free(files);
+    
+    // Send response to client
+    t = stats_now();
+    send_msg(client_sock, response);
+    stats_add(STATS_NETWORK, t);
+    stats_bytes(strlen(response));
+}
+
+// Function to fetch a report from a backend with the same exchange as SEND_FILE:
+// size, READY, then the body. Returns its length, or -1 if the backend can't deliver it.
+long fetch_backend_report(const ServerAddr* server, const char* cmd, char* out, size_t size) {
+    char buffer[BUFFER_SIZE];
+    long report_size = -1;
+    int server_sock = connect_to_server(server);
+    
+    if (server_sock < 0) {
+        return -1;
+    }
+    
+    send_command(server_sock, cmd);
+    
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(server_sock, buffer, BUFFER_SIZE, 0);
+    
+    if (strncmp(buffer, "ERROR", 5) != 0 && atol(buffer) >= 0 && (size_t)atol(buffer) < size) {
+        report_size = atol(buffer);
+        send(server_sock, "READY", 5, 0);
+        if (recv_all(server_sock, out, report_size) < 0) {
+            report_size = -1;
+        } else {
+            out[report_size] = 0;
+        }
+    }
+    
+    close(server_sock);
+    return report_size;
+}
+
+// Function to report the statistics of S1 and every backend as text or JSON
+void report_stats(int client_sock, const char* format) {
+    const ServerAddr* backends[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    const RoutePool* pools[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    int count = route_all_backends(&route_table, backends, pools, ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS);
+    int json = strcmp(format, "json") == 0;
+    size_t size = STATS_REPORT_SIZE * (count + 2), len = 0;
+    char* report = malloc(size);
+    char cmd[32];
+    
+    if (!report) {
+        send_msg(client_sock, "ERROR: Memory allocation failed");
+        return;
+    }
+    
+    if (json)
+        len += snprintf(report + len, size - len, "{\"servers\":[");
+    len += stats_format(report + len, STATS_REPORT_SIZE, json);
+    if (cache) {
+        len += snprintf(report + len, size - len, json ? "," : "");
+        len += cache_format(report + len, STATS_REPORT_SIZE, json);
+    }
+    
+    snprintf(cmd, sizeof(cmd), "STATS %s", json ? "json" : "text");
+    for (int i = 0; i < count; i++) {
+        len += snprintf(report + len, size - len, json ? "," : "\n");
+        
+        long got = fetch_backend_report(backends[i], cmd, report + len, STATS_REPORT_SIZE);
+        if (got >= 0) {
+            len += got;
+        } else {
+            // An unreachable backend gets a placeholder
+            len += snprintf(report + len, size - len, json ? "{\"server\":\"%s\",\"address\":\"%s:%d\",\"error\":\"unavailable\"}"
+                            : "%s %s:%d unavailable\n", pools[i]->prefix, backends[i]->host, backends[i]->port);
+        }
+    }
+    
+    if (json)
+        snprintf(report + len, size - len, "]}");
+    send_msg(client_sock, report);
+    free(report);
+}
+
+// Function to export the spans of S1 and every backend as one Chrome trace,
+// all recorded spans or only those of one trace id
+void report_trace(int client_sock, const char* trace_id) {
+    const ServerAddr* backends[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    const RoutePool* pools[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    int count = route_all_backends(&route_table, backends, pools, ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS);
+    size_t size = TRACE_EXPORT_SIZE * (count + 1) + 64, len = 0;
+    char* report = malloc(size);
+    char cmd[64];
+    
+    if (!report) {
+        send_msg(client_sock, "ERROR: Memory allocation failed");
+        return;
+    }
+    
+    len += snprintf(report + len, size - len, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    len += trace_export(report + len, TRACE_EXPORT_SIZE, strtoull(trace_id, NULL, 16));
+    
+    snprintf(cmd, sizeof(cmd), "TRACE %s", trace_id);
+    for (int i = 0; i < count; i++) {
+        report[len] = ',';
+        
+        long got = fetch_backend_report(backends[i], cmd, report + len + 1, TRACE_EXPORT_SIZE);
+        if (got > 0) {
+            len += got + 1;
+        }
+    }
+    
+    snprintf(report + len, size - len, "]}");
+    send_msg(client_sock, report);
+    free(report);
+}
+
+// Function to find the path a command writes or removes, "" for a read: the
+// path is forgotten before the command and again after it, so neither the
+// old content nor a read that raced the write outlives it
+void written_path(const char* cmd, int args, const char* arg1, const char* arg2, char* out, size_t size) {
+    const char* base_filename = strrchr(arg1, '/');
+    
+    out[0] = '\0';
+    if (args >= 2 && strcmp(cmd, "removef") == 0) {
+        snprintf(out, size, "%s", arg1);
+    } else if (args >= 3 && (strcmp(cmd, "uploadf") == 0 || strcmp(cmd, "placef") == 0 || strcmp(cmd, "commitf") == 0 ||
+                             strcmp(cmd, "deltaf") == 0)) {
+        snprintf(out, size, "%s/%s", arg2, base_filename ? base_filename + 1 : arg1);
+    }
+}
+
+// Function to drop what S1 holds of a path being written or removed: its
+// cached content, and the flights of it and of its type's tar
+void forget_path(const char* path) {
+    char key[MAX_PATH * 2 + 16];
+    const char* base_filename = strrchr(path, '/');
+    
+    cache_invalidate(path);
+    snprintf(key, sizeof(key), "downlf %s", path);
+    flight_close(key);
+    snprintf(key, sizeof(key), "downltar %s", get_file_extension(base_filename ? base_filename + 1 : path));
+    flight_close(key);
+}
+
+// Function to turn a transfer away while S1 is at its limits. An upload's
+// or a delta's size follows its command unasked, so it is read first to
+// keep the session in step with the client.
+int refuse_transfer(int client_sock, const char* cmd) {
+    char buffer[BUFFER_SIZE];
+    
+    if ((strcmp(cmd, "uploadf") == 0 || strcmp(cmd, "deltaf") == 0) && recv_msg(client_sock, buffer, BUFFER_SIZE) < 0)
+        return -1;
+    
+    snprintf(buffer, BUFFER_SIZE, "ERROR: Server busy, retry after %d ms", admit_retry_ms());
+    return send_msg(client_sock, buffer) < 0 ? -1 : 0;
+}
+
+// Function to handle client. The session stays open across commands until the
+// client disconnects, goes quiet for SESSION_IDLE_TIMEOUT, or a transfer breaks
+// the stream.
+void prcclient(int client_sock) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char cmd[32], arg1[MAX_PATH], arg2[MAX_PATH];
+    char written[MAX_PATH * 2 + 2];
+    int read_size;
+    int status = 0;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    
+    // The client's address picks its tenant, unless it names another later
+    if (getpeername(client_sock, (struct sockaddr*)&peer, &peer_len) < 0)
+        peer.sin_addr.s_addr = 0;
+    qos_attach(ntohl(peer.sin_addr.s_addr));
+    
+    while (status == 0) {
+        // Clear buffers
+        memset(buffer, 0, BUFFER_SIZE);
+        memset(response, 0, BUFFER_SIZE);
+        memset(cmd, 0, sizeof(cmd));
+        memset(arg1, 0, sizeof(arg1));
+        memset(arg2, 0, sizeof(arg2));
+        
+        // Wait for the next command; clients ping at least every few seconds while idle
+        struct pollfd pfd = { client_sock, POLLIN, 0 };
+        if (poll(&pfd, 1, SESSION_IDLE_TIMEOUT * 1000) <= 0) {
+            // Idle session
+            break;
+        }
+        
+        // Receive command from client
+        read_size = recv_msg(client_sock, buffer, BUFFER_SIZE);
+        
+        if (read_size <= 0) {
+            // Client disconnected or error
+            break;
+        }
+        
+        // Take the trace prefix off; the gap since the client sent the command is its queueing time
+        uint64_t received = stats_now();
+        uint64_t received_us = trace_now_us();
+        trace_parse(buffer);
+        
+        // Parse command
+        int args = sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
+        
+        // Heartbeats are answered without logging
+        if (strcmp(cmd, "ping") == 0) {
+            send_msg(client_sock, "PONG");
+            continue;
+        }
+        
+        // Statistics requests are not measured themselves
+        if (strcmp(cmd, "STATS") == 0 || strcmp(cmd, "stats") == 0) {
+            report_stats(client_sock, args >= 2 ? arg1 : "text");
+            continue;
+        }
+        if (strcmp(cmd, "TRACE") == 0 || strcmp(cmd, "trace") == 0) {
+            report_trace(client_sock, args >= 2 ? arg1 : "0");
+            continue;
+        }
+        if (strcmp(cmd, "tenant") == 0) {
+            if (args < 2 || strlen(arg1) >= QOS_NAME_MAX) {
+                snprintf(response, BUFFER_SIZE, "ERROR: Invalid command syntax. Usage: tenant name (up to %d characters)",
+                         QOS_NAME_MAX - 1);
+            } else {
+                // The reply names the tenant the session is charged to, which
+                // is another one when S1 doesn't let the client pick
+                char tenant[QOS_NAME_MAX];
+                qos_announce(arg1, tenant, sizeof(tenant));
+                snprintf(response, BUFFER_SIZE, "Tenant %s", tenant);
+            }
+            send_msg(client_sock, response);
+            continue;
+        }
+        
+        // Every command counts against the tenant's operation rate
+        qos_admit();
+        
+        // Transfers run only while S1 is under its limits, see dfs_admit.h
+        int transfer = ((strcmp(cmd, "uploadf") == 0 || strcmp(cmd, "deltaf") == 0) && args >= 3) ||
+                       ((strcmp(cmd, "downlf") == 0 || strcmp(cmd, "downltar") == 0) && args >= 2);
+        if (transfer && admit_begin() < 0) {
+            log_sampled(LOG_DEBUG, "transfer_refused", buffer, 0);
+            status = refuse_transfer(client_sock, cmd);
+            continue;
+        }
+        
+        if (trace_sent_us) {
+            trace_span("queue", trace_sent_us, received_us, NULL, NULL);
+        }
+        
+        log_sampled(LOG_INFO, "command", buffer, 0);
+        stats_begin(stats_lookup(cmd), received);
+        stats_add(STATS_PARSE, received);
+        
+        written_path(cmd, args, arg1, arg2, written, sizeof(written));
+        if (written[0])
+            forget_path(written);
+        
+        if (strcmp(cmd, "uploadf") == 0) {
+            // Upload file
+            if (args < 3) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: uploadf filename destination_path");
+                send_msg(client_sock, response);
+            } else {
+                status = upload_file(client_sock, arg1, arg2);
+            }
+        } else if (strcmp(cmd, "downlf") == 0) {
+            // Download file
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: downlf filename [version]");
+                send_msg(client_sock, response);
+            } else {
+                status = download_file(client_sock, arg1, args >= 3 ? arg2 : NULL);
+            }
+        } else if (strcmp(cmd, "removef") == 0) {
+            // Remove file
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: removef filename");
+                send_msg(client_sock, response);
+            } else {
+                remove_file(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "downltar") == 0) {
+            // Download tar
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: downltar filetype");
+                send_msg(client_sock, response);
+            } else {
+                status = download_tar(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "locatef") == 0) {
+            // Where to download a file from directly
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: locatef filename");
+                send_msg(client_sock, response);
+            } else {
+                locate_file(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "placef") == 0) {
+            // Where to upload a file to directly
+            if (args < 3) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: placef filename destination_path");
+                send_msg(client_sock, response);
+            } else {
+                place_upload(client_sock, arg1, arg2);
+            }
+        } else if (strcmp(cmd, "commitf") == 0) {
+            // A direct upload is in place
+            commit_upload(client_sock, buffer);
+        } else if (strcmp(cmd, "signf") == 0) {
+            // Signatures of a file's stored version, for a delta upload
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: signf filename");
+                send_msg(client_sock, response);
+            } else {
+                status = send_signatures(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "deltaf") == 0) {
+            // Upload the changes to a file
+            status = upload_delta(client_sock, buffer);
+        } else if (strcmp(cmd, "dispfnames") == 0) {
+            // Display filenames
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax. Usage: dispfnames pathname");
+                send_msg(client_sock, response);
+            } else {
+                display_filenames(client_sock, arg1);
+            }
+        } else {
+            // Unknown command
+            strcpy(response, "ERROR: Unknown command");
+            send_msg(client_sock, response);
+        }
+        
+        if (written[0])
+            forget_path(written);
+        qos_flush();
+        admit_end(status == 0);
+        
+        // A broken transfer ends the session and counts as a failure
+        if (status < 0)
+            stats_error();
+        if (stats_current.error)
+            log_event(LOG_WARN, "command_failed", buffer, status);
+        trace_span(cmd, received_us, trace_now_us(), arg1, stats_current.phase);
+        stats_end();
+    }
+    
+    // Clean up
+    qos_detach();
+    close(client_sock);
+}
+
+// Function to turn a client away while every session process is busy
+void refuse_session(int sock) {
+    char response[BUFFER_SIZE];
+    
+    log_event(LOG_WARN, "session_refused", "all session processes busy", worker_limit);
+    snprintf(response, BUFFER_SIZE, "ERROR: Server busy, retry after %d ms", SESSION_RETRY_MS);
+    send_msg(sock, response);
+    
+    // Read what the client already sent, so closing doesn't reset the
+    // connection before it sees the reply
+    while (recv(sock, response, sizeof(response), MSG_DONTWAIT) > 0)
+        ;
+    close(sock);
+}
+
+// Function to note a SIGHUP; the accept loop rereads the routing table
+void handle_reload(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
+// Function to make every routed backend known to the health monitor
+void watch_backends() {
+    const ServerAddr* servers[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    const RoutePool* pools[ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS];
+    int count = route_all_backends(&route_table, servers, pools, ROUTE_MAX_POOLS * ROUTE_MAX_BACKENDS);
+    
+    for (int i = 0; i < count; i++)
+        backend_lookup(servers[i]);
+}
+
+// Function to reread the routing table. Sessions already running keep the
+// table they started with, and a bad file leaves the current table in place.
+void reload_routes() {
+    RouteTable fresh;
+    char error[CONFIG_ERROR_SIZE] = "";
+    
+    reload_requested = 0;
+    if (route_config[0] == 0)
+        return;
+    
+    // The forwarder routes queued uploads with its own copy of the table
+    if (spool_forwarder > 0)
+        kill(spool_forwarder, SIGHUP);
+    
+    if (route_load(&fresh, route_config, error, sizeof(error)) < 0) {
+        log_event(LOG_ERROR, "route_reload_failed", error, 0);
+        return;
+    }
+    
+    route_free(&route_table);
+    route_table = fresh;
+    watch_backends();
+    log_event(LOG_INFO, "route_reloaded", route_config, route_table.pool_count);
+}
+
+// Function to store one upload from the spool on its pool. Returns 0 when
+// it needs no more forwarding, -1 to try again later.
+int forward_spooled(const SpoolEntry* entry) {
+    char dest_path[MAX_PATH];
+    const char* base_filename = strrchr(entry->path, '/');
+    
+    if (!base_filename)
+        return 0;
+    base_filename++;
+    snprintf(dest_path, sizeof(dest_path), "%.*s", (int)(base_filename - 1 - entry->path), entry->path);
+    
+    // A pool dropped by a reload may come back with the next one
+    RoutePool* pool = route_find(&route_table, get_file_extension(base_filename));
+    if (!pool) {
+        log_event(LOG_ERROR, "spool_unroutable", entry->path, (long)entry->seq);
+        return -1;
+    }
+    
+    FILE* file = spool_open(entry);
+    if (!file) {
+        log_event(LOG_ERROR, "spool_lost", entry->path, (long)entry->seq);
+        return 0;
+    }
+    
+    int failed = store_upload(-1, file, entry->size, pool, entry->path, dest_path, base_filename);
+    fclose(file);
+    
+    if (failed) {
+        log_event(LOG_WARN, "spool_forward_failed", entry->path, entry->attempts + 1);
+    } else {
+        log_event(LOG_DEBUG, "spool_forwarded", entry->path, entry->size);
+    }
+    return failed;
+}
+
+// Function to forward the upload spool for as long as S1 runs: the oldest
+// due upload first and the next right after it, so a backlog drains in one
+// go; a failed upload waits out a growing backoff and the rest go on meanwhile
+void run_forwarder(pid_t server) {
+    SpoolEntry entry;
+    
+    while (getppid() == server) {
+        if (reload_requested) {
+            reload_routes();
+        }
+        
+        if (spool_claim(&entry, backend_now_us()) < 0) {
+            spool_cleanup();
+            usleep(SPOOL_IDLE_US);
+            continue;
+        }
+        
+        trace_current = 0;
+        int stored = forward_spooled(&entry) == 0;
+        spool_finish(&entry, stored, backend_now_us());
+    }
+    
+    exit(0);
+}
+
+// Function to serve client sessions for as long as S1 runs: accept one on
+// the group's listener, serve it, and come back for the next. Workers pick up
+// a reload between sessions and leave reloading the forwarder to S1 itself.
+void run_worker(pid_t server) {
+    struct sockaddr_in address;
+    
+    signal(SIGHUP, SIG_IGN);
+    spool_forwarder = 0;
+    admit_owner = qos_owner = worker_self;
+    
+    while (getppid() == server) {
+        int client_sock = workers_accept(&address);
+        
+        if (client_sock < 0) {
+            if (errno != EINTR)
+                log_event(LOG_ERROR, "accept_failed", strerror(errno), errno);
+            continue;
+        }
+        if (workers_reloaded()) {
+            reload_routes();
+        }
+        
+        log_event(LOG_INFO, "client_connected", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+        trace_current = 0;
+        prcclient(client_sock);
+        
+        if (workers_surplus())
+            break;
+    }
+    
+    exit(0);
+}
+
+// Function to give back what a session process held when it exited: a
+// worker that died mid-session never got to release its transfer or tenant
+void reclaim_worker(int slot) {
+    if (admit_reclaim(slot))
+        log_event(LOG_WARN, "worker_lost", "transfer reclaimed", slot);
+    qos_reclaim(slot);
+}
+
+// Function to reread the tenant limits; sessions already running follow them at once
+void reload_qos() {
+    QosConfig* fresh;
+    char error[CONFIG_ERROR_SIZE] = "";
+    
+    if (qos_config[0] == 0 || !(fresh = malloc(sizeof(QosConfig))))
+        return;
+    
+    if (qos_load(fresh, qos_config, error, sizeof(error)) < 0) {
+        log_event(LOG_ERROR, "qos_reload_failed", error, 0);
+    } else {
+        qos_configure(fresh);
+        log_event(LOG_INFO, "qos_reloaded", qos_config, fresh->class_count);
+    }
+    free(fresh);
+}
+
+// Function to print usage information
+void print_usage(const char* program) {
+    printf("Usage: %s [-p port] [-r root] [-l listen_fd] [-R ready_fd] [-c routing.conf | -2 addr -3 addr -4 addr]\n", program);
+    printf("  -p port        Port to listen on, 0 for any free port (default %d)\n", PORT);
+    printf("  -r root        Storage directory for ~/S1 paths (default $HOME/S1)\n");
+    printf("  -l listen_fd   Serve on an inherited, already listening socket\n");
+    printf("  -R ready_fd    Write \"READY <port>\" to this descriptor once serving\n");
+    printf("  -c file        Routing table of backend pools; reread on SIGHUP\n");
+    printf("  -2/-3/-4 addr  host:port of S2, S3 and S4 without a routing table (default 127.0.0.1:%d-%d)\n", S2_PORT, S4_PORT);
+    printf("  -L level       Lowest log level: debug, info, warn, error or off (default info)\n");
+    printf("  -S n           Log one of every n commands (default 1)\n");
+    printf("  -P ms          Health probe interval for every backend, 0 for none (default %d)\n", HEALTH_INTERVAL_MS);
+    printf("  -H pct         Hedge a replicated read once it is slower than this percentile, 0 never (default %d)\n",
+           HEDGE_PERCENTILE);
+    printf("  -W dir         Write-behind: acknowledge uploads once spooled in dir and forward them in the background\n");
+    printf("  -Q file        Bandwidth and operation limits per tenant; reread on SIGHUP\n");
+    printf("  -w n           Listeners, each with its own pool of session processes (default: one per CPU)\n");
+    printf("  -A             Pin each listener's session processes to a CPU of their own\n");
+    printf("  -U             Reach backends on this host over TCP too, not their Unix sockets\n");
+    printf("  -C n           Session processes at most; clients beyond are turned away (default %d)\n", WORKER_MAX);
+    printf("  -T n           Transfers in flight at most; the adaptive limit stays below (default %d)\n", TRANSFER_LIMIT);
+    printf("  -B bytes       Upload bytes in flight at most, K/M/G suffix (default no limit)\n");
+    printf("  -K file        Key shared with the backends: sign commands, and let clients move files directly\n");
+    printf("  -M bytes       Keep hot files read from the pools in a memory cache this big, K/M/G suffix (default none)\n");
+    printf("  -F dir         Coalesce concurrent identical downloads and tars through buffers in dir, e.g. /dev/shm\n");
+}
+
+int main(int argc, char* argv[]) {
+    int server_fd = -1;
+    struct sockaddr_in address;
+    int opt = 1;
+    int addrlen = sizeof(address);
+    int port = PORT;
+    int ready_fd = -1;
+    int log_level = LOG_INFO;
+    unsigned log_sample = 1;
+    int hedge_percentile = HEDGE_PERCENTILE;
+    int health_interval = HEALTH_INTERVAL_MS;
+    char spool_path[MAX_PATH] = "";
+    ServerAddr s2_addr = { "127.0.0.1", S2_PORT };
+    ServerAddr s3_addr = { "127.0.0.1", S3_PORT };
+    ServerAddr s4_addr = { "127.0.0.1", S4_PORT };
+    char route_error[CONFIG_ERROR_SIZE] = "";
+    int groups = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int pin = 0;
+    int session_limit = WORKER_MAX;
+    int transfer_limit = TRANSFER_LIMIT;
+    long byte_limit = 0;
+    long cache_size = 0;
+    char flight_path_dir[MAX_PATH] = "";
+    int ch;
+    
+    snprintf(storage_root, sizeof(storage_root), "%s/S1", getenv("HOME"));
+    
+    // Parse command line options
+    while ((ch = getopt(argc, argv, "p:r:l:R:c:2:3:4:L:S:H:P:W:Q:w:AUC:T:B:K:M:F:h")) != -1) {
+        switch (ch) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            snprintf(storage_root, sizeof(storage_root), "%s", optarg);
+            break;
+        case 'l':
+            server_fd = atoi(optarg);
+            break;
+        case 'R':
+            ready_fd = atoi(optarg);
+            break;
+        case 'c':
+            snprintf(route_config, sizeof(route_config), "%s", optarg);
+            break;
+        case '2':
+        case '3':
+        case '4':
+            if (route_parse_addr(optarg, ch == '2' ? &s2_addr : ch == '3' ? &s3_addr : &s4_addr) < 0) {
+                printf("Invalid address for S%c: %s\n", ch, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            if ((log_level = log_parse_level(optarg)) < 0) {
+                printf("Invalid log level: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            log_sample = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'P':
+            health_interval = atoi(optarg);
+            break;
+        case 'W':
+            snprintf(spool_path, sizeof(spool_path), "%s", optarg);
+            break;
+        case 'Q':
+            snprintf(qos_config, sizeof(qos_config), "%s", optarg);
+            break;
+        case 'w':
+            groups = atoi(optarg);
+            if (groups < 1 || groups > WORKER_MAX_GROUPS) {
+                printf("Invalid listener count: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            pin = 1;
+            break;
+        case 'U':
+            local_enabled = 0;
+            break;
+        case 'K':
+            if (token_load_key(optarg) < 0) {
+                printf("Cannot read key file %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            session_limit = atoi(optarg);
+            if (session_limit < 1 || session_limit > WORKER_MAX) {
+                printf("Invalid session limit: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            transfer_limit = atoi(optarg);
+            if (transfer_limit < 1) {
+                printf("Invalid transfer limit: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            if ((byte_limit = qos_parse_size(optarg)) < 0) {
+                printf("Invalid byte limit: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            if ((cache_size = qos_parse_size(optarg)) <= 0) {
+                printf("Invalid cache size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            if (access(optarg, W_OK) != 0) {
+                printf("Cannot write to flight directory %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            snprintf(flight_path_dir, sizeof(flight_path_dir), "%s", optarg);
+            break;
+        case 'H':
+            hedge_percentile = atoi(optarg);
+            if (hedge_percentile < 0 || hedge_percentile > 99) {
+                printf("Invalid hedge percentile: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    
+    // Build the routing table: from the config file, or pdf/txt/zip to S2/S3/S4
+    if (route_config[0] ? route_load(&route_table, route_config, route_error, sizeof(route_error))
+                        : route_defaults(&route_table, &s2_addr, &s3_addr, &s4_addr)) {
+        printf("Invalid routing table: %s\n", route_error[0] ? route_error : "out of memory");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Tenant limits live in a shared table that every session draws from
+    if (qos_config[0]) {
+        QosConfig* config = malloc(sizeof(QosConfig));
+        char qos_error[CONFIG_ERROR_SIZE] = "";
+        
+        if (!config || qos_init() < 0 || qos_load(config, qos_config, qos_error, sizeof(qos_error)) < 0) {
+            printf("Invalid tenant limits: %s\n", qos_error[0] ? qos_error : "out of memory");
+            exit(EXIT_FAILURE);
+        }
+        qos_configure(config);
+        free(config);
+    }
+    
+    if (server_fd < 0) {
+        // Creating socket file descriptor
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Set socket options; SO_REUSEPORT lets the other listeners share the port
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+            setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+            perror("setsockopt failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        
+        // Bind socket to port
+        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Listen for connections
+        if (listen(server_fd, WORKER_BACKLOG) < 0) {
+            perror("listen failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Report the port actually bound, which differs from -p 0
+    if (getsockname(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen) < 0) {
+        perror("getsockname failed");
+        exit(EXIT_FAILURE);
+    }
+    port = ntohs(address.sin_port);
+    
+    printf("Server S1 started. Listening on port %d...\n", port);
+    
+    // Shared statistics, mapped before forking so every session records into it
+    if (stats_init("S1", stats_ops, sizeof(stats_ops) / sizeof(stats_ops[0])) < 0) {
+        perror("stats_init failed");
+    }
+    if (trace_init(1, "S1") < 0) {
+        perror("trace_init failed");
+    }
+    if (log_init("S1", log_level, log_sample) < 0) {
+        perror("log_init failed");
+    }
+    if (backend_init(hedge_percentile) < 0) {
+        perror("backend_init failed");
+    }
+    watch_backends();
+    if (backend_start_monitor(health_interval) < 0) {
+        perror("backend_start_monitor failed");
+    }
+    
+    // Create the storage directory if it doesn't exist
+    create_directory_recursive(storage_root);
+    
+    // A client that hangs up mid-transfer must fail that transfer, not kill
+    // the session process before it releases what it holds; sendfile has no
+    // MSG_NOSIGNAL, so the forwarder and every worker ignore SIGPIPE
+    signal(SIGPIPE, SIG_IGN);
+    
+    // SIGHUP rereads the routing table; it must interrupt accept, so no SA_RESTART
+    struct sigaction reload_action = { 0 };
+    reload_action.sa_handler = handle_reload;
+    sigemptyset(&reload_action.sa_mask);
+    sigaction(SIGHUP, &reload_action, NULL);
+    
+    // Write-behind: replay the spool left by the last run and fork the
+    // forwarder, which inherits the SIGHUP handler to follow reloads
+    if (spool_path[0]) {
+        int pending = spool_init(spool_path);
+        pid_t server = getpid();
+        
+        if (pending < 0) {
+            perror("spool_init failed");
+            exit(EXIT_FAILURE);
+        }
+        if (pending > 0) {
+            log_event(LOG_INFO, "spool_recovered", spool_path, pending);
+        }
+        
+        fflush(stdout);
+        spool_forwarder = fork();
+        if (spool_forwarder < 0) {
+            perror("fork failed");
+            exit(EXIT_FAILURE);
+        }
+        if (spool_forwarder == 0) {
+            close(server_fd);
+            if (ready_fd >= 0)
+                close(ready_fd);
+            run_forwarder(server);
+        }
+    }
+    
+    // Admission limits are shared by every session process
+    if (admit_init(transfer_limit, byte_limit) < 0) {
+        perror("admit_init failed");
+    }
+    
+    // The memory cache is shared by every session process too
+    if (cache_size > 0 && cache_init(cache_size) < 0) {
+        perror("cache_init failed");
+    }
+    
+    // And so is the table of reads in flight
+    if (flight_path_dir[0] && flight_init(flight_path_dir) < 0) {
+        perror("flight_init failed");
+    }
+    
+    // One listener per group; the session processes are forked by the loop below
+    if (workers_init(server_fd, groups, pin, session_limit) < 0) {
+        perror("workers_init failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Tell whoever launched us that we are serving
+    if (ready_fd >= 0) {
+        dprintf(ready_fd, "READY %d\n", port);
+        close(ready_fd);
+    }
+    
+    // Keep every listener stocked with idle session processes
+    pid_t server = getpid();
+    while (1) {
+        if (reload_requested) {
+            reload_routes();
+            reload_qos();
+            workers_reload();
+        }
+        
+        workers_reap(reclaim_worker);
+        for (int g = 0; g < worker_groups; g++) {
+            for (int wanted = workers_wanted(g); wanted > 0; wanted--) {
+                pid_t pid = workers_spawn(g);
+                
+                if (pid == 0) {
+                    run_worker(server);
+                }
+                if (pid < 0) {
+                    log_event(LOG_ERROR, "fork_failed", strerror(errno), errno);
+                    break;
+                }
+            }
+        }
+        
+        workers_wait(WORKER_POLL_MS, refuse_session);
+    }
+    
+    return 0;
 }
\ No newline at end of file
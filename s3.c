@@ -1,399 +1,920 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <libgen.h>
-
-#define PORT 8082
-#define BUFFER_SIZE 1024
-#define MAX_FILENAME 256
-#define MAX_PATH 1024
-
-// Function to create directory recursively
-void create_directory_recursive(const char* path) {
-    char temp[MAX_PATH];
-    char* p = NULL;
-    size_t len;
-    
-    snprintf(temp, sizeof(temp), "%s", path);
-    len = strlen(temp);
-    
-    if (temp[len - 1] == '/')
-        temp[len - 1] = 0;
-    
-    for (p = temp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            mkdir(temp, 0755);
-            *p = '/';
-        }
-    }
-    
-    mkdir(temp, 0755);
-}
-
-// Function to get file extension
-const char* get_file_extension(const char* filename) {
-    const char* dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return "";
-    return dot + 1;
-}
-
-// Function to receive file from S1
-void receive_file(int client_sock, char* filename, char* dest_path) {
-    char buffer[BUFFER_SIZE];
-    char full_path[MAX_PATH];
-    char response[BUFFER_SIZE];
-    FILE* file;
-    long filesize;
-    int bytes_read, total_bytes = 0;
-    
-    // Convert S1 path to S3 path
-    if (strncmp(dest_path, "~/S1", 4) == 0) {
-        dest_path[3] = '3';  // Replace S1 with S3
-    }
-    
-    // Ensure destination directory exists
-    create_directory_recursive(dest_path);
-    
-    // Extract filename from the full path
-    char* base_filename = basename(filename);
-    
-    // Append filename to destination path
-    sprintf(full_path, "%s/%s", dest_path, base_filename);
-    
-    // Tell S1 we're ready to receive
-    strcpy(response, "READY");
-    send(client_sock, response, strlen(response), 0);
-    
-    // Get file size
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_sock, buffer, BUFFER_SIZE, 0);
-    filesize = atol(buffer);
-    
-    // Open file for writing
-    file = fopen(full_path, "wb");
-    if (!file) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create file %s", full_path);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    // Tell S1 we're ready to receive file content
-    strcpy(response, "READY");
-    send(client_sock, response, strlen(response), 0);
-    
-    // Receive file content
-    total_bytes = 0;
-    
-    while (total_bytes < filesize) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (bytes_read <= 0)
-            break;
-        
-        fwrite(buffer, 1, bytes_read, file);
-        total_bytes += bytes_read;
-    }
-    
-    fclose(file);
-    
-    // Send success response
-    snprintf(response, BUFFER_SIZE, "File %s received and stored in S3", base_filename);
-    send(client_sock, response, strlen(response), 0);
-}
-
-// Function to send file to S1
-void send_file(int client_sock, char* filename) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    FILE* file;
-    struct stat st = {0};
-    long filesize;
-    int bytes_read;
-    
-    // Check if file exists
-    if (stat(filename, &st) == -1) {
-        snprintf(response, BUFFER_SIZE, "ERROR: File %s not found", filename);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    filesize = st.st_size;
-    
-    // Send file size to S1
-    sprintf(buffer, "%ld", filesize);
-    send(client_sock, buffer, strlen(buffer), 0);
-    
-    // Wait for S1 to be ready
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_sock, buffer, BUFFER_SIZE, 0);
-    
-    if (strcmp(buffer, "READY") != 0) {
-        return;
-    }
-    
-    // Send file content
-    file = fopen(filename, "rb");
-    if (!file) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Cannot open file %s", filename);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(client_sock, buffer, bytes_read, 0);
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-    
-    fclose(file);
-}
-
-// Function to remove file
-void remove_file(int client_sock, char* filename) {
-    char response[BUFFER_SIZE];
-    
-    // Check if file exists and remove it
-    if (remove(filename) != 0) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file %s", filename);
-    } else {
-        snprintf(response, BUFFER_SIZE, "File %s removed successfully", filename);
-    }
-    
-    send(client_sock, response, strlen(response), 0);
-}
-
-// Function to send tar of files
-void send_tar(int client_sock, char* filetype) {
-    char buffer[BUFFER_SIZE];
-    char tar_path[MAX_PATH];
-    char cmd[BUFFER_SIZE];
-    FILE* file;
-    struct stat st = {0};
-    long filesize;
-    int bytes_read;
-    
-    // Create tar file
-    sprintf(tar_path, "/tmp/text.tar");
-    sprintf(cmd, "find ~/S3 -name \"*.txt\" -type f | tar -cf %s -T -", tar_path);
-    
-    if (system(cmd) != 0) {
-        snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to create tar of .txt files");
-        send(client_sock, buffer, strlen(buffer), 0);
-        return;
-    }
-    
-    // Get file size
-    if (stat(tar_path, &st) == -1) {
-        snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to get tar file size");
-        send(client_sock, buffer, strlen(buffer), 0);
-        return;
-    }
-    
-    filesize = st.st_size;
-    
-    // Send file size to S1
-    sprintf(buffer, "%ld", filesize);
-    send(client_sock, buffer, strlen(buffer), 0);
-    
-    // Wait for S1 to be ready
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_sock, buffer, BUFFER_SIZE, 0);
-    
-    if (strcmp(buffer, "READY") != 0) {
-        return;
-    }
-    
-    // Send file content
-    file = fopen(tar_path, "rb");
-    if (!file) {
-        snprintf(buffer, BUFFER_SIZE, "ERROR: Cannot open tar file");
-        send(client_sock, buffer, strlen(buffer), 0);
-        return;
-    }
-    
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(client_sock, buffer, bytes_read, 0);
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-    
-    fclose(file);
-    remove(tar_path);  // Clean up
-}
-
-// Function to list files in directory
-void list_files(int client_sock, char* pathname, char* filetype) {
-    char response[BUFFER_SIZE * 4] = {0};
-    DIR* dir;
-    struct dirent* ent;
-    
-    // Check if directory exists
-    dir = opendir(pathname);
-    if (!dir) {
-        snprintf(response, BUFFER_SIZE, "ERROR: Directory %s not found", pathname);
-        send(client_sock, response, strlen(response), 0);
-        return;
-    }
-    
-    // Get files with the specified extension
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_REG) {
-            const char* ext = get_file_extension(ent->d_name);
-            if (strcmp(ext, filetype) == 0) {
-                if (strlen(response) > 0) {
-                    strcat(response, ",");
-                }
-                strcat(response, ent->d_name);
-            }
-        }
-    }
-    
-    closedir(dir);
-    
-    // Send response to S1
-    if (strlen(response) == 0) {
-        strcpy(response, "No files found");
-    }
-    
-    send(client_sock, response, strlen(response), 0);
-}
-
-// Function to handle client (S1)
-void handle_client(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    char response[BUFFER_SIZE];
-    char cmd[32], arg1[MAX_PATH], arg2[MAX_PATH];
-    int read_size;
-    
-    while (1) {
-        // Clear buffers
-        memset(buffer, 0, BUFFER_SIZE);
-        memset(cmd, 0, sizeof(cmd));
-        memset(arg1, 0, sizeof(arg1));
-        memset(arg2, 0, sizeof(arg2));
-        
-        // Receive command from S1
-        read_size = recv(client_sock, buffer, BUFFER_SIZE, 0);
-        
-        if (read_size <= 0) {
-            // S1 disconnected or error
-            break;
-        }
-        
-        printf("Received command from S1: %s\n", buffer);
-        
-        // Parse command
-        int args = sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
-        
-        if (strcmp(cmd, "RECV_FILE") == 0) {
-            if (args < 3) {
-                strcpy(response, "ERROR: Invalid command syntax");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                receive_file(client_sock, arg1, arg2);
-            }
-        } else if (strcmp(cmd, "SEND_FILE") == 0) {
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                send_file(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "REMOVE_FILE") == 0) {
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                remove_file(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "SEND_TAR") == 0) {
-            if (args < 2) {
-                strcpy(response, "ERROR: Invalid command syntax");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                send_tar(client_sock, arg1);
-            }
-        } else if (strcmp(cmd, "LIST_FILES") == 0) {
-            if (args < 3) {
-                strcpy(response, "ERROR: Invalid command syntax");
-                send(client_sock, response, strlen(response), 0);
-            } else {
-                list_files(client_sock, arg1, arg2);
-            }
-        } else {
-            // Unknown command
-            strcpy(response, "ERROR: Unknown command");
-            send(client_sock, response, strlen(response), 0);
-        }
-    }
-    
-    // Clean up
-    close(client_sock);
-}
-
-int main() {
-    int server_fd, client_sock;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-    
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        perror("setsockopt failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
-    
-    // Bind socket to port
-    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        perror("bind failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    // Listen for connections
-    if (listen(server_fd, 10) < 0) {
-        perror("listen failed");
-        exit(EXIT_FAILURE);
-    }
-    
-    printf("Server S3 started. Listening on port %d...\n", PORT);
-    
-    // Create ~/S3 directory if it doesn't exist
-    char s3_dir[MAX_PATH];
-    snprintf(s3_dir, sizeof(s3_dir), "%s/S3", getenv("HOME"));
-    mkdir(s3_dir, 0755);
-    
-    // Accept connections
-    while (1) {
-        if ((client_sock = accept(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("accept failed");
-            continue;
-        }
-        
-        printf("S1 connected\n");
-        
-        // Handle client (S1)
-        handle_client(client_sock);
-    }
-    
-    return 0;
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <signal.h>
+
+#include "dfs_stats.h"
+#include "dfs_trace.h"
+#include "dfs_log.h"
+#include "dfs_lanes.h"
+#include "dfs_local.h"
+#include "dfs_token.h"
+#include "dfs_version.h"
+#include "dfs_delta.h"
+
+#define PORT 8082
+#define BUFFER_SIZE 1024
+#define MAX_FILENAME 256
+#define MAX_PATH 1024
+
+// Commands measured in the statistics region
+static const char* stats_ops[] = { "RECV_FILE", "SEND_FILE", "REMOVE_FILE", "SEND_TAR", "LIST_FILES", "RECV_DELTA",
+                                    "SEND_SIGS" };
+
+char storage_root[MAX_PATH];    // Directory that ~/S3 paths are stored under
+
+// Function to create directory recursively
+void create_directory_recursive(const char* path) {
+    char temp[MAX_PATH];
+    char* p = NULL;
+    size_t len;
+    
+    snprintf(temp, sizeof(temp), "%s", path);
+    len = strlen(temp);
+    
+    if (temp[len - 1] == '/')
+        temp[len - 1] = 0;
+    
+    for (p = temp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(temp, 0755);
+            *p = '/';
+        }
+    }
+    
+    mkdir(temp, 0755);
+}
+
+// Function to map a ~/S3 path onto the storage root
+void resolve_path(const char* path, char* out, size_t size) {
+    if (strncmp(path, "~/S3", 4) == 0 && (path[4] == '/' || path[4] == 0)) {
+        snprintf(out, size, "%s%s", storage_root, path + 4);
+    } else {
+        snprintf(out, size, "%s", path);
+    }
+}
+
+// Function to get file extension
+const char* get_file_extension(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+        return "";
+    return dot + 1;
+}
+
+// Function to receive file from S1. For a direct upload S1 names the backend
+// it meant the command for, and the reply carries a receipt naming it too.
+void receive_file(int client_sock, char* filename, char* dest_path, const char* backend) {
+    char buffer[BUFFER_SIZE];
+    char local_dir[MAX_PATH];
+    char full_path[MAX_PATH * 2];
+    char temp_path[MAX_PATH * 2 + 8];
+    char response[BUFFER_SIZE];
+    FILE* file;
+    long filesize, src_offset = 0;
+    long bytes_read, total_bytes = 0;
+    int fd, src_fd;
+    uint64_t t;
+    
+    // What the receipt for this upload names, see dfs_token.h
+    char receipt_args[MAX_PATH * 2 + 2];
+    snprintf(receipt_args, sizeof(receipt_args), "%s %s", filename, dest_path);
+    
+    // Convert S1 path to S3 path
+    if (strncmp(dest_path, "~/S1", 4) == 0) {
+        dest_path[3] = '3';  // Replace S1 with S3
+    }
+    
+    // Ensure destination directory exists
+    t = stats_now();
+    resolve_path(dest_path, local_dir, sizeof(local_dir));
+    create_directory_recursive(local_dir);
+    stats_add(STATS_DISK, t);
+    
+    // Extract filename from the full path
+    char* base_filename = basename(filename);
+    
+    // Append filename to destination path
+    snprintf(full_path, sizeof(full_path), "%s/%s", local_dir, base_filename);
+    
+    // Tell S1 we're ready to receive
+    t = stats_now();
+    strcpy(response, "READY");
+    send(client_sock, response, strlen(response), 0);
+    
+    // Get file size; S1 on this host may attach the file to it, with the
+    // offset its content starts at, see dfs_local.h
+    memset(buffer, 0, BUFFER_SIZE);
+    local_recv(client_sock, buffer, BUFFER_SIZE - 1, &src_fd);
+    filesize = atol(buffer);
+    if (src_fd >= 0 && strchr(buffer, ' ')) {
+        src_offset = atol(strchr(buffer, ' ') + 1);
+    }
+    stats_add(STATS_NETWORK, t);
+    
+    // Write to a temporary name; the file only appears under its own once it is complete and on disk
+    t = stats_now();
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", full_path);
+    fd = mkstemp(temp_path);
+    file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    stats_add(STATS_DISK, t);
+    if (!file) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot create file %s/%s", dest_path, base_filename);
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        if (src_fd >= 0)
+            close(src_fd);
+        return;
+    }
+    
+    // Tell S1 we're ready to receive file content
+    strcpy(response, "READY");
+    send(client_sock, response, strlen(response), 0);
+    
+    // Receive file content
+    total_bytes = 0;
+    
+    if (src_fd >= 0) {
+        // Copy it straight out of S1's file
+        t = stats_now();
+        total_bytes = local_copy(src_fd, src_offset, fd, filesize);
+        stats_add(STATS_DISK, t);
+        close(src_fd);
+    }
+    
+    while (src_fd < 0 && total_bytes < filesize) {
+        memset(buffer, 0, BUFFER_SIZE);
+        t = stats_now();
+        bytes_read = recv(client_sock, buffer, BUFFER_SIZE, 0);
+        stats_add(STATS_NETWORK, t);
+        
+        if (bytes_read <= 0)
+            break;
+        
+        t = stats_now();
+        fwrite(buffer, 1, bytes_read, file);
+        stats_add(STATS_DISK, t);
+        total_bytes += bytes_read;
+    }
+    
+    // Only acknowledge what is durably stored: S1 counts this reply towards the write quorum
+    t = stats_now();
+    fchmod(fd, 0644);
+    int stored = total_bytes == filesize && fflush(file) == 0 && fsync(fd) == 0;
+    stored = fclose(file) == 0 && stored && rename(temp_path, full_path) == 0;
+    if (!stored) {
+        remove(temp_path);
+    } else {
+        // The rename itself lives in the directory
+        int dir_fd = open(local_dir, O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    stats_add(STATS_DISK, t);
+    stats_bytes(total_bytes);
+    
+    if (!stored) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to store file %s/%s", dest_path, base_filename);
+        stats_error();
+    } else {
+        // Send success response, with a receipt the client can show S1
+        int len = snprintf(response, BUFFER_SIZE, "File %s received and stored in S3", base_filename);
+        if (token_enabled && backend[0] && len < BUFFER_SIZE - TOKEN_MAX) {
+            response[len] = ' ';
+            if (token_receipt(backend, receipt_args, total_bytes, response + len + 1, BUFFER_SIZE - len - 1) < 0)
+                response[len] = 0;
+        }
+    }
+    send(client_sock, response, strlen(response), 0);
+}
+
+// Function to rebuild a file from its stored version and a delta S1 sends,
+// see dfs_delta.h. The command carries the block size and the size and hash
+// the new version must have; the file is only replaced if they match.
+void receive_delta(int client_sock, char* command) {
+    char buffer[BUFFER_SIZE];
+    char filename[MAX_PATH], dest_path[MAX_PATH];
+    char local_dir[MAX_PATH];
+    char full_path[MAX_PATH * 2];
+    char temp_path[MAX_PATH * 2 + 8];
+    char response[BUFFER_SIZE];
+    struct stat st = {0};
+    unsigned long long hash;
+    long filesize, written = -1;
+    int block, fd, base_fd, src_fd;
+    DeltaInput input = { client_sock, 0, 0, 0 };
+    uint64_t t;
+    
+    if (sscanf(command, "%*s %1023s %1023s %d %ld %llx", filename, dest_path, &block, &filesize, &hash) != 5 ||
+        block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX || filesize < 0) {
+        strcpy(response, "ERROR: Invalid command syntax");
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        return;
+    }
+    
+    // Convert S1 path to S3 path
+    if (strncmp(dest_path, "~/S1", 4) == 0) {
+        dest_path[3] = '3';  // Replace S1 with S3
+    }
+    
+    // The stored version is what the delta was made against
+    t = stats_now();
+    resolve_path(dest_path, local_dir, sizeof(local_dir));
+    char* base_filename = basename(filename);
+    snprintf(full_path, sizeof(full_path), "%s/%s", local_dir, base_filename);
+    base_fd = open(full_path, O_RDONLY | O_CLOEXEC);
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", full_path);
+    fd = base_fd >= 0 && fstat(base_fd, &st) == 0 ? mkstemp(temp_path) : -1;
+    stats_add(STATS_DISK, t);
+    if (fd < 0) {
+        snprintf(response, BUFFER_SIZE, "ERROR: No stored version of %s/%s to apply a delta to", dest_path,
+                 base_filename);
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        if (base_fd >= 0)
+            close(base_fd);
+        return;
+    }
+    
+    // Tell S1 we're ready to receive
+    t = stats_now();
+    strcpy(response, "READY");
+    send(client_sock, response, strlen(response), 0);
+    
+    // Get the delta's size; S1 on this host may attach the file holding it
+    memset(buffer, 0, BUFFER_SIZE);
+    local_recv(client_sock, buffer, BUFFER_SIZE - 1, &src_fd);
+    input.left = atol(buffer);
+    if (src_fd >= 0 && strchr(buffer, ' ')) {
+        input.fd = src_fd;
+        input.positional = 1;
+        input.offset = atol(strchr(buffer, ' ') + 1);
+    }
+    send(client_sock, response, strlen(response), 0);
+    stats_add(STATS_NETWORK, t);
+    
+    // Rebuild into the temporary file, then check it is the client's version
+    t = stats_now();
+    written = delta_apply(&input, base_fd, st.st_size, block, fd);
+    fchmod(fd, 0644);
+    int stored = written == filesize && delta_verify(fd, filesize, hash) == 0 && fsync(fd) == 0;
+    stored = close(fd) == 0 && stored && rename(temp_path, full_path) == 0;
+    if (!stored) {
+        remove(temp_path);
+    } else {
+        int dir_fd = open(local_dir, O_RDONLY);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+    close(base_fd);
+    if (src_fd >= 0)
+        close(src_fd);
+    stats_add(STATS_DISK, t);
+    stats_bytes(written > 0 ? written : 0);
+    
+    if (!stored) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Delta for %s/%s does not match the stored version", dest_path,
+                 base_filename);
+        stats_error();
+    } else {
+        snprintf(response, BUFFER_SIZE, "File %s received and stored in S3", base_filename);
+    }
+    send(client_sock, response, strlen(response), 0);
+}
+
+// Function to send S1 the block signatures of a stored file, with the same
+// exchange as SEND_FILE: "<length> <block size> <file size>", READY, body
+void send_signatures(int client_sock, char* filename) {
+    char buffer[BUFFER_SIZE];
+    char local_path[MAX_PATH];
+    struct stat st = {0};
+    unsigned char* sigs = NULL;
+    long length = -1;
+    int block = 0;
+    uint64_t t = stats_now();
+    
+    resolve_path(filename, local_path, sizeof(local_path));
+    int fd = open(local_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        block = delta_block_size(st.st_size);
+        length = delta_signatures(fd, st.st_size, block, &sigs);
+    }
+    if (fd >= 0)
+        close(fd);
+    stats_add(STATS_DISK, t);
+    
+    if (length < 0) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: File %s not found", filename);
+        send(client_sock, buffer, strlen(buffer), 0);
+        stats_error();
+        return;
+    }
+    
+    // Send the signatures' length, block size and file size to S1
+    t = stats_now();
+    sprintf(buffer, "%ld %d %ld", length, block, (long)st.st_size);
+    send(client_sock, buffer, strlen(buffer), 0);
+    
+    // Wait for S1 to be ready
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(client_sock, buffer, BUFFER_SIZE, 0);
+    if (strcmp(buffer, "READY") == 0) {
+        for (long sent = 0; sent < length;) {
+            ssize_t n = send(client_sock, sigs + sent, length - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        stats_bytes(length);
+    }
+    stats_add(STATS_NETWORK, t);
+    free(sigs);
+}
+
+// Function to send file to S1
+void send_file(int client_sock, char* filename) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char tag[VERSION_TAG_MAX];
+    char local_path[MAX_PATH];
+    FILE* file;
+    struct stat st = {0};
+    long filesize, total_sent = 0;
+    int bytes_read;
+    uint64_t t;
+    
+    resolve_path(filename, local_path, sizeof(local_path));
+    
+    // Check if file exists
+    t = stats_now();
+    if (stat(local_path, &st) == -1) {
+        stats_add(STATS_DISK, t);
+        snprintf(response, BUFFER_SIZE, "ERROR: File %s not found", filename);
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        return;
+    }
+    stats_add(STATS_DISK, t);
+    
+    filesize = st.st_size;
+    
+    // S1 on this host gets the open file with the size and reads it itself, see dfs_local.h
+    int local_fd = local_is_unix(client_sock) ? open(local_path, O_RDONLY | O_CLOEXEC) : -1;
+    if (local_fd >= 0 && fstat(local_fd, &st) == 0) {
+        filesize = st.st_size;
+    }
+    
+    // Send file size and version to S1
+    t = stats_now();
+    version_tag(&st, tag, sizeof(tag));
+    sprintf(buffer, "%ld %s", filesize, tag);
+    if (local_fd >= 0) {
+        local_send_fd(client_sock, buffer, local_fd);
+        close(local_fd);
+    } else {
+        send(client_sock, buffer, strlen(buffer), 0);
+    }
+    
+    // Wait for S1 to be ready
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(client_sock, buffer, BUFFER_SIZE, 0);
+    stats_add(STATS_NETWORK, t);
+    
+    if (strcmp(buffer, "READY") != 0) {
+        return;
+    }
+    
+    // Send file content
+    t = stats_now();
+    file = fopen(local_path, "rb");
+    stats_add(STATS_DISK, t);
+    if (!file) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Cannot open file %s", filename);
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        return;
+    }
+    
+    while (1) {
+        t = stats_now();
+        bytes_read = fread(buffer, 1, BUFFER_SIZE, file);
+        stats_add(STATS_DISK, t);
+        if (bytes_read <= 0)
+            break;
+        
+        // A client that went away ends the transfer
+        t = stats_now();
+        int sent = 0;
+        while (sent < bytes_read) {
+            ssize_t n = send(client_sock, buffer + sent, bytes_read - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        stats_add(STATS_NETWORK, t);
+        total_sent += sent;
+        if (sent < bytes_read)
+            break;
+        memset(buffer, 0, BUFFER_SIZE);
+    }
+    
+    fclose(file);
+    stats_bytes(total_sent);
+}
+
+// Function to remove file
+void remove_file(int client_sock, char* filename) {
+    char response[BUFFER_SIZE];
+    char local_path[MAX_PATH];
+    
+    resolve_path(filename, local_path, sizeof(local_path));
+    
+    // Check if file exists and remove it
+    uint64_t t = stats_now();
+    int failed = remove(local_path) != 0;
+    stats_add(STATS_DISK, t);
+    
+    if (failed) {
+        snprintf(response, BUFFER_SIZE, "ERROR: Failed to remove file %s", filename);
+        stats_error();
+    } else {
+        snprintf(response, BUFFER_SIZE, "File %s removed successfully", filename);
+    }
+    
+    send(client_sock, response, strlen(response), 0);
+}
+
+// Function to send tar of files
+void send_tar(int client_sock, char* filetype) {
+    char buffer[BUFFER_SIZE];
+    char tar_path[MAX_PATH];
+    char cmd[MAX_PATH * 2];
+    FILE* file;
+    struct stat st = {0};
+    long filesize, total_sent = 0;
+    int bytes_read;
+    uint64_t t = stats_now();
+    
+    // Files of the type S1 asks for, so the backend can serve any pool, .c files included
+    if (!filetype[0] || strlen(filetype) > 15 || strspn(filetype, "abcdefghijklmnopqrstuvwxyz0123456789") != strlen(filetype)) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: Invalid file type %s", filetype);
+        send(client_sock, buffer, strlen(buffer), 0);
+        stats_error();
+        return;
+    }
+    
+    // Create tar file with paths relative to the storage root, so S1 can merge
+    // the tars of several instances; the pid keeps them from sharing the file
+    snprintf(tar_path, sizeof(tar_path), "/tmp/%s.%d.tar", filetype, (int)getpid());
+    snprintf(cmd, sizeof(cmd), "cd '%s' && find . -name \"*.%s\" -type f | tar -cf %s -T -", storage_root, filetype, tar_path);
+    
+    int tar_status = system(cmd);
+    stats_add(STATS_DISK, t);
+    
+    if (tar_status != 0) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to create tar of .%s files", filetype);
+        send(client_sock, buffer, strlen(buffer), 0);
+        stats_error();
+        return;
+    }
+    
+    // Get file size
+    if (stat(tar_path, &st) == -1) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: Failed to get tar file size");
+        send(client_sock, buffer, strlen(buffer), 0);
+        stats_error();
+        return;
+    }
+    
+    filesize = st.st_size;
+    
+    // Send file size to S1
+    t = stats_now();
+    sprintf(buffer, "%ld", filesize);
+    send(client_sock, buffer, strlen(buffer), 0);
+    
+    // Wait for S1 to be ready
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(client_sock, buffer, BUFFER_SIZE, 0);
+    stats_add(STATS_NETWORK, t);
+    
+    if (strcmp(buffer, "READY") != 0) {
+        return;
+    }
+    
+    // Send file content
+    file = fopen(tar_path, "rb");
+    if (!file) {
+        snprintf(buffer, BUFFER_SIZE, "ERROR: Cannot open tar file");
+        send(client_sock, buffer, strlen(buffer), 0);
+        stats_error();
+        return;
+    }
+    
+    while (1) {
+        t = stats_now();
+        bytes_read = fread(buffer, 1, BUFFER_SIZE, file);
+        stats_add(STATS_DISK, t);
+        if (bytes_read <= 0)
+            break;
+        
+        // A client that went away ends the transfer
+        t = stats_now();
+        int sent = 0;
+        while (sent < bytes_read) {
+            ssize_t n = send(client_sock, buffer + sent, bytes_read - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        stats_add(STATS_NETWORK, t);
+        total_sent += sent;
+        if (sent < bytes_read)
+            break;
+        memset(buffer, 0, BUFFER_SIZE);
+    }
+    
+    fclose(file);
+    stats_bytes(total_sent);
+    remove(tar_path);  // Clean up
+}
+
+// Function to list files in directory
+void list_files(int client_sock, char* pathname, char* filetype) {
+    char response[BUFFER_SIZE * 4] = {0};
+    char local_path[MAX_PATH];
+    DIR* dir;
+    struct dirent* ent;
+    
+    resolve_path(pathname, local_path, sizeof(local_path));
+    
+    // Check if directory exists
+    uint64_t t = stats_now();
+    dir = opendir(local_path);
+    if (!dir) {
+        stats_add(STATS_DISK, t);
+        snprintf(response, BUFFER_SIZE, "ERROR: Directory %s not found", pathname);
+        send(client_sock, response, strlen(response), 0);
+        stats_error();
+        return;
+    }
+    
+    // Get files with the specified extension
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_type == DT_REG) {
+            const char* ext = get_file_extension(ent->d_name);
+            if (strcmp(ext, filetype) == 0) {
+                if (strlen(response) > 0) {
+                    strcat(response, ",");
+                }
+                strcat(response, ent->d_name);
+            }
+        }
+    }
+    
+    closedir(dir);
+    stats_add(STATS_DISK, t);
+    
+    // Send response to S1
+    if (strlen(response) == 0) {
+        strcpy(response, "No files found");
+    }
+    
+    t = stats_now();
+    send(client_sock, response, strlen(response), 0);
+    stats_add(STATS_NETWORK, t);
+    stats_bytes(strlen(response));
+}
+
+// Function to send a report to S1 with the same exchange as SEND_FILE: size, READY, body
+void send_report(int client_sock, const char* report, size_t len) {
+    char buffer[BUFFER_SIZE];
+    size_t sent = 0;
+    
+    // Send report size to S1
+    sprintf(buffer, "%ld", (long)len);
+    send(client_sock, buffer, strlen(buffer), 0);
+    
+    // Wait for S1 to be ready
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(client_sock, buffer, BUFFER_SIZE, 0);
+    
+    if (strcmp(buffer, "READY") != 0) {
+        return;
+    }
+    
+    while (sent < len) {
+        ssize_t n = send(client_sock, report + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+}
+
+// Function to send this server's statistics to S1
+void send_stats(int client_sock, char* format) {
+    char* report = malloc(STATS_REPORT_SIZE);
+    
+    if (!report) {
+        char response[] = "ERROR: Memory allocation failed";
+        send(client_sock, response, strlen(response), 0);
+        return;
+    }
+    
+    send_report(client_sock, report, stats_format(report, STATS_REPORT_SIZE, strcmp(format, "json") == 0));
+    free(report);
+}
+
+// Function to send this server's recorded spans to S1, all of them or those of one trace
+void send_trace(int client_sock, char* trace_id) {
+    char* report = malloc(TRACE_EXPORT_SIZE);
+    
+    if (!report) {
+        char response[] = "ERROR: Memory allocation failed";
+        send(client_sock, response, strlen(response), 0);
+        return;
+    }
+    
+    send_report(client_sock, report, trace_export(report, TRACE_EXPORT_SIZE, strtoull(trace_id, NULL, 16)));
+    free(report);
+}
+
+// Function to handle client (S1)
+void handle_client(int client_sock) {
+    char buffer[BUFFER_SIZE];
+    char response[BUFFER_SIZE];
+    char cmd[32], arg1[MAX_PATH], arg2[MAX_PATH];
+    int read_size;
+    
+    while (1) {
+        // Clear buffers
+        memset(buffer, 0, BUFFER_SIZE);
+        memset(cmd, 0, sizeof(cmd));
+        memset(arg1, 0, sizeof(arg1));
+        memset(arg2, 0, sizeof(arg2));
+        
+        // Receive command from S1
+        read_size = recv(client_sock, buffer, BUFFER_SIZE, 0);
+        
+        if (read_size <= 0) {
+            // S1 disconnected or error
+            break;
+        }
+        
+        // S1's health probes are answered without being recorded
+        if (strcmp(buffer, "PING") == 0) {
+            send(client_sock, "PONG", 4, 0);
+            continue;
+        }
+        
+        uint64_t received = stats_now();
+        uint64_t received_us = trace_now_us();
+        
+        // Time spent queued behind earlier connections shows up as the gap since S1 sent the command
+        trace_parse(buffer);
+        if (trace_sent_us) {
+            trace_span("queue", trace_sent_us, received_us, NULL, NULL);
+        }
+        
+        // With a key only commands S1 signed are served, see dfs_token.h
+        int signature = token_check(buffer);
+        if (token_enabled && signature <= 0) {
+            strcpy(response, signature < 0 ? "ERROR: Invalid or expired signature" : "ERROR: Unsigned command");
+            send(client_sock, response, strlen(response), 0);
+            log_event(LOG_WARN, "command_refused", buffer, signature);
+            continue;
+        }
+        
+        log_sampled(LOG_INFO, "command", buffer, 0);
+        
+        // Parse command
+        int args = sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
+        stats_begin(stats_lookup(cmd), received);
+        stats_add(STATS_PARSE, received);
+        
+        if (strcmp(cmd, "RECV_FILE") == 0) {
+            if (args < 3) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                char backend[TOKEN_BACKEND_MAX] = "";
+                sscanf(buffer, "%*s %*s %*s %71s", backend);
+                receive_file(client_sock, arg1, arg2, backend);
+            }
+        } else if (strcmp(cmd, "SEND_FILE") == 0) {
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                send_file(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "REMOVE_FILE") == 0) {
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                remove_file(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "SEND_TAR") == 0) {
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                send_tar(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "LIST_FILES") == 0) {
+            if (args < 3) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                list_files(client_sock, arg1, arg2);
+            }
+        } else if (strcmp(cmd, "RECV_DELTA") == 0) {
+            receive_delta(client_sock, buffer);
+        } else if (strcmp(cmd, "SEND_SIGS") == 0) {
+            if (args < 2) {
+                strcpy(response, "ERROR: Invalid command syntax");
+                send(client_sock, response, strlen(response), 0);
+                stats_error();
+            } else {
+                send_signatures(client_sock, arg1);
+            }
+        } else if (strcmp(cmd, "STATS") == 0) {
+            send_stats(client_sock, args >= 2 ? arg1 : "text");
+        } else if (strcmp(cmd, "TRACE") == 0) {
+            send_trace(client_sock, args >= 2 ? arg1 : "0");
+        } else {
+            // Unknown command
+            strcpy(response, "ERROR: Unknown command");
+            send(client_sock, response, strlen(response), 0);
+        }
+        
+        if (stats_current.error)
+            log_event(LOG_WARN, "command_failed", buffer, 0);
+        if (strcmp(cmd, "STATS") != 0 && strcmp(cmd, "TRACE") != 0) {
+            trace_span(cmd, received_us, trace_now_us(), arg1, stats_current.phase);
+        }
+        stats_end();
+    }
+    
+    // Clean up
+    close(client_sock);
+}
+
+// Function to print usage information
+void print_usage(const char* program) {
+    printf("Usage: %s [-p port] [-r root] [-l listen_fd] [-R ready_fd] [-K keyfile]\n", program);
+    printf("  -p port        Port to listen on, 0 for any free port (default %d)\n", PORT);
+    printf("  -r root        Storage directory for ~/S3 paths (default $HOME/S3)\n");
+    printf("  -l listen_fd   Serve on an inherited, already listening socket\n");
+    printf("  -R ready_fd    Write \"READY <port>\" to this descriptor once serving\n");
+    printf("  -L level       Lowest log level: debug, info, warn, error or off (default info)\n");
+    printf("  -S n           Log one of every n commands (default 1)\n");
+    printf("  -K file        Key shared with S1; only commands S1 signed with it are served\n");
+}
+
+int main(int argc, char* argv[]) {
+    int server_fd = -1;
+    struct sockaddr_in address;
+    int opt = 1;
+    int addrlen = sizeof(address);
+    int port = PORT;
+    int ready_fd = -1;
+    int log_level = LOG_INFO;
+    unsigned log_sample = 1;
+    int ch;
+    
+    snprintf(storage_root, sizeof(storage_root), "%s/S3", getenv("HOME"));
+    
+    // Clients reach the backends directly; one that hangs up mid-transfer
+    // must fail that transfer with EPIPE, not kill the backend
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Parse command line options
+    while ((ch = getopt(argc, argv, "p:r:l:R:L:S:K:h")) != -1) {
+        switch (ch) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'r':
+            snprintf(storage_root, sizeof(storage_root), "%s", optarg);
+            break;
+        case 'l':
+            server_fd = atoi(optarg);
+            break;
+        case 'R':
+            ready_fd = atoi(optarg);
+            break;
+        case 'L':
+            if ((log_level = log_parse_level(optarg)) < 0) {
+                printf("Invalid log level: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            log_sample = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'K':
+            if (token_load_key(optarg) < 0) {
+                printf("Cannot read key file %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    
+    if (server_fd < 0) {
+        // Creating socket file descriptor
+        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+            perror("socket failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Set socket options
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
+            perror("setsockopt failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+        
+        // Bind socket to port
+        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            perror("bind failed");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Listen for connections
+        if (listen(server_fd, 10) < 0) {
+            perror("listen failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Report the port actually bound, which differs from -p 0
+    if (getsockname(server_fd, (struct sockaddr*)&address, (socklen_t*)&addrlen) < 0) {
+        perror("getsockname failed");
+        exit(EXIT_FAILURE);
+    }
+    port = ntohs(address.sin_port);
+    
+    printf("Server S3 started. Listening on port %d...\n", port);
+    
+    // Shared statistics, see dfs_stats.h
+    if (stats_init("S3", stats_ops, sizeof(stats_ops) / sizeof(stats_ops[0])) < 0) {
+        perror("stats_init failed");
+    }
+    if (trace_init(3, "S3") < 0) {
+        perror("trace_init failed");
+    }
+    if (log_init("S3", log_level, log_sample) < 0) {
+        perror("log_init failed");
+    }
+    
+    // Create the storage directory if it doesn't exist
+    create_directory_recursive(storage_root);
+    
+    // S1 on this host connects through a Unix socket, see dfs_local.h
+    int local_fd = local_listen(port);
+    if (local_fd < 0) {
+        log_event(LOG_WARN, "local_listen_failed", strerror(errno), port);
+    }
+    
+    // Tell whoever launched us that we are serving
+    if (ready_fd >= 0) {
+        dprintf(ready_fd, "READY %d\n", port);
+        close(ready_fd);
+    }
+    
+    // Accept connections and serve them on the control and bulk lanes, see dfs_lanes.h
+    lanes_serve(server_fd, local_fd, handle_client);
+    
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,577 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libw25.h"
+
+// w25bench: closed-loop load generator for S1-S4.
+//
+// Each simulated client is a thread with its own libw25 session that issues
+// operations back to back, drawn from a weighted mix, against a fixed key space
+// with optional Zipf skew. Latency is measured around every request and reported
+// per operation as throughput and p50/p99/p999, as text or JSON.
+
+#define MAX_PATH 1024
+#define MAX_TYPES 4
+
+// Operations in the mix
+enum {
+    BENCH_UPLOAD,
+    BENCH_DOWNLOAD,
+    BENCH_REMOVE,
+    BENCH_TAR,
+    BENCH_LIST,
+    BENCH_OPS
+};
+
+static const char* op_names[BENCH_OPS] = { "uploadf", "downlf", "removef", "downltar", "dispfnames" };
+
+// File size distributions
+enum {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP
+};
+
+// Structure to store the benchmark configuration
+typedef struct {
+    const char* host;
+    int port;
+    int clients;
+    double duration;            // Seconds; ignored when total_ops is set
+    long total_ops;
+    int weights[BENCH_OPS];
+    int size_dist;
+    long size_a;                // Fixed size, uniform minimum or exponential mean
+    long size_b;                // Uniform maximum
+    int keys;
+    double zipf;                // 0 = uniform key choice
+    char types[MAX_TYPES][8];
+    int type_count;
+    const char* prefix;
+    int preload;
+    int json;
+    uint64_t seed;
+} BenchConfig;
+
+// Structure to store the latencies one thread measured for one operation
+typedef struct {
+    double* samples;
+    long count;
+    long capacity;
+    long errors;
+    long bytes;
+} OpSamples;
+
+// Structure to store one client thread's state
+typedef struct {
+    int id;
+    uint64_t rng;
+    OpSamples ops[BENCH_OPS];
+} BenchThread;
+
+static BenchConfig config;
+static double* zipf_cdf;        // Cumulative key popularity, NULL for uniform
+static char* payload;           // Shared upload source, sent without copying
+static long payload_size;
+static long ops_issued;
+static double deadline_ms;
+static pthread_mutex_t issue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to get a monotonic timestamp in milliseconds
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Function to draw the next pseudo-random number (xorshift64*)
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Function to draw a uniform double in [0, 1)
+static double next_unit(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Function to parse a size with an optional k/m/g suffix
+static long parse_size(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 'k': case 'K': value *= 1024; break;
+    case 'm': case 'M': value *= 1024 * 1024; break;
+    case 'g': case 'G': value *= 1024.0 * 1024 * 1024; break;
+    }
+
+    return (long)value;
+}
+
+// Function to parse the operation mix, e.g. "uploadf=40,downlf=50,dispfnames=10"
+static int parse_mix(const char* text) {
+    char copy[MAX_PATH];
+    char* save;
+
+    memset(config.weights, 0, sizeof(config.weights));
+    snprintf(copy, sizeof(copy), "%s", text);
+
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(item, '=');
+        int op;
+
+        if (!eq) {
+            return -1;
+        }
+        *eq = 0;
+
+        for (op = 0; op < BENCH_OPS && strcmp(op_names[op], item) != 0; op++)
+            ;
+        if (op == BENCH_OPS) {
+            return -1;
+        }
+        config.weights[op] = atoi(eq + 1);
+    }
+
+    return 0;
+}
+
+// Function to parse the size distribution: fixed:N, uniform:MIN-MAX or exp:MEAN
+static int parse_size_dist(const char* text) {
+    if (strncmp(text, "fixed:", 6) == 0) {
+        config.size_dist = SIZE_FIXED;
+        config.size_a = parse_size(text + 6);
+    } else if (strncmp(text, "uniform:", 8) == 0) {
+        const char* dash = strchr(text + 8, '-');
+        if (!dash) {
+            return -1;
+        }
+        config.size_dist = SIZE_UNIFORM;
+        config.size_a = parse_size(text + 8);
+        config.size_b = parse_size(dash + 1);
+    } else if (strncmp(text, "exp:", 4) == 0) {
+        config.size_dist = SIZE_EXP;
+        config.size_a = parse_size(text + 4);
+    } else {
+        return -1;
+    }
+
+    return config.size_a >= 0 && config.size_b >= 0 ? 0 : -1;
+}
+
+// Function to parse the file types, e.g. "txt,pdf,zip,c"
+static int parse_types(const char* text) {
+    char copy[MAX_PATH];
+    char* save;
+
+    config.type_count = 0;
+    snprintf(copy, sizeof(copy), "%s", text);
+
+    for (char* item = strtok_r(copy, ",", &save); item && config.type_count < MAX_TYPES; item = strtok_r(NULL, ",", &save)) {
+        if (strcmp(item, "c") != 0 && strcmp(item, "pdf") != 0 && strcmp(item, "txt") != 0 && strcmp(item, "zip") != 0) {
+            return -1;
+        }
+        snprintf(config.types[config.type_count++], sizeof(config.types[0]), "%s", item);
+    }
+
+    return config.type_count > 0 ? 0 : -1;
+}
+
+// Function to build the cumulative Zipf distribution over the key space
+static void build_zipf() {
+    double total = 0;
+
+    zipf_cdf = malloc(config.keys * sizeof(double));
+    for (int i = 0; i < config.keys; i++) {
+        total += 1.0 / pow(i + 1, config.zipf);
+        zipf_cdf[i] = total;
+    }
+    for (int i = 0; i < config.keys; i++) {
+        zipf_cdf[i] /= total;
+    }
+}
+
+// Function to pick a key, hot keys first when skewed
+static int pick_key(uint64_t* rng) {
+    double u = next_unit(rng);
+
+    if (!zipf_cdf) {
+        return (int)(u * config.keys);
+    }
+
+    int lo = 0, hi = config.keys - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Function to pick an upload size from the configured distribution
+static long pick_size(uint64_t* rng) {
+    long size;
+
+    switch (config.size_dist) {
+    case SIZE_UNIFORM:
+        size = config.size_a + (long)(next_unit(rng) * (config.size_b - config.size_a + 1));
+        break;
+    case SIZE_EXP:
+        size = (long)(-log(1.0 - next_unit(rng)) * config.size_a);
+        break;
+    default:
+        size = config.size_a;
+        break;
+    }
+
+    return size < payload_size ? size : payload_size;
+}
+
+// Function to pick the next operation from the weighted mix
+static int pick_op(uint64_t* rng) {
+    int total = 0;
+
+    for (int op = 0; op < BENCH_OPS; op++)
+        total += config.weights[op];
+
+    int r = (int)(next_unit(rng) * total);
+    for (int op = 0; op < BENCH_OPS; op++) {
+        if (r < config.weights[op])
+            return op;
+        r -= config.weights[op];
+    }
+
+    return BENCH_LIST;
+}
+
+// Function to reserve the next operation; returns 0 once the run is over
+static int claim_op() {
+    if (config.total_ops > 0) {
+        pthread_mutex_lock(&issue_lock);
+        int more = ops_issued < config.total_ops;
+        if (more)
+            ops_issued++;
+        pthread_mutex_unlock(&issue_lock);
+        return more;
+    }
+
+    return now_ms() < deadline_ms;
+}
+
+// Function to record one measured request
+static void record(OpSamples* samples, double ms, int ok, long bytes) {
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->samples = realloc(samples->samples, samples->capacity * sizeof(double));
+    }
+
+    samples->samples[samples->count++] = ms;
+    if (!ok)
+        samples->errors++;
+    else
+        samples->bytes += bytes;
+}
+
+// Function to name a key's remote file and directory
+static void key_path(int key, char* dir, size_t dir_size, char* name, size_t name_size) {
+    snprintf(dir, dir_size, "%s/d%02d", config.prefix, key % 16);
+    snprintf(name, name_size, "k%06d.%s", key, config.types[key % config.type_count]);
+}
+
+// Function to issue one operation and wait for it
+static const W25Result* issue(W25Client* client, int op, int key, uint64_t* rng, W25Request** request) {
+    char dir[MAX_PATH], name[MAX_PATH], path[MAX_PATH * 2 + 1];
+
+    key_path(key, dir, sizeof(dir), name, sizeof(name));
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    switch (op) {
+    case BENCH_UPLOAD:
+        *request = w25_upload_buffer(client, name, dir, payload, pick_size(rng), NULL, NULL, NULL, NULL);
+        break;
+    case BENCH_DOWNLOAD:
+        *request = w25_download_buffer(client, path, NULL, NULL);
+        break;
+    case BENCH_REMOVE:
+        *request = w25_remove(client, path, NULL, NULL);
+        break;
+    case BENCH_TAR:
+        *request = w25_download_tar(client, config.types[key % config.type_count], "/dev/null", NULL, NULL);
+        break;
+    default:
+        *request = w25_list(client, dir, NULL, NULL);
+        break;
+    }
+
+    return w25_request_wait(*request);
+}
+
+// Client thread: runs operations back to back until the run ends
+static void* bench_thread(void* arg) {
+    BenchThread* thread = arg;
+    W25Options options = { config.host, config.port, 1 };
+    W25Client* client = w25_client_new(&options);
+
+    if (!client) {
+        return NULL;
+    }
+
+    while (claim_op()) {
+        int op = pick_op(&thread->rng);
+        int key = pick_key(&thread->rng);
+        W25Request* request;
+
+        // .zip files have no tar archive; list instead
+        if (op == BENCH_TAR && strcmp(config.types[key % config.type_count], "zip") == 0)
+            op = BENCH_LIST;
+
+        double start = now_ms();
+        const W25Result* result = issue(client, op, key, &thread->rng, &request);
+        double elapsed = now_ms() - start;
+
+        record(&thread->ops[op], elapsed, result->status == W25_OK, result->bytes);
+        w25_request_free(request);
+    }
+
+    w25_client_free(client);
+    return NULL;
+}
+
+// Function to upload every key once so downloads have something to read
+static void preload() {
+    W25Options options = { config.host, config.port, config.clients };
+    W25Client* client = w25_client_new(&options);
+    W25Request** requests = malloc(config.keys * sizeof(W25Request*));
+    uint64_t rng = config.seed;
+    int failed = 0;
+
+    for (int key = 0; key < config.keys; key++) {
+        char dir[MAX_PATH], name[MAX_PATH];
+        key_path(key, dir, sizeof(dir), name, sizeof(name));
+        requests[key] = w25_upload_buffer(client, name, dir, payload, pick_size(&rng), NULL, NULL, NULL, NULL);
+    }
+    for (int key = 0; key < config.keys; key++) {
+        if (w25_request_wait(requests[key])->status != W25_OK)
+            failed++;
+        w25_request_free(requests[key]);
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "Warning: %d of %d preload uploads failed\n", failed, config.keys);
+    }
+
+    free(requests);
+    w25_client_free(client);
+}
+
+// Function to compare two doubles for sorting
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to read a percentile from sorted samples
+static double percentile(const double* sorted, long count, double p) {
+    if (count == 0)
+        return 0;
+
+    long index = (long)ceil(p / 100.0 * count) - 1;
+    if (index < 0)
+        index = 0;
+    if (index >= count)
+        index = count - 1;
+
+    return sorted[index];
+}
+
+// Function to merge the threads' samples and print the report
+static void report(BenchThread* threads, double elapsed_s) {
+    long total_ops = 0, total_errors = 0;
+
+    if (config.json) {
+        printf("{\"config\":{\"clients\":%d,\"keys\":%d,\"zipf\":%.3f,\"seed\":%llu},\"duration_s\":%.3f,\"ops\":{",
+               config.clients, config.keys, config.zipf, (unsigned long long)config.seed, elapsed_s);
+    } else {
+        printf("%-11s %9s %7s %10s %9s %9s %9s %9s %9s\n",
+               "op", "count", "errors", "ops/s", "MB/s", "p50(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+    }
+
+    int first = 1;
+    for (int op = 0; op < BENCH_OPS; op++) {
+        long count = 0, errors = 0, bytes = 0;
+
+        for (int t = 0; t < config.clients; t++) {
+            count += threads[t].ops[op].count;
+            errors += threads[t].ops[op].errors;
+            bytes += threads[t].ops[op].bytes;
+        }
+        if (count == 0)
+            continue;
+
+        double* merged = malloc(count * sizeof(double));
+        double sum = 0;
+        long n = 0;
+        for (int t = 0; t < config.clients; t++) {
+            memcpy(merged + n, threads[t].ops[op].samples, threads[t].ops[op].count * sizeof(double));
+            n += threads[t].ops[op].count;
+        }
+        qsort(merged, count, sizeof(double), compare_double);
+        for (long i = 0; i < count; i++)
+            sum += merged[i];
+
+        double rate = count / elapsed_s;
+        double mbps = bytes / elapsed_s / (1024.0 * 1024.0);
+
+        if (config.json) {
+            printf("%s\"%s\":{\"count\":%ld,\"errors\":%ld,\"ops_per_sec\":%.2f,\"mb_per_sec\":%.3f,"
+                   "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                   first ? "" : ",", op_names[op], count, errors, rate, mbps, sum / count,
+                   percentile(merged, count, 50), percentile(merged, count, 99),
+                   percentile(merged, count, 99.9), merged[count - 1]);
+        } else {
+            printf("%-11s %9ld %7ld %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f\n",
+                   op_names[op], count, errors, rate, mbps,
+                   percentile(merged, count, 50), percentile(merged, count, 99),
+                   percentile(merged, count, 99.9), merged[count - 1]);
+        }
+
+        first = 0;
+        total_ops += count;
+        total_errors += errors;
+        free(merged);
+    }
+
+    if (config.json) {
+        printf("},\"total\":{\"count\":%ld,\"errors\":%ld,\"ops_per_sec\":%.2f}}\n",
+               total_ops, total_errors, total_ops / elapsed_s);
+    } else {
+        printf("%-11s %9ld %7ld %10.1f\n", "total", total_ops, total_errors, total_ops / elapsed_s);
+    }
+}
+
+static void print_usage() {
+    printf("Usage: w25bench [options]\n");
+    printf("  -H host          S1 address (default $W25_HOST or 127.0.0.1)\n");
+    printf("  -P port          S1 port (default $W25_PORT or 8080)\n");
+    printf("  -c clients       concurrent clients (default 8)\n");
+    printf("  -d seconds       run time (default 10)\n");
+    printf("  -n ops           stop after this many operations instead\n");
+    printf("  -m mix           weights, e.g. uploadf=30,downlf=60,removef=2,downltar=1,dispfnames=7\n");
+    printf("  -s dist          sizes: fixed:N, uniform:MIN-MAX or exp:MEAN (k/m/g suffixes)\n");
+    printf("  -k keys          distinct files (default 1000)\n");
+    printf("  -z theta         Zipf key skew, 0 for uniform (default 0.99)\n");
+    printf("  -t types         file types, e.g. txt,pdf,zip,c (default txt,pdf,zip)\n");
+    printf("  -p prefix        remote directory (default ~/S1/bench)\n");
+    printf("  -r seed          random seed\n");
+    printf("  -x               skip uploading every key before the run\n");
+    printf("  -j               JSON output\n");
+}
+
+int main(int argc, char* argv[]) {
+    BenchThread* threads;
+    pthread_t* tids;
+    int opt;
+
+    config.host = NULL;         // libw25 applies $W25_HOST/$W25_PORT and the defaults
+    config.port = 0;
+    config.clients = 8;
+    config.duration = 10;
+    config.keys = 1000;
+    config.zipf = 0.99;
+    config.prefix = "~/S1/bench";
+    config.preload = 1;
+    config.seed = (uint64_t)time(NULL);
+    parse_mix("uploadf=30,downlf=60,removef=2,downltar=1,dispfnames=7");
+    parse_size_dist("exp:64k");
+    parse_types("txt,pdf,zip");
+
+    while ((opt = getopt(argc, argv, "H:P:c:d:n:m:s:k:z:t:p:r:xjh")) != -1) {
+        int bad = 0;
+
+        switch (opt) {
+        case 'H': config.host = optarg; break;
+        case 'P': config.port = atoi(optarg); break;
+        case 'c': config.clients = atoi(optarg); break;
+        case 'd': config.duration = atof(optarg); break;
+        case 'n': config.total_ops = atol(optarg); break;
+        case 'm': bad = parse_mix(optarg); break;
+        case 's': bad = parse_size_dist(optarg); break;
+        case 'k': config.keys = atoi(optarg); break;
+        case 'z': config.zipf = atof(optarg); break;
+        case 't': bad = parse_types(optarg); break;
+        case 'p': config.prefix = optarg; break;
+        case 'r': config.seed = strtoull(optarg, NULL, 10); break;
+        case 'x': config.preload = 0; break;
+        case 'j': config.json = 1; break;
+        default: bad = 1; break;
+        }
+
+        if (bad) {
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (config.clients < 1 || config.keys < 1 || (config.duration <= 0 && config.total_ops <= 0)) {
+        print_usage();
+        return 2;
+    }
+    if (config.seed == 0)
+        config.seed = 1;
+
+    // One random payload covers every upload size; uploads send slices of it
+    payload_size = config.size_dist == SIZE_UNIFORM ? config.size_b
+                 : config.size_dist == SIZE_EXP ? config.size_a * 8 : config.size_a;
+    payload = malloc(payload_size > 0 ? payload_size : 1);
+    uint64_t fill = config.seed;
+    for (long i = 0; i < payload_size; i++)
+        payload[i] = (char)next_random(&fill);
+
+    if (config.zipf > 0)
+        build_zipf();
+
+    if (config.preload)
+        preload();
+
+    threads = calloc(config.clients, sizeof(BenchThread));
+    tids = calloc(config.clients, sizeof(pthread_t));
+
+    double start = now_ms();
+    deadline_ms = start + config.duration * 1000.0;
+
+    for (int i = 0; i < config.clients; i++) {
+        threads[i].id = i;
+        threads[i].rng = config.seed * 0x9E3779B97F4A7C15ULL + i + 1;
+        pthread_create(&tids[i], NULL, bench_thread, &threads[i]);
+    }
+    for (int i = 0; i < config.clients; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    report(threads, (now_ms() - start) / 1000.0);
+
+    for (int i = 0; i < config.clients; i++) {
+        for (int op = 0; op < BENCH_OPS; op++)
+            free(threads[i].ops[op].samples);
+    }
+    free(threads);
+    free(tids);
+    free(payload);
+    free(zipf_cdf);
+
+    return 0;
+}
\ No newline at end of file
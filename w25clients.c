@@ -1,414 +1,389 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <libgen.h>
-
-#define SERVER_IP "127.0.0.1"
-#define SERVER_PORT 8080
-#define BUFFER_SIZE 1024
-#define MAX_FILENAME 256
-#define MAX_PATH 1024
-
-// Function to check if file exists
-int file_exists(const char* filename) {
-    struct stat st;
-    return (stat(filename, &st) == 0);
-}
-
-// Function to get file extension
-const char* get_file_extension(const char* filename) {
-    const char* dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
-        return "";
-    return dot + 1;
-}
-
-// Function to connect to the server (S1)
-int connect_to_server() {
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        printf("Error: Socket creation error\n");
-        return -1;
-    }
-    
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(SERVER_PORT);
-    
-    if (inet_pton(AF_INET, SERVER_IP, &serv_addr.sin_addr) <= 0) {
-        printf("Error: Invalid address/ Address not supported\n");
-        return -1;
-    }
-    
-    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        printf("Error: Connection failed\n");
-        return -1;
-    }
-    
-    return sock;
-}
-
-// Function to upload file to the server
-void upload_file(const char* filename, const char* dest_path) {
-    char buffer[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    FILE* file;
-    struct stat st;
-    long filesize;
-    int bytes_read;
-    int sock;
-    
-    // Check if file exists
-    if (!file_exists(filename)) {
-        printf("Error: File %s not found\n", filename);
-        return;
-    }
-    
-    // Check if file has valid extension (.c, .pdf, .txt, .zip)
-    const char* ext = get_file_extension(filename);
-    if (strcmp(ext, "c") != 0 && strcmp(ext, "pdf") != 0 && strcmp(ext, "txt") != 0 && strcmp(ext, "zip") != 0) {
-        printf("Error: Unsupported file extension: %s\n", ext);
-        return;
-    }
-    
-    // Connect to server
-    sock = connect_to_server();
-    if (sock < 0) {
-        return;
-    }
-    
-    // Send command to server
-    snprintf(cmd, BUFFER_SIZE, "uploadf %s %s", filename, dest_path);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Get file size
-    stat(filename, &st);
-    filesize = st.st_size;
-    
-    // Send file size to server
-    sprintf(buffer, "%ld", filesize);
-    send(sock, buffer, strlen(buffer), 0);
-    
-    // Wait for server to be ready
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    if (strcmp(buffer, "READY") != 0) {
-        printf("Error: Server not ready to receive file\n");
-        close(sock);
-        return;
-    }
-    
-    // Send file content
-    file = fopen(filename, "rb");
-    if (!file) {
-        printf("Error: Cannot open file %s\n", filename);
-        close(sock);
-        return;
-    }
-    
-    while ((bytes_read = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(sock, buffer, bytes_read, 0);
-        memset(buffer, 0, BUFFER_SIZE);
-    }
-    
-    fclose(file);
-    
-    // Get response from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    printf("%s\n", buffer);
-    
-    close(sock);
-}
-
-// Function to download file from the server
-void download_file(const char* filename) {
-    char buffer[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    FILE* file;
-    long filesize;
-    int bytes_read, total_bytes = 0;
-    int sock;
-    
-    // Connect to server
-    sock = connect_to_server();
-    if (sock < 0) {
-        return;
-    }
-    
-    // Send command to server
-    snprintf(cmd, BUFFER_SIZE, "downlf %s", filename);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Get file size from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    if (strncmp(buffer, "ERROR", 5) == 0) {
-        printf("%s\n", buffer);
-        close(sock);
-        return;
-    }
-    
-    filesize = atol(buffer);
-    
-    // Extract filename from path
-    char* base_filename = basename((char*)filename);
-    
-    // Open file for writing
-    file = fopen(base_filename, "wb");
-    if (!file) {
-        printf("Error: Cannot create file %s\n", base_filename);
-        close(sock);
-        return;
-    }
-    
-    // Tell server we're ready to receive the file content
-    strcpy(buffer, "READY");
-    send(sock, buffer, strlen(buffer), 0);
-    
-    // Receive file content
-    while (total_bytes < filesize) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = recv(sock, buffer, BUFFER_SIZE, 0);
-        
-        if (bytes_read <= 0)
-            break;
-        
-        fwrite(buffer, 1, bytes_read, file);
-        total_bytes += bytes_read;
-    }
-    
-    fclose(file);
-    
-    printf("File %s downloaded successfully\n", base_filename);
-    
-    close(sock);
-}
-
-// Function to remove file from the server
-void remove_file(const char* filename) {
-    char buffer[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    int sock;
-    
-    // Connect to server
-    sock = connect_to_server();
-    if (sock < 0) {
-        return;
-    }
-    
-    // Send command to server
-    snprintf(cmd, BUFFER_SIZE, "removef %s", filename);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Get response from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    printf("%s\n", buffer);
-    
-    close(sock);
-}
-
-// Function to download tar file of specified file type
-void download_tar(const char* filetype) {
-    char buffer[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    FILE* file;
-    long filesize;
-    int bytes_read, total_bytes = 0;
-    int sock;
-    char tar_filename[MAX_FILENAME];
-    
-    // Check if file type is valid (.c, .pdf, .txt)
-    if (strcmp(filetype, "c") != 0 && strcmp(filetype, "pdf") != 0 && strcmp(filetype, "txt") != 0) {
-        printf("Error: Unsupported file type: %s\n", filetype);
-        return;
-    }
-    
-    // Connect to server
-    sock = connect_to_server();
-    if (sock < 0) {
-        return;
-    }
-    
-    // Send command to server
-    snprintf(cmd, BUFFER_SIZE, "downltar %s", filetype);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Get file size from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    if (strncmp(buffer, "ERROR", 5) == 0) {
-        printf("%s\n", buffer);
-        close(sock);
-        return;
-    }
-    
-    filesize = atol(buffer);
-    
-    // Determine tar file name based on file type
-    if (strcmp(filetype, "c") == 0) {
-        strcpy(tar_filename, "cfiles.tar");
-    } else if (strcmp(filetype, "pdf") == 0) {
-        strcpy(tar_filename, "pdf.tar");
-    } else if (strcmp(filetype, "txt") == 0) {
-        strcpy(tar_filename, "text.tar");
-    }
-    
-    // Open file for writing
-    file = fopen(tar_filename, "wb");
-    if (!file) {
-        printf("Error: Cannot create file %s\n", tar_filename);
-        close(sock);
-        return;
-    }
-    
-    // Tell server we're ready to receive the file content
-    strcpy(buffer, "READY");
-    send(sock, buffer, strlen(buffer), 0);
-    
-    // Receive file content
-    while (total_bytes < filesize) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = recv(sock, buffer, BUFFER_SIZE, 0);
-        
-        if (bytes_read <= 0)
-            break;
-        
-        fwrite(buffer, 1, bytes_read, file);
-        total_bytes += bytes_read;
-    }
-    
-    fclose(file);
-    
-    printf("Tar file %s downloaded successfully\n", tar_filename);
-    
-    close(sock);
-}
-
-// Function to display filenames in specified path
-void display_filenames(const char* pathname) {
-    char buffer[BUFFER_SIZE];
-    char cmd[BUFFER_SIZE];
-    int sock;
-    
-    // Connect to server
-    sock = connect_to_server();
-    if (sock < 0) {
-        return;
-    }
-    
-    // Send command to server
-    snprintf(cmd, BUFFER_SIZE, "dispfnames %s", pathname);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Get response from server
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(sock, buffer, BUFFER_SIZE, 0);
-    
-    printf("%s\n", buffer);
-    
-    close(sock);
-}
-
-void print_usage() {
-    printf("Available commands:\n");
-    printf("  uploadf filename destination_path\n");
-    printf("  downlf filename\n");
-    printf("  removef filename\n");
-    printf("  downltar filetype\n");
-    printf("  dispfnames pathname\n");
-}
-
-int main() {
-    char cmd[BUFFER_SIZE];
-    char arg1[MAX_PATH];
-    char arg2[MAX_PATH];
-    
-    printf("Welcome to w25clients\n");
-    
-    while (1) {
-        printf("w25clients$ ");
-        fflush(stdout);
-        
-        // Clear buffers
-        memset(cmd, 0, sizeof(cmd));
-        memset(arg1, 0, sizeof(arg1));
-        memset(arg2, 0, sizeof(arg2));
-        
-        // Get user input
-        char input[BUFFER_SIZE];
-        if (fgets(input, BUFFER_SIZE, stdin) == NULL) {
-            break;
-        }
-        
-        // Remove trailing newline
-        input[strcspn(input, "\n")] = 0;
-        
-        // Parse command
-        int args = sscanf(input, "%s %s %s", cmd, arg1, arg2);
-        
-        if (args < 1) {
-            continue;
-        }
-        
-        // Process command
-        if (strcmp(cmd, "uploadf") == 0) {
-            if (args != 3) {
-                printf("Error: Invalid command syntax\n");
-                printf("Usage: uploadf filename destination_path\n");
-            } else {
-                upload_file(arg1, arg2);
-            }
-        } else if (strcmp(cmd, "downlf") == 0) {
-            if (args != 2) {
-                printf("Error: Invalid command syntax\n");
-                printf("Usage: downlf filename\n");
-            } else {
-                download_file(arg1);
-            }
-        } else if (strcmp(cmd, "removef") == 0) {
-            if (args != 2) {
-                printf("Error: Invalid command syntax\n");
-                printf("Usage: removef filename\n");
-            } else {
-                remove_file(arg1);
-            }
-        } else if (strcmp(cmd, "downltar") == 0) {
-            if (args != 2) {
-                printf("Error: Invalid command syntax\n");
-                printf("Usage: downltar filetype\n");
-            } else {
-                download_tar(arg1);
-            }
-        } else if (strcmp(cmd, "dispfnames") == 0) {
-            if (args != 2) {
-                printf("Error: Invalid command syntax\n");
-                printf("Usage: dispfnames pathname\n");
-            } else {
-                display_filenames(arg1);
-            }
-        } else if (strcmp(cmd, "help") == 0) {
-            print_usage();
-        } else if (strcmp(cmd, "exit") == 0) {
-            break;
-        } else {
-            printf("Error: Unknown command: %s\n", cmd);
-            print_usage();
-        }
-    }
-    
-    return 0;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+
+#include "libw25.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_PATH 1024
+
+// Function to get file extension
+const char* get_file_extension(const char* filename) {
+    const char* dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+        return "";
+    return dot + 1;
+}
+
+void print_usage() {
+    printf("Available commands:\n");
+    printf("  uploadf filename destination_path\n");
+    printf("  downlf filename\n");
+    printf("  removef filename\n");
+    printf("  downltar filetype\n");
+    printf("  dispfnames pathname\n");
+    printf("  stats [json]\n");
+    printf("  trace [trace_id]\n");
+    printf("Batch mode:\n");
+    printf("  w25clients -b command_file [-j workers]\n");
+    printf("  w25clients -s local_dir destination_path [-j workers]\n");
+}
+
+// Function to check a command's argument count. Returns NULL when the command is
+// well formed, "" when it is unknown, or its usage line otherwise.
+const char* command_usage(const char* cmd, int args) {
+    if (strcmp(cmd, "uploadf") == 0) {
+        return args == 3 ? NULL : "uploadf filename destination_path";
+    } else if (strcmp(cmd, "downlf") == 0) {
+        return args == 2 ? NULL : "downlf filename";
+    } else if (strcmp(cmd, "removef") == 0) {
+        return args == 2 ? NULL : "removef filename";
+    } else if (strcmp(cmd, "downltar") == 0) {
+        return args == 2 ? NULL : "downltar filetype";
+    } else if (strcmp(cmd, "dispfnames") == 0) {
+        return args == 2 ? NULL : "dispfnames pathname";
+    } else if (strcmp(cmd, "stats") == 0) {
+        return args <= 2 ? NULL : "stats [json]";
+    } else if (strcmp(cmd, "trace") == 0) {
+        return args <= 2 ? NULL : "trace [trace_id]";
+    }
+
+    return "";
+}
+
+// Function to check whether a command returns a report in the result data
+int is_report(const char* cmd) {
+    return strcmp(cmd, "stats") == 0 || strcmp(cmd, "trace") == 0;
+}
+
+// Function to submit one parsed command to the client library
+W25Request* submit_command(W25Client* client, const char* cmd, const char* arg1, const char* arg2, void* user) {
+    if (strcmp(cmd, "uploadf") == 0) {
+        return w25_upload_file(client, arg1, arg2, NULL, user);
+    } else if (strcmp(cmd, "downlf") == 0) {
+        return w25_download_file(client, arg1, NULL, NULL, user);
+    } else if (strcmp(cmd, "removef") == 0) {
+        return w25_remove(client, arg1, NULL, user);
+    } else if (strcmp(cmd, "downltar") == 0) {
+        return w25_download_tar(client, arg1, NULL, NULL, user);
+    } else if (strcmp(cmd, "stats") == 0) {
+        return w25_stats(client, arg1, NULL, user);
+    } else if (strcmp(cmd, "trace") == 0) {
+        return w25_trace(client, arg1, NULL, user);
+    }
+
+    return w25_list(client, arg1, NULL, user);
+}
+
+// Structure to store one queued batch operation
+typedef struct {
+    int line;
+    char cmd[32];
+    char arg1[MAX_PATH];
+    char arg2[MAX_PATH];
+} BatchJob;
+
+// Structure to store the batch being run
+typedef struct {
+    BatchJob* jobs;
+    int job_count;
+    int max_jobs;
+    int failed;
+} Batch;
+
+// Function to queue a batch operation
+int batch_add(Batch* batch, int line, const char* cmd, const char* arg1, const char* arg2) {
+    if (batch->job_count >= batch->max_jobs) {
+        int max_jobs = batch->max_jobs ? batch->max_jobs * 2 : 64;
+        BatchJob* jobs = realloc(batch->jobs, max_jobs * sizeof(BatchJob));
+        if (!jobs) {
+            return -1;
+        }
+        batch->jobs = jobs;
+        batch->max_jobs = max_jobs;
+    }
+
+    BatchJob* job = &batch->jobs[batch->job_count++];
+    job->line = line;
+    snprintf(job->cmd, sizeof(job->cmd), "%s", cmd);
+    snprintf(job->arg1, sizeof(job->arg1), "%s", arg1 ? arg1 : "");
+    snprintf(job->arg2, sizeof(job->arg2), "%s", arg2 ? arg2 : "");
+
+    return 0;
+}
+
+// Function to load a command file: one client command per line, '#' starts a comment
+int batch_load_commands(Batch* batch, const char* path) {
+    char input[BUFFER_SIZE];
+    char cmd[BUFFER_SIZE], arg1[MAX_PATH], arg2[MAX_PATH];
+    FILE* file;
+    int line = 0;
+
+    file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open command file %s\n", path);
+        return -1;
+    }
+
+    while (fgets(input, sizeof(input), file) != NULL) {
+        line++;
+        input[strcspn(input, "#\n")] = 0;
+
+        int args = sscanf(input, "%s %s %s", cmd, arg1, arg2);
+        if (args < 1) {
+            continue;
+        }
+
+        const char* usage = command_usage(cmd, args);
+        if (usage != NULL) {
+            fprintf(stderr, "Error: %s:%d: %s%s\n", path, line,
+                    usage[0] ? "usage: " : "unknown command ", usage[0] ? usage : cmd);
+            fclose(file);
+            return -1;
+        }
+
+        if (batch_add(batch, line, cmd, args >= 2 ? arg1 : NULL, args == 3 ? arg2 : NULL) < 0) {
+            fclose(file);
+            return -1;
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Function to queue an upload of every supported file under local_dir, mirroring
+// its subdirectories below dest_path
+int batch_load_sync(Batch* batch, const char* local_dir, const char* dest_path) {
+    char local_path[MAX_PATH];
+    char remote_path[MAX_PATH];
+    struct dirent* ent;
+    struct stat st;
+    DIR* dir;
+    int status = 0;
+
+    dir = opendir(local_dir);
+    if (!dir) {
+        fprintf(stderr, "Error: Cannot open directory %s\n", local_dir);
+        return -1;
+    }
+
+    while (status == 0 && (ent = readdir(dir)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        snprintf(local_path, sizeof(local_path), "%s/%s", local_dir, ent->d_name);
+        if (stat(local_path, &st) < 0) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(remote_path, sizeof(remote_path), "%s/%s", dest_path, ent->d_name);
+            status = batch_load_sync(batch, local_path, remote_path);
+        } else if (S_ISREG(st.st_mode)) {
+            const char* ext = get_file_extension(ent->d_name);
+            if (strcmp(ext, "c") == 0 || strcmp(ext, "pdf") == 0 || strcmp(ext, "txt") == 0 || strcmp(ext, "zip") == 0) {
+                status = batch_add(batch, 0, "uploadf", local_path, dest_path);
+            }
+        }
+    }
+
+    closedir(dir);
+    return status;
+}
+
+// Function to write a string as a JSON string literal
+void json_print_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for (const unsigned char* p = (const unsigned char*)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p == '\n') {
+            fputs("\\n", out);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Function to print one finished batch operation as a JSON object
+void print_batch_result(int seq, BatchJob* job, const W25Result* result) {
+    printf("{\"seq\":%d,\"line\":%d,\"op\":\"%s\",\"args\":[", seq, job->line, job->cmd);
+    json_print_string(stdout, job->arg1);
+    if (job->arg2[0]) {
+        putchar(',');
+        json_print_string(stdout, job->arg2);
+    }
+    printf("],\"status\":\"%s\",\"ms\":%.3f,\"bytes\":%ld,\"message\":",
+           result->status == W25_OK ? "ok" : "error", result->elapsed_ms, result->bytes);
+    json_print_string(stdout, is_report(job->cmd) && result->data ? (char*)result->data : result->message);
+    printf(",\"trace\":\"%s\"}\n", result->trace_id);
+    fflush(stdout);
+}
+
+// Function to run a batch with the given number of concurrent sessions. Every
+// job is queued up front; results are printed as they come off the completion
+// queue. Returns the process exit status: 0 when every operation succeeded.
+int run_batch(Batch* batch, int workers) {
+    W25Options options = { NULL, 0, workers };    // S1 from $W25_HOST/$W25_PORT or the defaults
+    W25Client* client;
+    struct timespec start, end;
+    int finished = 0;
+
+    if (workers > batch->job_count) {
+        options.connections = batch->job_count > 0 ? batch->job_count : 1;
+    }
+
+    client = w25_client_new(&options);
+    if (!client) {
+        fprintf(stderr, "Error: Cannot start client\n");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < batch->job_count; i++) {
+        BatchJob* job = &batch->jobs[i];
+        submit_command(client, job->cmd, job->arg1, job->arg2, (void*)(long)i);
+    }
+
+    struct pollfd pfd = { w25_client_fd(client), POLLIN, 0 };
+    while (finished < batch->job_count) {
+        W25Request* request = w25_next_completed(client);
+
+        if (!request) {
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        int seq = (int)(long)w25_request_user(request);
+        const W25Result* result = w25_request_result(request);
+        if (result->status != W25_OK) {
+            batch->failed++;
+        }
+        print_batch_result(seq, &batch->jobs[seq], result);
+        w25_request_free(request);
+        finished++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    printf("{\"summary\":{\"ops\":%d,\"ok\":%d,\"failed\":%d,\"workers\":%d,\"wall_ms\":%.3f,\"ops_per_sec\":%.1f}}\n",
+           batch->job_count, batch->job_count - batch->failed, batch->failed, options.connections, elapsed,
+           elapsed > 0 ? batch->job_count * 1000.0 / elapsed : 0.0);
+
+    w25_client_free(client);
+
+    return batch->failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    char cmd[BUFFER_SIZE];
+    char arg1[MAX_PATH];
+    char arg2[MAX_PATH];
+
+    // Batch mode: -b command_file or -s local_dir destination_path, with -j workers
+    if (argc > 1) {
+        Batch batch = {0};
+        int workers = 4;
+        int loaded = -1;
+
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                workers = atoi(argv[++i]);
+            } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+                loaded = batch_load_commands(&batch, argv[++i]);
+            } else if (strcmp(argv[i], "-s") == 0 && i + 2 < argc) {
+                loaded = batch_load_sync(&batch, argv[i + 1], argv[i + 2]);
+                i += 2;
+            } else {
+                loaded = -1;
+                break;
+            }
+        }
+
+        if (loaded < 0 || workers < 1) {
+            print_usage();
+            free(batch.jobs);
+            return 2;
+        }
+
+        int status = run_batch(&batch, workers);
+        free(batch.jobs);
+        return status;
+    }
+
+    // One session, kept alive by the library between commands
+    W25Options options = { NULL, 0, 1 };
+    W25Client* client = w25_client_new(&options);
+    if (!client) {
+        fprintf(stderr, "Error: Cannot start client\n");
+        return 1;
+    }
+
+    printf("Welcome to w25clients\n");
+
+    while (1) {
+        printf("w25clients$ ");
+        fflush(stdout);
+
+        // Clear buffers
+        memset(cmd, 0, sizeof(cmd));
+        memset(arg1, 0, sizeof(arg1));
+        memset(arg2, 0, sizeof(arg2));
+
+        // Get user input
+        char input[BUFFER_SIZE];
+        if (fgets(input, BUFFER_SIZE, stdin) == NULL) {
+            break;
+        }
+
+        // Remove trailing newline
+        input[strcspn(input, "\n")] = 0;
+
+        // Parse command
+        int args = sscanf(input, "%s %s %s", cmd, arg1, arg2);
+
+        if (args < 1) {
+            continue;
+        }
+
+        // Process command
+        if (strcmp(cmd, "help") == 0) {
+            print_usage();
+        } else if (strcmp(cmd, "exit") == 0) {
+            break;
+        } else {
+            const char* usage = command_usage(cmd, args);
+
+            if (usage == NULL) {
+                W25Request* request = submit_command(client, cmd, arg1, arg2, NULL);
+                const W25Result* result = w25_request_wait(request);
+
+                // Statistics and trace reports can outgrow the message buffer
+                printf("%s\n", is_report(cmd) && result->data ? (char*)result->data : result->message);
+                w25_request_free(request);
+            } else if (usage[0]) {
+                printf("Error: Invalid command syntax\n");
+                printf("Usage: %s\n", usage);
+            } else {
+                printf("Error: Unknown command: %s\n", cmd);
+                print_usage();
+            }
+        }
+    }
+
+    w25_client_free(client);
+
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,720 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// w25cluster: starts S1-S4 as one isolated local cluster.
+//
+// Every server gets a listening socket bound by the launcher on 127.0.0.1 (an
+// ephemeral port unless -p is given for S1), its own storage root under the
+// cluster directory and a pipe it reports readiness on. A backend can run as
+// several instances (-n s3=3); S1 gets a routing table with one pool per
+// backend type listing all of its instances, replicated with -r and erasure
+// coded with -e where a pool has enough instances. With -n c=N .c files get a
+// pool of their own too, served by S3 binaries, and with -f N that many S1
+// instances share the backends as interchangeable front ends; with -w S1 spools uploads
+// under the cluster directory and forwards them in the background. The
+// launcher then either waits for SIGINT/SIGTERM or runs a command against the
+// cluster, and finally
+// stops every server together with its forked session processes. Any number of
+// launchers can run side by side since nothing is shared between clusters.
+
+#define MAX_PATH 1024
+#define MAX_SERVERS (5 * MAX_INSTANCES)  // Four backend kinds and the S1 instances
+#define MAX_INSTANCES 16            // Per backend type, the size of a routing pool
+#define DEFAULT_START_TIMEOUT 10    // Seconds to wait for every server to report ready
+#define STOP_GRACE_MS 3000          // Time servers get to exit after SIGTERM before SIGKILL
+
+// Structure to store one server of the cluster
+typedef struct {
+    const char* name;               // s1 .. s4, the binary
+    const char* kind;               // s1 .. s4 or c, what the server is for
+    char label[16];                 // s3, s3.2, c.2, ...: log file and storage root
+    int listen_fd;
+    int port;
+    pid_t pid;                      // Also the process group of the server and its sessions
+    int ready_fd;                   // Read end of the readiness pipe
+} Server;
+
+// Structure to store one kind of backend and the pool it serves
+typedef struct {
+    const char* kind;
+    const char* binary;
+    const char* ext;                // Also the name of the pool
+    const char* prefix;             // Storage prefix of the binary
+} BackendKind;
+
+static const BackendKind kinds[4] = {
+    { "s2", "s2", "pdf", "S2" },
+    { "s3", "s3", "txt", "S3" },
+    { "s4", "s4", "zip", "S4" },
+    { "c", "s3", "c", "S3" },       // Any backend stores any type; S3 also builds tars
+};
+
+static Server servers[MAX_SERVERS];  // Backends first; S1 last, once its backends are known
+static int server_count;
+static int instances[4] = { 1, 1, 1, 0 };  // Of s2, s3, s4 and the .c pool, none by default
+static int front_ends = 1;              // S1 instances (-f)
+static int replicas = 1, write_quorum;  // Per pool, capped at its instances; quorum 0 for a majority
+static int ec_data, ec_parity;          // Erasure coding of large files, 0 when off
+static long ec_min_size = 1024 * 1024;
+static int write_behind;                // Whether S1 spools uploads (-W)
+static char qos_file[MAX_PATH];         // Tenant limits for S1 (-Q), empty for none
+static int direct;                      // Whether clients move content straight to the backends (-D)
+static char key_file[MAX_PATH];         // Key S1 signs backend commands with, see dfs_token.h
+
+static char cluster_dir[MAX_PATH];
+static char bin_dir[MAX_PATH];
+static volatile sig_atomic_t stop_requested;
+
+// Function to record a shutdown request
+static void handle_stop(int sig) {
+    stop_requested = sig;
+}
+
+// Function to do nothing; SIGCHLD only needs to interrupt sigsuspend
+static void handle_child(int sig) {
+    (void)sig;
+}
+
+// Function to get a monotonic timestamp in milliseconds
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Function to bind a listening socket on 127.0.0.1; port 0 picks a free one
+static int open_listener(int port, int* bound_port) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    
+    if (fd < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));    // S1 adds listeners of its own
+    
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 128) < 0 ||
+        getsockname(fd, (struct sockaddr*)&address, &addrlen) < 0) {
+        perror("bind failed");
+        close(fd);
+        return -1;
+    }
+    
+    *bound_port = ntohs(address.sin_port);
+    return fd;
+}
+
+// Function to add a server of a kind, run by the binary name, to the cluster
+static void add_server(const char* kind, const char* name, int instance) {
+    Server* server = &servers[server_count++];
+    
+    server->name = name;
+    server->kind = kind;
+    if (instance > 1) {
+        snprintf(server->label, sizeof(server->label), "%s.%d", kind, instance);
+    } else {
+        snprintf(server->label, sizeof(server->label), "%s", kind);
+    }
+    server->listen_fd = -1;
+    server->pid = -1;
+    server->ready_fd = -1;
+}
+
+// Function to write S1's routing table: one pool per backend type with every instance
+static int write_routes(const char* path) {
+    FILE* file = fopen(path, "w");
+    
+    if (!file) {
+        perror("Cannot write routing table");
+        return -1;
+    }
+    
+    for (int k = 0; k < 4; k++) {
+        const char* ext = kinds[k].ext;
+        
+        if (instances[k] == 0) {
+            continue;
+        }
+        
+        fprintf(file, "pool %s %s", ext, kinds[k].prefix);
+        for (int i = 0; i < server_count; i++) {
+            if (strcmp(servers[i].kind, kinds[k].kind) == 0) {
+                fprintf(file, " 127.0.0.1:%d", servers[i].port);
+            }
+        }
+        fprintf(file, "\nroute %s %s\n", ext, ext);
+        
+        // Smaller pools keep as many copies as they have instances
+        int copies = replicas < instances[k] ? replicas : instances[k];
+        if (copies > 1) {
+            int quorum = write_quorum ? write_quorum : copies / 2 + 1;
+            fprintf(file, "replicas %s %d %d\n", ext, copies, quorum < copies ? quorum : copies);
+        }
+        
+        // Pools too small for a stripe keep copying large files
+        if (ec_data && ec_data + ec_parity <= instances[k]) {
+            fprintf(file, "erasure %s %d %d %ld\n", ext, ec_data, ec_parity, ec_min_size);
+        }
+    }
+    
+    return fclose(file);
+}
+
+// Function to start one server with its listener, storage root and readiness pipe
+static int start_server(Server* server) {
+    char program[MAX_PATH * 2], root[MAX_PATH * 2], log_path[MAX_PATH * 2], routes[MAX_PATH * 2];
+    char spool[MAX_PATH * 2];
+    char listen_arg[16], ready_arg[16];
+    int pipe_fds[2];
+    
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        return -1;
+    }
+    
+    snprintf(program, sizeof(program), "%s/%s", bin_dir, server->name);
+    snprintf(root, sizeof(root), "%s/%c%s", cluster_dir, toupper((unsigned char)server->label[0]), server->label + 1);
+    snprintf(log_path, sizeof(log_path), "%s/%s.log", cluster_dir, server->label);
+    snprintf(routes, sizeof(routes), "%s/routing.conf", cluster_dir);
+    snprintf(spool, sizeof(spool), "%s/spool", cluster_dir);
+    snprintf(listen_arg, sizeof(listen_arg), "%d", server->listen_fd);
+    snprintf(ready_arg, sizeof(ready_arg), "%d", pipe_fds[1]);
+    
+    if (strcmp(server->name, "s1") == 0 && write_routes(routes) != 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    
+    server->pid = fork();
+    if (server->pid < 0) {
+        perror("fork failed");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    
+    if (server->pid == 0) {
+        // Own process group, so stopping the server also stops its sessions
+        setpgid(0, 0);
+        
+        // Only the listener and the write end of the pipe survive exec
+        fcntl(server->listen_fd, F_SETFD, 0);
+        fcntl(pipe_fds[1], F_SETFD, 0);
+        
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log_fd >= 0) {
+            dup2(log_fd, STDOUT_FILENO);
+            dup2(log_fd, STDERR_FILENO);
+            close(log_fd);
+        }
+        
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        
+        // S1 also gets the routing table and its optional settings
+        char* args[16] = { program, "-l", listen_arg, "-r", root, "-R", ready_arg };
+        int argn = 7;
+        if (key_file[0]) {
+            args[argn++] = "-K";
+            args[argn++] = key_file;
+        }
+        if (strcmp(server->name, "s1") == 0) {
+            args[argn++] = "-c";
+            args[argn++] = routes;
+            if (write_behind) {
+                args[argn++] = "-W";
+                args[argn++] = spool;
+            }
+            if (qos_file[0]) {
+                args[argn++] = "-Q";
+                args[argn++] = qos_file;
+            }
+        }
+        args[argn] = NULL;
+        execv(program, args);
+        
+        fprintf(stderr, "Cannot run %s: %s\n", program, strerror(errno));
+        _exit(127);
+    }
+    
+    // Also set here, so the group exists before the launcher might signal it
+    setpgid(server->pid, server->pid);
+    close(pipe_fds[1]);
+    server->ready_fd = pipe_fds[0];
+    
+    return 0;
+}
+
+// Function to wait until a server writes READY; EOF or timeout means it failed
+static int wait_ready(Server* server, long deadline) {
+    char line[64];
+    size_t used = 0;
+    
+    while (used < sizeof(line) - 1) {
+        struct pollfd pfd = { server->ready_fd, POLLIN, 0 };
+        long left = deadline - now_ms();
+        
+        if (left <= 0 || poll(&pfd, 1, (int)left) <= 0) {
+            printf("ERROR: %s did not become ready in time, see %s/%s.log\n", server->label, cluster_dir, server->label);
+            return -1;
+        }
+        
+        ssize_t n = read(server->ready_fd, line + used, sizeof(line) - 1 - used);
+        if (n <= 0) {
+            printf("ERROR: %s exited during startup, see %s/%s.log\n", server->label, cluster_dir, server->label);
+            return -1;
+        }
+        
+        used += n;
+        line[used] = 0;
+        if (strchr(line, '\n')) {
+            break;
+        }
+    }
+    
+    close(server->ready_fd);
+    server->ready_fd = -1;
+    
+    return strncmp(line, "READY", 5) == 0 ? 0 : -1;
+}
+
+// Function to stop every running server: SIGTERM first, SIGKILL after the grace period
+static void stop_servers() {
+    long deadline = now_ms() + STOP_GRACE_MS;
+    int running;
+    
+    for (int i = server_count - 1; i >= 0; i--) {
+        if (servers[i].pid > 0) {
+            kill(-servers[i].pid, SIGTERM);
+        }
+    }
+    
+    do {
+        running = 0;
+        for (int i = 0; i < server_count; i++) {
+            if (servers[i].pid > 0) {
+                if (waitpid(servers[i].pid, NULL, WNOHANG) == servers[i].pid) {
+                    servers[i].pid = -1;
+                } else {
+                    running++;
+                }
+            }
+        }
+        if (running > 0) {
+            usleep(10000);
+        }
+    } while (running > 0 && now_ms() < deadline);
+    
+    for (int i = 0; i < server_count; i++) {
+        if (servers[i].pid > 0) {
+            printf("%s did not stop, killing it\n", servers[i].label);
+            kill(-servers[i].pid, SIGKILL);
+            waitpid(servers[i].pid, NULL, 0);
+            servers[i].pid = -1;
+        }
+    }
+    
+    for (int i = 0; i < server_count; i++) {
+        if (servers[i].listen_fd >= 0) {
+            close(servers[i].listen_fd);
+            servers[i].listen_fd = -1;
+        }
+    }
+}
+
+// Function to reap exited children; returns the index of a server that died, or -1
+static int reap_children(pid_t command_pid, int* command_status, int* command_done) {
+    pid_t pid;
+    int status;
+    int died = -1;
+    
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == command_pid) {
+            *command_status = status;
+            *command_done = 1;
+            continue;
+        }
+        for (int i = 0; i < server_count; i++) {
+            if (servers[i].pid == pid) {
+                servers[i].pid = -1;
+                died = i;
+            }
+        }
+    }
+    
+    return died;
+}
+
+// Function to remove one entry while deleting the cluster directory
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Function to find the directory holding this binary, where s1-s4 are looked up by default
+static void default_bin_dir(const char* argv0) {
+    char self[MAX_PATH];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    
+    if (n > 0) {
+        self[n] = 0;
+    } else {
+        snprintf(self, sizeof(self), "%s", argv0);
+    }
+    
+    snprintf(bin_dir, sizeof(bin_dir), "%s", dirname(self));
+}
+
+// Function to write a fresh key for S1 and the backends to <dir>/cluster.key
+static int write_key() {
+    unsigned char key[32];
+    int fd = open("/dev/urandom", O_RDONLY);
+    
+    if (fd < 0 || read(fd, key, sizeof(key)) != (ssize_t)sizeof(key)) {
+        perror("Cannot read /dev/urandom");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    
+    snprintf(key_file, sizeof(key_file), "%s/cluster.key", cluster_dir);
+    fd = open(key_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, key, sizeof(key)) != (ssize_t)sizeof(key)) {
+        perror("Cannot write cluster key");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to print usage information
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] [-- command [args...]]\n", program);
+    printf("  -d dir       Cluster directory for storage roots and logs (default: new /tmp/w25cluster.XXXXXX)\n");
+    printf("  -b dir       Directory containing the s1-s4 binaries (default: next to %s)\n", program);
+    printf("  -p port      S1 port (default: any free port); backends always use free ports\n");
+    printf("  -n s3=count  Run count instances of a backend, routed by consistent hashing (default 1 each);\n");
+    printf("               c=count gives .c files a pool of their own instead of S1's disk\n");
+    printf("  -f count     Run count S1 instances as interchangeable front ends (implies -n c=1)\n");
+    printf("  -r n[/w]     Keep n copies of every file, acknowledged after w (default a majority)\n");
+    printf("  -e k+m[@b]   Erasure code files of at least b bytes (default 1 MiB) into k data and m parity\n");
+    printf("               shards, in pools with at least k+m instances\n");
+    printf("  -w           Write-behind: S1 acknowledges uploads once spooled in <dir>/spool\n");
+    printf("  -q file      Tenant bandwidth and operation limits for S1, reread on SIGHUP to S1\n");
+    printf("  -D           Direct transfers: S1 signs backend commands with <dir>/cluster.key and\n");
+    printf("               clients move file content straight to and from the backends\n");
+    printf("  -t seconds   Startup timeout (default %d)\n", DEFAULT_START_TIMEOUT);
+    printf("  -k           Keep a generated cluster directory after shutdown\n");
+    printf("\n");
+    printf("Once every server is ready the launcher prints W25_HOST, W25_PORT and\n");
+    printf("W25_CLUSTER_DIR (W25_DIRECT with -D, W25_SERVERS with -f) and writes them to\n");
+    printf("<dir>/cluster.env. With a command it runs it with those variables set\n");
+    printf("and stops the cluster when it exits, returning its exit status;\n");
+    printf("otherwise it runs until SIGINT or SIGTERM.\n");
+}
+
+int main(int argc, char* argv[]) {
+    char env_path[MAX_PATH * 2], port_text[16];
+    char** command = NULL;
+    int s1_port = 0;
+    int start_timeout = DEFAULT_START_TIMEOUT;
+    int keep = 0, generated_dir = 0;
+    int exit_status = EXIT_SUCCESS;
+    int command_status = 0;
+    int command_done = 0;
+    pid_t command_pid = -1;
+    int kind, count;
+    int ch;
+    
+    default_bin_dir(argv[0]);
+    
+    // Parse command line options; everything after -- is the command to run
+    while ((ch = getopt(argc, argv, "+d:b:p:n:f:r:e:t:wq:Dkh")) != -1) {
+        switch (ch) {
+        case 'd':
+            snprintf(cluster_dir, sizeof(cluster_dir), "%s", optarg);
+            break;
+        case 'b':
+            snprintf(bin_dir, sizeof(bin_dir), "%s", optarg);
+            break;
+        case 'p':
+            s1_port = atoi(optarg);
+            break;
+        case 'n':
+            if (sscanf(optarg, "c=%d", &count) == 1) {
+                kind = 5;
+            } else if (sscanf(optarg, "s%d=%d", &kind, &count) != 2 || kind < 2 || kind > 4) {
+                kind = 0;
+            }
+            if (kind == 0 || count < 1 || count > MAX_INSTANCES) {
+                printf("Invalid instance count %s, expected s2, s3, s4 or c=1-%d\n", optarg, MAX_INSTANCES);
+                exit(EXIT_FAILURE);
+            }
+            instances[kind - 2] = count;
+            break;
+        case 'f':
+            front_ends = atoi(optarg);
+            if (front_ends < 1 || front_ends > MAX_INSTANCES) {
+                printf("Invalid front end count %s, expected 1-%d\n", optarg, MAX_INSTANCES);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            write_quorum = 0;
+            if (sscanf(optarg, "%d/%d", &replicas, &write_quorum) < 1 || replicas < 1 || replicas > MAX_INSTANCES ||
+                write_quorum < 0 || write_quorum > replicas) {
+                printf("Invalid replication %s, expected copies[/quorum]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            if (sscanf(optarg, "%d+%d@%ld", &ec_data, &ec_parity, &ec_min_size) < 2 || ec_data < 1 || ec_parity < 1 ||
+                ec_data + ec_parity > MAX_INSTANCES || ec_min_size < 1) {
+                printf("Invalid erasure coding %s, expected data+parity[@min bytes]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            start_timeout = atoi(optarg);
+            break;
+        case 'w':
+            write_behind = 1;
+            break;
+        case 'q': {
+            // S1 runs from elsewhere, so the path must not be relative
+            char* resolved = realpath(optarg, NULL);
+            if (!resolved) {
+                printf("Cannot find tenant limits %s: %s\n", optarg, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            snprintf(qos_file, sizeof(qos_file), "%s", resolved);
+            free(resolved);
+            break;
+        }
+        case 'D':
+            direct = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(ch == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        command = &argv[optind];
+    }
+    
+    // Front ends only share a namespace when none of them keeps files of its own,
+    // and spooled uploads are only known to the S1 that took them
+    if (front_ends > 1) {
+        if (write_behind) {
+            printf("Write-behind keeps uploads on the S1 that took them; -w and -f can't be combined\n");
+            exit(EXIT_FAILURE);
+        }
+        if (instances[3] == 0) {
+            instances[3] = 1;
+        }
+    }
+    
+    // Backends first, S1 last
+    for (kind = 0; kind < 4; kind++) {
+        for (int i = 1; i <= instances[kind]; i++) {
+            add_server(kinds[kind].kind, kinds[kind].binary, i);
+        }
+    }
+    int first_s1 = server_count;
+    for (int i = 1; i <= front_ends; i++) {
+        add_server("s1", "s1", i);
+    }
+    
+    // Create the cluster directory
+    if (cluster_dir[0] == 0) {
+        snprintf(cluster_dir, sizeof(cluster_dir), "/tmp/w25cluster.XXXXXX");
+        if (!mkdtemp(cluster_dir)) {
+            perror("mkdtemp failed");
+            exit(EXIT_FAILURE);
+        }
+        generated_dir = 1;
+    } else if (mkdir(cluster_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir failed");
+        exit(EXIT_FAILURE);
+    }
+    
+    // The backends' Unix sockets go with the rest of the cluster, see dfs_local.h
+    setenv("W25_SOCKET_DIR", cluster_dir, 0);
+    
+    if (direct && write_key() < 0) {
+        exit_status = EXIT_FAILURE;
+        goto cleanup;
+    }
+    
+    // Signals are only taken while waiting in sigsuspend
+    sigset_t block, wait_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &wait_mask);
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+    signal(SIGCHLD, handle_child);
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Bind every listener up front so ports are known before anything starts
+    for (int i = 0; i < server_count; i++) {
+        int port = i == first_s1 ? s1_port : 0;
+        servers[i].listen_fd = open_listener(port, &servers[i].port);
+        if (servers[i].listen_fd < 0) {
+            exit_status = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+    
+    // Backends first, then S1 pointed at them
+    long deadline = now_ms() + start_timeout * 1000L;
+    for (int i = 0; i < server_count; i++) {
+        if (start_server(&servers[i]) < 0 || wait_ready(&servers[i], deadline) < 0) {
+            exit_status = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+    
+    // Publish the cluster address, and with several front ends all of them
+    snprintf(port_text, sizeof(port_text), "%d", servers[first_s1].port);
+    setenv("W25_HOST", "127.0.0.1", 1);
+    setenv("W25_PORT", port_text, 1);
+    setenv("W25_CLUSTER_DIR", cluster_dir, 1);
+    if (direct)
+        setenv("W25_DIRECT", "1", 1);
+    
+    char front_list[MAX_INSTANCES * 24] = "";
+    for (int i = first_s1; i < server_count && front_ends > 1; i++) {
+        snprintf(front_list + strlen(front_list), sizeof(front_list) - strlen(front_list), "%s127.0.0.1:%d",
+                 i > first_s1 ? "," : "", servers[i].port);
+    }
+    if (front_list[0])
+        setenv("W25_SERVERS", front_list, 1);
+    
+    snprintf(env_path, sizeof(env_path), "%s/cluster.env", cluster_dir);
+    FILE* env_file = fopen(env_path, "w");
+    if (env_file) {
+        fprintf(env_file, "W25_HOST=127.0.0.1\nW25_PORT=%s\nW25_CLUSTER_DIR=%s\n", port_text, cluster_dir);
+        if (direct)
+            fprintf(env_file, "W25_DIRECT=1\n");
+        if (front_list[0])
+            fprintf(env_file, "W25_SERVERS=%s\n", front_list);
+        fclose(env_file);
+    }
+    
+    printf("W25_HOST=127.0.0.1\n");
+    printf("W25_PORT=%s\n", port_text);
+    printf("W25_CLUSTER_DIR=%s\n", cluster_dir);
+    if (direct)
+        printf("W25_DIRECT=1\n");
+    if (front_list[0])
+        printf("W25_SERVERS=%s\n", front_list);
+    for (int i = 0; i < server_count; i++) {
+        if (i == first_s1) {
+            continue;
+        }
+        printf("# %s on port %d\n", servers[i].label, servers[i].port);
+    }
+    fflush(stdout);
+    
+    // Run the command, if any, with the cluster address in its environment
+    if (command) {
+        command_pid = fork();
+        if (command_pid == 0) {
+            for (int i = 0; i < server_count; i++) {
+                close(servers[i].listen_fd);
+            }
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGCHLD, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+            execvp(command[0], command);
+            fprintf(stderr, "Cannot run %s: %s\n", command[0], strerror(errno));
+            _exit(127);
+        } else if (command_pid < 0) {
+            perror("fork failed");
+            exit_status = EXIT_FAILURE;
+            goto cleanup;
+        }
+    }
+    
+    // Wait for a stop signal, the command to finish, or a server to die
+    while (!stop_requested) {
+        int died = reap_children(command_pid, &command_status, &command_done);
+        
+        if (died >= 0) {
+            printf("ERROR: %s exited unexpectedly, see %s/%s.log\n", servers[died].label, cluster_dir, servers[died].label);
+            exit_status = EXIT_FAILURE;
+            break;
+        }
+        if (command_done) {
+            break;
+        }
+        
+        sigsuspend(&wait_mask);
+    }
+    
+    if (command_pid > 0) {
+        if (!command_done) {
+            // Stopped early: take the command down with the cluster
+            kill(command_pid, SIGTERM);
+            waitpid(command_pid, &command_status, 0);
+            exit_status = EXIT_FAILURE;
+        } else if (exit_status == EXIT_SUCCESS) {
+            exit_status = WIFEXITED(command_status) ? WEXITSTATUS(command_status) : 128 + WTERMSIG(command_status);
+        }
+    }
+
+cleanup:
+    stop_servers();
+    
+    if (generated_dir && !keep && exit_status == EXIT_SUCCESS) {
+        nftw(cluster_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    } else if (generated_dir) {
+        printf("Cluster directory kept at %s\n", cluster_dir);
+    }
+    
+    return exit_status;
+}
\ No newline at end of file